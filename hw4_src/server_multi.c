@@ -50,6 +50,9 @@
  * included by both client and server */
 #include "common.h"
 
+/* Lock-free ring used as the shared request queue */
+#include "ringq.h"
+
 #define BACKLOG_COUNT 100
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
@@ -69,11 +72,6 @@ sem_t * printf_mutex;
 		sem_post(printf_mutex);		\
 	} while (0)
 
-/* START - Variables needed to protect the shared queue. DO NOT TOUCH */
-sem_t * queue_mutex;
-sem_t * queue_notify;
-/* END - Variables needed to protect the shared queue. DO NOT TOUCH */
-
 struct request_meta {
 	struct request request;
 	struct timespec receipt_timestamp;
@@ -81,12 +79,11 @@ struct request_meta {
 	struct timespec completion_timestamp;
 };
 
+/* The shared queue is a lock-free ring: producers and consumers never
+ * take a lock, and idle workers sleep on a futex inside ringq_pop(). */
 struct queue {
-	struct request_meta* items;
-    int max; 
-    int front;
-    int rear;
-    int size;
+	struct ringq ring;
+	struct request_meta * snapshot; /* Scratch space for dump_queue_status() */
 };
 
 struct connection_params {
@@ -104,84 +101,50 @@ struct worker_params {
 /* Helper function to perform queue initialization */
 void queue_init(struct queue * the_queue, size_t queue_size)
 {
-	the_queue->items = (struct request_meta*)malloc(queue_size * sizeof(struct request_meta));
-    the_queue->max = queue_size;
-    the_queue->size = 0; 
-    the_queue->front = 0;
-    the_queue->rear = -1;
+	the_queue->snapshot = (struct request_meta*)malloc(queue_size * sizeof(struct request_meta));
+	ringq_init(&the_queue->ring, queue_size, sizeof(struct request_meta));
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
+/* Add a new request <request> to the shared queue <the_queue>.
+ * Returns 1 if the queue is full. */
 int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 {
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* Make sure that the queue is not full */
-	if (the_queue->size == the_queue->max) {
-		/* What to do in case of a full queue */
-		retval = 1;
-		/* DO NOT RETURN DIRECTLY HERE. The
-		 * sem_post(queue_mutex) below MUST happen. */
-	} else {
-		/* If all good, add the item in the queue */
-		the_queue->rear = (the_queue->rear + 1) % the_queue->max;
-		the_queue->items[the_queue->rear] = to_add;
-		the_queue->size++;
-
-		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-		sem_post(queue_notify);
-	}
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	return ringq_push(&the_queue->ring, &to_add);
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue * the_queue)
+/* Get the next request from the shared queue <the_queue>, waiting for
+ * one if it is empty. Returns 1 once the queue has been shut down. */
+int get_from_queue(struct queue * the_queue, struct request_meta * req)
 {
-	struct request_meta retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	if (the_queue->size > 0) {
-        retval = the_queue->items[the_queue->front];
-        the_queue->front = (the_queue->front + 1) % the_queue->max;
-        the_queue->size--;
-    }
+	return ringq_pop(&the_queue->ring, req);
+}
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+/* Wake up all the workers waiting on <the_queue> for termination */
+void queue_shutdown(struct queue * the_queue)
+{
+	ringq_close(&the_queue->ring);
 }
 
 void dump_queue_status(struct queue * the_queue)
 {
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	sync_printf("Q:[");
-    for (int i = 0; i < the_queue->size; i++) {
-		uint64_t id = the_queue->items[(the_queue->front + i) % the_queue->max].request.req_id;
-        sync_printf("R%lu", id);
-        if (i < the_queue->size - 1) {
-            sync_printf(",");
+	size_t count;
+
+	/* printf_mutex also guards the scratch space of the snapshot */
+	sem_wait(printf_mutex);
+
+	/* Without a lock this is a snapshot: requests being added or
+	 * picked up at the same time may or may not show up. */
+	count = ringq_snapshot(&the_queue->ring, the_queue->snapshot);
+
+	printf("Q:[");
+    for (size_t i = 0; i < count; i++) {
+        printf("R%lu", the_queue->snapshot[i].request.req_id);
+        if (i + 1 < count) {
+            printf(",");
         }
     }
-    sync_printf("]\n");
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+    printf("]\n");
+	sem_post(printf_mutex);
 }
 
 /* Main logic of the worker thread */
@@ -200,7 +163,12 @@ int worker_main (void * arg)
 	/* Okay, now execute the main logic. */
 	while (!params->worker_done) {
 
-		struct request_meta req = get_from_queue(the_queue);
+		struct request_meta req;
+
+		/* Detect wakeup after termination asserted */
+		if (get_from_queue(the_queue, &req) || params->worker_done)
+			break;
+
 		clock_gettime(CLOCK_MONOTONIC, &req.start_timestamp);
 		busywait_timespec(req.request.req_length);
 		clock_gettime(CLOCK_MONOTONIC, &req.completion_timestamp);
@@ -250,7 +218,7 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 
 	int worker_id;
 
-	the_queue = (struct queue *)malloc(sizeof(struct queue));
+	the_queue = (struct queue *)aligned_alloc(RINGQ_CACHELINE, sizeof(struct queue));
 	if (the_queue == NULL) {
         perror("Failed to allocate memory for the queue");
         exit(EXIT_FAILURE);
@@ -315,13 +283,15 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 	 * worker threads ! */
 	for (int i = 0; i < conn_params.servers; ++i) {
 		worker_params[i].worker_done = 1;
-		sem_post(queue_notify);
+		queue_shutdown(the_queue);
 		waitpid(-1, NULL, 0);
     }
 
 	for(int i = 0; i < conn_params.servers; ++i){
 		free(worker_stacks[i]);
 	}
+	ringq_destroy(&the_queue->ring);
+	free(the_queue->snapshot);
 	free(the_queue);
 	free(req);
 	shutdown(conn_socket, SHUT_RDWR);
@@ -424,29 +394,9 @@ int main (int argc, char ** argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Initialize queue protection variables. DO NOT TOUCH. */
-	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-	queue_notify = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(queue_mutex, 0, 1);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue mutex");
-		return EXIT_FAILURE;
-	}
-	retval = sem_init(queue_notify, 0, 0);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue notify");
-		return EXIT_FAILURE;
-	}
-	/* DONE - Initialize queue protection variables */
-
 	/* Ready to handle the new connection with the client. */
 	handle_connection(accepted, conn_params);
 
-	free(queue_mutex);
-	free(queue_notify);
-
 	close(sockfd);
 	return EXIT_SUCCESS;
 
@@ -9,12 +9,21 @@
 *
 * Usage:
 *     client_executable <port_number> [-a arrival_rate] [-s service_rate] [-n num_packets]
+*                       [-b batch_size] [-v wire_version] [-D deadline_slack]
 *
 * Parameters:
 *     port_number    - The port number the server on localhost is bound to.
 *     -a             - Optional. Specifies the arrival rate of packets.
 *     -s             - Optional. Specifies the service rate for processing packets.
 *     -n             - Optional. Specifies the total number of packets to be sent.
+*     -b             - Optional. Sends the requests in frames of this many
+*                      requests (default: 1, one plain request at a time).
+*     -v             - Optional. 2 uses the packed encoding of the requests and
+*                      the responses, always in frames (default: 1).
+*     -D             - Optional. Asks for each response within this many
+*                      times the length of its request from the time it is
+*                      sent, for the EDF policy of the server. Needs -v 2
+*                      (default: 1).
 *
 * Author:
 *     Renato Mancuso
@@ -30,6 +39,11 @@
 *     parameters are not specified, default values will be used. For more
 *     details or troubleshooting, refer to the accompanying documentation.
 *
+*     In batched mode, the requests of a frame are sent together at the
+*     arrival time of the first one, and the next frame is sent after the
+*     sum of their inter-arrival times: the rate stays the same, but the
+*     arrivals come in bursts.
+*
 *******************************************************************************/
 
 #include <stdio.h>
@@ -44,7 +58,8 @@
 #define USAGE_STRING							\
 	"Missing or unrecognized parameter. Exiting.\n"			\
 	"Usage: %s [-a <arrival rate>] [-s <service rate>]"		\
-	" [-n <nr. of packets>] <port number>\n"
+	" [-n <nr. of packets>] [-b <batch size>] [-v <wire version>]"	\
+	" [-D <deadline slack>] <port number>\n"
 
 #define DISTR_EXP   0
 #define DISTR_CONST 1
@@ -52,7 +67,10 @@
 #define NUM_DISTR   3
 
 #define CLIENT_VERSION    3
-#define CLIENT_SUBVERSION 0
+#define CLIENT_SUBVERSION 1
+
+/* Responses are received in chunks of up to this many bytes */
+#define RX_BUF_SIZE 4096
 
 struct request_metadata {
 	uint64_t req_id;
@@ -72,9 +90,15 @@ struct client_params {
 	uint64_t num_requests;
 	double arr_rate;
 	double serv_rate;
+	unsigned long batch;
+	double deadline_slack; /* 0 to leave the deadlines to the server */
 	struct request_metadata * script;
 };
 
+/* Packed encoding of the requests and the responses, see struct
+ * request_v2 */
+int packed_wire = 0;
+
 struct request_metadata * requests = NULL;
 struct response_metadata * responses = NULL;
 unsigned long num_responses = 0;
@@ -125,21 +149,45 @@ void generate_report(void)
 
 void get_response(int conn_socket)
 {
-	/* Attempt to non-blockigly receive responses */
-	struct response resp;
-	int res = recv(conn_socket, &resp, sizeof(struct response), MSG_DONTWAIT);
+	/* Attempt to non-blockigly receive responses. Several may come
+	 * in at once, and one may be split across segments. */
+	static char rx_buf[RX_BUF_SIZE];
+	static size_t rx_len = 0;
+	size_t off = 0, size = packed_wire ? sizeof(struct response_v2) : sizeof(struct response);
+	int res = recv(conn_socket, rx_buf + rx_len, RX_BUF_SIZE - rx_len, MSG_DONTWAIT);
 
 	if (res > 0) {
-		if (resp.ack == RESP_COMPLETED) {
-			printf(PREFIX "RESP REQ %ld\n", resp.req_id);
-		} else {
-			printf(PREFIX "REJ REQ %ld\n", resp.req_id);
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rx_len += res;
+
+		for (; rx_len - off >= size; off += size) {
+			struct response resp;
+			struct response_metadata * to_fill;
+
+			if (packed_wire) {
+				struct response_v2 v2;
+
+				memcpy(&v2, rx_buf + off, sizeof(v2));
+				response_from_v2(&resp, &v2);
+			} else {
+				memcpy(&resp, rx_buf + off, sizeof(struct response));
+			}
+			if (resp.ack == RESP_COMPLETED) {
+				printf(PREFIX "RESP REQ %ld\n", resp.req_id);
+			} else {
+				printf(PREFIX "REJ REQ %ld\n", resp.req_id);
+			}
+			num_responses++;
+			to_fill = &responses[resp.req_id];
+			to_fill->recv_timestamp = now;
+			to_fill->req_id = resp.req_id;
+			to_fill->ack = resp.ack;
 		}
-		num_responses++;
-		struct response_metadata * to_fill = &responses[resp.req_id];
-		clock_gettime(CLOCK_MONOTONIC, &to_fill->recv_timestamp);
-		to_fill->req_id = resp.req_id;
-		to_fill->ack = resp.ack;
+
+		memmove(rx_buf, rx_buf + off, rx_len - off);
+		rx_len -= off;
 	} else if (res == 0) {
 		printf(PREFIX "Connection closed by the server.\n");
 		exit(EXIT_FAILURE);
@@ -153,10 +201,11 @@ uint64_t busywait_timespec_recv(struct timespec delay, int conn_socket)
 {
 	uint64_t start, end;
 	struct timespec now;
+	nstime_t deadline;
 
 	/* Measure the current system time */
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	timespec_add(&delay, &now);
+	deadline = timespec_to_ns(&now) + timespec_to_ns(&delay);
 
 	/* Get the start timestamp */
 	get_clocks(start);
@@ -165,7 +214,7 @@ uint64_t busywait_timespec_recv(struct timespec delay, int conn_socket)
 	do {
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		get_response(conn_socket);
-	} while (delay.tv_sec > now.tv_sec || delay.tv_nsec > now.tv_nsec);
+	} while (timespec_to_ns(&now) < deadline);
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -215,7 +264,9 @@ void handle_connection(struct client_params * params)
 {
 	/* Retrieve all the client parameters */
 	int conn_socket = params->conn_socket;
-	unsigned long i, num_requests = params->num_requests;
+	unsigned long i, count, num_requests = params->num_requests;
+	struct request * reqs;
+	char * frame;
 	int res;
 
 	/* Initialize buffer where to accumulate responses */
@@ -225,23 +276,71 @@ void handle_connection(struct client_params * params)
 	requests = (struct request_metadata *)malloc(num_requests *
 						       sizeof(struct request_metadata));
 
-	for (i = 0; i < num_requests; ++i) {
-		struct timespec inter_arrival;
-		struct request req_payload;
-		struct request_metadata * req_meta = &requests[i];
+	/* Room for the largest frame */
+	reqs = (struct request *)malloc(params->batch * sizeof(struct request));
+	frame = (char *)malloc(sizeof(struct frame_header) +
+			       params->batch * sizeof(struct request));
+
+	for (i = 0; i < num_requests; i += count) {
+		struct timespec inter_arrival, now;
+		struct frame_header * hdr = (struct frame_header *)frame;
+		size_t len = sizeof(struct frame_header);
+		unsigned long j;
+
+		count = num_requests - i < params->batch ? num_requests - i : params->batch;
+		memset(&inter_arrival, 0, sizeof(inter_arrival));
+
+		for (j = 0; j < count; ++j) {
+			struct timespec next;
+
+			printf(PREFIX "PREP REQ %ld\n", i + j);
+			next = get_next_arrival(params, i + j);
+			timespec_add(&inter_arrival, &next);
+			reqs[j].req_id = i + j;
+			reqs[j].req_length = get_next_length(params, i + j);
+			requests[i + j].req_id = i + j;
+			requests[i + j].req_length = reqs[j].req_length;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (j = 0; j < count; ++j) {
+			requests[i + j].send_timestamp = now;
+			reqs[j].req_timestamp = now;
+		}
 
-		printf(PREFIX "PREP REQ %ld\n", i);
-		inter_arrival = get_next_arrival(params, i);
-		req_payload.req_id = i;
-		req_payload.req_length = get_next_length(params, i);
+		/* A single request goes out plain, as older servers
+		 * expect, unless packed */
+		if (packed_wire) {
+			struct request_v2 * v2 = (struct request_v2 *)(hdr + 1);
 
-		req_meta->req_id = i;
-		req_meta->req_length = req_payload.req_length;
-		clock_gettime(CLOCK_MONOTONIC, &req_meta->send_timestamp);
-		req_payload.req_timestamp = req_meta->send_timestamp;
+			for (j = 0; j < count; ++j) {
+				uint64_t deadline = 0;
+
+				if (params->deadline_slack) {
+					deadline = timespec_to_ns(&reqs[j].req_timestamp) +
+						params->deadline_slack *
+						timespec_to_ns(&reqs[j].req_length);
+				}
+				request_to_v2(&v2[j], &reqs[j], deadline);
+			}
+			len += count * sizeof(struct request_v2);
+		} else if (params->batch > 1) {
+			memcpy(hdr + 1, reqs, count * sizeof(struct request));
+			len += count * sizeof(struct request);
+		}
 
-		res = send(conn_socket, &req_payload, sizeof(struct request), 0);
-		printf(PREFIX "SENT REQ %ld\n", i);
+		if (len > sizeof(struct frame_header)) {
+			hdr->magic = htole32(REQ_FRAME_MAGIC);
+			hdr->version = htole16(packed_wire ? REQ_FRAME_VERSION_PACKED
+					       : REQ_FRAME_VERSION);
+			hdr->count = htole16(count);
+			res = send(conn_socket, frame, len, 0);
+		} else {
+			res = send(conn_socket, reqs, sizeof(struct request), 0);
+		}
+		for (j = 0; j < count; ++j) {
+			printf(PREFIX "SENT REQ %ld\n", i + j);
+		}
 		if (res == -1) {
 			printf(PREFIX "Connection closed by the server.\n");
 			exit(EXIT_FAILURE);
@@ -255,6 +354,8 @@ void handle_connection(struct client_params * params)
 
 	generate_report();
 
+	free(frame);
+	free(reqs);
 	free(responses);
 	free(requests);
 	printf(PREFIX "DONE!\n");
@@ -321,11 +422,13 @@ int main (int argc, char ** argv) {
 	params.serv_rate = 12;
 	params.distr = DISTR_EXP;
 	params.script = NULL;
+	params.batch = 1;
+	params.deadline_slack = 0;
 
 	printf(PREFIX "INFO: CS350 Client Version %d.%d\n", CLIENT_VERSION, CLIENT_SUBVERSION);
 
 	/* Parse command line parameters */
-	while((opt = getopt(argc, argv, "d:s:a:n:P:")) != -1) {
+	while((opt = getopt(argc, argv, "d:s:a:n:P:b:v:D:")) != -1) {
 		switch (opt) {
 		case 's':
 			params.serv_rate = strtod(optarg, NULL);
@@ -342,12 +445,34 @@ int main (int argc, char ** argv) {
 		case 'P':
 			parse_req_script(optarg, &params);
 			break;
+		case 'b':
+			params.batch = strtoul(optarg, NULL, 0);
+			if (params.batch < 1 || params.batch > REQ_FRAME_MAX) {
+				fprintf(stderr, PREFIX "Invalid batch size.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			packed_wire = (strtoul(optarg, NULL, 0) == REQ_FRAME_VERSION_PACKED);
+			break;
+		case 'D':
+			params.deadline_slack = strtod(optarg, NULL);
+			if (params.deadline_slack <= 0) {
+				fprintf(stderr, PREFIX "Invalid deadline slack.\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		default: /* '?' */
 			fprintf(stderr, PREFIX USAGE_STRING, argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
 
+	if (params.deadline_slack && !packed_wire) {
+		fprintf(stderr, PREFIX "Deadlines need the packed encoding (-v 2).\n");
+		return EXIT_FAILURE;
+	}
+
 	if (optind < argc) {
 		socket_port = strtol(argv[optind], NULL, 10);
 	} else {
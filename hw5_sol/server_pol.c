@@ -1,21 +1,26 @@
 /*******************************************************************************
-* Multi-Threaded FIFO+SJN Server Implementation w/ Queue Limit
+* Multi-Threaded FIFO+SJN+EDF Server Implementation w/ Queue Limit
 *
 * Description:
 *     A server implementation designed to process client requests in First In,
-*     First Out (FIFO) or Shortest Job Next (SJN) order. The server binds to 
+*     First Out (FIFO), Shortest Job Next (SJN), SJN with aging (SJNA) or
+*     Earliest Deadline First (EDF) order. The server binds to 
 *     the specified port number provided as a parameter upon launch. It launches 
 *     w worker threads to process incoming requests and allows to specify a maximum 
 *     queue size.
 *
 * Usage:
-*     <build directory>/server -q <queue_size> -w <workers> -p <policy> <port_number>
+*     <build directory>/server -q <queue_size> -w <workers> -p <policy>
+*                              [-S <slo_ms>] <port_number>
 *
 * Parameters:
 *     port_number - The port number to bind the server to.
 *     queue_size  - The maximum number of queued requests.
 *     workers     - The number of parallel threads to process requests.
 *     policy      - The queue policy to use for request dispatching.
+*     slo_ms      - Reject the requests that are not expected to complete
+*                   within this many milliseconds of their receipt (default:
+*                   0, only reject when the queue is full).
 *
 * Author:
 *     Renato Mancuso
@@ -32,6 +37,22 @@
 *     guaranteeing the order of processing. If the queue is full at the time a
 *     new request is received, the request is rejected with a negative ack.
 *
+*     Requests are received in large chunks, and may come one at a time or
+*     in frames of many requests (see struct frame_header). A client that
+*     starts with a frame of version 2 gets the packed encoding of the
+*     requests and responses instead (see struct request_v2).
+*
+*     Under SJNA, the length of a request counts for less the longer it
+*     has waited, so that long requests are not starved by a steady
+*     stream of short ones. Under EDF, only clients that use the packed
+*     encoding may give their own deadlines: the requests of the others
+*     are due at their timestamp plus their length.
+*
+*     With -S, a request is rejected on arrival if the work ahead of it,
+*     spread over the workers, plus its own length go beyond the SLO
+*     (see admission.h). The counters of rejections and response times
+*     are printed when the client disconnects.
+*
 *******************************************************************************/
 
 #define _GNU_SOURCE
@@ -52,16 +73,33 @@
  * included by both client and server */
 #include "common.h"
 
+/* Lock-free ring used as the shared queue under the FIFO policy */
+#include "ringq.h"
+/* Heap used as the shared queue under the SJN policy */
+#include "pqueue.h"
+
+/* Early rejection of the requests that would miss the SLO */
+#include "admission.h"
+
 #define BACKLOG_COUNT 100
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
 	"Usage: %s -q <queue size> "		\
 	"-w <workers> "				\
-	"-p <policy: FIFO | SJN> "		\
+	"-p <policy: FIFO | SJN | SJNA | EDF> "	\
+	"[-S <SLO ms: 0>] "			\
 	"<port_number>\n"
 
-/* 4KB of stack for the worker thread */
+/* Requests are received in chunks of up to this many bytes */
+#define RX_BUF_SIZE (16 * 1024)
+
+/* 4KB of stack for the worker thread, more in the sanitizer builds,
+ * whose frames are much larger */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define STACK_SIZE (256 * 1024)
+#else
 #define STACK_SIZE (4096)
+#endif
 
 /* Mutex needed to protect the threaded printf. DO NOT TOUCH */
 sem_t * printf_mutex;
@@ -79,33 +117,85 @@ sem_t * queue_mutex;
 sem_t * queue_notify;
 /* END - Variables needed to protect the shared queue. DO NOT TOUCH */
 
+/* The client asked for the packed encoding, see struct request_v2.
+ * Set before its first request is queued. */
+int packed_wire = 0;
+
 struct request_meta {
 	struct request request;
 	struct timespec receipt_timestamp;
 	struct timespec start_timestamp;
 	struct timespec completion_timestamp;
+	nstime_t deadline_ns;
 };
 
 enum queue_policy {
 	QUEUE_FIFO,
-	QUEUE_SJN
+	QUEUE_SJN,
+	QUEUE_SJN_AGING,
+	QUEUE_EDF,
+	QUEUE_POLICIES
+};
+
+/* Under SJNA, waiting this long makes up for one unit of length */
+#define AGING_RATE 10
+
+/* Every policy but FIFO serves the queued requests in increasing order
+ * of a key, which is computed once for each request as it is queued */
+typedef uint64_t (*policy_key_fn)(const struct request_meta * req);
+
+uint64_t sjn_key(const struct request_meta * req)
+{
+	return timespec_to_ns(&req->request.req_length);
+}
+
+/* The effective length is the length minus the time waited so far over
+ * AGING_RATE. All the queued requests age at the same pace, so at any
+ * point in time they are in the same order as length + receipt time
+ * over AGING_RATE, which never changes. */
+uint64_t sjn_aging_key(const struct request_meta * req)
+{
+	return timespec_to_ns(&req->request.req_length) +
+		timespec_to_ns(&req->receipt_timestamp) / AGING_RATE;
+}
+
+uint64_t edf_key(const struct request_meta * req)
+{
+	return req->deadline_ns;
+}
+
+struct policy {
+	const char * name;
+	policy_key_fn key; /* NULL: in order of arrival, in the ring */
+};
+
+const struct policy policies[QUEUE_POLICIES] = {
+	[QUEUE_FIFO]      = { "FIFO", NULL },
+	[QUEUE_SJN]       = { "SJN",  sjn_key },
+	[QUEUE_SJN_AGING] = { "SJNA", sjn_aging_key },
+	[QUEUE_EDF]       = { "EDF",  edf_key },
 };
 
+/* Under the FIFO policy the queue is a lock-free ring, see ringq.h.
+ * The other policies keep the requests in a heap ordered by their key,
+ * see pqueue.h, protected by the semaphores. */
 struct queue {
-	size_t wr_pos;
-	size_t rd_pos;
-	size_t max_size;
-	size_t available;
+	struct ringq ring;
+	struct pqueue heap;
+	struct request_meta * snapshot; /* Scratch space for dump_queue_status() */
 	enum queue_policy policy;
-	struct request_meta * requests;
 };
 
 struct connection_params {
 	size_t queue_size;
 	size_t workers;
 	enum queue_policy queue_policy;
+	nstime_t slo_ns;
 };
 
+/* Work in the queue and at the workers, for the current client */
+struct admission admission;
+
 struct worker_params {
 	int conn_socket;
 	int worker_done;
@@ -121,20 +211,27 @@ enum worker_command {
 
 void queue_init(struct queue * the_queue, size_t queue_size, enum queue_policy policy)
 {
-	the_queue->rd_pos = 0;
-	the_queue->wr_pos = 0;
-	the_queue->max_size = queue_size;
-	the_queue->requests = (struct request_meta *)malloc(sizeof(struct request_meta)
-						     * the_queue->max_size);
-	the_queue->available = queue_size;
 	the_queue->policy = policy;
+	the_queue->snapshot = (struct request_meta *)malloc(sizeof(struct request_meta)
+							    * queue_size);
+
+	if (policy == QUEUE_FIFO) {
+		ringq_init(&the_queue->ring, queue_size, sizeof(struct request_meta));
+	} else {
+		pqueue_init(&the_queue->heap, queue_size, sizeof(struct request_meta));
+	}
 }
 
 /* Add a new request <request> to the shared queue <the_queue> */
 int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 {
 	int retval = 0;
-	size_t i, j;
+
+	/* Lock-free fast path, rejects when full just the same */
+	if (the_queue->policy == QUEUE_FIFO) {
+		return ringq_push(&the_queue->ring, &to_add);
+	}
+
 	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
 	sem_wait(queue_mutex);
 	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
@@ -142,51 +239,11 @@ int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 	/* WRITE YOUR CODE HERE! */
 	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
 
-	/* Make sure that the queue is not full */
-	if (the_queue->available == 0) {
-		retval = 1;
-	} else {
-
-		if (the_queue->policy == QUEUE_FIFO) {
-			/* If all good, add the item in the queue */
-			the_queue->requests[the_queue->wr_pos] = to_add;
-			the_queue->wr_pos = (the_queue->wr_pos + 1) % the_queue->max_size;
-			the_queue->available--;
-		} else if (the_queue->policy == QUEUE_SJN) {
-		    /* Find the position of the insertion */
-		    for (i = the_queue->rd_pos, j = 0;
-			 j < the_queue->max_size - the_queue->available;
-			 i = (i + 1) % the_queue->max_size, ++j)
-		    {
-			    struct request * cur_req = &the_queue->requests[i].request;
-			    if (timespec_cmp(&to_add.request.req_length, &cur_req->req_length) < 0)
-			    {
-				    /* Once we break, i will be the
-				     * actual position in the queue
-				     * where to inser the new request,
-				     * while j will be the logical
-				     * index at which the new request
-				     * will be placed. */
-				    break;
-			    }
-		    }
-
-		    /* Same loop logic, but no initialization on i and
-		     * j because that's the whole point of the loop
-		     * above. Now, we just need to move things
-		     * around. */
-		    struct request_meta to_move = to_add;
-		    the_queue->wr_pos = (the_queue->wr_pos + 1) % the_queue->max_size;
-		    the_queue->available--;
-
-		    for (; j < the_queue->max_size - the_queue->available;
-			 i = (i + 1) % the_queue->max_size, ++j) {
-			    struct request_meta tmp = the_queue->requests[i];
-			    the_queue->requests[i] = to_move;
-			    to_move = tmp;
-		    }
-
-		}
+	/* Lowest key first; equal keys keep their arrival order. Fails
+	 * if the queue is full. */
+	retval = pqueue_push(&the_queue->heap,
+			     policies[the_queue->policy].key(&to_add), &to_add);
+	if (!retval) {
 		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
 		sem_post(queue_notify);
 	}
@@ -201,6 +258,17 @@ int add_to_queue(struct request_meta to_add, struct queue * the_queue)
 struct request_meta get_from_queue(struct queue * the_queue)
 {
 	struct request_meta retval;
+
+	/* Sleeps in the ring until a request arrives. After
+	 * queue_shutdown(), <retval> is meaningless and the caller
+	 * finds its termination flag set. */
+	if (the_queue->policy == QUEUE_FIFO) {
+		if (ringq_pop(&the_queue->ring, &retval)) {
+			memset(&retval, 0, sizeof(retval));
+		}
+		return retval;
+	}
+
 	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
 	sem_wait(queue_notify);
 	sem_wait(queue_mutex);
@@ -208,9 +276,11 @@ struct request_meta get_from_queue(struct queue * the_queue)
 
 	/* WRITE YOUR CODE HERE! */
 	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	retval = the_queue->requests[the_queue->rd_pos];
-	the_queue->rd_pos = (the_queue->rd_pos + 1) % the_queue->max_size;
-	the_queue->available++;
+
+	/* Empty only when woken up by queue_shutdown() */
+	if (pqueue_pop(&the_queue->heap, &retval)) {
+		memset(&retval, 0, sizeof(retval));
+	}
 
 	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
 	sem_post(queue_mutex);
@@ -218,29 +288,60 @@ struct request_meta get_from_queue(struct queue * the_queue)
 	return retval;
 }
 
+/* Wake up all the workers waiting on <the_queue> for termination */
+void queue_shutdown(struct queue * the_queue)
+{
+	if (the_queue->policy == QUEUE_FIFO) {
+		ringq_close(&the_queue->ring);
+	} else {
+		sem_post(queue_notify);
+	}
+}
+
 void dump_queue_status(struct queue * the_queue)
 {
-	size_t i, j;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	size_t i, count;
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	sync_printf("Q:[");
+	/* printf_mutex also guards the scratch space of the snapshot */
+	sem_wait(printf_mutex);
+
+	/* Without a lock this is a snapshot: requests being added or
+	 * picked up at the same time may or may not show up. */
+	if (the_queue->policy == QUEUE_FIFO) {
+		count = ringq_snapshot(&the_queue->ring, the_queue->snapshot);
+	} else {
+		/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+		sem_wait(queue_mutex);
+		/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+
+		/* In service order, printed once the queue is released */
+		count = pqueue_snapshot(&the_queue->heap, the_queue->snapshot);
 
-	for (i = the_queue->rd_pos, j = 0; j < the_queue->max_size - the_queue->available;
-	     i = (i + 1) % the_queue->max_size, ++j)
-	{
-		sync_printf("R%ld%s", the_queue->requests[i].request.req_id,
-		       ((j+1 != the_queue->max_size - the_queue->available)?",":""));
+		/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+		sem_post(queue_mutex);
+		/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
 	}
 
-	sync_printf("]\n");
+	printf("Q:[");
+	for (i = 0; i < count; ++i) {
+		printf("R%ld%s", the_queue->snapshot[i].request.req_id,
+		       ((i+1 != count)?",":""));
+	}
+	printf("]\n");
+	sem_post(printf_mutex);
+}
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+/* Send <resp> to the client in the encoding that it asked for */
+void send_response(int conn_socket, const struct response * resp)
+{
+	if (packed_wire) {
+		struct response_v2 v2;
+
+		response_to_v2(&v2, resp);
+		send(conn_socket, &v2, sizeof(v2), 0);
+	} else {
+		send(conn_socket, resp, sizeof(struct response), 0);
+	}
 }
 
 /* Main logic of the worker thread */
@@ -250,7 +351,7 @@ int worker_main (void * arg)
 	struct worker_params * params = (struct worker_params *)arg;
 
 	/* Print the first alive message. */
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	tsc_gettime(&now);
 	sync_printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
 
 	/* Okay, now execute the main logic. */
@@ -264,14 +365,18 @@ int worker_main (void * arg)
 		if (params->worker_done)
 			break;
 
-		clock_gettime(CLOCK_MONOTONIC, &req.start_timestamp);
+		tsc_gettime(&req.start_timestamp);
+		admission_start(&admission, timespec_to_ns(&req.request.req_length));
 		busywait_timespec(req.request.req_length);
-		clock_gettime(CLOCK_MONOTONIC, &req.completion_timestamp);
+		tsc_gettime(&req.completion_timestamp);
+		admission_finish(&admission, timespec_to_ns(&req.request.req_length),
+				 timespec_to_ns(&req.completion_timestamp) -
+				 timespec_to_ns(&req.receipt_timestamp));
 
 		/* Now provide a response! */
 		resp.req_id = req.request.req_id;
 		resp.ack = RESP_COMPLETED;
-		send(params->conn_socket, &resp, sizeof(struct response), 0);
+		send_response(params->conn_socket, &resp);
 
 		sync_printf("T%d R%ld:%lf,%lf,%lf,%lf,%lf\n",
 		       params->worker_id,
@@ -379,7 +484,7 @@ int control_workers(enum worker_command cmd, size_t worker_count,
 				continue;
 			}
 
-			sem_post(queue_notify);
+			queue_shutdown(worker_params[i]->the_queue);
 			waitpid(-1, NULL, 0);
 			sync_printf("INFO: Worker thread exited.\n");
 		}
@@ -409,6 +514,25 @@ int control_workers(enum worker_command cmd, size_t worker_count,
 	return EXIT_SUCCESS;
 }
 
+/* Print the counters of the admission control under <policy> */
+void dump_admission_stats(const char * policy)
+{
+	struct admission_stats stats;
+	uint64_t rejected, total;
+
+	admission_get_stats(&admission, &stats);
+	rejected = stats.rejected_full + stats.rejected_slo;
+	total = stats.completed + rejected;
+
+	sync_printf("INFO: policy=%s completed=%lu rejected_full=%lu rejected_slo=%lu "
+		    "rejection_rate=%.2f%% slo_misses=%lu mean_resp=%lf max_resp=%lf\n",
+		    policy, stats.completed, stats.rejected_full, stats.rejected_slo,
+		    total ? 100.0 * rejected / total : 0.0,
+		    stats.slo_misses,
+		    stats.completed ? stats.resp_ns_sum / 1e9 / stats.completed : 0.0,
+		    stats.resp_ns_max / 1e9);
+}
+
 /* Main function to handle connection with the client. This function
  * takes in input conn_socket and returns only when the connection
  * with the client is interrupted. */
@@ -416,7 +540,11 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 {
 	struct request_meta * req;
 	struct queue * the_queue;
-	size_t in_bytes;
+	ssize_t in_bytes;
+	char * rx_buf;
+	size_t rx_start = 0, rx_end = 0, frame_left = 0;
+	nstime_t cost_ns;
+	int started = 0;
 
 	/* The connection with the client is alive here. Let's start
 	 * the worker thread. */
@@ -424,7 +552,8 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 	int res;
 
 	/* Now handle queue allocation and initialization */
-	the_queue = (struct queue *)malloc(sizeof(struct queue));
+	admission_init(&admission, conn_params.slo_ns, conn_params.workers);
+	the_queue = (struct queue *)aligned_alloc(RINGQ_CACHELINE, sizeof(struct queue));
 	queue_init(the_queue, conn_params.queue_size, conn_params.queue_policy);
 
 	common_worker_params.conn_socket = conn_socket;
@@ -445,25 +574,103 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 	 * handling logic. */
 
 	req = (struct request_meta *)malloc(sizeof(struct request_meta));
+	rx_buf = (char *)malloc(RX_BUF_SIZE);
 
 	do {
-		in_bytes = recv(conn_socket, &req->request, sizeof(struct request), 0);
-		clock_gettime(CLOCK_MONOTONIC, &req->receipt_timestamp);
+		in_bytes = recv(conn_socket, rx_buf + rx_end, RX_BUF_SIZE - rx_end, 0);
+		tsc_gettime(&req->receipt_timestamp);
 
 		/* Don't just return if in_bytes is 0 or -1. Instead
 		 * skip the response and break out of the loop in an
 		 * orderly fashion so that we can de-allocate the req
 		 * and resp varaibles, and shutdown the socket. */
-		if (in_bytes > 0) {
-			res = add_to_queue(*req, the_queue);
+		if (in_bytes <= 0) {
+			break;
+		}
+		rx_end += in_bytes;
+
+		/* Parse all the complete requests received so far, plain
+		 * or in frames */
+		for (;;) {
+			size_t avail = rx_end - rx_start;
+
+			if (!frame_left) {
+				struct frame_header hdr;
+				int frame, valid;
+
+				if (avail < sizeof(struct frame_header)) {
+					break;
+				}
+				memcpy(&hdr, rx_buf + rx_start, sizeof(hdr));
+
+				/* The packed encoding can only be asked for
+				 * by the first frame, and then is all there
+				 * is */
+				frame = le32toh(hdr.magic) == REQ_FRAME_MAGIC;
+				if (frame && !started &&
+				    le16toh(hdr.version) == REQ_FRAME_VERSION_PACKED) {
+					packed_wire = 1;
+				}
+				started = 1;
+
+				valid = packed_wire
+					? frame && le16toh(hdr.version) == REQ_FRAME_VERSION_PACKED
+					: !frame || le16toh(hdr.version) == REQ_FRAME_VERSION;
+				if (!valid || (frame && le16toh(hdr.count) > REQ_FRAME_MAX)) {
+					ERROR_INFO();
+					fprintf(stderr, "Invalid request frame.\n");
+					in_bytes = 0;
+					break;
+				}
+				if (frame) {
+					frame_left = le16toh(hdr.count);
+					rx_start += sizeof(hdr);
+					continue;
+				}
+			}
+
+			if (packed_wire) {
+				struct request_v2 v2;
+
+				if (avail < sizeof(v2)) {
+					break;
+				}
+				memcpy(&v2, rx_buf + rx_start, sizeof(v2));
+				request_from_v2(&req->request, &req->deadline_ns, &v2);
+				rx_start += sizeof(v2);
+			} else {
+				if (avail < sizeof(struct request)) {
+					break;
+				}
+				memcpy(&req->request, rx_buf + rx_start, sizeof(struct request));
+				req->deadline_ns = request_default_deadline(&req->request);
+				rx_start += sizeof(struct request);
+			}
+			if (frame_left) {
+				frame_left--;
+			}
+
+			/* Unless expected to be too late, accounted for
+			 * before a worker can get to it */
+			cost_ns = timespec_to_ns(&req->request.req_length);
+			res = admission_admit(&admission, cost_ns);
+			if (!res) {
+				admission_enqueue(&admission, cost_ns);
+				res = add_to_queue(*req, the_queue);
+
+				/* The queue is full if the return value is 1 */
+				if (res) {
+					admission_dequeue(&admission, cost_ns);
+					admission_reject_full(&admission);
+				}
+			}
 
-			/* The queue is full if the return value is 1 */
 			if (res) {
 				struct response resp;
 				/* Now provide a response! */
 				resp.req_id = req->request.req_id;
 				resp.ack = RESP_REJECTED;
-				send(conn_socket, &resp, sizeof(struct response), 0);
+				send_response(conn_socket, &resp);
 
 				sync_printf("X%ld:%lf,%lf,%lf\n", req->request.req_id,
 				       TSPEC_TO_DOUBLE(req->request.req_timestamp),
@@ -472,12 +679,20 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
 					);
 			}
 		}
+
+		/* Keep the partial request, if any, at the front */
+		memmove(rx_buf, rx_buf + rx_start, rx_end - rx_start);
+		rx_end -= rx_start;
+		rx_start = 0;
 	} while (in_bytes > 0);
 
 
 	/* Stop all the worker threads. */
 	control_workers(WORKERS_STOP, conn_params.workers, NULL);
 
+	dump_admission_stats(policies[conn_params.queue_policy].name);
+
+	free(rx_buf);
 	free(req);
 	shutdown(conn_socket, SHUT_RDWR);
 	close(conn_socket);
@@ -489,7 +704,7 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
  * server. The server must accept in input a command line parameter
  * with the <port number> to bind the server to. */
 int main (int argc, char ** argv) {
-	int sockfd, retval, accepted, optval, opt;
+	int sockfd, retval, accepted, optval, opt, p;
 	in_port_t socket_port;
 	struct sockaddr_in addr, client;
 	struct in_addr any_address;
@@ -498,9 +713,10 @@ int main (int argc, char ** argv) {
 	conn_params.queue_size = 0;
 	conn_params.queue_policy = QUEUE_FIFO;
 	conn_params.workers = 1;
+	conn_params.slo_ns = 0;
 
 	/* Parse all the command line arguments */
-	while((opt = getopt(argc, argv, "q:w:p:")) != -1) {
+	while((opt = getopt(argc, argv, "q:w:p:S:")) != -1) {
 		switch (opt) {
 		case 'q':
 			conn_params.queue_size = strtol(optarg, NULL, 10);
@@ -511,17 +727,23 @@ int main (int argc, char ** argv) {
 			printf("INFO: setting worker count = %ld\n", conn_params.workers);
 			break;
 		case 'p':
-			if (!strcmp(optarg, "FIFO")) {
-				conn_params.queue_policy = QUEUE_FIFO;
-			} else if (!strcmp(optarg, "SJN")) {
-				conn_params.queue_policy = QUEUE_SJN;
-			} else {
+			for (p = 0; p < QUEUE_POLICIES; ++p) {
+				if (!strcmp(optarg, policies[p].name)) {
+					conn_params.queue_policy = p;
+					break;
+				}
+			}
+			if (p == QUEUE_POLICIES) {
 				ERROR_INFO();
 				fprintf(stderr, "Invalid queue policy.\n" USAGE_STRING, argv[0]);
 				return EXIT_FAILURE;
 			}
 			printf("INFO: setting queue policy = %s\n", optarg);
 			break;
+		case 'S':
+			conn_params.slo_ns = strtod(optarg, NULL) * 1e6;
+			printf("INFO: setting SLO = %lf ms\n", conn_params.slo_ns / 1e6);
+			break;
 		default: /* '?' */
 			fprintf(stderr, USAGE_STRING, argv[0]);
 		}
@@ -542,6 +764,14 @@ int main (int argc, char ** argv) {
 		return EXIT_FAILURE;
 	}
 
+	/* Timestamps come off the TSC from now on, if it can be trusted */
+	if (tsc_init()) {
+		printf("INFO: no invariant TSC, timestamps use clock_gettime()\n");
+	} else {
+		printf("INFO: timestamps use the TSC at %.3lf MHz\n", tsc_hz() / 1e6);
+	}
+	PRINT_BUILD_INFO();
+
 	/* Now onward to create the right type of socket */
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -0,0 +1,228 @@
+/*******************************************************************************
+* SJN Queue Benchmark
+*
+* Description:
+*     Compares the heap in pqueue.c against the ordered insertion into a
+*     circular buffer that the SJN policy of the server used before,
+*     which is reproduced below as the baseline. For every queue size,
+*     the queue is filled to the requested level and then takes a steady
+*     stream of arrivals and departures, one of each per step. The cost
+*     of a step is reported for both implementations, together with the
+*     speedup of the heap over the baseline.
+*
+* Usage:
+*     <build directory>/sjnbench [-q <queue size>] [-f <fill %>]
+*                                [-n <steps>]
+*
+*     e.g. ./build/sjnbench -q 10000 -f 90
+*
+* Notes:
+*     Without -q, a range of queue sizes from 100 to 100000 is measured.
+*     Lengths are drawn from an exponential distribution, as the client
+*     does. Both implementations are fed the same lengths and must serve
+*     the requests in the same order, which is checked as well.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common.h"
+#include "pqueue.h"
+
+#define USAGE_STRING							\
+	"Usage: %s [-q <queue size>] [-f <fill %%>] [-n <steps>]\n"
+
+/* Same layout as the request_meta of the server */
+struct request_meta {
+	struct request request;
+	struct timespec receipt_timestamp;
+	struct timespec start_timestamp;
+	struct timespec completion_timestamp;
+	nstime_t deadline_ns;
+};
+
+/* The baseline: requests are kept sorted by length in a circular
+ * buffer, and every insertion shifts the longer ones by one slot */
+struct sorted_queue {
+	size_t rd_pos;
+	size_t max_size;
+	size_t available;
+	struct request_meta * requests;
+};
+
+static void sorted_init(struct sorted_queue * q, size_t size)
+{
+	q->rd_pos = 0;
+	q->max_size = q->available = size;
+	q->requests = (struct request_meta *)malloc(size * sizeof(struct request_meta));
+}
+
+static int sorted_push(struct sorted_queue * q, struct request_meta to_add)
+{
+	struct request_meta to_move = to_add;
+	size_t i, j;
+
+	if (q->available == 0) {
+		return 1;
+	}
+
+	for (i = q->rd_pos, j = 0; j < q->max_size - q->available;
+	     i = (i + 1) % q->max_size, ++j) {
+		if (timespec_cmp(&to_add.request.req_length,
+				 &q->requests[i].request.req_length) < 0) {
+			break;
+		}
+	}
+
+	q->available--;
+	for (; j < q->max_size - q->available; i = (i + 1) % q->max_size, ++j) {
+		struct request_meta tmp = q->requests[i];
+		q->requests[i] = to_move;
+		to_move = tmp;
+	}
+
+	return 0;
+}
+
+static int sorted_pop(struct sorted_queue * q, struct request_meta * out)
+{
+	if (q->available == q->max_size) {
+		return 1;
+	}
+
+	*out = q->requests[q->rd_pos];
+	q->rd_pos = (q->rd_pos + 1) % q->max_size;
+	q->available++;
+
+	return 0;
+}
+
+enum bench_impl {
+	IMPL_SORTED,
+	IMPL_HEAP
+};
+
+static struct timespec exp_length(unsigned int * seed)
+{
+	/* Mean of 1 ms, in the same shape as the lengths of the client */
+	double u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+	double len = -log(u) * 1e-3;
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)len;
+	ts.tv_nsec = (long)((len - ts.tv_sec) * 1e9);
+	return ts;
+}
+
+/* Returns the seconds spent on <steps> steps, and in <order> a hash of
+ * the IDs in the order in which they were served */
+static double run(enum bench_impl impl, size_t queue_size, size_t fill,
+		  size_t steps, uint64_t * order)
+{
+	struct sorted_queue sq;
+	struct pqueue heap;
+	struct request_meta req, out;
+	struct timespec start, end;
+	unsigned int seed = 42;
+	uint64_t hash = 1469598103934665603ULL;
+	size_t i;
+
+	memset(&sq, 0, sizeof(sq));
+	if (impl == IMPL_SORTED)
+		sorted_init(&sq, queue_size);
+	else
+		pqueue_init(&heap, queue_size, sizeof(struct request_meta));
+
+	memset(&req, 0, sizeof(req));
+	for (i = 0; i < fill; ++i) {
+		req.request.req_id = i;
+		req.request.req_length = exp_length(&seed);
+		if (impl == IMPL_SORTED)
+			sorted_push(&sq, req);
+		else
+			pqueue_push(&heap, timespec_to_ns(&req.request.req_length), &req);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < steps; ++i) {
+		req.request.req_id = fill + i;
+		req.request.req_length = exp_length(&seed);
+		if (impl == IMPL_SORTED) {
+			sorted_push(&sq, req);
+			sorted_pop(&sq, &out);
+		} else {
+			pqueue_push(&heap, timespec_to_ns(&req.request.req_length), &req);
+			pqueue_pop(&heap, &out);
+		}
+		hash = (hash ^ out.request.req_id) * 1099511628211ULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (impl == IMPL_SORTED)
+		free(sq.requests);
+	else
+		pqueue_destroy(&heap);
+
+	*order = hash;
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main (int argc, char ** argv)
+{
+	size_t sizes[] = { 100, 1000, 10000, 100000 };
+	size_t queue_size = 0, steps = 200000, i, count;
+	int opt, fill_pct = 50, ok = 1;
+
+	while((opt = getopt(argc, argv, "q:f:n:")) != -1) {
+		switch (opt) {
+		case 'q':
+			queue_size = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			fill_pct = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			steps = strtol(optarg, NULL, 10);
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (fill_pct < 0 || fill_pct > 99 || !steps) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (queue_size) {
+		sizes[0] = queue_size;
+		count = 1;
+	} else {
+		count = sizeof(sizes) / sizeof(sizes[0]);
+	}
+
+	PRINT_BUILD_INFO();
+	printf("%8s %8s %14s %14s %9s\n", "QSIZE", "QUEUED", "SORTED(ns)", "HEAP(ns)", "SPEEDUP");
+	for (i = 0; i < count; ++i) {
+		size_t fill = sizes[i] * fill_pct / 100;
+		uint64_t order_sorted, order_heap;
+		double sorted_s, heap_s;
+
+		sorted_s = run(IMPL_SORTED, sizes[i], fill, steps, &order_sorted);
+		heap_s = run(IMPL_HEAP, sizes[i], fill, steps, &order_heap);
+
+		printf("%8ld %8ld %14.1f %14.1f %8.2fx%s\n", sizes[i], fill,
+		       sorted_s / steps * 1e9, heap_s / steps * 1e9, sorted_s / heap_s,
+		       order_sorted == order_heap ? "" : "  ORDER MISMATCH!");
+		ok = ok && order_sorted == order_heap;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -22,6 +22,153 @@
 
 #include "timelib.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+/* How long tsc_init() sleeps for: the longer, the more precise */
+#define TSC_CALIBRATION_NS (100 * 1000 * 1000)
+
+/* Readings of both clocks to pick the tightest pair from */
+#define TSC_SAMPLE_TRIES 64
+
+/* Conversions between TSC ticks and nanoseconds, as 32.32 fixed-point
+ * factors, and the reading of both clocks at calibration time. Set
+ * once by tsc_init(). */
+static int tsc_enabled = 0;
+static uint64_t tsc_ns_per_tick;
+static uint64_t tsc_ticks_per_ns;
+static uint64_t tsc_base_ticks;
+static nstime_t tsc_base_ns;
+static uint64_t tsc_freq;
+
+static nstime_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_ns(&now);
+}
+
+/* Whether the CPU reports an invariant TSC: CPUID 0x80000007, EDX bit 8 */
+static int tsc_invariant(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+		return 0;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (edx >> 8) & 1;
+#else
+	return 0;
+#endif
+}
+
+/* Both clocks read as close together as possible: the TSC reading is
+ * the one of the middle of the call to clock_gettime(), in the
+ * attempt where that call took the fewest ticks, i.e. was the least
+ * likely to be interrupted */
+static void tsc_sample(uint64_t * ticks, nstime_t * ns)
+{
+	uint64_t before, after, best = UINT64_MAX;
+	nstime_t now;
+	int i;
+
+	for (i = 0; i < TSC_SAMPLE_TRIES; ++i) {
+		get_clocks(before);
+		now = monotonic_ns();
+		get_clocks(after);
+
+		if (!i || after - before < best) {
+			best = after - before;
+			*ticks = before + (after - before) / 2;
+			*ns = now;
+		}
+	}
+}
+
+int tsc_init(void)
+{
+	struct timespec pause = { 0, TSC_CALIBRATION_NS };
+	uint64_t ticks0, ticks1, dticks;
+	nstime_t ns0, ns1, dns;
+
+	tsc_enabled = 0;
+	tsc_freq = 0;
+	if (!tsc_invariant())
+		return 1;
+
+	tsc_sample(&ticks0, &ns0);
+	nanosleep(&pause, NULL);
+	tsc_sample(&ticks1, &ns1);
+
+	dticks = ticks1 - ticks0;
+	dns = ns1 - ns0;
+	if (!dticks || !dns || ticks1 < ticks0)
+		return 1;
+
+	tsc_ns_per_tick = (uint64_t)(((unsigned __int128)dns << 32) / dticks);
+	tsc_ticks_per_ns = (uint64_t)(((unsigned __int128)dticks << 32) / dns);
+	tsc_freq = (uint64_t)((unsigned __int128)dticks * NANO_IN_SEC / dns);
+	tsc_base_ticks = ticks1;
+	tsc_base_ns = ns1;
+	tsc_enabled = 1;
+	return 0;
+}
+
+nstime_t tsc_now_ns(void)
+{
+	uint64_t ticks;
+
+	if (!tsc_enabled)
+		return monotonic_ns();
+
+	get_clocks(ticks);
+	return tsc_base_ns + (uint64_t)(((unsigned __int128)(ticks - tsc_base_ticks)
+					 * tsc_ns_per_tick) >> 32);
+}
+
+void tsc_gettime(struct timespec * ts)
+{
+	if (!tsc_enabled) {
+		clock_gettime(CLOCK_MONOTONIC, ts);
+		return;
+	}
+
+	*ts = ns_to_timespec(tsc_now_ns());
+}
+
+uint64_t tsc_hz(void)
+{
+	return tsc_freq;
+}
+
+uint64_t busywait_ns(nstime_t ns)
+{
+	uint64_t start, now, end;
+
+	get_clocks(start);
+
+	if (!tsc_enabled) {
+		nstime_t deadline = monotonic_ns() + ns;
+
+		while (monotonic_ns() < deadline)
+			;
+		get_clocks(now);
+		return now - start;
+	}
+
+	/* Spin on the counter itself: no conversion in the loop */
+	end = start + (uint64_t)(((unsigned __int128)ns * tsc_ticks_per_ns) >> 32);
+	do {
+		get_clocks(now);
+	} while (now < end);
+
+	return now - start;
+}
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec)
@@ -48,22 +195,17 @@ uint64_t get_elapsed_sleep(long sec, long nsec)
 uint64_t get_elapsed_busywait(long sec, long nsec)
 {
 	uint64_t start, end;
-	struct timespec now;
-	struct timespec time_end;
+	nstime_t time_end;
 
 	/* Measure the current system time */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	time_end.tv_sec = sec;
-	time_end.tv_nsec = nsec;
-	timespec_add(&time_end, &now);
+	time_end = monotonic_ns() + (nstime_t)sec * NANO_IN_SEC + nsec;
 
 	/* Get the start timestamp */
 	get_clocks(start);
 
 	/* Busy wait until enough time has elapsed */
-	do {
-		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (time_end.tv_sec > now.tv_sec || time_end.tv_nsec > now.tv_nsec);
+	while (monotonic_ns() < time_end)
+		;
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -76,10 +218,10 @@ uint64_t get_elapsed_busywait(long sec, long nsec)
 void timespec_add (struct timespec * a, struct timespec * b)
 {
 	/* Try to add up the nsec and see if we spill over into the
-	 * seconds */
+	 * seconds: exactly NANO_IN_SEC is a whole second too */
 	time_t addl_seconds = b->tv_sec;
 	a->tv_nsec += b->tv_nsec;
-	if (a->tv_nsec > NANO_IN_SEC) {
+	if (a->tv_nsec >= NANO_IN_SEC) {
 		addl_seconds += a->tv_nsec / NANO_IN_SEC;
 		a->tv_nsec = a->tv_nsec % NANO_IN_SEC;
 	}
@@ -91,14 +233,7 @@ void timespec_add (struct timespec * a, struct timespec * b)
  * compared to a; 0 if they are identical. */
 int timespec_cmp(struct timespec *a, struct timespec *b)
 {
-	if(a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec) {
-		return 0;
-	} else if((a->tv_sec > b->tv_sec) ||
-		  (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec)) {
-		return 1;
-	} else {
-		return -1;
-	}
+	return ns_cmp(timespec_to_ns(a), timespec_to_ns(b));
 }
 
 /* Busywait for the amount of time described via the delay
@@ -106,19 +241,22 @@ int timespec_cmp(struct timespec *a, struct timespec *b)
 uint64_t busywait_timespec(struct timespec delay)
 {
 	uint64_t start, end;
-	struct timespec now;
+	nstime_t deadline;
+
+	if (tsc_enabled)
+		return busywait_ns(timespec_to_ns(&delay));
 
 	/* Measure the current system time */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	timespec_add(&delay, &now);
+	deadline = monotonic_ns() + timespec_to_ns(&delay);
 
 	/* Get the start timestamp */
 	get_clocks(start);
 
-	/* Busy wait until enough time has elapsed */
-	do {
-		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (delay.tv_sec > now.tv_sec || delay.tv_nsec > now.tv_nsec);
+	/* Busy wait until enough time has elapsed: comparing the seconds
+	 * and the nanoseconds apart would keep spinning past the deadline
+	 * whenever its nanoseconds are past those of the time */
+	while (monotonic_ns() < deadline)
+		;
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -129,10 +267,7 @@ uint64_t busywait_timespec(struct timespec delay)
 /* Translate a double timestamp into a valid timespec */
 inline struct timespec dtotspec(double timestamp)
 {
-	/* Timestamp assumed is in seconds, so fill timespec
-	 * accordingly */
-	struct timespec retval;
-	retval.tv_sec = (long)timestamp;
-	retval.tv_nsec = (long)(timestamp * NANO_IN_SEC) % NANO_IN_SEC;
-	return retval;
+	/* Timestamp assumed is in seconds, rounded to the nearest
+	 * nanosecond rather than truncated */
+	return ns_to_timespec(double_to_ns(timestamp));
 }
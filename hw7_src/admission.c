@@ -0,0 +1,120 @@
+/*******************************************************************************
+* Predictive Admission Control (implementation)
+*
+* Description:
+*     Estimates of the response time of new requests, see admission.h.
+*
+* Notes:
+*     The queued and running work are two counters updated with atomic
+*     additions: they are read together without a lock, so an estimate
+*     may be off by the request that is moving from one to the other at
+*     the same time.
+*
+*******************************************************************************/
+
+#include <string.h>
+
+#include "admission.h"
+
+void admission_init(struct admission * adm, uint64_t slo_ns, size_t workers)
+{
+	memset(adm, 0, sizeof(struct admission));
+	adm->slo_ns = slo_ns;
+	adm->workers = workers ? workers : 1;
+}
+
+void admission_set_workers(struct admission * adm, size_t workers)
+{
+	__atomic_store_n(&adm->workers, workers ? workers : 1, __ATOMIC_RELAXED);
+}
+
+int admission_admit(struct admission * adm, uint64_t cost_ns, uint64_t deadline_ns)
+{
+	uint64_t backlog, limit = adm->slo_ns;
+	size_t workers;
+
+	if (deadline_ns && (!limit || deadline_ns < limit)) {
+		limit = deadline_ns;
+	}
+	if (!limit) {
+		return 0;
+	}
+
+	backlog = __atomic_load_n(&adm->queued_ns, __ATOMIC_RELAXED) +
+		__atomic_load_n(&adm->running_ns, __ATOMIC_RELAXED);
+	workers = __atomic_load_n(&adm->workers, __ATOMIC_RELAXED);
+	if (backlog / workers + cost_ns <= limit) {
+		return 0;
+	}
+
+	__atomic_add_fetch(&adm->stats.rejected_slo, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+void admission_enqueue(struct admission * adm, uint64_t cost_ns)
+{
+	__atomic_add_fetch(&adm->queued_ns, cost_ns, __ATOMIC_RELAXED);
+}
+
+void admission_start(struct admission * adm, uint64_t cost_ns)
+{
+	__atomic_sub_fetch(&adm->queued_ns, cost_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&adm->running_ns, cost_ns, __ATOMIC_RELAXED);
+}
+
+void admission_finish(struct admission * adm, uint64_t cost_ns, uint64_t resp_ns)
+{
+	uint64_t max;
+
+	__atomic_sub_fetch(&adm->running_ns, cost_ns, __ATOMIC_RELAXED);
+	if (!resp_ns) {
+		return;
+	}
+
+	__atomic_add_fetch(&adm->stats.completed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&adm->stats.resp_ns_sum, resp_ns, __ATOMIC_RELAXED);
+	if (adm->slo_ns && resp_ns > adm->slo_ns) {
+		__atomic_add_fetch(&adm->stats.slo_misses, 1, __ATOMIC_RELAXED);
+	}
+
+	max = __atomic_load_n(&adm->stats.resp_ns_max, __ATOMIC_RELAXED);
+	while (resp_ns > max &&
+	       !__atomic_compare_exchange_n(&adm->stats.resp_ns_max, &max, resp_ns, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void admission_dequeue(struct admission * adm, uint64_t cost_ns)
+{
+	__atomic_sub_fetch(&adm->queued_ns, cost_ns, __ATOMIC_RELAXED);
+}
+
+void admission_drop(struct admission * adm, uint64_t cost_ns, int cancelled)
+{
+	__atomic_sub_fetch(&adm->queued_ns, cost_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(cancelled ? &adm->stats.cancelled : &adm->stats.expired, 1,
+			   __ATOMIC_RELAXED);
+}
+
+void admission_reject_full(struct admission * adm)
+{
+	__atomic_add_fetch(&adm->stats.rejected_full, 1, __ATOMIC_RELAXED);
+}
+
+void admission_reject_share(struct admission * adm)
+{
+	__atomic_add_fetch(&adm->stats.rejected_share, 1, __ATOMIC_RELAXED);
+}
+
+void admission_get_stats(struct admission * adm, struct admission_stats * stats)
+{
+	stats->completed = __atomic_load_n(&adm->stats.completed, __ATOMIC_RELAXED);
+	stats->rejected_full = __atomic_load_n(&adm->stats.rejected_full, __ATOMIC_RELAXED);
+	stats->rejected_slo = __atomic_load_n(&adm->stats.rejected_slo, __ATOMIC_RELAXED);
+	stats->rejected_share = __atomic_load_n(&adm->stats.rejected_share, __ATOMIC_RELAXED);
+	stats->slo_misses = __atomic_load_n(&adm->stats.slo_misses, __ATOMIC_RELAXED);
+	stats->expired = __atomic_load_n(&adm->stats.expired, __ATOMIC_RELAXED);
+	stats->cancelled = __atomic_load_n(&adm->stats.cancelled, __ATOMIC_RELAXED);
+	stats->resp_ns_sum = __atomic_load_n(&adm->stats.resp_ns_sum, __ATOMIC_RELAXED);
+	stats->resp_ns_max = __atomic_load_n(&adm->stats.resp_ns_max, __ATOMIC_RELAXED);
+}
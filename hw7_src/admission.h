@@ -0,0 +1,92 @@
+/*******************************************************************************
+* Predictive Admission Control (header)
+*
+* Description:
+*     Decides whether to take a new request from an estimate of how long
+*     it would take to get its response, rather than only from whether
+*     the queue has room for it. The estimate is the work still queued
+*     or being processed, spread over the workers, plus the service time
+*     of the request itself. A request whose estimate is beyond the
+*     service level objective (SLO), or its own deadline, is rejected
+*     right away, instead of occupying a worker for a response that
+*     would come too late anyway.
+*
+*     It also keeps the counters needed to weigh the rejections against
+*     the latency of the accepted requests.
+*
+* Notes:
+*     The work of the requests that are being processed is counted in
+*     full until they complete, and under the policies that let a new
+*     request overtake the queue the whole queue is still counted: the
+*     estimate errs on the side of rejecting. All the functions are
+*     thread-safe and lock-free.
+*
+*******************************************************************************/
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct admission_stats {
+	uint64_t completed;
+	uint64_t rejected_full; /* No room in the queue */
+	uint64_t rejected_slo;  /* Estimated to miss the SLO */
+	uint64_t rejected_share; /* Client over its share of the queue */
+	uint64_t slo_misses;    /* Completed, but later than the SLO */
+	uint64_t expired;       /* Dropped from the queue past their deadline */
+	uint64_t cancelled;     /* ... or as their client asked */
+	uint64_t resp_ns_sum;
+	uint64_t resp_ns_max;
+};
+
+struct admission {
+	uint64_t slo_ns; /* 0 to only reject when the queue is full */
+	size_t workers;
+	uint64_t queued_ns;
+	uint64_t running_ns;
+	struct admission_stats stats;
+};
+
+/* Initialize <adm> for <workers> workers and an SLO of <slo_ns> on the
+ * time from the receipt of a request to its completion */
+void admission_init(struct admission * adm, uint64_t slo_ns, size_t workers);
+
+/* Spread the work over <workers> workers from now on */
+void admission_set_workers(struct admission * adm, size_t workers);
+
+/* Whether a new request with an estimated service time of <cost_ns>
+ * is expected to meet the SLO, and to complete within <deadline_ns> of
+ * now unless 0. Returns 0 if so, and 1, counting the rejection, if
+ * not. Without an SLO, only the deadline counts. */
+int admission_admit(struct admission * adm, uint64_t cost_ns, uint64_t deadline_ns);
+
+/* Account for a request of estimated service time <cost_ns> entering
+ * the queue, leaving it for a worker, and being completed <resp_ns>
+ * after its receipt. Requests that are not meant for a client, with
+ * <resp_ns> 0, are left out of the statistics. A request enters the
+ * queue before it is actually pushed, so that no worker can start it
+ * first. */
+void admission_enqueue(struct admission * adm, uint64_t cost_ns);
+void admission_start(struct admission * adm, uint64_t cost_ns);
+void admission_finish(struct admission * adm, uint64_t cost_ns, uint64_t resp_ns);
+
+/* Take back a request that could not be pushed after all */
+void admission_dequeue(struct admission * adm, uint64_t cost_ns);
+
+/* Account for a request taken out of the queue without running, past
+ * its deadline or because it was <cancelled> */
+void admission_drop(struct admission * adm, uint64_t cost_ns, int cancelled);
+
+/* Count a request rejected because the queue is full */
+void admission_reject_full(struct admission * adm);
+
+/* ... or because its client already has its share of the queue */
+void admission_reject_share(struct admission * adm);
+
+/* Copy of the counters of <adm> */
+void admission_get_stats(struct admission * adm, struct admission_stats * stats);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -6,6 +6,7 @@
 #define __COMMON_H__
 /* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
 
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -33,6 +34,12 @@
 #define RESP_COMPLETED  0
 #define RESP_REJECTED   1
 
+/* A request that was accepted, but dropped from the queue before any
+ * worker started on it: its deadline passed (see REQ_FRAME_DEADLINE),
+ * or its client cancelled it (see IMG_CANCEL) */
+#define RESP_EXPIRED    2
+#define RESP_CANCELLED  3
+
 /* This is a handy definition to print out runtime errors that report
  * the file and line number where the error was encountered. */
 #define ERROR_INFO()							\
@@ -41,6 +48,18 @@
 		fflush(stdout);						\
 	} while(0)
 
+/* The configuration that the Makefile built the program in (see CONFIG
+ * there), so that the benchmarks can say what they ran against. */
+#ifndef BUILD_CONFIG
+#define BUILD_CONFIG "unknown"
+#endif
+#ifndef BUILD_CFLAGS
+#define BUILD_CFLAGS ""
+#endif
+
+#define PRINT_BUILD_INFO()						\
+	printf("INFO: build %s (%s)\n", BUILD_CONFIG, BUILD_CFLAGS)
+
 /* A simple macro to convert between a struct timespec and a double
  * representation of a timestamp. */
 #define TSPEC_TO_DOUBLE(spec)				\
@@ -55,7 +74,13 @@ enum img_opcode {
     IMG_SHARPEN,
     IMG_VERTEDGES,
     IMG_HORIZEDGES,
-    IMG_RETRIEVE
+    IMG_RETRIEVE,
+    IMG_GAUSSBLUR,
+    IMG_EMBOSS,
+    IMG_SOBEL,
+    IMG_PIPELINE,
+    IMG_RETRIEVE_REGION,
+    IMG_CANCEL
 };
 
 /* String version of the opcodes */
@@ -67,7 +92,13 @@ const char * __opcode_strings [] = {
     "IMG_SHARPEN",
     "IMG_VERTEDGES",
     "IMG_HORIZEDGES",
-    "IMG_RETRIEVE"
+    "IMG_RETRIEVE",
+    "IMG_GAUSSBLUR",
+    "IMG_EMBOSS",
+    "IMG_SOBEL",
+    "IMG_PIPELINE",
+    "IMG_RETRIEVE_REGION",
+    "IMG_CANCEL"
 };
 
 /* Handy macro to render an opcode as a string */
@@ -75,7 +106,10 @@ const char * __opcode_strings [] = {
     (__opcode_strings[opcode])
 
 /* Request payload as sent by the client and received by the
- * server. */
+ * server. An IMG_PIPELINE request applies the <pipeline_len> opcodes
+ * in <pipeline> to the same image, one after the other, as a single
+ * operation. The opcodes fit in what would otherwise be padding
+ * before <img_id>, so the request keeps the same size and layout. */
 struct request {
 	uint64_t req_id;
 	struct timespec req_timestamp;
@@ -84,11 +118,20 @@ struct request {
 		struct {
 			uint8_t  img_op;
 			uint8_t  overwrite;
+			uint8_t  pipeline_len;
+			uint8_t  pipeline[IMG_PIPELINE_MAX];
 			uint64_t img_id;
 		};
 	};
 };
 
+/* An IMG_CANCEL request names, in its <img_id>, the ID of an earlier
+ * request of the same connection that is no longer wanted. That one is
+ * then answered with RESP_CANCELLED instead, unless a worker has
+ * started on it already. The IMG_CANCEL itself is answered right away,
+ * with RESP_COMPLETED if the request was still waiting for its
+ * response, and RESP_REJECTED if there was no such request. */
+
 /* Response payload as sent by the server and received by the
  * client. */
 struct response {
@@ -97,5 +140,126 @@ struct response {
 	uint8_t  ack;
 };
 
+/* An IMG_RETRIEVE_REGION request is followed by the rectangle to send
+ * back, in either encoding of the requests: the pixels from (<x>,<y>)
+ * on, <width> x <height> of them, shrunk <scale> times in each
+ * direction (see regionImage()). A <width> or <height> of 0 goes to
+ * that edge of the image, and larger ones are clipped to it. The
+ * response is followed by the resulting image, like for IMG_RETRIEVE.
+ * The fields are little-endian. */
+#pragma pack(push, 1)
+struct img_region {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+	uint8_t  scale;
+};
+#pragma pack(pop)
+
+/* Batched framing. Instead of one struct request at a time, a client
+ * may send a frame header followed by <count> requests. The header
+ * has a magic number where a plain request has its ID, which no
+ * request ID reaches in practice: the server tells frames and plain
+ * requests apart, and both can be mixed on the same connection. The
+ * payload of an IMG_REGISTER follows its request, also within a
+ * frame. The fields of the header are little-endian. */
+#define REQ_FRAME_MAGIC   0x4d415246U /* "FRAM" on the wire */
+#define REQ_FRAME_VERSION 1
+#define REQ_FRAME_MAX     1024
+
+/* Frames of version 2 carry packed, little-endian requests instead.
+ * A client opts in by sending one, possibly empty, as the first thing
+ * on the connection: the server answers with packed responses from
+ * then on. */
+#define REQ_FRAME_VERSION_PACKED 2
+
+/* A client that sets this bit in the version of its first frame, of
+ * either version, gets the images it retrieves in the compressed wire
+ * format of imglib (see packImage()). The bit may be set in any later
+ * frame, where it has no effect. Images in either format can always be
+ * registered. */
+#define REQ_FRAME_COMPRESSED 0x8000
+
+/* A client that sets this bit in the version of its first frame, of
+ * either version, sends a deadline after every request from then on,
+ * plain or within a frame, before its rectangle or payload if any: the
+ * microseconds from the receipt of the request after which its result
+ * is of no use anymore, 0 for none, as a little-endian uint32_t. A
+ * request that is still queued by then is dropped, and answered with
+ * RESP_EXPIRED. The bit has no effect in any later frame. */
+#define REQ_FRAME_DEADLINE 0x4000
+
+/* The bits of the version that are not the version itself */
+#define REQ_FRAME_FLAGS (REQ_FRAME_COMPRESSED | REQ_FRAME_DEADLINE)
+
+struct frame_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+};
+
+/* Packed encodings: no padding, fixed endianness, and timestamps in
+ * nanoseconds */
+#pragma pack(push, 1)
+struct request_v2 {
+	uint64_t req_id;
+	uint64_t req_timestamp_ns;
+	uint8_t  img_op;
+	uint8_t  overwrite;
+	uint8_t  pipeline_len;
+	uint8_t  pipeline[IMG_PIPELINE_MAX];
+	uint64_t img_id;
+};
+
+struct response_v2 {
+	uint64_t req_id;
+	uint64_t img_id;
+	uint8_t  ack;
+};
+#pragma pack(pop)
+
+/* Decode a packed request */
+static inline void request_from_v2(struct request * req, const struct request_v2 * v2)
+{
+	memset(req, 0, sizeof(struct request));
+	req->req_id = le64toh(v2->req_id);
+	req->req_timestamp = ns_to_timespec(le64toh(v2->req_timestamp_ns));
+	req->img_op = v2->img_op;
+	req->overwrite = v2->overwrite;
+	req->pipeline_len = v2->pipeline_len;
+	memcpy(req->pipeline, v2->pipeline, IMG_PIPELINE_MAX);
+	req->img_id = le64toh(v2->img_id);
+}
+
+/* Encode a packed request */
+static inline void request_to_v2(struct request_v2 * v2, const struct request * req)
+{
+	v2->req_id = htole64(req->req_id);
+	v2->req_timestamp_ns = htole64(timespec_to_ns(&req->req_timestamp));
+	v2->img_op = req->img_op;
+	v2->overwrite = req->overwrite;
+	v2->pipeline_len = req->pipeline_len;
+	memcpy(v2->pipeline, req->pipeline, IMG_PIPELINE_MAX);
+	v2->img_id = htole64(req->img_id);
+}
+
+/* Encode a packed response */
+static inline void response_to_v2(struct response_v2 * v2, const struct response * resp)
+{
+	v2->req_id = htole64(resp->req_id);
+	v2->img_id = htole64(resp->img_id);
+	v2->ack = resp->ack;
+}
+
+/* Decode a packed response */
+static inline void response_from_v2(struct response * resp, const struct response_v2 * v2)
+{
+	memset(resp, 0, sizeof(struct response));
+	resp->req_id = le64toh(v2->req_id);
+	resp->img_id = le64toh(v2->img_id);
+	resp->ack = v2->ack;
+}
+
 /* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
 #endif
@@ -0,0 +1,52 @@
+/*******************************************************************************
+* Image Operation Cost Model (implementation)
+*
+* Description:
+*     Per-opcode estimates of the time per pixel, see costmodel.h.
+*
+* Notes:
+*     Coefficients are kept in picoseconds per pixel, so that the cheap
+*     operations of small images do not round down to nothing.
+*
+*******************************************************************************/
+
+#include <string.h>
+
+#include "costmodel.h"
+
+void costmodel_init(struct costmodel * model, const uint64_t * ps_per_px, size_t count)
+{
+	memset(model, 0, sizeof(struct costmodel));
+	if (count > COSTMODEL_OPCODES) {
+		count = COSTMODEL_OPCODES;
+	}
+	memcpy(model->ps_per_px, ps_per_px, count * sizeof(uint64_t));
+}
+
+uint64_t costmodel_estimate(const struct costmodel * model, const uint8_t * ops,
+			    size_t count, uint64_t pixels)
+{
+	uint64_t ps_per_px = 0;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (ops[i] < COSTMODEL_OPCODES) {
+			ps_per_px += __atomic_load_n(&model->ps_per_px[ops[i]], __ATOMIC_RELAXED);
+		}
+	}
+	return ps_per_px * pixels / 1000;
+}
+
+void costmodel_learn(struct costmodel * model, uint8_t op, uint64_t pixels, uint64_t ns)
+{
+	int64_t old, sample;
+
+	if (op >= COSTMODEL_OPCODES || !pixels) {
+		return;
+	}
+
+	old = __atomic_load_n(&model->ps_per_px[op], __ATOMIC_RELAXED);
+	sample = ns * 1000 / pixels;
+	__atomic_store_n(&model->ps_per_px[op],
+			 old + (sample - old) / (1 << COSTMODEL_SHIFT), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+* Image Operation Cost Model (header)
+*
+* Description:
+*     An online estimate of how long an image operation takes, for the
+*     policies that serve the shortest requests first. The service time
+*     of an operation is modeled as proportional to the number of pixels
+*     of the image, with one coefficient per opcode that is learned from
+*     the operations that the workers complete.
+*
+* Notes:
+*     Each coefficient starts from a prior given by the caller and then
+*     follows an exponentially weighted moving average of the observed
+*     time per pixel. Updates from concurrent workers may overwrite each
+*     other, which only drops a few samples: all the functions but
+*     costmodel_init() are thread-safe and lock-free.
+*
+*******************************************************************************/
+#ifndef __COSTMODEL_H__
+#define __COSTMODEL_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Opcodes from 0 to COSTMODEL_OPCODES - 1 are tracked */
+#define COSTMODEL_OPCODES 16
+
+/* Weight of a new sample in the moving average: 1 / 2^COSTMODEL_SHIFT */
+#define COSTMODEL_SHIFT 3
+
+struct costmodel {
+	/* Picoseconds per pixel, for each opcode */
+	uint64_t ps_per_px[COSTMODEL_OPCODES];
+};
+
+/* Start <model> from the <count> priors in <ps_per_px>, in picoseconds
+ * per pixel and indexed by opcode. The other opcodes start from 0. */
+void costmodel_init(struct costmodel * model, const uint64_t * ps_per_px, size_t count);
+
+/* Estimated nanoseconds for the <count> operations in <ops> applied one
+ * after the other to an image of <pixels> pixels */
+uint64_t costmodel_estimate(const struct costmodel * model, const uint8_t * ops,
+			    size_t count, uint64_t pixels);
+
+/* Account for operation <op> that took <ns> nanoseconds on an image
+ * of <pixels> pixels */
+void costmodel_learn(struct costmodel * model, uint8_t op, uint64_t pixels, uint64_t ns);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
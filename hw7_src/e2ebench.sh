@@ -0,0 +1,294 @@
+#!/bin/bash
+###############################################################################
+# End-to-End Benchmark of the Server
+#
+# Description:
+#     Starts server_mimg with every combination of the given queue sizes,
+#     worker counts and policies and, for each of them, drives it with
+#     loadgen at increasing arrival rates. Every rate runs against a fresh
+#     server. It prints one table per configuration, with the throughput,
+#     the percentiles of the response times seen by the clients, the
+#     rejections and the CPU time of the server at each rate, followed by
+#     the highest rate that met the SLO.
+#
+# Usage:
+#     ./e2ebench.sh [-q "<queue sizes>"] [-w "<worker counts>"]
+#                   [-p "<policies>"] [-a "<arrival rates>"] [-d <seconds>]
+#                   [-c <connections>] [-t <threads>] [-m <op mix>]
+#                   [-I <images folder>] [-s <p99 SLO ms>] [-r <reject %>]
+#                   [-x "<server options>"] [-e <build directory>]
+#                   [-P <port>] [-o <output folder>] [-b <baseline>] [-S]
+#
+#     e.g. ./e2ebench.sh -q "100 1000" -w "1 2" -p "FIFO SJN" \
+#               -a "1000 2000 4000 8000" -s 20 -b baseline.txt
+#     or   make e2e E2E_ARGS='-w "1 2" -b baseline.txt'
+#
+# Parameters:
+#     -q  - Queue sizes of the server (default "1000")
+#     -w  - Worker counts of the server (default "1")
+#     -p  - Policies of the server (default "FIFO")
+#     -a  - Arrival rates, in requests per second, in increasing order
+#           (default "500 1000 2000 4000 8000 16000")
+#     -d  - Seconds of load at every rate (default 5)
+#     -c  - Connections of loadgen (default 8)
+#     -t  - Threads of loadgen (default 1)
+#     -m  - Operation mix of loadgen, as its -m (default: its own)
+#     -I  - Images for loadgen to register (default: random ones)
+#     -s  - SLO on the 99th percentile of the response times, in ms
+#           (default 50)
+#     -r  - Highest share of rejected requests at a sustainable rate, in
+#           percent (default 1)
+#     -x  - More options for the server, e.g. "-S 20 -A" or "-u"
+#     -e  - Build directory with server_mimg and loadgen (default build)
+#     -P  - Port of the server (default 2222)
+#     -o  - Folder for the logs of every run (default: a new one in /tmp)
+#     -b  - Compare the highest sustainable rates against this baseline,
+#           and fail if any is more than 10% lower
+#     -S  - With -b, store the results as the new baseline instead
+#
+# Notes:
+#     A rate is sustainable if loadgen measured a p99 of the responses
+#     within the SLO, no more rejections than -r, and did not drop or
+#     lose any request. The response times of loadgen are taken from the
+#     time at which every request was due, so a server or client that
+#     falls behind fails the SLO. Once a rate is not sustainable, the
+#     higher ones of that configuration are skipped.
+#
+#     The CPU column is the user and system time of the server while
+#     loadgen ran, as a share of one CPU. The server writes its binary
+#     trace to /dev/null, and its STATS lines at exit, with the
+#     histograms of the server side, are kept in the log of every run
+#     (server.log), next to the output of loadgen (loadgen.log).
+#
+#     The summary, one line per configuration, is written to
+#     summary.txt in the output folder, in the format of the baselines.
+#     The build of the server (see CONFIG in the Makefile) is reported
+#     first, and the baseline comparison warns if it differs from the
+#     build that the baseline was taken with.
+#
+###############################################################################
+
+QUEUES="1000"
+WORKERS="1"
+POLICIES="FIFO"
+RATES="500 1000 2000 4000 8000 16000"
+DURATION=5
+CONNS=8
+THREADS=1
+MIX=""
+IMAGES=""
+SLO_MS=50
+MAX_REJECT_PCT=1
+SERVER_ARGS=""
+BUILD=build
+PORT=2222
+OUT=""
+BASELINE=""
+SAVE_BASELINE=0
+# Largest drop of a sustainable rate from the baseline, in percent
+TOLERANCE_PCT=10
+
+usage() {
+	sed -n '/^# Usage:/,/^# Parameters:/p' "$0" | sed '$d; s/^#//' >&2
+	exit 1
+}
+
+while getopts "q:w:p:a:d:c:t:m:I:s:r:x:e:P:o:b:S" opt; do
+	case $opt in
+	q) QUEUES=$OPTARG ;;
+	w) WORKERS=$OPTARG ;;
+	p) POLICIES=$OPTARG ;;
+	a) RATES=$OPTARG ;;
+	d) DURATION=$OPTARG ;;
+	c) CONNS=$OPTARG ;;
+	t) THREADS=$OPTARG ;;
+	m) MIX=$OPTARG ;;
+	I) IMAGES=$OPTARG ;;
+	s) SLO_MS=$OPTARG ;;
+	r) MAX_REJECT_PCT=$OPTARG ;;
+	x) SERVER_ARGS=$OPTARG ;;
+	e) BUILD=$OPTARG ;;
+	P) PORT=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	b) BASELINE=$OPTARG ;;
+	S) SAVE_BASELINE=1 ;;
+	*) usage ;;
+	esac
+done
+
+SERVER=$BUILD/server_mimg
+LOADGEN=$BUILD/loadgen
+for bin in "$SERVER" "$LOADGEN"; do
+	if [ ! -x "$bin" ]; then
+		echo "ERROR: $bin not found, run make first" >&2
+		exit 1
+	fi
+done
+
+if [ $SAVE_BASELINE = 1 ] && [ -z "$BASELINE" ]; then
+	echo "ERROR: -S needs a baseline file (-b)" >&2
+	exit 1
+fi
+
+[ -n "$OUT" ] || OUT=$(mktemp -d /tmp/e2ebench.XXXXXX)
+mkdir -p "$OUT" || exit 1
+SUMMARY=$OUT/summary.txt
+
+TICKS=$(getconf CLK_TCK)
+SERVER_PID=""
+
+# User plus system time of process $1, in clock ticks
+cpu_ticks() {
+	# The name of the command may contain spaces: skip past it
+	sed 's/^.*) //' "/proc/$1/stat" 2>/dev/null | awk '{ print $12 + $13 }'
+}
+
+stop_server() {
+	if [ -n "$SERVER_PID" ]; then
+		kill -INT $SERVER_PID 2>/dev/null
+		wait $SERVER_PID 2>/dev/null
+		SERVER_PID=""
+	fi
+}
+trap 'stop_server; exit 1' INT TERM
+
+# Start the server with the options $@ and its log in $LOG, and wait
+# until it accepts connections
+start_server() {
+	stdbuf -oL $SERVER "$@" -T /dev/null $SERVER_ARGS $PORT > "$LOG" 2>&1 &
+	SERVER_PID=$!
+	for i in $(seq 100); do
+		grep -qs "Waiting for incoming connections" "$LOG" && return 0
+		kill -0 $SERVER_PID 2>/dev/null || break
+		sleep 0.05
+	done
+	echo "ERROR: the server did not start, see $LOG" >&2
+	stop_server
+	return 1
+}
+
+# Value of the field $2 in the line of $1 that matches $3
+field() {
+	grep -m1 "$3" "$1" | grep -o "$2=[0-9.]*" | cut -d= -f2
+}
+
+run_config() {
+	local q=$1 w=$2 p=$3 rate dir lg_args before after start_ns wall_ns
+	local best_rate=0 best_p99=- best_rej=- best_cpu=-
+
+	echo
+	echo "CONFIG q=$q w=$w p=$p $SERVER_ARGS"
+	printf "%9s %9s %9s %9s %9s %9s %8s %7s %7s  %s\n" OFFERED ACHIEVED \
+	       GOODPUT "P50(ms)" "P99(ms)" "P999(ms)" REJECT% LOST CPU% SLO
+
+	for rate in $RATES; do
+		dir=$OUT/q$q-w$w-$p/a$rate
+		mkdir -p "$dir"
+		LOG=$dir/server.log
+		start_server -q $q -w $w -p $p || return 1
+
+		lg_args=(-a $rate -d $DURATION -c $CONNS -t $THREADS)
+		[ -n "$MIX" ] && lg_args+=(-m "$MIX")
+		[ -n "$IMAGES" ] && lg_args+=(-I "$IMAGES")
+
+		before=$(cpu_ticks $SERVER_PID)
+		start_ns=$(date +%s%N)
+		$LOADGEN "${lg_args[@]}" $PORT > "$dir/loadgen.log" 2>&1
+		wall_ns=$(($(date +%s%N) - start_ns))
+		after=$(cpu_ticks $SERVER_PID)
+		stop_server
+
+		local lg=$dir/loadgen.log
+		local achieved=$(field $lg achieved "offered=")
+		local n=$(field $lg n "op=ALL")
+		local rej=$(field $lg rejected "op=ALL")
+		local p50=$(field $lg resp_p50 "op=ALL")
+		local p99=$(field $lg resp_p99 "op=ALL")
+		local p999=$(field $lg resp_p999 "op=ALL")
+		local elapsed=$(grep -m1 "offered=" $lg | grep -o "over [0-9.]*" | cut -d' ' -f2)
+		local dropped=$(field $lg dropped "lost=")
+		local lost=$(field $lg lost "lost=")
+		if [ -z "$n" ] || [ -z "$elapsed" ]; then
+			echo "ERROR: loadgen failed at $rate req/s, see $lg" >&2
+			return 1
+		fi
+
+		local row=$(awk -v n=$n -v rej=$rej -v el=$elapsed -v dt=$((after - before)) \
+				-v tck=$TICKS -v wall=$wall_ns -v p99=$p99 -v slo=$SLO_MS \
+				-v maxrej=$MAX_REJECT_PCT -v miss=$((dropped + lost)) 'BEGIN {
+			rej_pct = n + rej ? 100 * rej / (n + rej) : 0
+			ok = p99 <= slo && rej_pct <= maxrej && miss == 0
+			printf "%.1f %.2f %.1f %s", el ? n / el : 0, rej_pct,
+			       100 * dt / tck / (wall / 1e9), ok ? "ok" : "MISSED"
+		}')
+		set -- $row
+		printf "%9d %9.1f %9.1f %9.3f %9.3f %9.3f %8.2f %7d %7.1f  %s\n" $rate \
+		       $achieved $1 $p50 $p99 $p999 $2 $((dropped + lost)) $3 $4
+		if [ "$4" != ok ]; then
+			break
+		fi
+		best_rate=$rate best_p99=$p99 best_rej=$2 best_cpu=$3
+	done
+
+	echo "MAX_RATE q=$q w=$w p=$p rate=$best_rate p99=$best_p99 reject=$best_rej% cpu=$best_cpu%"
+	echo "q=$q w=$w p=$p x=${SERVER_ARGS// /_} max_rate=$best_rate p99_ms=$best_p99" \
+	     "reject_pct=$best_rej cpu_pct=$best_cpu" >> "$SUMMARY"
+}
+
+# A first server only tells the build that the numbers are for
+LOG=$OUT/build.log
+start_server -q 1 -w 1 -p FIFO || exit 1
+stop_server
+BUILD_INFO=$(grep -m1 "INFO: build" "$LOG" | sed 's/^INFO: build //')
+echo "INFO: server build ${BUILD_INFO:-unknown}"
+echo "# build ${BUILD_INFO:-unknown}" > "$SUMMARY"
+echo "INFO: SLO p99=${SLO_MS} ms, rejections <= ${MAX_REJECT_PCT}%, ${DURATION} s per rate, logs in $OUT"
+for q in $QUEUES; do
+	for w in $WORKERS; do
+		for p in $POLICIES; do
+			run_config $q $w $p || { stop_server; exit 1; }
+		done
+	done
+done
+
+[ -n "$BASELINE" ] || exit 0
+
+if [ $SAVE_BASELINE = 1 ]; then
+	cp "$SUMMARY" "$BASELINE"
+	echo "INFO: baseline saved to $BASELINE"
+	exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+	echo "ERROR: no baseline $BASELINE, store one with -S" >&2
+	exit 1
+fi
+
+# Match the configurations by everything before max_rate
+echo
+echo "BASELINE $BASELINE"
+awk -v tol=$TOLERANCE_PCT '
+	function key(line) { sub(/ max_rate=.*/, "", line); return line }
+	function rate(line) { sub(/.*max_rate=/, "", line); sub(/ .*/, "", line); return line + 0 }
+	/^# build / {
+		if (NR == FNR)
+			built = $0
+		else if ($0 != built)
+			printf "  WARNING: the baseline has %s\n", substr(built, 3)
+		next
+	}
+	NR == FNR { base[key($0)] = rate($0); next }
+	{
+		k = key($0); r = rate($0)
+		if (!(k in base)) {
+			printf "  %-40s %9d  (not in the baseline)\n", k, r
+			next
+		}
+		bad = r < base[k] * (1 - tol / 100)
+		printf "  %-40s %9d vs %9d  %s\n", k, r, base[k], bad ? "REGRESSION" : "ok"
+		regressions += bad
+	}
+	END { exit regressions > 0 }' "$BASELINE" "$SUMMARY"
+status=$?
+[ $status = 0 ] || echo "ERROR: sustainable rate below the baseline" >&2
+exit $status
@@ -0,0 +1,103 @@
+/*******************************************************************************
+* Latency Histograms (implementation)
+*
+* Description:
+*     Log-linear histograms, see histo.h.
+*
+* Notes:
+*     Values below 2^(HISTO_SUB_BITS + 1) have one bucket each. Above,
+*     a value whose highest bit is bit <msb> keeps its top HISTO_SUB_BITS
+*     + 1 bits, and lands in bucket ((msb - HISTO_SUB_BITS) <<
+*     HISTO_SUB_BITS) + those bits: the buckets of one power of two
+*     follow those of the previous one without a gap.
+*
+*******************************************************************************/
+
+#include <string.h>
+
+#include "histo.h"
+
+static size_t histo_index(uint64_t value)
+{
+	int msb;
+
+	if (value >> (HISTO_SUB_BITS + 1) == 0)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((size_t)(msb - HISTO_SUB_BITS) << HISTO_SUB_BITS) +
+		(value >> (msb - HISTO_SUB_BITS));
+}
+
+/* Middle of the range of values of bucket <index> */
+static uint64_t histo_value(size_t index)
+{
+	size_t shift;
+
+	if (index >> (HISTO_SUB_BITS + 1) == 0)
+		return index;
+
+	shift = (index >> HISTO_SUB_BITS) - 1;
+	return ((uint64_t)((index & ((1 << HISTO_SUB_BITS) - 1)) | (1 << HISTO_SUB_BITS))
+		<< shift) + ((1ULL << shift) >> 1);
+}
+
+void histo_record(struct histo * h, uint64_t value)
+{
+	size_t index;
+
+	if (value >> HISTO_MAX_BITS)
+		value = (1ULL << HISTO_MAX_BITS) - 1;
+	index = histo_index(value);
+
+	/* Single writer: no need for atomic increments, only for the
+	 * readers to see whole values */
+	__atomic_store_n(&h->buckets[index],
+			 __atomic_load_n(&h->buckets[index], __ATOMIC_RELAXED) + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, __atomic_load_n(&h->count, __ATOMIC_RELAXED) + 1,
+			 __ATOMIC_RELAXED);
+	if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void histo_merge(struct histo * dst, const struct histo * src)
+{
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	size_t i;
+
+	/* The count is summed from the buckets, to agree with them */
+	for (i = 0; i < HISTO_BUCKETS; ++i) {
+		uint64_t n = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+
+		dst->buckets[i] += n;
+		dst->count += n;
+	}
+	if (max > dst->max)
+		dst->max = max;
+}
+
+uint64_t histo_percentile(const struct histo * h, double q)
+{
+	uint64_t rank, seen = 0;
+	size_t i;
+
+	if (!h->count)
+		return 0;
+
+	/* Rank of the value, from 1 to count */
+	rank = (uint64_t)(q * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (i = 0; i < HISTO_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			uint64_t value = histo_value(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
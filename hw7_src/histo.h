@@ -0,0 +1,48 @@
+/*******************************************************************************
+* Latency Histograms (header)
+*
+* Description:
+*     Log-linear histograms of 64-bit values, in the style of HDR
+*     histograms: every power of two is split into 2^HISTO_SUB_BITS
+*     buckets of equal width, so that a value is recorded with a relative
+*     error of at most 1 / 2^HISTO_SUB_BITS (about 3%) whatever its
+*     magnitude, and percentiles can be read back at any time.
+*
+* Notes:
+*     A histogram has a single writer: histo_record() is a plain load and
+*     store of one counter, with no read-modify-write, and other threads
+*     may read the histogram at any time with histo_merge(). Values
+*     beyond 2^HISTO_MAX_BITS - 1 (about 137 s in nanoseconds) are
+*     recorded as that maximum.
+*
+*******************************************************************************/
+#ifndef __HISTO_H__
+#define __HISTO_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define HISTO_SUB_BITS 5
+#define HISTO_MAX_BITS 37
+#define HISTO_BUCKETS (((HISTO_MAX_BITS - HISTO_SUB_BITS) + 1) << HISTO_SUB_BITS)
+
+struct histo {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HISTO_BUCKETS];
+};
+
+/* Add <value> to <h>. Only one thread may record into <h>. */
+void histo_record(struct histo * h, uint64_t value);
+
+/* Add the counts of <src>, which may be recorded into meanwhile, to
+ * those of <dst> */
+void histo_merge(struct histo * dst, const struct histo * src);
+
+/* Value below which a fraction <q> of the values of <h> fall, e.g. 0.99
+ * for the 99th percentile. Returns 0 if <h> is empty. */
+uint64_t histo_percentile(const struct histo * h, double q);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -0,0 +1,675 @@
+/*******************************************************************************
+* ImgLib Benchmark Suite
+*
+* Description:
+*     Times the functions of the imglib that the server relies on, the
+*     ones that libtest.c used to exercise and the rest of the filters,
+*     on a sweep of image sizes. Every case is run a number of times on a
+*     pinned CPU, and the median and best times are reported, together
+*     with the time per megapixel and the cycles per pixel. The output of
+*     every case is hashed and checked against the golden digests below,
+*     so that an optimization that changes a single pixel is caught.
+*
+* Usage:
+*     <build directory>/imgbench [-r <repetitions>] [-s <W>x<H>[,...]]
+*                                [-c <cpu>] [-g] [image.bmp ...]
+*
+*     e.g. ./build/imgbench -r 20 -s 256x256,1920x1080
+*          ./build/imgbench ../hw6_src/images/test1.bmp
+*
+* Parameters:
+*     -r  - Timed runs of every case (default 10), after one warm-up run
+*     -s  - Sizes of the synthetic images (default: a sweep from 64x64
+*           to 1920x1080)
+*     -c  - CPU to run on (default: the first one allowed). The sender of
+*           the socket case runs on the next allowed CPU, if any.
+*     -g  - Print the digests of all the cases as a golden table instead
+*           of checking them
+*
+* Notes:
+*     The synthetic images have pseudo-random pixels drawn from their
+*     size, so their digests are the same on every run and machine.
+*     Images given on the command line are timed too, but can only be
+*     checked for consistency: LOAD and SENDRECV must give back the
+*     input. The digests of images cover their pixels in the order of
+*     the wire format, whatever their layout in memory.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common.h"
+
+#define USAGE_STRING							\
+	"Usage: %s [-r <repetitions>] [-s <W>x<H>[,...]] [-c <cpu>] [-g] [image.bmp ...]\n"
+
+#define DEFAULT_REPS 10
+#define MAX_SIZES    16
+
+enum bench_case {
+	CASE_LOAD,
+	CASE_SAVE,
+	CASE_ROT90CLKW,
+	CASE_BLUR,
+	CASE_SHARPEN,
+	CASE_VERTEDGES,
+	CASE_HORIZEDGES,
+	CASE_GAUSSBLUR,
+	CASE_EMBOSS,
+	CASE_SOBEL,
+	CASE_CLONE,
+	CASE_SENDRECV,
+	CASE_MD5,
+	CASE_MD5X8,
+	CASE_PACK,
+	CASE_UNPACK,
+	CASE_COUNT
+};
+
+const char * case_names[CASE_COUNT] = {
+	[CASE_LOAD]       = "LOAD",
+	[CASE_SAVE]       = "SAVE",
+	[CASE_ROT90CLKW]  = "ROT90CLKW",
+	[CASE_BLUR]       = "BLUR",
+	[CASE_SHARPEN]    = "SHARPEN",
+	[CASE_VERTEDGES]  = "VERTEDGES",
+	[CASE_HORIZEDGES] = "HORIZEDGES",
+	[CASE_GAUSSBLUR]  = "GAUSSBLUR",
+	[CASE_EMBOSS]     = "EMBOSS",
+	[CASE_SOBEL]      = "SOBEL",
+	[CASE_CLONE]      = "CLONE",
+	[CASE_SENDRECV]   = "SENDRECV",
+	[CASE_MD5]        = "MD5",
+	[CASE_MD5X8]      = "MD5X8",
+	[CASE_PACK]       = "PACK",
+	[CASE_UNPACK]     = "UNPACK",
+};
+
+struct golden {
+	uint32_t width, height;
+	enum bench_case which;
+	const char * digest;
+};
+
+/* Digests of the outputs on the synthetic images, from imgbench -g:
+ * the same as those of the original row-by-row imglib of hw6 for the
+ * cases it has. SAVE is the digest of the BMP file, PACK that of the
+ * compressed encoding. */
+const struct golden goldens[] = {
+	{   64,   64, CASE_LOAD,       "c3c189b4443bfa479c3f66512c07ef43" },
+	{   64,   64, CASE_SAVE,       "cddb192d65414599d25fb6c86d794559" },
+	{   64,   64, CASE_ROT90CLKW,  "0090a3f1d7de8c542ede4246918281cd" },
+	{   64,   64, CASE_BLUR,       "e0203231769061aa9396ca18db6eb681" },
+	{   64,   64, CASE_SHARPEN,    "3d7fca4340495baf6eb5d5c604dfe55c" },
+	{   64,   64, CASE_VERTEDGES,  "0ce0b47277784cd26f4b0dbf7de80758" },
+	{   64,   64, CASE_HORIZEDGES, "f43a6bef2354e5a38013ffcd1936e1ab" },
+	{   64,   64, CASE_GAUSSBLUR,  "b87afdeab43de92720321ec944924bca" },
+	{   64,   64, CASE_EMBOSS,     "c01fc507ebeb3ad663e6124e0c89b82e" },
+	{   64,   64, CASE_SOBEL,      "7141eee4b563c70b50dfb22d93bc5e92" },
+	{   64,   64, CASE_CLONE,      "c3c189b4443bfa479c3f66512c07ef43" },
+	{   64,   64, CASE_SENDRECV,   "c3c189b4443bfa479c3f66512c07ef43" },
+	{   64,   64, CASE_MD5,        "c3c189b4443bfa479c3f66512c07ef43" },
+	{   64,   64, CASE_MD5X8,      "c3c189b4443bfa479c3f66512c07ef43" },
+	{   64,   64, CASE_PACK,       "9532e5c7493791912aa36ffc2d3fe6f5" },
+	{   64,   64, CASE_UNPACK,     "c3c189b4443bfa479c3f66512c07ef43" },
+	{  256,  256, CASE_LOAD,       "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  256,  256, CASE_SAVE,       "968eb2ac6895855efa2426e717991e38" },
+	{  256,  256, CASE_ROT90CLKW,  "60a1ec39619a299a74fd2fc93ebf0026" },
+	{  256,  256, CASE_BLUR,       "d559c56dcee964687ef1d595fea939fa" },
+	{  256,  256, CASE_SHARPEN,    "259c9d3a8ba0df9a41688250f36f90fa" },
+	{  256,  256, CASE_VERTEDGES,  "eb1801d01265af28c0750c1784d39ac1" },
+	{  256,  256, CASE_HORIZEDGES, "3da5d6e46f7dd0a672b4d57ba9d2e8fc" },
+	{  256,  256, CASE_GAUSSBLUR,  "df488162341fd56b7fe9d4832368afb6" },
+	{  256,  256, CASE_EMBOSS,     "d52a35a2c2bdf9a9aa1533288e5525ed" },
+	{  256,  256, CASE_SOBEL,      "5727d162bddb8f77f7a6fb863e319318" },
+	{  256,  256, CASE_CLONE,      "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  256,  256, CASE_SENDRECV,   "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  256,  256, CASE_MD5,        "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  256,  256, CASE_MD5X8,      "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  256,  256, CASE_PACK,       "081106585bec2f8de69a1190b8a0b149" },
+	{  256,  256, CASE_UNPACK,     "c009c32c9d693ca5d4594eed5feb35a0" },
+	{  640,  480, CASE_LOAD,       "97917b67c408c67c83690b9a95a5b30b" },
+	{  640,  480, CASE_SAVE,       "2fa6f1447d07375080cc54e0c570d8e0" },
+	{  640,  480, CASE_ROT90CLKW,  "bedf685e561522a8a94c3f05ba58839d" },
+	{  640,  480, CASE_BLUR,       "ba5fe28bd911db0e9a78cdc49d18057a" },
+	{  640,  480, CASE_SHARPEN,    "eea6c1d5dffe92b3f989f92bc8173dd0" },
+	{  640,  480, CASE_VERTEDGES,  "22bd8d3eccc28139b38514a3333e1cda" },
+	{  640,  480, CASE_HORIZEDGES, "734d1b466ffbadbfe4fac8ce5e8b0240" },
+	{  640,  480, CASE_GAUSSBLUR,  "1faf22985fcad1c3ed72ab8bc579ebd2" },
+	{  640,  480, CASE_EMBOSS,     "f2f18ef9c8221698ce71e749560660cd" },
+	{  640,  480, CASE_SOBEL,      "35175c41505714f7c91f4874f45495df" },
+	{  640,  480, CASE_CLONE,      "97917b67c408c67c83690b9a95a5b30b" },
+	{  640,  480, CASE_SENDRECV,   "97917b67c408c67c83690b9a95a5b30b" },
+	{  640,  480, CASE_MD5,        "97917b67c408c67c83690b9a95a5b30b" },
+	{  640,  480, CASE_MD5X8,      "97917b67c408c67c83690b9a95a5b30b" },
+	{  640,  480, CASE_PACK,       "c318e516c963d1537e50bed430c438d6" },
+	{  640,  480, CASE_UNPACK,     "97917b67c408c67c83690b9a95a5b30b" },
+	{ 1024, 1024, CASE_LOAD,       "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1024, 1024, CASE_SAVE,       "a1a22f830dc3d8ab7d86b1a6fdc8f99a" },
+	{ 1024, 1024, CASE_ROT90CLKW,  "b85e67c6a21066c460cae83363e57561" },
+	{ 1024, 1024, CASE_BLUR,       "4b10438c05040002dd7803ccd590181a" },
+	{ 1024, 1024, CASE_SHARPEN,    "44cb08bac8bf4e69a185a79daf2d4cc9" },
+	{ 1024, 1024, CASE_VERTEDGES,  "290a282b81e3551877991213c3c334c7" },
+	{ 1024, 1024, CASE_HORIZEDGES, "f031f304f4527bd7113166cb40b41788" },
+	{ 1024, 1024, CASE_GAUSSBLUR,  "492e07dfe5bafd1c5ca7a16b434503e1" },
+	{ 1024, 1024, CASE_EMBOSS,     "7ac5baf708803df7c16132a77ce113f0" },
+	{ 1024, 1024, CASE_SOBEL,      "3e08b9281a02b6f0d86345f6950a477f" },
+	{ 1024, 1024, CASE_CLONE,      "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1024, 1024, CASE_SENDRECV,   "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1024, 1024, CASE_MD5,        "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1024, 1024, CASE_MD5X8,      "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1024, 1024, CASE_PACK,       "b1cc65a7f9180d434ad0ff8bb5bbe10d" },
+	{ 1024, 1024, CASE_UNPACK,     "9653d5a6aff721dc961be483e6b4fd6f" },
+	{ 1920, 1080, CASE_LOAD,       "1cce5abeaafc7688b21f655c51d8868f" },
+	{ 1920, 1080, CASE_SAVE,       "95fedf5b630dfd03694f7c5cad05031c" },
+	{ 1920, 1080, CASE_ROT90CLKW,  "a6ba6ddfb8db12c7cde053ae5ecec714" },
+	{ 1920, 1080, CASE_BLUR,       "c41f6de77e979e4a3f2d670aa506f7c5" },
+	{ 1920, 1080, CASE_SHARPEN,    "9a0a0ed6f73455698d974ef05d69a027" },
+	{ 1920, 1080, CASE_VERTEDGES,  "3cb40334811a2ea52b69e3d6a74dd910" },
+	{ 1920, 1080, CASE_HORIZEDGES, "269f36a71c10e70c594d92202148053b" },
+	{ 1920, 1080, CASE_GAUSSBLUR,  "12f3fc0829d5ed749538d6d5b7bf6dba" },
+	{ 1920, 1080, CASE_EMBOSS,     "04b68c4e8e525266bd89bb7f3cccbe62" },
+	{ 1920, 1080, CASE_SOBEL,      "e6d6cd3b4c4e13602f7bc23e381032f6" },
+	{ 1920, 1080, CASE_CLONE,      "1cce5abeaafc7688b21f655c51d8868f" },
+	{ 1920, 1080, CASE_SENDRECV,   "1cce5abeaafc7688b21f655c51d8868f" },
+	{ 1920, 1080, CASE_MD5,        "1cce5abeaafc7688b21f655c51d8868f" },
+	{ 1920, 1080, CASE_MD5X8,      "1cce5abeaafc7688b21f655c51d8868f" },
+	{ 1920, 1080, CASE_PACK,       "67ff3c4ea7b296bcdf3edaf69edf7996" },
+	{ 1920, 1080, CASE_UNPACK,     "1cce5abeaafc7688b21f655c51d8868f" },
+};
+
+struct bench_sizes {
+	uint32_t width[MAX_SIZES], height[MAX_SIZES];
+	size_t count;
+};
+
+const struct bench_sizes default_sizes = {
+	{ 64, 256, 640, 1024, 1920 },
+	{ 64, 256, 480, 1024, 1080 },
+	5
+};
+
+/* The other end of the socket case, see sender_main() */
+struct sender {
+	pthread_t tid;
+	int fd;
+	int cpu;
+	struct image * img;
+	sem_t go;
+	int stop;
+};
+
+static uint64_t rng_next(uint64_t * state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Pseudo-random pixels, drawn from the size alone. The top byte is not
+ * kept by the BMP files, so it is left at 0. */
+static struct image * synth_image(uint32_t width, uint32_t height)
+{
+	struct image * img = createImage(width, height);
+	uint64_t state = ((uint64_t)width << 32 | height) * 0x9E3779B97F4A7C15ULL + 1;
+	size_t i;
+
+	for (i = 0; i < (size_t)width * height; ++i) {
+		img->pixels[i] = rng_next(&state) & 0xffffff;
+	}
+	return img;
+}
+
+static int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* The <nth> CPU the process may run on, wrapping around */
+static int allowed_cpu(const cpu_set_t * allowed, int nth)
+{
+	int count = CPU_COUNT(allowed), cpu;
+
+	nth %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, allowed) && nth-- == 0) {
+			return cpu;
+		}
+	}
+	return 0;
+}
+
+static void md5_consume(void * arg, const void * data, size_t len)
+{
+	md5_update((struct md5ctx *)arg, data, len);
+}
+
+static struct md5digest image_digest(const struct image * img)
+{
+	struct md5ctx ctx;
+
+	md5_init(&ctx);
+	readImageRows(img, md5_consume, &ctx);
+	return md5_final(&ctx);
+}
+
+/* The pixels of <img> hashed MD5_LANES times over by md5_multi(): the
+ * digest if all the lanes agree, zeros otherwise */
+static struct md5digest md5_lanes(const struct image * img)
+{
+	const void * bufs[MD5_LANES];
+	size_t lens[MD5_LANES];
+	struct md5digest digests[MD5_LANES];
+	int i;
+
+	for (i = 0; i < MD5_LANES; ++i) {
+		bufs[i] = img->pixels;
+		lens[i] = (size_t)img->width * img->height * sizeof(uint32_t);
+	}
+	md5_multi(bufs, lens, MD5_LANES, digests);
+
+	for (i = 1; i < MD5_LANES; ++i) {
+		if (memcmp(&digests[i], &digests[0], sizeof(digests[0]))) {
+			memset(&digests[0], 0, sizeof(digests[0]));
+			break;
+		}
+	}
+	return digests[0];
+}
+
+/* Compress <img>, and if <unpack> decode it back: the time of UNPACK
+ * includes that of PACK. If <keep>, returns the digest of the encoding
+ * or of the decoded image. */
+static struct md5digest pack_round(const struct image * img, int unpack, int keep)
+{
+	uint8_t * buf = (uint8_t *)malloc(packImageBound(img->width, img->height));
+	struct image * out = NULL;
+	struct md5digest digest;
+	size_t len;
+
+	memset(&digest, 0, sizeof(digest));
+	if (!buf || packImage(img, buf, &len)) {
+		ERROR_INFO();
+		fprintf(stderr, "Unable to pack the image\n");
+	} else if (!unpack) {
+		if (keep) {
+			digest = buf_md5sum((const char *)buf, len);
+		}
+	} else if (!(out = createImage(img->width, img->height)) ||
+		   unpackImage(out, buf, len)) {
+		ERROR_INFO();
+		fprintf(stderr, "Unable to unpack the image\n");
+	} else if (keep) {
+		digest = image_digest(out);
+	}
+	if (out) {
+		deleteImage(out);
+	}
+	free(buf);
+	return digest;
+}
+
+static void digest_to_hex(const struct md5digest * d, char * hex)
+{
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		sprintf(hex + 2 * i, "%.2x", d->__digest[i]);
+	}
+}
+
+static void * sender_main(void * arg)
+{
+	struct sender * s = (struct sender *)arg;
+
+	pin_to_cpu(s->cpu);
+	for (;;) {
+		sem_wait(&s->go);
+		if (s->stop) {
+			break;
+		}
+		if (sendImage(s->img, s->fd)) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to send the image\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void * a, const void * b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+	return (ua > ub) - (ua < ub);
+}
+
+/* Run case <which> once on <img>, and if <keep> return the digest of
+ * what it produced */
+static struct md5digest run_case(enum bench_case which, struct image * img,
+				 const char * bmp_path, const char * tmp_path,
+				 struct sender * sender, int sock, int keep)
+{
+	struct image * out = NULL;
+	struct md5digest digest;
+
+	memset(&digest, 0, sizeof(digest));
+
+	switch (which) {
+	case CASE_LOAD:
+		out = loadBMP(bmp_path);
+		break;
+	case CASE_SAVE:
+		if (saveBMP(tmp_path, img)) {
+			ERROR_INFO();
+			perror("Unable to save the image");
+		}
+		if (keep) {
+			digest = file_md5sum(tmp_path);
+		}
+		return digest;
+	case CASE_ROT90CLKW:
+		out = rotate90Clockwise(img, NULL);
+		break;
+	case CASE_BLUR:
+		out = blurImage(img);
+		break;
+	case CASE_SHARPEN:
+		out = sharpenImage(img);
+		break;
+	case CASE_VERTEDGES:
+		out = detectVerticalEdges(img);
+		break;
+	case CASE_HORIZEDGES:
+		out = detectHorizontalEdges(img);
+		break;
+	case CASE_GAUSSBLUR:
+		out = gaussianBlurImage(img);
+		break;
+	case CASE_EMBOSS:
+		out = embossImage(img);
+		break;
+	case CASE_SOBEL:
+		out = detectEdges(img);
+		break;
+	case CASE_CLONE:
+		out = cloneImage(img, NULL);
+		break;
+	case CASE_SENDRECV:
+		sender->img = img;
+		sem_post(&sender->go);
+		out = recvImage(sock);
+		break;
+	case CASE_MD5:
+		return buf_md5sum((const char *)img->pixels,
+				  (size_t)img->width * img->height * sizeof(uint32_t));
+	case CASE_MD5X8:
+		return md5_lanes(img);
+	case CASE_PACK:
+	case CASE_UNPACK:
+		return pack_round(img, which == CASE_UNPACK, keep);
+	default:
+		break;
+	}
+
+	if (!out) {
+		ERROR_INFO();
+		fprintf(stderr, "%s failed\n", case_names[which]);
+		return digest;
+	}
+	if (keep) {
+		digest = image_digest(out);
+	}
+	deleteImage(out);
+	return digest;
+}
+
+static const char * golden_for(uint32_t width, uint32_t height, enum bench_case which)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(goldens) / sizeof(goldens[0]); ++i) {
+		if (goldens[i].width == width && goldens[i].height == height &&
+		    goldens[i].which == which) {
+			return goldens[i].digest;
+		}
+	}
+	return NULL;
+}
+
+/* Time every case on <img>. <expect_input> is set for the images of
+ * the command line, that have no golden digests: the cases that must
+ * give back the input are checked against it. Returns the number of
+ * mismatches. */
+static int bench_image(const char * label, struct image * img, int reps, int print_golden,
+		       int expect_input, const char * tmp_path, struct sender * sender, int sock)
+{
+	char bmp_path[] = "/tmp/imgbench_in_XXXXXX";
+	uint64_t * ns = (uint64_t *)malloc(reps * sizeof(uint64_t));
+	uint64_t * clocks = (uint64_t *)malloc(reps * sizeof(uint64_t));
+	double mpix = (double)img->width * img->height / 1e6;
+	struct md5digest input = image_digest(img);
+	char input_hex[33];
+	int fd, mismatches = 0;
+	size_t which;
+
+	digest_to_hex(&input, input_hex);
+
+	fd = mkstemp(bmp_path);
+	if (fd < 0 || saveBMP(bmp_path, img)) {
+		ERROR_INFO();
+		perror("Unable to write the input BMP");
+		free(ns);
+		free(clocks);
+		return 1;
+	}
+	close(fd);
+
+	for (which = 0; which < CASE_COUNT; ++which) {
+		struct md5digest digest;
+		const char * expected;
+		char hex[33];
+		double scale;
+		int i;
+
+		/* One untimed run, which also gives the digest */
+		digest = run_case(which, img, bmp_path, tmp_path, sender, sock, 1);
+		digest_to_hex(&digest, hex);
+
+		for (i = 0; i < reps; ++i) {
+			struct timespec start, end;
+			uint64_t c0, c1;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			get_clocks(c0);
+			run_case(which, img, bmp_path, tmp_path, sender, sock, 0);
+			get_clocks(c1);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			ns[i] = timespec_to_ns(&end) - timespec_to_ns(&start);
+			clocks[i] = c1 - c0;
+		}
+		qsort(ns, reps, sizeof(uint64_t), cmp_u64);
+		qsort(clocks, reps, sizeof(uint64_t), cmp_u64);
+
+		if (print_golden) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "CASE_%s,", case_names[which]);
+			printf("\t{ %4u, %4u, %-16s \"%s\" },\n", img->width, img->height,
+			       name, hex);
+			continue;
+		}
+
+		if (expect_input) {
+			expected = (which == CASE_LOAD || which == CASE_SENDRECV ||
+				    which == CASE_CLONE || which == CASE_UNPACK) ? input_hex : NULL;
+		} else {
+			expected = golden_for(img->width, img->height, which);
+		}
+		if (expected && strcmp(expected, hex)) {
+			mismatches++;
+		}
+
+		/* MD5X8 hashes the image once per lane */
+		scale = which == CASE_MD5X8 ? MD5_LANES : 1;
+		printf("%-24s %-10s %9.2f %10.3f %10.3f %10.3f %10.2f  %s\n", label,
+		       case_names[which], mpix * scale, ns[reps / 2] / 1e6, ns[0] / 1e6,
+		       ns[reps / 2] / 1e6 / mpix / scale,
+		       (double)clocks[reps / 2] / ((double)img->width * img->height * scale),
+		       !expected ? "-" : strcmp(expected, hex) ? "MISMATCH!" : "ok");
+	}
+
+	unlink(bmp_path);
+	free(ns);
+	free(clocks);
+	return mismatches;
+}
+
+static int parse_sizes(char * list, struct bench_sizes * sizes)
+{
+	char * tok, * save;
+
+	sizes->count = 0;
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		unsigned int w, h;
+
+		if (sizes->count == MAX_SIZES || sscanf(tok, "%ux%u", &w, &h) != 2 || !w || !h) {
+			return 1;
+		}
+		sizes->width[sizes->count] = w;
+		sizes->height[sizes->count] = h;
+		sizes->count++;
+	}
+	return !sizes->count;
+}
+
+int main (int argc, char ** argv)
+{
+	struct bench_sizes sizes = default_sizes;
+	char tmp_path[] = "/tmp/imgbench_out_XXXXXX";
+	struct sender sender;
+	cpu_set_t allowed;
+	int opt, reps = DEFAULT_REPS, cpu = -1, print_golden = 0, mismatches = 0;
+	int socks[2], fd;
+	size_t i;
+
+	while((opt = getopt(argc, argv, "r:s:c:g")) != -1) {
+		switch (opt) {
+		case 'r':
+			reps = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			if (parse_sizes(optarg, &sizes)) {
+				fprintf(stderr, USAGE_STRING, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 10);
+			break;
+		case 'g':
+			print_golden = 1;
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (reps <= 0) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* The benchmark on one CPU, the sender of the socket case on the
+	 * next one */
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	if (cpu < 0) {
+		cpu = allowed_cpu(&allowed, 0);
+	}
+	if (pin_to_cpu(cpu)) {
+		ERROR_INFO();
+		perror("Unable to pin to the CPU");
+		return EXIT_FAILURE;
+	}
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+		ERROR_INFO();
+		perror("Unable to set up the benchmark");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	memset(&sender, 0, sizeof(sender));
+	sender.fd = socks[0];
+	sender.cpu = CPU_COUNT(&allowed) > 1 ? allowed_cpu(&allowed, 1) : cpu;
+	if (sender.cpu == cpu && CPU_COUNT(&allowed) > 1) {
+		sender.cpu = allowed_cpu(&allowed, 0);
+	}
+	sem_init(&sender.go, 0, 0);
+	if (pthread_create(&sender.tid, NULL, sender_main, &sender)) {
+		ERROR_INFO();
+		perror("Unable to create the sender thread");
+		return EXIT_FAILURE;
+	}
+
+	if (!print_golden) {
+		PRINT_BUILD_INFO();
+		printf("INFO: CPU %d, sender on CPU %d, %d runs per case\n", cpu, sender.cpu, reps);
+		printf("%-24s %-10s %9s %10s %10s %10s %10s  %s\n", "IMAGE", "CASE", "MPIX",
+		       "MEDIAN(ms)", "BEST(ms)", "ms/MPIX", "CYCLES/PX", "CHECK");
+	}
+
+	for (i = 0; i < sizes.count; ++i) {
+		struct image * img = synth_image(sizes.width[i], sizes.height[i]);
+		char label[32];
+
+		snprintf(label, sizeof(label), "synth %ux%u", sizes.width[i], sizes.height[i]);
+		mismatches += bench_image(label, img, reps, print_golden, 0, tmp_path,
+					  &sender, socks[1]);
+		deleteImage(img);
+	}
+
+	for (; optind < argc && !print_golden; ++optind) {
+		struct image * img = loadBMP(argv[optind]);
+		const char * base = strrchr(argv[optind], '/');
+
+		if (!img) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to load image %s\n", argv[optind]);
+			mismatches++;
+			continue;
+		}
+		mismatches += bench_image(base ? base + 1 : argv[optind], img, reps, 0, 1,
+					  tmp_path, &sender, socks[1]);
+		deleteImage(img);
+	}
+
+	sender.stop = 1;
+	sem_post(&sender.go);
+	pthread_join(sender.tid, NULL);
+	close(socks[0]);
+	close(socks[1]);
+	unlink(tmp_path);
+
+	if (!print_golden) {
+		printf("INFO: %d mismatches\n", mismatches);
+	}
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
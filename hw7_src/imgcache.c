@@ -0,0 +1,234 @@
+/*******************************************************************************
+* Image Result Cache (implementation)
+*
+* Description:
+*     A bounded, content-addressed cache of image operation results, see
+*     imgcache.h.
+*
+* Notes:
+*     Entries live in a chained hash table indexed by the digest of the
+*     source image, and are also linked in a doubly-linked LRU list. A
+*     single mutex protects both: the critical sections only move a few
+*     pointers, and the outputs themselves are never copied.
+*
+*******************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "imgcache.h"
+
+/* Number of hash buckets, a power of two */
+#define IMGCACHE_BUCKETS 4096
+
+struct imgcache_entry {
+	struct imgcache_key key;
+	struct image * img;
+	size_t bytes;
+	struct imgcache_entry * chain;
+	struct imgcache_entry * prev;
+	struct imgcache_entry * next;
+};
+
+void imgcache_make_key(struct imgcache_key * key, const struct md5digest * digest,
+		       uint32_t width, uint32_t height, uint8_t img_op)
+{
+	/* Clear the padding too, the keys are compared field by field
+	 * but also hashed from the digest bytes */
+	memset(key, 0, sizeof(struct imgcache_key));
+	key->digest = *digest;
+	key->width = width;
+	key->height = height;
+	key->img_op = img_op;
+}
+
+static int key_equal(const struct imgcache_key * a, const struct imgcache_key * b)
+{
+	return a->width == b->width && a->height == b->height &&
+		a->img_op == b->img_op &&
+		!memcmp(a->digest.__digest, b->digest.__digest, sizeof(a->digest.__digest));
+}
+
+/* The digest is already uniformly distributed: use its first bytes */
+static size_t key_bucket(const struct imgcache * cache, const struct imgcache_key * key)
+{
+	uint64_t h;
+
+	memcpy(&h, key->digest.__digest, sizeof(h));
+	h ^= key->img_op * 0x9e3779b97f4a7c15ULL;
+	return h & (cache->bucket_count - 1);
+}
+
+static void lru_unlink(struct imgcache * cache, struct imgcache_entry * e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->lru_head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->lru_tail = e->prev;
+
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct imgcache * cache, struct imgcache_entry * e)
+{
+	e->prev = NULL;
+	e->next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->prev = e;
+	cache->lru_head = e;
+	if (!cache->lru_tail)
+		cache->lru_tail = e;
+}
+
+/* Unlink <e> from its hash chain. Must be called with the lock held. */
+static void chain_remove(struct imgcache * cache, struct imgcache_entry * e)
+{
+	struct imgcache_entry ** link = &cache->buckets[key_bucket(cache, &e->key)];
+
+	while (*link != e)
+		link = &(*link)->chain;
+	*link = e->chain;
+}
+
+/* Evict the least recently used entry. Returns the evicted image, whose
+ * reference must be dropped outside the lock. */
+static struct image * evict_lru(struct imgcache * cache)
+{
+	struct imgcache_entry * e = cache->lru_tail;
+	struct image * img = e->img;
+
+	lru_unlink(cache, e);
+	chain_remove(cache, e);
+
+	cache->stats.bytes -= e->bytes;
+	cache->stats.entries--;
+	cache->stats.evictions++;
+
+	free(e);
+	return img;
+}
+
+int imgcache_init(struct imgcache * cache, size_t max_bytes)
+{
+	memset(cache, 0, sizeof(struct imgcache));
+	cache->max_bytes = max_bytes;
+	cache->bucket_count = IMGCACHE_BUCKETS;
+	cache->buckets = (struct imgcache_entry **)calloc(cache->bucket_count,
+							  sizeof(struct imgcache_entry *));
+	if (!cache->buckets)
+		return 1;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return 0;
+}
+
+void imgcache_destroy(struct imgcache * cache)
+{
+	struct imgcache_entry * e, * next;
+
+	for (e = cache->lru_head; e; e = next) {
+		next = e->next;
+		releaseImage(e->img);
+		free(e);
+	}
+
+	free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0, sizeof(struct imgcache));
+}
+
+struct image * imgcache_lookup(struct imgcache * cache, const struct imgcache_key * key)
+{
+	struct imgcache_entry * e;
+	struct image * img = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (e = cache->buckets[key_bucket(cache, key)]; e; e = e->chain) {
+		if (key_equal(&e->key, key))
+			break;
+	}
+
+	if (e) {
+		/* Move it to the front of the LRU list */
+		lru_unlink(cache, e);
+		lru_push_front(cache, e);
+		img = retainImage(e->img);
+		cache->stats.hits++;
+	} else {
+		cache->stats.misses++;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return img;
+}
+
+void imgcache_insert(struct imgcache * cache, const struct imgcache_key * key,
+		     struct image * img)
+{
+	size_t bytes = imageBytes(img);
+	struct image * evicted[8];
+	struct imgcache_entry * e;
+	size_t bucket, n;
+
+	if (bytes > cache->max_bytes)
+		return;
+
+	e = (struct imgcache_entry *)malloc(sizeof(struct imgcache_entry));
+	if (!e)
+		return;
+
+	e->key = *key;
+	e->img = retainImage(img);
+	e->bytes = bytes;
+
+	pthread_mutex_lock(&cache->lock);
+
+	bucket = key_bucket(cache, key);
+
+	/* Another worker may have computed the same result meanwhile:
+	 * keep the entry that is already there */
+	for (e->chain = cache->buckets[bucket]; e->chain; e->chain = e->chain->chain) {
+		if (key_equal(&e->chain->key, key))
+			break;
+	}
+	if (e->chain) {
+		pthread_mutex_unlock(&cache->lock);
+		releaseImage(e->img);
+		free(e);
+		return;
+	}
+
+	e->chain = cache->buckets[bucket];
+	cache->buckets[bucket] = e;
+	lru_push_front(cache, e);
+	cache->stats.bytes += bytes;
+	cache->stats.entries++;
+
+	do {
+		/* Release the evicted images outside the lock, a few at a
+		 * time: deleting them returns the buffers to the pool */
+		for (n = 0; n < 8 && cache->stats.bytes > cache->max_bytes; ++n)
+			evicted[n] = evict_lru(cache);
+
+		pthread_mutex_unlock(&cache->lock);
+		while (n > 0)
+			releaseImage(evicted[--n]);
+		pthread_mutex_lock(&cache->lock);
+	} while (cache->stats.bytes > cache->max_bytes);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void imgcache_get_stats(struct imgcache * cache, struct imgcache_stats * stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+* Image Result Cache (header)
+*
+* Description:
+*     A bounded, content-addressed cache of image operation results. An
+*     entry maps the MD5 digest and size of a source image, together
+*     with the operation applied to it, to a reference on the output
+*     image. When the total size of the cached outputs exceeds the
+*     budget, the least recently used entries are evicted.
+*
+* Notes:
+*     Cached outputs are shared with whoever looks them up, through the
+*     reference count of the image: they must be treated as read-only.
+*     All the functions are thread-safe.
+*
+*******************************************************************************/
+#ifndef __IMGCACHE_H__
+#define __IMGCACHE_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "imglib.h"
+#include "md5sum.h"
+
+struct imgcache_key {
+	struct md5digest digest; /* MD5 of the source pixels */
+	uint32_t width;
+	uint32_t height;
+	uint8_t img_op;
+};
+
+struct imgcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;
+};
+
+struct imgcache_entry;
+
+struct imgcache {
+	pthread_mutex_t lock;
+	struct imgcache_entry ** buckets;
+	size_t bucket_count;
+	/* LRU list: most recently used at the head */
+	struct imgcache_entry * lru_head;
+	struct imgcache_entry * lru_tail;
+	size_t max_bytes;
+	struct imgcache_stats stats;
+};
+
+/* Fill <key> for the result of <img_op> applied to an image of the
+ * given size whose pixels have MD5 digest <digest>. */
+void imgcache_make_key(struct imgcache_key * key, const struct md5digest * digest,
+		       uint32_t width, uint32_t height, uint8_t img_op);
+
+/* Initialize <cache> to hold up to <max_bytes> of pixel data. Returns
+ * 0 on success and 1 on allocation failure. */
+int imgcache_init(struct imgcache * cache, size_t max_bytes);
+
+/* Drop all the entries and release the memory of <cache> */
+void imgcache_destroy(struct imgcache * cache);
+
+/* Look up the result for <key>. On a hit, returns the cached image
+ * with a new reference taken for the caller, to be dropped with
+ * releaseImage(). Returns NULL on a miss. */
+struct image * imgcache_lookup(struct imgcache * cache, const struct imgcache_key * key);
+
+/* Add <img> as the result for <key>, taking a reference on it, and
+ * evict older entries as needed to stay within the budget. Images
+ * larger than the whole budget are not cached. */
+void imgcache_insert(struct imgcache * cache, const struct imgcache_key * key,
+		     struct image * img);
+
+/* Copy the current counters of <cache> into <stats> */
+void imgcache_get_stats(struct imgcache * cache, struct imgcache_stats * stats);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -20,33 +20,386 @@
 *
 *******************************************************************************/
 
+#define _GNU_SOURCE
 #include "imglib.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMGLIB_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define pix(img, x, y)				\
 	img->pixels[((y) * img->width) + (x)]
 
-/* Allocate and initialize the memory and metadata for a new
- * <width>x<height> pixels. */
-struct image * createImage(uint32_t width, uint32_t height)
+/*******************************************************************************
+* Pixel buffer pool
+*
+* Pixel buffers are recycled through per-size-class free lists rather
+* than returned to malloc. The filters allocate an output of the same
+* size as their input on every call, so they mostly get back warm
+* memory that is already faulted in. Size classes are the powers of
+* two split in four steps, hence a buffer is at most 25% larger than
+* requested. All buffers are aligned to 64 bytes for the SIMD kernels.
+*
+* On NUMA machines, see setPoolNodes(), there is a set of free lists per
+* node: a buffer goes back to the lists of the node its pages are on,
+* and comes out of those of the node the caller runs on.
+*
+* The pool is configured from the environment on first use:
+*   IMGLIB_POOL_MB   - Upper bound of idle memory kept in the pool, in
+*                      MB (default: 512). 0 disables the recycling.
+*   IMGLIB_HUGEPAGES - If set to 1, buffers of 2MB or more are backed
+*                      by huge pages: reserved ones (MAP_HUGETLB) when
+*                      available, transparent ones otherwise.
+*******************************************************************************/
+
+#define POOL_ALIGN 64
+#define POOL_MIN_SHIFT 12 /* Smallest class: 4KB */
+#define POOL_MAX_SHIFT 34 /* Larger buffers bypass the pool */
+#define POOL_STEPS 4
+#define POOL_CLASSES (1 + (POOL_MAX_SHIFT - POOL_MIN_SHIFT) * POOL_STEPS)
+#define POOL_HUGE_SIZE ((size_t)2 << 20)
+#define POOL_DEFAULT_MB 512
+
+/* Smallest buffer whose node is looked up when it is given back:
+ * below, it is assumed to be on the node of the caller */
+#define POOL_NODE_LOOKUP_MIN ((size_t)64 << 10)
+
+struct pool_class {
+	pthread_mutex_t lock;
+	void * free_list; /* Idle buffers, linked through their first word */
+};
+
+static struct pool_class pool_classes[IMG_POOL_MAX_NODES][POOL_CLASSES] = {
+	[0 ... IMG_POOL_MAX_NODES - 1] = {
+		[0 ... POOL_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+	}
+};
+
+/* See setPoolNodes() */
+static int pool_nodes = 1;
+static const int * pool_cpu_node;
+static size_t pool_cpu_count;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static const char * pool_foreign;     /* See setForeignPixels() */
+static size_t pool_foreign_len;
+static size_t pool_limit;
+static size_t pool_idle;
+static int pool_huge;
+
+static void pool_setup(void)
+{
+	const char * env;
+
+	pool_limit = (size_t)POOL_DEFAULT_MB << 20;
+	env = getenv("IMGLIB_POOL_MB");
+	if (env)
+		pool_limit = (size_t)strtoul(env, NULL, 10) << 20;
+
+	env = getenv("IMGLIB_HUGEPAGES");
+	pool_huge = env && !strcmp(env, "1");
+}
+
+/* Map a buffer size to its class. Returns -1 for buffers too large to
+ * be pooled, whose size is left unchanged. */
+static int pool_class_of(size_t * bytes)
+{
+	size_t sz = *bytes, step;
+	unsigned e, sub;
+
+	if (sz <= ((size_t)1 << POOL_MIN_SHIFT)) {
+		*bytes = (size_t)1 << POOL_MIN_SHIFT;
+		return 0;
+	}
+
+	/* 2^e < sz <= 2^(e+1) */
+	e = 63 - __builtin_clzll(sz - 1);
+	if (e >= POOL_MAX_SHIFT)
+		return -1;
+
+	step = (size_t)1 << (e - 2);
+	sub = ((sz - 1) - ((size_t)1 << e)) / step;
+	*bytes = ((size_t)1 << e) + (sub + 1) * step;
+	return 1 + (e - POOL_MIN_SHIFT) * POOL_STEPS + sub;
+}
+
+static int pool_is_mapped(size_t bytes)
+{
+	return pool_huge && bytes >= POOL_HUGE_SIZE;
+}
+
+static size_t pool_map_len(size_t bytes)
+{
+	return (bytes + POOL_HUGE_SIZE - 1) & ~(POOL_HUGE_SIZE - 1);
+}
+
+static void * pool_alloc(size_t bytes)
+{
+	void * buf;
+
+	if (pool_is_mapped(bytes)) {
+		size_t len = pool_map_len(bytes);
+
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED) {
+			/* No reserved huge pages: ask for transparent ones */
+			buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buf == MAP_FAILED)
+				return NULL;
+			madvise(buf, len, MADV_HUGEPAGE);
+		}
+		return buf;
+	}
+
+	if (posix_memalign(&buf, POOL_ALIGN, bytes))
+		return NULL;
+	return buf;
+}
+
+static void pool_release(void * buf, size_t bytes)
+{
+	if (pool_is_mapped(bytes))
+		munmap(buf, pool_map_len(bytes));
+	else
+		free(buf);
+}
+
+/* Node of the CPU the caller runs on */
+static int pool_local_node(void)
+{
+	int cpu;
+
+	if (pool_nodes == 1)
+		return 0;
+	cpu = sched_getcpu();
+	if (cpu < 0 || (size_t)cpu >= pool_cpu_count || pool_cpu_node[cpu] < 0)
+		return 0;
+	return pool_cpu_node[cpu] % pool_nodes;
+}
+
+/* Node that the first page of <buf>, of <bytes> bytes, is on */
+static int pool_buffer_node(void * buf, size_t bytes)
+{
+	int node;
+
+	if (pool_nodes == 1)
+		return 0;
+	if (bytes < POOL_NODE_LOOKUP_MIN ||
+	    syscall(SYS_get_mempolicy, &node, NULL, 0, buf, MPOL_F_NODE | MPOL_F_ADDR) ||
+	    node < 0)
+		return pool_local_node();
+	return node % pool_nodes;
+}
+
+/* Get a pixel buffer of at least <bytes> bytes, content undefined */
+static void * pool_get(size_t bytes)
+{
+	struct pool_class * pc;
+	void * buf;
+	int c;
+
+	pthread_once(&pool_once, pool_setup);
+
+	c = pool_class_of(&bytes);
+	if (c < 0)
+		return pool_alloc(bytes);
+
+	pc = &pool_classes[pool_local_node()][c];
+	pthread_mutex_lock(&pc->lock);
+	buf = pc->free_list;
+	if (buf)
+		pc->free_list = *(void **)buf;
+	pthread_mutex_unlock(&pc->lock);
+
+	if (!buf)
+		return pool_alloc(bytes);
+
+	__atomic_sub_fetch(&pool_idle, bytes, __ATOMIC_RELAXED);
+	return buf;
+}
+
+/* Give back a buffer obtained from pool_get() for <bytes> bytes */
+static void pool_put(void * buf, size_t bytes)
+{
+	struct pool_class * pc;
+	int c;
+
+	/* Not ours to recycle or free */
+	if ((uintptr_t)buf - (uintptr_t)pool_foreign < pool_foreign_len)
+		return;
+
+	pthread_once(&pool_once, pool_setup);
+
+	c = pool_class_of(&bytes);
+	if (c < 0 || __atomic_add_fetch(&pool_idle, bytes, __ATOMIC_RELAXED) > pool_limit) {
+		if (c >= 0)
+			__atomic_sub_fetch(&pool_idle, bytes, __ATOMIC_RELAXED);
+		pool_release(buf, bytes);
+		return;
+	}
+
+	pc = &pool_classes[pool_buffer_node(buf, bytes)][c];
+	pthread_mutex_lock(&pc->lock);
+	*(void **)buf = pc->free_list;
+	pc->free_list = buf;
+	pthread_mutex_unlock(&pc->lock);
+}
+
+/* Number of tiles needed to cover <n> pixels */
+#define TILES_OF(n) (((n) + IMG_TILE - 1) >> IMG_TILE_BITS)
+
+/* Size of the pixel buffer of a <width>x<height> image in <layout> */
+static size_t layout_bytes(uint32_t width, uint32_t height, uint32_t layout)
+{
+	if (layout == IMG_LAYOUT_TILED)
+		return (size_t)TILES_OF(width) * TILES_OF(height)
+			* IMG_TILE * IMG_TILE * sizeof(uint32_t);
+	if (layout == IMG_LAYOUT_PLANAR)
+		return (size_t)width * height * 3;
+	return (size_t)width * height * sizeof(uint32_t);
+}
+
+static size_t image_bytes(const struct image * img)
+{
+	return layout_bytes(img->width, img->height, img->layout);
+}
+
+size_t imageBytes(const struct image * img)
+{
+	return image_bytes(img);
+}
+
+/* Channel plane <c> (0: blue, 1: green, 2: red) of a planar image */
+static inline uint8_t * image_plane(const struct image * img, int c)
+{
+	return (uint8_t *)img->pixels + (size_t)c * img->width * img->height;
+}
+
+/* Offset of the first pixel of tile (<tx>,<ty>) of a tiled image */
+static inline size_t tile_offset(const struct image * img, uint32_t tx, uint32_t ty)
+{
+	return ((size_t)ty * TILES_OF(img->width) + tx) << (2 * IMG_TILE_BITS);
+}
+
+/* Offset of pixel (<x>,<y>) in the buffer of a linear or tiled <img> */
+static inline size_t pixel_index(const struct image * img, uint32_t x, uint32_t y)
+{
+	if (img->layout != IMG_LAYOUT_TILED)
+		return (size_t)y * img->width + x;
+	return tile_offset(img, x >> IMG_TILE_BITS, y >> IMG_TILE_BITS) +
+		((y & (IMG_TILE - 1)) << IMG_TILE_BITS) + (x & (IMG_TILE - 1));
+}
+
+static void copy_row_span(const struct image * img, uint32_t x, uint32_t y,
+			  uint32_t n, uint32_t * dst, int to_image);
+
+/* Allocate the memory and metadata for a new <width>x<height> image
+ * without initializing the pixels. Meant for outputs that are about
+ * to be overwritten entirely. */
+struct image * createImageUninitLayout(uint32_t width, uint32_t height,
+				       enum img_layout layout)
+{
+	struct image * img = (struct image*)malloc(sizeof(struct image));
+
+	if (!img)
+		return NULL;
+
+	img->width = width;
+	img->height = height;
+	img->refs = 1;
+	img->layout = layout;
+	img->pixels = (uint32_t *)pool_get(layout_bytes(width, height, layout));
+	if (!img->pixels) {
+		free(img);
+		return NULL;
+	}
+
+	return img;
+}
+
+void setPoolNodes(const int * cpu_node, size_t cpus, int nodes)
+{
+	pool_cpu_node = cpu_node;
+	pool_cpu_count = cpus;
+	pool_nodes = nodes < 1 ? 1 : nodes > IMG_POOL_MAX_NODES ? IMG_POOL_MAX_NODES : nodes;
+}
+
+void setForeignPixels(const void * base, size_t len)
+{
+	pool_foreign = (const char *)base;
+	pool_foreign_len = len;
+}
+
+struct image * createImageOver(uint32_t width, uint32_t height, enum img_layout layout,
+			       void * pixels)
 {
-	uint64_t img_bytes = height * width * sizeof(uint32_t);
 	struct image * img = (struct image*)malloc(sizeof(struct image));
+
+	if (!img)
+		return NULL;
+
 	img->width = width;
 	img->height = height;
-	img->pixels = (uint32_t * )malloc(img_bytes);
+	img->refs = 1;
+	img->layout = layout;
+	img->pixels = (uint32_t *)pixels;
+	return img;
+}
+
+struct image * createImageUninit(uint32_t width, uint32_t height)
+{
+	return createImageUninitLayout(width, height, IMG_LAYOUT_LINEAR);
+}
+
+/* An uninitialized image of the given size in the same layout as <img> */
+static struct image * create_like(const struct image * img, uint32_t width, uint32_t height)
+{
+	return createImageUninitLayout(width, height, (enum img_layout)img->layout);
+}
+
+/* Allocate and initialize the memory and metadata for a new
+ * <width>x<height> pixels. */
+struct image * createImage(uint32_t width, uint32_t height)
+{
+	struct image * img = createImageUninit(width, height);
 
 	/* Reset all the pixels to 0 for an all-black image */
-	memset(img->pixels, 0, img_bytes);
+	if (img)
+		memset(img->pixels, 0, (size_t)width * height * sizeof(uint32_t));
 
 	return img;
 }
 
-/* Deallocate all the memory for a given image. */
+/* Deallocate all the memory for a given image. The pixel buffer goes
+ * back to the pool, for reuse by the next image of a similar size. */
 void deleteImage(struct image * img)
 {
 	/* Remove image payload, if any. */
 	if (img && img->pixels) {
-		free(img->pixels);
+		pool_put(img->pixels, image_bytes(img));
 		img->pixels = NULL;
 	}
 
@@ -56,6 +409,21 @@ void deleteImage(struct image * img)
 	}
 }
 
+struct image * retainImage(struct image * img)
+{
+	if (img)
+		__atomic_add_fetch(&img->refs, 1, __ATOMIC_RELAXED);
+	return img;
+}
+
+void releaseImage(struct image * img)
+{
+	/* Whoever drops the last reference must see all the writes
+	 * done to the pixels under the other ones */
+	if (img && __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		deleteImage(img);
+}
+
 /* Set a specific pixel at position (<x>,<y>) in the image <img> to a
  * specific <value>. The function returns 0 if the operation is
  * successful and 1 in case of error. */
@@ -65,7 +433,10 @@ uint8_t setPixel(struct image * img, uint32_t x, uint32_t y, uint32_t value) {
 	}
 
 	if (x < img->width && y < img->height) {
-		pix(img, x, y) = value;
+		if (img->layout == IMG_LAYOUT_PLANAR)
+			copy_row_span(img, x, y, 1, &value, 1);
+		else
+			img->pixels[pixel_index(img, x, y)] = value;
 		return 0;
 	}
 
@@ -92,7 +463,12 @@ uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * er
 		if (err) {
 			*err = 0;
 		}
-		return pix(img, x, y);
+		if (img->layout == IMG_LAYOUT_PLANAR) {
+			uint32_t value;
+			copy_row_span(img, x, y, 1, &value, 0);
+			return value;
+		}
+		return img->pixels[pixel_index(img, x, y)];
 	}
 
 	if (err) {
@@ -120,9 +496,9 @@ struct image * cloneImage(const struct image * src, uint8_t * err) {
 		return NULL;
 	}
 
-	/* Create an empty destination image */
-	uint64_t img_bytes = src->height * src->width * sizeof(uint32_t);
-	struct image * dest = createImage(src->width, src->height);
+	/* Create the destination image, fully written below */
+	uint64_t img_bytes = image_bytes(src);
+	struct image * dest = create_like(src, src->width, src->height);
 
 	if(!dest || !dest->pixels) {
 		if (err) {
@@ -141,352 +517,2845 @@ struct image * cloneImage(const struct image * src, uint8_t * err) {
 	return dest;
 }
 
-/* Creates a new image by rotating the input image by 90 degreees
- * clockwise. NOTE: the original image must be manually deallocated if
- * not needed. If successful, the function returns a pointer to the
- * new image.
- *
- * If <err> is not NULL, the function sets 0 in the err parameter if
- * retrieval of the selected pixel is successful, and 1 if an error
- * has occurred. In case of error, NULL is returned by the function.
-*/
-struct image * rotate90Clockwise(const struct image * img, uint8_t * err) {
-    struct image * rotated = createImage(img->height, img->width);
-    uint32_t y, x;
-
-    if (!img || !img->pixels) {
-	    if (err) {
-		    *err = 1;
-	    }
-	    return NULL;
-    }
+/*******************************************************************************
+* Tiled layout
+*
+* With IMG_LAYOUT_TILED the neighbours of a pixel in the rows above
+* and below are in the same 16KB tile, rather than a whole row apart,
+* so a filter walks a few pages at a time instead of three or five
+* rows that span many pages each. The filters below process tiled
+* images one output tile at a time: the source tile is gathered, with
+* its halo from the neighbouring tiles, into a small block in x-y
+* order on which the same row kernels as for linear images run. The
+* rotation gathers the source block of each output tile and rotates
+* it within L1. Conversions to x-y order only happen on the way out,
+* in sendImage() and saveBMP().
+*
+* IMG_LAYOUT_PLANAR keeps one plane of bytes per channel instead, on
+* which the same filters run with planar row kernels, one channel at a
+* time. The helpers below convert between any of the layouts and x-y
+* order of packed pixels, one span of a row at a time.
+*******************************************************************************/
 
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            uint32_t newX = y;
-            uint32_t newY = img->width - x - 1;
-            pix(rotated, newX, newY) = pix(img, x, y);
-        }
-    }
+/* Copy <n> pixels of row <y> of <img> starting at column <x> into
+ * <dst> (<to_image> = 0) or from <dst> into the image (<to_image> = 1),
+ * as packed pixel values */
+static void copy_row_span(const struct image * img, uint32_t x, uint32_t y,
+			  uint32_t n, uint32_t * dst, int to_image)
+{
+	if (img->layout == IMG_LAYOUT_PLANAR) {
+		size_t off = (size_t)y * img->width + x;
+		uint8_t * b = image_plane(img, 0) + off;
+		uint8_t * g = image_plane(img, 1) + off;
+		uint8_t * r = image_plane(img, 2) + off;
+		uint32_t i;
+
+		if (to_image) {
+			for (i = 0; i < n; ++i) {
+				b[i] = dst[i];
+				g[i] = dst[i] >> 8;
+				r[i] = dst[i] >> 16;
+			}
+		} else {
+			for (i = 0; i < n; ++i)
+				dst[i] = b[i] | ((uint32_t)g[i] << 8) | ((uint32_t)r[i] << 16);
+		}
+		return;
+	}
 
-    if (err) {
-	    *err = 0;
-    }
-    return rotated;
+	while (n) {
+		uint32_t span = n;
+		uint32_t * p = img->pixels + pixel_index(img, x, y);
+
+		/* Pixels are contiguous up to the end of the tile */
+		if (img->layout == IMG_LAYOUT_TILED &&
+		    span > IMG_TILE - (x & (IMG_TILE - 1)))
+			span = IMG_TILE - (x & (IMG_TILE - 1));
+
+		if (to_image)
+			memcpy(p, dst, span * sizeof(uint32_t));
+		else
+			memcpy(dst, p, span * sizeof(uint32_t));
+		dst += span;
+		x += span;
+		n -= span;
+	}
 }
 
-/**
- * @brief Blur an image using a 3x3 averaging kernel.
- *
- * This function applies a 3x3 averaging kernel to each pixel in the image, resulting in 
- * a blurred effect. Edge pixels are not blurred to keep the implementation simple.
- *
- * @param img The original image to be blurred.
- * @return A new image structure containing the blurred image. The original image remains 
- *         unchanged.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* blurImage(const struct image* img) {
-    struct image* blurredImg = createImage(img->width, img->height);
-    uint32_t x, y;
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not blurred
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(blurredImg, x, y) = pix(img, x, y);
-            } else {
-                uint32_t sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += (pixel >> 16) & 0xFF;
-			    sumG += (pixel >> 8) & 0xFF;
-			    sumB += pixel & 0xFF;
-                    }
-                }
-
-                // Average the sums to get the new pixel value
-                sumR /= 9;
-                sumG /= 9;
-                sumB /= 9;
-
-                pix(blurredImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
-
-    return blurredImg;
-}
+void readImageBlock(const struct image * img, int64_t x0, int64_t y0,
+		    uint32_t bw, uint32_t bh, uint32_t * dst, size_t stride)
+{
+	int64_t w = img->width, h = img->height;
+	int64_t xa = x0 < 0 ? 0 : x0;
+	int64_t xb = x0 + bw > w ? w : x0 + bw;
+	uint32_t by;
 
-/**
- * @brief Sharpen an image using a 3x3 sharpening kernel.
- *
- * This function applies a 3x3 sharpening kernel to each pixel in the image to enhance its
- * details. Edge pixels are not sharpened to keep the implementation simple.
- *
- * @param img The original image to be sharpened.
- * @return A new image structure containing the sharpened image. The original image remains 
- *         unchanged.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* sharpenImage(const struct image* img) {
-    struct image* sharpenedImg = createImage(img->width, img->height);
-    uint32_t x, y;
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not sharpened
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(sharpenedImg, x, y) = pix(img, x, y);
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                /* Convolve with the kernel that emphasizes center pixel */
-                int kernel[3][3] = { {-1, -1, -1},
-                                     {-1,  9, -1},
-                                     {-1, -1, -1} };
-
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                /* Clip the values to [0, 255] */
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(sharpenedImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+	for (by = 0; by < bh; ++by, dst += stride) {
+		int64_t y = y0 + by;
 
-    return sharpenedImg;
+		if (y < 0 || y >= h || xa >= xb) {
+			memset(dst, 0, bw * sizeof(uint32_t));
+			continue;
+		}
+		memset(dst, 0, (xa - x0) * sizeof(uint32_t));
+		copy_row_span(img, xa, y, xb - xa, dst + (xa - x0), 0);
+		memset(dst + (xb - x0), 0, (x0 + bw - xb) * sizeof(uint32_t));
+	}
 }
 
-/**
- * @brief Detect vertical edges in an image using the Sobel operator.
- *
- * This function applies the Sobel vertical operator to each pixel in the image to detect
- * vertical edges. Edge pixels are not processed to keep the implementation simple.
- *
- * @param img The original image.
- * @return A new image structure containing the edge detected image. The original image remains 
- *         unchanged.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* detectVerticalEdges(const struct image* img) {
-    struct image* edgeImg = createImage(img->width, img->height);
-    uint32_t x, y;
-
-    int kernel[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}
-    };
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not processed
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(edgeImg, x, y) = 0; // Set to black for edge pixels
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                // Clip the values to [0, 255]
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(edgeImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+void readImageRows(const struct image * img, img_stream_fn consume, void * arg)
+{
+	size_t row_bytes = (size_t)img->width * sizeof(uint32_t);
+	uint32_t * rows;
+	uint32_t y, n, i;
 
-    return edgeImg;
-}
+	if (img->layout == IMG_LAYOUT_LINEAR) {
+		consume(arg, img->pixels, row_bytes * img->height);
+		return;
+	}
 
-/**
- * @brief Detect horizontal edges in an image using the Sobel operator.
- *
- * This function applies the Sobel horizontal operator to each pixel in the image to detect
- * horizontal edges. Edge pixels are not processed to keep the implementation simple.
- *
- * @param img The original image.
- * @return A new image structure containing the edge detected image. The original image remains 
- *         unchanged.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* detectHorizontalEdges(const struct image* img) {
-    struct image* edgeImg = createImage(img->width, img->height);
-    uint32_t x, y;
-
-    int kernel[3][3] = {
-        {-1, -2, -1},
-        { 0,  0,  0},
-        { 1,  2,  1}
-    };
-
-    for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            // For simplicity, edge pixels are not processed
-            if (y == 0 || x == 0 || y == img->height - 1 || x == img->width - 1) {
-		    pix(edgeImg, x, y) = 0; // Set to black for edge pixels
-            } else {
-                int sumR = 0, sumG = 0, sumB = 0;
-
-                // Convolve with the kernel
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-			    uint32_t pixel = pix(img, x + kx, y + ky);
-			    sumR += ((pixel >> 16) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumG += ((pixel >> 8) & 0xFF) * kernel[ky + 1][kx + 1];
-			    sumB += (pixel & 0xFF) * kernel[ky + 1][kx + 1];
-                    }
-                }
-
-                // Clip the values to [0, 255]
-                sumR = (sumR > 255) ? 255 : (sumR < 0) ? 0 : sumR;
-                sumG = (sumG > 255) ? 255 : (sumG < 0) ? 0 : sumG;
-                sumB = (sumB > 255) ? 255 : (sumB < 0) ? 0 : sumB;
-
-                pix(edgeImg, x, y) = (sumR << 16) | (sumG << 8) | sumB;
-            }
-        }
-    }
+	/* One row of tiles, or as many rows, at a time */
+	rows = (uint32_t *)pool_get(row_bytes * IMG_TILE);
+	if (!rows)
+		return;
 
-    return edgeImg;
-}
+	for (y = 0; y < img->height; y += n) {
+		n = (img->height - y > IMG_TILE) ? IMG_TILE : img->height - y;
+		for (i = 0; i < n; ++i)
+			copy_row_span(img, 0, y + i, img->width, rows + (size_t)i * img->width, 0);
+		consume(arg, rows, row_bytes * n);
+	}
 
-/**
- * @brief Load a BMP image from a file.
- *
- * This function loads a 24-bit BMP image from the specified file and returns a pointer to 
- * an image structure. The image is represented as a 2D array of uint32_t values where 
- * each entry corresponds to an RGB pixel.
- *
- * @param filename The path to the BMP file to be loaded.
- * @return A pointer to a struct image containing the image data. Returns NULL if the 
- *         file couldn't be opened or if the file is not a valid 24-bit BMP image.
- *
- * Note: The returned image structure should be freed using the deleteImage function 
- *       to avoid memory leaks.
- */
-struct image* loadBMP(const char* filename) {
-	int fd = open(filename, O_RDONLY);
-	uint32_t x, y;
-	BMPHeader header;
-	BMPInfoHeader infoHeader;
+	pool_put(rows, row_bytes * IMG_TILE);
+}
 
-	if (fd == -1) return NULL;
+uint8_t convertImageLayout(struct image * img, enum img_layout layout)
+{
+	struct image tmp;
+	uint32_t y, * row;
 
-	header.type = 0;
+	if (!img || !img->pixels)
+		return 1;
+	if (img->layout == (uint32_t)layout)
+		return 0;
 
-	read(fd, &header, sizeof(BMPHeader));
-	read(fd, &infoHeader, sizeof(BMPInfoHeader));
+	tmp = *img;
+	tmp.layout = layout;
+	tmp.pixels = (uint32_t *)pool_get(image_bytes(&tmp));
+	row = (uint32_t *)malloc((size_t)img->width * sizeof(uint32_t));
+	if (!tmp.pixels || !row) {
+		if (tmp.pixels)
+			pool_put(tmp.pixels, image_bytes(&tmp));
+		free(row);
+		return 1;
+	}
 
-	if (header.type != 0x4D42 || infoHeader.bits != 24) {
-		close(fd);
-		return NULL;
+	for (y = 0; y < img->height; ++y) {
+		copy_row_span(img, 0, y, img->width, row, 0);
+		copy_row_span(&tmp, 0, y, img->width, row, 1);
 	}
 
-	//printf("IMG: %d x %d x %d\n", infoHeader.width, infoHeader.height, infoHeader.bits);
-	struct image* img = createImage(infoHeader.width, infoHeader.height);
-	int padding = (4 - (infoHeader.width * 3) % 4) % 4;
+	free(row);
+	pool_put(img->pixels, image_bytes(img));
+	img->pixels = tmp.pixels;
+	img->layout = layout;
+	return 0;
+}
 
-	lseek(fd, header.offset, SEEK_SET);
+struct image * regionImage(const struct image * img, uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height, uint32_t scale)
+{
+	struct image * out;
+	uint32_t * row, * sums;
+	uint32_t out_w, out_h, oy, ox, i;
+	int c;
 
-	/* Start from the last row */
-	y = infoHeader.height - 1;
+	if (!img || !img->pixels || !scale || scale > IMG_REGION_SCALE_MAX)
+		return NULL;
+	if (!width || !height || x >= img->width || y >= img->height ||
+	    width > img->width - x || height > img->height - y)
+		return NULL;
+
+	out_w = (width + scale - 1) / scale;
+	out_h = (height + scale - 1) / scale;
+	out = create_like(img, out_w, out_h);
+	row = (uint32_t *)malloc((size_t)width * sizeof(uint32_t));
+	sums = (uint32_t *)malloc((size_t)out_w * 4 * sizeof(uint32_t));
+	if (!out || !row || !sums) {
+		deleteImage(out);
+		free(row);
+		free(sums);
+		return NULL;
+	}
+
+	for (oy = 0; oy < out_h; ++oy) {
+		uint32_t y0 = y + oy * scale;
+		uint32_t rows = (height - oy * scale < scale) ? height - oy * scale : scale;
+
+		/* A plain crop is a copy of each row span */
+		if (scale == 1) {
+			copy_row_span(img, x, y0, width, row, 0);
+			copy_row_span(out, 0, oy, out_w, row, 1);
+			continue;
+		}
+
+		/* Box filter: the sums of each channel over a scale x scale
+		 * block, fewer pixels at the right and bottom edges */
+		memset(sums, 0, (size_t)out_w * 4 * sizeof(uint32_t));
+		for (i = 0; i < rows; ++i) {
+			copy_row_span(img, x, y0 + i, width, row, 0);
+			for (ox = 0; ox < width; ++ox)
+				for (c = 0; c < 4; ++c)
+					sums[(ox / scale) * 4 + c] += (row[ox] >> (8 * c)) & 0xff;
+		}
+		for (ox = 0; ox < out_w; ++ox) {
+			uint32_t cols = (width - ox * scale < scale) ? width - ox * scale : scale;
+			uint32_t count = cols * rows, value = 0;
+
+			for (c = 0; c < 4; ++c)
+				value |= ((sums[ox * 4 + c] + count / 2) / count) << (8 * c);
+			row[ox] = value;
+		}
+		copy_row_span(out, 0, oy, out_w, row, 1);
+	}
+
+	free(row);
+	free(sums);
+	return out;
+}
+
+uint8_t compareImages(const struct image * a, const struct image * b)
+{
+	uint32_t * rows, y;
+	uint8_t diff = 0;
+
+	if (!a || !b || !a->pixels || !b->pixels ||
+	    a->width != b->width || a->height != b->height)
+		return 1;
+
+	if (a->layout == IMG_LAYOUT_LINEAR && b->layout == IMG_LAYOUT_LINEAR)
+		return memcmp(a->pixels, b->pixels, image_bytes(a)) != 0;
+
+	/* The padding of the tiles is not part of the image */
+	rows = (uint32_t *)malloc(2 * (size_t)a->width * sizeof(uint32_t));
+	if (!rows)
+		return 1;
+	for (y = 0; y < a->height && !diff; ++y) {
+		copy_row_span(a, 0, y, a->width, rows, 0);
+		copy_row_span(b, 0, y, b->width, rows + a->width, 0);
+		diff = memcmp(rows, rows + a->width, (size_t)a->width * sizeof(uint32_t)) != 0;
+	}
+	free(rows);
+	return diff;
+}
+
+/* Side of the square tiles used by the rotation, in pixels. A source
+ * tile and its destination tile (2 x 16 KB) fit together in L1. */
+#define ROT_TILE 64
+
+/* Rotate the block [x0, x1) x [y0, y1) of the <w>x<h> source <src>
+ * into <dst>; pixel (x, y) goes to (y, w - x - 1) of the rotated
+ * image, whose rows are <h> pixels wide. */
+static void rotate_block(const uint32_t * src, uint32_t * dst,
+			 uint32_t w, uint32_t h,
+			 uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+{
+	uint32_t x, y = y0;
+
+#ifdef IMGLIB_X86_SIMD
+	/* Rotate 4x4 sub-blocks in registers: transpose 4 source rows
+	 * so that each register holds a source column, which is a
+	 * destination row. */
+	for (; y + 4 <= y1; y += 4) {
+		for (x = x0; x + 4 <= x1; x += 4) {
+			const uint32_t * s = src + (size_t)y * w + x;
+			__m128i r0 = _mm_loadu_si128((const __m128i *)s);
+			__m128i r1 = _mm_loadu_si128((const __m128i *)(s + w));
+			__m128i r2 = _mm_loadu_si128((const __m128i *)(s + 2 * w));
+			__m128i r3 = _mm_loadu_si128((const __m128i *)(s + 3 * w));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+			__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+			uint32_t * d = dst + (size_t)(w - x - 1) * h + y;
+			_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(t0, t1));
+			_mm_storeu_si128((__m128i *)(d - h), _mm_unpackhi_epi64(t0, t1));
+			_mm_storeu_si128((__m128i *)(d - 2 * h), _mm_unpacklo_epi64(t2, t3));
+			_mm_storeu_si128((__m128i *)(d - 3 * h), _mm_unpackhi_epi64(t2, t3));
+		}
+		/* Leftover columns of these 4 rows */
+		for (; x < x1; ++x) {
+			uint32_t * d = dst + (size_t)(w - x - 1) * h + y;
+			const uint32_t * s = src + (size_t)y * w + x;
+			d[0] = s[0];
+			d[1] = s[w];
+			d[2] = s[2 * w];
+			d[3] = s[3 * w];
+		}
+	}
+#endif
+
+	for (; y < y1; ++y)
+		for (x = x0; x < x1; ++x)
+			dst[(size_t)(w - x - 1) * h + y] = src[(size_t)y * w + x];
+}
+
+/* Rotate the source rows [y0, y1) of <img> into <rotated>, where
+ * they become the columns [y0, y1). Walk the source in tiles so that
+ * both the rows read from the source and the rows written to the
+ * destination stay in cache while a tile is processed. */
+/* Rotate the source rows [y0, y1) of the tiled image <img> into
+ * <rotated>. The output tiles are grouped in columns, each of which
+ * comes from one row of source tiles: a column belongs to the band in
+ * which its first source row falls. */
+static void rotate_band_tiled(const struct image * img, struct image * rotated,
+			      uint32_t y0, uint32_t y1)
+{
+	uint32_t tx, ty, tx1 = TILES_OF(y1);
+	uint32_t * block = (uint32_t *)pool_get(IMG_TILE * IMG_TILE * sizeof(uint32_t));
+
+	if (!block)
+		return;
+
+	/* Output pixel (X, Y) is source pixel (width - 1 - Y, X) */
+	for (tx = TILES_OF(y0); tx < tx1; ++tx) {
+		for (ty = 0; ty < TILES_OF(rotated->height); ++ty) {
+			readImageBlock(img, (int64_t)img->width - ((int64_t)(ty + 1) << IMG_TILE_BITS),
+				       (int64_t)tx << IMG_TILE_BITS, IMG_TILE, IMG_TILE,
+				       block, IMG_TILE);
+			rotate_block(block, rotated->pixels + tile_offset(rotated, tx, ty),
+				     IMG_TILE, IMG_TILE, 0, 0, IMG_TILE, IMG_TILE);
+		}
+	}
+
+	pool_put(block, IMG_TILE * IMG_TILE * sizeof(uint32_t));
+}
+
+/* Same as rotate_block() for the rows [y0, y1) of the channel planes
+ * of a planar image, also walking them in tiles */
+static void rotate_band_planar(const struct image * img, struct image * rotated,
+			       uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	uint32_t ty, tx, x, y;
+	int c;
+
+	for (c = 0; c < 3; ++c) {
+		const uint8_t * src = image_plane(img, c);
+		uint8_t * dst = image_plane(rotated, c);
+
+		for (ty = y0; ty < y1; ty += ROT_TILE) {
+			uint32_t ty1 = (y1 - ty > ROT_TILE) ? ty + ROT_TILE : y1;
+			for (tx = 0; tx < w; tx += ROT_TILE) {
+				uint32_t tx1 = (w - tx > ROT_TILE) ? tx + ROT_TILE : w;
+				for (x = tx; x < tx1; ++x)
+					for (y = ty; y < ty1; ++y)
+						dst[(size_t)(w - x - 1) * h + y] =
+							src[(size_t)y * w + x];
+			}
+		}
+	}
+}
+
+static void rotate_band(const struct image * img, struct image * rotated,
+			uint32_t y0, uint32_t y1)
+{
+	uint32_t y, x;
+
+	if (img->layout == IMG_LAYOUT_TILED) {
+		rotate_band_tiled(img, rotated, y0, y1);
+		return;
+	}
+	if (img->layout == IMG_LAYOUT_PLANAR) {
+		rotate_band_planar(img, rotated, y0, y1);
+		return;
+	}
+
+	for (y = y0; y < y1; y += ROT_TILE) {
+		uint32_t ty1 = (y1 - y > ROT_TILE) ? y + ROT_TILE : y1;
+		for (x = 0; x < img->width; x += ROT_TILE) {
+			uint32_t tx1 = (img->width - x > ROT_TILE) ? x + ROT_TILE : img->width;
+			rotate_block(img->pixels, rotated->pixels,
+				     img->width, img->height, x, y, tx1, ty1);
+		}
+	}
+}
+
+/* Rotate the source rows [y0, y1) of <img> by 180 degrees into
+ * <rotated>, where they become the rows [h - y1, h - y0) in reverse
+ * order, each of them reversed */
+static void rotate180_band(const struct image * img, struct image * rotated,
+			   uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	uint32_t * row;
+	uint32_t y, x;
+
+	if (img->layout == IMG_LAYOUT_LINEAR) {
+		for (y = y0; y < y1; ++y) {
+			const uint32_t * s = img->pixels + (size_t)y * w;
+			uint32_t * d = rotated->pixels + (size_t)(h - 1 - y) * w;
+
+			for (x = 0; x < w; ++x)
+				d[w - 1 - x] = s[x];
+		}
+		return;
+	}
+
+	row = (uint32_t *)pool_get((size_t)w * sizeof(uint32_t));
+	if (!row)
+		return;
+
+	for (y = y0; y < y1; ++y) {
+		copy_row_span(img, 0, y, w, row, 0);
+		for (x = 0; x < w / 2; ++x) {
+			uint32_t t = row[x];
+
+			row[x] = row[w - 1 - x];
+			row[w - 1 - x] = t;
+		}
+		copy_row_span(rotated, 0, h - 1 - y, w, row, 1);
+	}
+
+	pool_put(row, (size_t)w * sizeof(uint32_t));
+}
+
+/* Creates a new image by rotating the input image by 90 degreees
+ * clockwise. NOTE: the original image must be manually deallocated if
+ * not needed. If successful, the function returns a pointer to the
+ * new image.
+ *
+ * If <err> is not NULL, the function sets 0 in the err parameter if
+ * retrieval of the selected pixel is successful, and 1 if an error
+ * has occurred. In case of error, NULL is returned by the function.
+*/
+struct image * rotate90Clockwise(const struct image * img, uint8_t * err) {
+	struct image * rotated;
+
+	if (!img || !img->pixels) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+
+	rotated = create_like(img, img->height, img->width);
+	if (!rotated) {
+		if (err) {
+			*err = 1;
+		}
+		return NULL;
+	}
+	rotate_band(img, rotated, 0, img->height);
+
+	if (err) {
+		*err = 0;
+	}
+	return rotated;
+}
+
+/* Rotates the input image by 90 degrees clockwise, replacing its
+ * content. Square images are rotated in place by moving each group of
+ * four pixels along its rotation cycle, so no second buffer is
+ * needed. Other images are rotated into a new pixel buffer which then
+ * replaces the original one. The function returns 0 on success and 1
+ * in case of error. */
+uint8_t rotate90ClockwiseInPlace(struct image * img) {
+	uint32_t n, tx, ty, x, y;
+
+	if (!img || !img->pixels) {
+		return 1;
+	}
+
+	/* Only linear square images have the rotation cycles below */
+	if (img->width != img->height || img->layout != IMG_LAYOUT_LINEAR) {
+		uint8_t err;
+		struct image * rotated = rotate90Clockwise(img, &err);
+		uint32_t * old_pixels;
+
+		if (err) {
+			return 1;
+		}
+
+		old_pixels = img->pixels;
+		img->pixels = rotated->pixels;
+		img->width = rotated->width;
+		img->height = rotated->height;
+
+		rotated->pixels = old_pixels;
+		deleteImage(rotated);
+		return 0;
+	}
+
+	/* Each pixel (x, y) of the top-left quadrant starts a cycle
+	 * (x, y) -> (y, n-1-x) -> (n-1-x, n-1-y) -> (n-1-y, x). With
+	 * odd sizes the quadrant includes the middle column, but not
+	 * the middle row, so the center pixel stays put. */
+	n = img->width;
+	for (ty = 0; ty < n / 2; ty += ROT_TILE) {
+		for (tx = 0; tx < (n + 1) / 2; tx += ROT_TILE) {
+			for (y = ty; y < ty + ROT_TILE && y < n / 2; ++y) {
+				for (x = tx; x < tx + ROT_TILE && x < (n + 1) / 2; ++x) {
+					uint32_t p0 = pix(img, x, y);
+					uint32_t p1 = pix(img, y, n - 1 - x);
+					uint32_t p2 = pix(img, n - 1 - x, n - 1 - y);
+					uint32_t p3 = pix(img, n - 1 - y, x);
+					pix(img, y, n - 1 - x) = p0;
+					pix(img, n - 1 - x, n - 1 - y) = p1;
+					pix(img, n - 1 - y, x) = p2;
+					pix(img, x, y) = p3;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Convolution engine
+*
+* All the filters below share the same driver: the border rows and
+* columns are handled in a separate pass, and the interior of the
+* image is processed one row at a time by a row kernel that has no
+* per-pixel bounds checks.
+*
+* A filter is declared with DEFINE_CONV_FILTER() from its kernel
+* weights, its normalization and its border policy. The macro
+* instantiates a scalar, an SSE2 (4 pixels per step) and an AVX2 (8
+* pixels per step) row kernel from the generic always-inline kernels
+* below. Since the weights are compile-time constants and the tap
+* loops are fully unrolled, every tap is specialized by the compiler:
+* zero taps are dropped, +/-1 and powers of two become adds, subtracts
+* and shifts, and the normalization becomes a fixed-point multiply.
+* Adding a new filter is thus just a kernel definition plus a one-line
+* wrapper, see gaussianBlurImage() and embossImage().
+*
+* The AVX2 kernels are only selected at runtime when the CPU supports
+* them, so the same imglib.o runs on any x86-64 machine. All the
+* variants produce bit-identical output.
+*
+* The vector kernels widen each byte of a packed pixel (B, G, R and
+* the unused top byte) to a 16-bit lane. The top byte is computed like
+* any other channel and masked off before the store, exactly like the
+* scalar per-channel code drops it. For this to be exact, signed
+* kernels must have sum(|w|) * 255 < 32768 and the weights of
+* normalized kernels must add up to at most 257.
+*
+* Setting the environment variable IMGLIB_SIMD to "scalar", "sse2"
+* or "avx2" caps the selected back-end, which is handy to compare
+* the implementations against one another.
+*******************************************************************************/
+
+#define CONV_INLINE static inline __attribute__((always_inline))
+
+/* Row kernel: compute <count> output pixels in <dst> from the source
+ * pixels centered at <src>, where <stride> is the distance in pixels
+ * between two consecutive rows of the source image. */
+typedef void (*conv_row_fn)(uint32_t * dst, const uint32_t * src,
+			    size_t stride, uint32_t count);
+
+/* Same for the fused Sobel kernels below, which have up to three
+ * outputs */
+typedef void (*sobel_row_fn)(uint32_t * mag, uint32_t * vert, uint32_t * horiz,
+			     const uint32_t * src, size_t stride, uint32_t count);
+
+/* How the border rows and columns of the output are generated */
+enum conv_border {
+	BORDER_COPY, /* Copy the source pixel over */
+	BORDER_ZERO  /* Set the pixel to black */
+};
+
+/* Available back-ends, in increasing order of preference */
+enum conv_isa {
+	ISA_SCALAR = 0,
+	ISA_SSE2,
+	ISA_AVX2,
+	ISA_COUNT
+};
+
+#define CLIP_CHANNEL(v)					\
+	((v) > 255 ? 255 : ((v) < 0 ? 0 : (v)))
+
+#define CHAN_R(p) (((p) >> 16) & 0xFF)
+#define CHAN_G(p) (((p) >> 8) & 0xFF)
+#define CHAN_B(p) ((p) & 0xFF)
+
+/* Mask to drop the unused top byte of each pixel */
+#define PIXEL_MASK 0x00FFFFFF
+
+/* Normalization of the weighted sum: x becomes (x * recip) >> (16 +
+ * shift) if recip is not zero, x >> shift otherwise. NORM_DIV9 is
+ * exact for any 16-bit x. */
+#define NORM_NONE    0, 0
+#define NORM_DIV9    58255, 3
+#define NORM_SHIFT(s) 0, (s)
+
+/* Generic scalar row kernel for a <size>x<size> kernel <k> */
+CONV_INLINE void conv_row_scalar(uint32_t * dst, const uint32_t * src,
+				 size_t stride, uint32_t count,
+				 const int size, const int * k,
+				 const uint32_t recip, const int shift)
+{
+	const int r = size / 2;
+	uint32_t x;
+
+	for (x = 0; x < count; ++x) {
+		const uint32_t * p = src + x;
+		int sumR = 0, sumG = 0, sumB = 0;
+		int ky, kx;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++) {
+				const int w = k[(ky + r) * size + (kx + r)];
+				uint32_t pixel;
+				if (w == 0)
+					continue;
+				pixel = p[ky * (ptrdiff_t)stride + kx];
+				sumR += (int)CHAN_R(pixel) * w;
+				sumG += (int)CHAN_G(pixel) * w;
+				sumB += (int)CHAN_B(pixel) * w;
+			}
+		}
+
+		if (recip) {
+			sumR = ((uint32_t)sumR * recip) >> (16 + shift);
+			sumG = ((uint32_t)sumG * recip) >> (16 + shift);
+			sumB = ((uint32_t)sumB * recip) >> (16 + shift);
+		} else if (shift) {
+			sumR >>= shift;
+			sumG >>= shift;
+			sumB >>= shift;
+		}
+
+		sumR = CLIP_CHANNEL(sumR);
+		sumG = CLIP_CHANNEL(sumG);
+		sumB = CLIP_CHANNEL(sumB);
+		dst[x] = (sumR << 16) | (sumG << 8) | sumB;
+	}
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+/* Accumulate the widened tap <v> with weight <w> into <acc> */
+CONV_INLINE __m128i conv_tap_sse2(__m128i acc, __m128i v, const int w)
+{
+	int a = w < 0 ? -w : w;
+
+	if (w == 0)
+		return acc;
+	if ((a & (a - 1)) == 0) {
+		v = _mm_slli_epi16(v, __builtin_ctz(a));
+		return w > 0 ? _mm_add_epi16(acc, v) : _mm_sub_epi16(acc, v);
+	}
+	return _mm_add_epi16(acc, _mm_mullo_epi16(v, _mm_set1_epi16(w)));
+}
+
+/* Compute 2 pixels worth of 16-bit channels from the widened taps */
+CONV_INLINE __m128i conv_combine_sse2(const __m128i * t, const int taps,
+				      const int * k, const uint32_t recip,
+				      const int shift)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i;
+
+#pragma GCC unroll 25
+	for (i = 0; i < taps; ++i)
+		acc = conv_tap_sse2(acc, t[i], k[i]);
+
+	if (recip)
+		acc = _mm_srli_epi16(_mm_mulhi_epu16(acc, _mm_set1_epi16((short)recip)),
+				     shift);
+	else if (shift)
+		acc = _mm_srli_epi16(acc, shift);
+
+	return acc;
+}
+
+CONV_INLINE void conv_row_sse2(uint32_t * dst, const uint32_t * src,
+			       size_t stride, uint32_t count,
+			       const int size, const int * k,
+			       const uint32_t recip, const int shift)
+{
+	const __m128i mask = _mm_set1_epi32(PIXEL_MASK);
+	const int r = size / 2;
+	uint32_t x = 0;
+
+	for (; x + 4 <= count; x += 4) {
+		const uint32_t * p = src + x;
+		__m128i lo[25], hi[25];
+		int ky, kx, i = 0;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++, i++) {
+				__m128i v;
+				if (k[i] == 0)
+					continue;
+				v = _mm_loadu_si128((const __m128i *)
+						    (p + ky * (ptrdiff_t)stride + kx));
+				lo[i] = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+				hi[i] = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+			}
+		}
+
+		__m128i res = _mm_packus_epi16(
+			conv_combine_sse2(lo, size * size, k, recip, shift),
+			conv_combine_sse2(hi, size * size, k, recip, shift));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_and_si128(res, mask));
+	}
+
+	conv_row_scalar(dst + x, src + x, stride, count - x, size, k, recip, shift);
+}
+
+/* AVX2 flavor of the above, with 8 pixels per step. Unpacking and
+ * packing both operate within 128-bit lanes, so the pixel order is
+ * preserved without any cross-lane permutation. */
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+CONV_INLINE AVX2_TARGET __m256i conv_tap_avx2(__m256i acc, __m256i v, const int w)
+{
+	int a = w < 0 ? -w : w;
+
+	if (w == 0)
+		return acc;
+	if ((a & (a - 1)) == 0) {
+		v = _mm256_slli_epi16(v, __builtin_ctz(a));
+		return w > 0 ? _mm256_add_epi16(acc, v) : _mm256_sub_epi16(acc, v);
+	}
+	return _mm256_add_epi16(acc, _mm256_mullo_epi16(v, _mm256_set1_epi16(w)));
+}
+
+CONV_INLINE AVX2_TARGET __m256i conv_combine_avx2(const __m256i * t, const int taps,
+						  const int * k, const uint32_t recip,
+						  const int shift)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int i;
+
+#pragma GCC unroll 25
+	for (i = 0; i < taps; ++i)
+		acc = conv_tap_avx2(acc, t[i], k[i]);
+
+	if (recip)
+		acc = _mm256_srli_epi16(_mm256_mulhi_epu16(acc, _mm256_set1_epi16((short)recip)),
+					shift);
+	else if (shift)
+		acc = _mm256_srli_epi16(acc, shift);
+
+	return acc;
+}
+
+CONV_INLINE AVX2_TARGET void conv_row_avx2(uint32_t * dst, const uint32_t * src,
+					   size_t stride, uint32_t count,
+					   const int size, const int * k,
+					   const uint32_t recip, const int shift)
+{
+	const __m256i mask = _mm256_set1_epi32(PIXEL_MASK);
+	const int r = size / 2;
+	uint32_t x = 0;
+
+	for (; x + 8 <= count; x += 8) {
+		const uint32_t * p = src + x;
+		__m256i lo[25], hi[25];
+		int ky, kx, i = 0;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++, i++) {
+				__m256i v;
+				if (k[i] == 0)
+					continue;
+				v = _mm256_loadu_si256((const __m256i *)
+						       (p + ky * (ptrdiff_t)stride + kx));
+				lo[i] = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+				hi[i] = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+			}
+		}
+
+		__m256i res = _mm256_packus_epi16(
+			conv_combine_avx2(lo, size * size, k, recip, shift),
+			conv_combine_avx2(hi, size * size, k, recip, shift));
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_and_si256(res, mask));
+	}
+
+	conv_row_sse2(dst + x, src + x, stride, count - x, size, k, recip, shift);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+/* Planar row kernels: the same computation on one 8-bit channel plane
+ * of an image, see IMG_LAYOUT_PLANAR. Without the unused top byte in
+ * every pixel, a vector holds 16 (SSE2) or 32 (AVX2) values of the
+ * channel, none of which is wasted. */
+typedef void (*conv_plane_fn)(uint8_t * dst, const uint8_t * src,
+			      size_t stride, uint32_t count);
+
+CONV_INLINE void conv_plane_scalar(uint8_t * dst, const uint8_t * src,
+				   size_t stride, uint32_t count,
+				   const int size, const int * k,
+				   const uint32_t recip, const int shift)
+{
+	const int r = size / 2;
+	uint32_t x;
+
+	for (x = 0; x < count; ++x) {
+		const uint8_t * p = src + x;
+		int sum = 0;
+		int ky, kx;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++) {
+				const int w = k[(ky + r) * size + (kx + r)];
+				if (w == 0)
+					continue;
+				sum += (int)p[ky * (ptrdiff_t)stride + kx] * w;
+			}
+		}
+
+		if (recip)
+			sum = ((uint32_t)sum * recip) >> (16 + shift);
+		else if (shift)
+			sum >>= shift;
+
+		dst[x] = CLIP_CHANNEL(sum);
+	}
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+CONV_INLINE void conv_plane_sse2(uint8_t * dst, const uint8_t * src,
+				 size_t stride, uint32_t count,
+				 const int size, const int * k,
+				 const uint32_t recip, const int shift)
+{
+	const int r = size / 2;
+	uint32_t x = 0;
+
+	for (; x + 16 <= count; x += 16) {
+		const uint8_t * p = src + x;
+		__m128i lo[25], hi[25];
+		int ky, kx, i = 0;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++, i++) {
+				__m128i v;
+				if (k[i] == 0)
+					continue;
+				v = _mm_loadu_si128((const __m128i *)
+						    (p + ky * (ptrdiff_t)stride + kx));
+				lo[i] = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+				hi[i] = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+			}
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(
+			conv_combine_sse2(lo, size * size, k, recip, shift),
+			conv_combine_sse2(hi, size * size, k, recip, shift)));
+	}
+
+	conv_plane_scalar(dst + x, src + x, stride, count - x, size, k, recip, shift);
+}
+
+CONV_INLINE AVX2_TARGET void conv_plane_avx2(uint8_t * dst, const uint8_t * src,
+					     size_t stride, uint32_t count,
+					     const int size, const int * k,
+					     const uint32_t recip, const int shift)
+{
+	const int r = size / 2;
+	uint32_t x = 0;
+
+	for (; x + 32 <= count; x += 32) {
+		const uint8_t * p = src + x;
+		__m256i lo[25], hi[25];
+		int ky, kx, i = 0;
+
+#pragma GCC unroll 5
+		for (ky = -r; ky <= r; ky++) {
+#pragma GCC unroll 5
+			for (kx = -r; kx <= r; kx++, i++) {
+				__m256i v;
+				if (k[i] == 0)
+					continue;
+				v = _mm256_loadu_si256((const __m256i *)
+						       (p + ky * (ptrdiff_t)stride + kx));
+				lo[i] = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+				hi[i] = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+			}
+		}
+
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(
+			conv_combine_avx2(lo, size * size, k, recip, shift),
+			conv_combine_avx2(hi, size * size, k, recip, shift)));
+	}
+
+	conv_plane_sse2(dst + x, src + x, stride, count - x, size, k, recip, shift);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+/* Per-filter descriptor: one row kernel per back-end, indexed by
+ * enum conv_isa, for packed pixels and for channel planes, plus the
+ * geometry needed by the driver. Missing entries fall back to the next
+ * lower back-end. */
+struct conv_filter {
+	conv_row_fn rows[ISA_COUNT];
+	conv_plane_fn planes[ISA_COUNT];
+	int size;
+	enum conv_border border;
+};
+
+#ifdef IMGLIB_X86_SIMD
+#define CONV_SIMD_ROWS(name, size, ...)				\
+	static void name##_row_sse2(uint32_t * dst, const uint32_t * src, \
+				    size_t stride, uint32_t count)	\
+	{								\
+		conv_row_sse2(dst, src, stride, count, size,		\
+			      name##_kernel, __VA_ARGS__);		\
+	}								\
+	static AVX2_TARGET void name##_row_avx2(uint32_t * dst,		\
+						const uint32_t * src,	\
+						size_t stride,		\
+						uint32_t count)		\
+	{								\
+		conv_row_avx2(dst, src, stride, count, size,		\
+			      name##_kernel, __VA_ARGS__);		\
+	}								\
+	static void name##_plane_sse2(uint8_t * dst, const uint8_t * src, \
+				      size_t stride, uint32_t count)	\
+	{								\
+		conv_plane_sse2(dst, src, stride, count, size,		\
+				name##_kernel, __VA_ARGS__);		\
+	}								\
+	static AVX2_TARGET void name##_plane_avx2(uint8_t * dst,	\
+						  const uint8_t * src,	\
+						  size_t stride,	\
+						  uint32_t count)	\
+	{								\
+		conv_plane_avx2(dst, src, stride, count, size,		\
+				name##_kernel, __VA_ARGS__);		\
+	}
+#define CONV_ROWS(name)							\
+	{ name##_row_scalar, name##_row_sse2, name##_row_avx2 },	\
+	{ name##_plane_scalar, name##_plane_sse2, name##_plane_avx2 }
+#else
+#define CONV_SIMD_ROWS(name, size, ...)
+#define CONV_ROWS(name)							\
+	{ name##_row_scalar, NULL, NULL },				\
+	{ name##_plane_scalar, NULL, NULL }
+#endif
+
+/* Declare the <name>_filter descriptor for a <size>x<size> kernel
+ * whose weights, in row-major order, follow the other parameters. */
+#define DEFINE_CONV_FILTER(name, size, norm, border, ...)		\
+	static const int name##_kernel[(size) * (size)] = { __VA_ARGS__ }; \
+	static void name##_row_scalar(uint32_t * dst, const uint32_t * src, \
+				      size_t stride, uint32_t count)	\
+	{								\
+		conv_row_scalar(dst, src, stride, count, size,		\
+				name##_kernel, norm);			\
+	}								\
+	static void name##_plane_scalar(uint8_t * dst, const uint8_t * src, \
+					size_t stride, uint32_t count)	\
+	{								\
+		conv_plane_scalar(dst, src, stride, count, size,	\
+				  name##_kernel, norm);			\
+	}								\
+	CONV_SIMD_ROWS(name, size, norm)				\
+	static const struct conv_filter name##_filter =			\
+		{ CONV_ROWS(name), size, border }
+
+DEFINE_CONV_FILTER(blur, 3, NORM_DIV9, BORDER_COPY,
+		   1, 1, 1,
+		   1, 1, 1,
+		   1, 1, 1);
+
+DEFINE_CONV_FILTER(sharpen, 3, NORM_NONE, BORDER_COPY,
+		   -1, -1, -1,
+		   -1,  9, -1,
+		   -1, -1, -1);
+
+DEFINE_CONV_FILTER(vertedges, 3, NORM_NONE, BORDER_ZERO,
+		   -1, 0, 1,
+		   -2, 0, 2,
+		   -1, 0, 1);
+
+DEFINE_CONV_FILTER(horizedges, 3, NORM_NONE, BORDER_ZERO,
+		   -1, -2, -1,
+		    0,  0,  0,
+		    1,  2,  1);
+
+DEFINE_CONV_FILTER(gaussian, 5, NORM_SHIFT(8), BORDER_COPY,
+		   1,  4,  6,  4, 1,
+		   4, 16, 24, 16, 4,
+		   6, 24, 36, 24, 6,
+		   4, 16, 24, 16, 4,
+		   1,  4,  6,  4, 1);
+
+DEFINE_CONV_FILTER(emboss, 3, NORM_NONE, BORDER_COPY,
+		   -2, -1, 0,
+		   -1,  1, 1,
+		    0,  1, 2);
+
+/* Select the best back-end supported by this CPU, capped by the
+ * IMGLIB_SIMD environment variable if set. The selection is done
+ * once and cached. */
+static enum conv_isa conv_select_isa(void)
+{
+	static int selected = -1;
+	enum conv_isa isa = ISA_SCALAR;
+	const char * cap;
+	int cached = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+
+	if (cached >= 0)
+		return (enum conv_isa)cached;
+
+#ifdef IMGLIB_X86_SIMD
+	__builtin_cpu_init();
+	isa = ISA_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		isa = ISA_AVX2;
+#endif
+
+	cap = getenv("IMGLIB_SIMD");
+	if (cap) {
+		if (!strcmp(cap, "scalar"))
+			isa = ISA_SCALAR;
+		else if (!strcmp(cap, "sse2") && isa > ISA_SSE2)
+			isa = ISA_SSE2;
+	}
+
+	/* Threads that race here all pick the same */
+	__atomic_store_n(&selected, isa, __ATOMIC_RELAXED);
+	return isa;
+}
+
+/* Fill the border rows and columns, <r> pixels wide, of <out> from
+ * <img> according to the <border> policy. Only the rows in [y0, y1)
+ * are touched. */
+static void conv_fill_border(const struct image * img, struct image * out,
+			     uint32_t r, enum conv_border border,
+			     uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	uint32_t x, y;
+
+	for (y = y0; y < y1; ++y) {
+		if (y < r || y + r >= h) {
+			if (border == BORDER_COPY)
+				memcpy(&pix(out, 0, y), &pix(img, 0, y), w * sizeof(uint32_t));
+			else
+				memset(&pix(out, 0, y), 0, w * sizeof(uint32_t));
+			continue;
+		}
+		for (x = 0; x < r && x < w; ++x) {
+			pix(out, x, y) = (border == BORDER_COPY) ? pix(img, x, y) : 0;
+			pix(out, w - x - 1, y) =
+				(border == BORDER_COPY) ? pix(img, w - x - 1, y) : 0;
+		}
+	}
+}
+
+/* Row kernels of a stencil: <conv> writes to out[0], or <sobel> to
+ * any of out[0..3) that is not NULL */
+struct stencil_rows {
+	conv_row_fn conv;
+	sobel_row_fn sobel;
+};
+
+/* Compute <count> output pixels at offset <off> of each output tile
+ * in <d> from the source pixels at <src>, with rows <stride> apart */
+static inline void stencil_run(const struct stencil_rows * k, uint32_t ** d, size_t off,
+			       const uint32_t * src, size_t stride, uint32_t count)
+{
+	if (k->conv)
+		k->conv(d[0] + off, src, stride, count);
+	else
+		k->sobel(d[0] ? d[0] + off : NULL, d[1] ? d[1] + off : NULL,
+			 d[2] ? d[2] + off : NULL, src, stride, count);
+}
+
+/* Fast path of readImageBlock() for a tile (<tx>,<ty>) of a tiled
+ * image that has neighbours on all sides: gather it with a halo of
+ * <r> pixels into <block>, whose rows are <bs> pixels apart. Each row
+ * of the block is the end of a row of the tile on the left, a whole
+ * row of the tile and the start of a row of the tile on the right. */
+static void gather_tile_halo(const struct image * img, uint32_t tx, uint32_t ty,
+			     uint32_t r, uint32_t * block, size_t bs)
+{
+	const size_t tile_pixels = IMG_TILE * IMG_TILE;
+	int64_t by;
+	uint32_t i;
+
+	for (by = -(int64_t)r; by < IMG_TILE + r; ++by, block += bs) {
+		uint32_t row_ty = ty + (int32_t)(by >> IMG_TILE_BITS);
+		const uint32_t * c = img->pixels + tile_offset(img, tx, row_ty) +
+			((by & (IMG_TILE - 1)) << IMG_TILE_BITS);
+
+		for (i = 0; i < r; ++i) {
+			block[i] = c[i - tile_pixels + IMG_TILE - r];
+			block[r + IMG_TILE + i] = c[tile_pixels + i];
+		}
+		memcpy(block + r, c, IMG_TILE * sizeof(uint32_t));
+	}
+}
+
+/* Tiled flavor of the drivers below, for a <r> pixels wide stencil
+ * with up to three outputs. Either <conv_row> runs with outs[0] as
+ * its output, or <sobel_row> with all three, some of which may be
+ * NULL. The output tiles that start within the rows [y0, y1) are
+ * computed, so disjoint row ranges write disjoint tiles. */
+static void stencil_tiled(const struct image * img, struct image ** outs,
+			  uint32_t r, enum conv_border border,
+			  conv_row_fn conv_row, sobel_row_fn sobel_row,
+			  uint32_t y0, uint32_t y1)
+{
+	const struct stencil_rows k = { conv_row, sobel_row };
+	uint32_t w = img->width, h = img->height;
+	uint32_t bs = IMG_TILE + 2 * r;
+	uint32_t tx, ty, ty1 = TILES_OF(y1);
+	int interior = (w > 2 * r && h > 2 * r);
+	size_t block_bytes = (size_t)bs * bs * sizeof(uint32_t);
+	uint32_t * block = (uint32_t *)pool_get(block_bytes);
+	int i;
+
+	if (!block)
+		return;
+
+	for (ty = TILES_OF(y0); ty < ty1; ++ty) {
+		for (tx = 0; tx < TILES_OF(w); ++tx) {
+			uint32_t ox = tx << IMG_TILE_BITS, oy = ty << IMG_TILE_BITS;
+			uint32_t tw = (w - ox > IMG_TILE) ? IMG_TILE : w - ox;
+			uint32_t th = (h - oy > IMG_TILE) ? IMG_TILE : h - oy;
+			uint32_t * d[3] = { NULL, NULL, NULL };
+			uint32_t xa = 0, xb = 0, ly;
+
+			for (i = 0; i < 3; ++i)
+				if (outs[i])
+					d[i] = outs[i]->pixels + tile_offset(outs[i], tx, ty);
+
+			/* Gather the source tile and its halo in x-y order,
+			 * so that the kernels run on whole rows of the tile */
+			if (tx > 0 && ty > 0 && tx + 1 < TILES_OF(w) && ty + 1 < TILES_OF(h) &&
+			    r <= IMG_TILE)
+				gather_tile_halo(img, tx, ty, r, block, bs);
+			else
+				readImageBlock(img, (int64_t)ox - r, (int64_t)oy - r,
+					       tw + 2 * r, th + 2 * r, block, bs);
+
+			/* Interior columns [xa, xb) of the tile */
+			if (interior) {
+				xa = (ox < r) ? r - ox : 0;
+				xb = (ox + tw > w - r) ? ((w - r > ox) ? w - r - ox : 0) : tw;
+				if (xb < xa)
+					xb = xa;
+			}
+
+			for (ly = 0; ly < th; ++ly) {
+				const uint32_t * src = block + (size_t)(ly + r) * bs + r;
+				uint32_t y = oy + ly, wa = xa, wb = xb;
+				size_t row = (size_t)ly * IMG_TILE;
+
+				/* Border rows and columns, as in conv_fill_border() */
+				if (!interior || y < r || y + r >= h)
+					wa = wb = tw;
+				for (i = 0; i < 3; ++i) {
+					if (!d[i] || (wa == 0 && wb == tw))
+						continue;
+					if (border == BORDER_COPY) {
+						memcpy(d[i] + row, src, wa * sizeof(uint32_t));
+						memcpy(d[i] + row + wb, src + wb,
+						       (tw - wb) * sizeof(uint32_t));
+					} else {
+						memset(d[i] + row, 0, wa * sizeof(uint32_t));
+						memset(d[i] + row + wb, 0, (tw - wb) * sizeof(uint32_t));
+					}
+				}
+
+				if (wb > wa && wa < tw)
+					stencil_run(&k, d, row + wa, src + wa, bs, wb - wa);
+			}
+		}
+	}
+
+	pool_put(block, block_bytes);
+}
+
+/* Row kernels of the fused Sobel gradient on channel planes */
+typedef void (*sobel_plane_fn)(uint8_t * mag, uint8_t * vert, uint8_t * horiz,
+			       const uint8_t * src, size_t stride, uint32_t count);
+
+/* Planar flavor of the drivers below, for a <r> pixels wide stencil
+ * with up to three outputs, as in stencil_tiled(). Each channel plane
+ * is filtered on its own, rows [y0, y1) of all the planes. */
+static void stencil_planar(const struct image * img, struct image ** outs,
+			   uint32_t r, enum conv_border border,
+			   conv_plane_fn conv_plane, sobel_plane_fn sobel_plane,
+			   uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	int interior = (w > 2 * r && h > 2 * r);
+	uint32_t y;
+	int c, i;
+
+	for (c = 0; c < 3; ++c) {
+		const uint8_t * src = image_plane(img, c);
+		uint8_t * d[3] = { NULL, NULL, NULL };
+
+		for (i = 0; i < 3; ++i)
+			if (outs[i])
+				d[i] = image_plane(outs[i], c);
+
+		for (y = y0; y < y1; ++y) {
+			const uint8_t * s = src + (size_t)y * w;
+			size_t row = (size_t)y * w;
+			/* Border columns [0, wa) and [wb, w), as in
+			 * conv_fill_border() */
+			uint32_t wa = r, wb = w - r;
+
+			if (!interior || y < r || y + r >= h)
+				wa = wb = w;
+			for (i = 0; i < 3; ++i) {
+				if (!d[i])
+					continue;
+				if (border == BORDER_COPY) {
+					memcpy(d[i] + row, s, wa);
+					memcpy(d[i] + row + wb, s + wb, w - wb);
+				} else {
+					memset(d[i] + row, 0, wa);
+					memset(d[i] + row + wb, 0, w - wb);
+				}
+			}
+
+			if (wa >= wb)
+				continue;
+			if (conv_plane)
+				conv_plane(d[0] + row + wa, s + wa, w, wb - wa);
+			else
+				sobel_plane(d[0] ? d[0] + row + wa : NULL,
+					    d[1] ? d[1] + row + wa : NULL,
+					    d[2] ? d[2] + row + wa : NULL,
+					    s + wa, w, wb - wa);
+		}
+	}
+}
+
+/* Run a filter over the rows [y0, y1) of <img>, writing the same
+ * rows of <out>. Each output row only depends on the source, so
+ * disjoint row ranges can be computed concurrently. */
+static void convolve_rows(const struct image * img, struct image * out,
+			  const struct conv_filter * filter,
+			  uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	uint32_t r = filter->size / 2;
+	uint32_t y;
+	conv_row_fn row;
+	int isa;
+
+	for (isa = conv_select_isa(); !filter->rows[isa]; --isa);
+	row = filter->rows[isa];
+
+	if (img->layout == IMG_LAYOUT_TILED) {
+		struct image * outs[3] = { out, NULL, NULL };
+		stencil_tiled(img, outs, r, filter->border, row, NULL, y0, y1);
+		return;
+	}
+	if (img->layout == IMG_LAYOUT_PLANAR) {
+		struct image * outs[3] = { out, NULL, NULL };
+		for (isa = conv_select_isa(); !filter->planes[isa]; --isa);
+		stencil_planar(img, outs, r, filter->border, filter->planes[isa], NULL, y0, y1);
+		return;
+	}
+
+	/* First pass: the border rows and columns */
+	conv_fill_border(img, out, r, filter->border, y0, y1);
+
+	/* Nothing else to do if there are no interior pixels */
+	if (w <= 2 * r || h <= 2 * r)
+		return;
+
+	/* Second pass: branch-free interior, one row at a time */
+	for (y = (y0 > r) ? y0 : r; y + r < h && y < y1; ++y)
+		row(&pix(out, r, y), &pix(img, r, y), w, w - 2 * r);
+}
+
+/* Run a filter over the whole of <img> and return the result in a
+ * newly allocated image. */
+static struct image * convolve(const struct image * img,
+			       const struct conv_filter * filter)
+{
+	struct image * out = create_like(img, img->width, img->height);
+
+	if (out)
+		convolve_rows(img, out, filter, 0, img->height);
+	return out;
+}
+
+/*******************************************************************************
+* Fused Sobel gradient
+*
+* Both Sobel kernels are computed from a single load of each 3x3
+* neighbourhood. The fused row kernels can emit any combination of
+* the gradient magnitude, approximated per channel as |Gx| + |Gy| and
+* clipped to [0, 255], and of the two individual responses, which are
+* bit-identical to detectVerticalEdges() and detectHorizontalEdges().
+* Outputs that are not wanted are passed as NULL.
+*******************************************************************************/
+
+/* Either kernel needs every tap but the center one */
+#define SOBEL_TAP(i) ((i) != 4)
+
+CONV_INLINE void sobel_row_scalar(uint32_t * mag, uint32_t * vert, uint32_t * horiz,
+				  const uint32_t * src, size_t stride, uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x) {
+		const uint32_t * p = src + x;
+		int gx[3] = { 0, 0, 0 }, gy[3] = { 0, 0, 0 };
+		uint32_t m = 0, v = 0, h = 0;
+		int i, c;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			uint32_t pixel;
+			if (!SOBEL_TAP(i))
+				continue;
+			pixel = p[(i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)];
+			for (c = 0; c < 3; ++c) {
+				int ch = (pixel >> (8 * c)) & 0xFF;
+				gx[c] += ch * vertedges_kernel[i];
+				gy[c] += ch * horizedges_kernel[i];
+			}
+		}
+
+		for (c = 0; c < 3; ++c) {
+			int ax = gx[c] < 0 ? -gx[c] : gx[c];
+			int ay = gy[c] < 0 ? -gy[c] : gy[c];
+			m |= (uint32_t)CLIP_CHANNEL(ax + ay) << (8 * c);
+			v |= (uint32_t)CLIP_CHANNEL(gx[c]) << (8 * c);
+			h |= (uint32_t)CLIP_CHANNEL(gy[c]) << (8 * c);
+		}
+
+		if (mag)
+			mag[x] = m;
+		if (vert)
+			vert[x] = v;
+		if (horiz)
+			horiz[x] = h;
+	}
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+static void sobel_row_sse2(uint32_t * mag, uint32_t * vert, uint32_t * horiz,
+			   const uint32_t * src, size_t stride, uint32_t count)
+{
+	const __m128i mask = _mm_set1_epi32(PIXEL_MASK);
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t x = 0;
+
+	for (; x + 4 <= count; x += 4) {
+		const uint32_t * p = src + x;
+		__m128i lo[9], hi[9];
+		int i;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			__m128i v;
+			if (!SOBEL_TAP(i)) {
+				lo[i] = hi[i] = zero;
+				continue;
+			}
+			v = _mm_loadu_si128((const __m128i *)
+					    (p + (i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)));
+			lo[i] = _mm_unpacklo_epi8(v, zero);
+			hi[i] = _mm_unpackhi_epi8(v, zero);
+		}
+
+		__m128i gx_lo = conv_combine_sse2(lo, 9, vertedges_kernel, NORM_NONE);
+		__m128i gx_hi = conv_combine_sse2(hi, 9, vertedges_kernel, NORM_NONE);
+		__m128i gy_lo = conv_combine_sse2(lo, 9, horizedges_kernel, NORM_NONE);
+		__m128i gy_hi = conv_combine_sse2(hi, 9, horizedges_kernel, NORM_NONE);
+
+		if (mag) {
+			/* SSE2 has no 16-bit abs: use max(v, -v) */
+			__m128i m_lo = _mm_add_epi16(
+				_mm_max_epi16(gx_lo, _mm_sub_epi16(zero, gx_lo)),
+				_mm_max_epi16(gy_lo, _mm_sub_epi16(zero, gy_lo)));
+			__m128i m_hi = _mm_add_epi16(
+				_mm_max_epi16(gx_hi, _mm_sub_epi16(zero, gx_hi)),
+				_mm_max_epi16(gy_hi, _mm_sub_epi16(zero, gy_hi)));
+			_mm_storeu_si128((__m128i *)(mag + x),
+					 _mm_and_si128(_mm_packus_epi16(m_lo, m_hi), mask));
+		}
+		if (vert)
+			_mm_storeu_si128((__m128i *)(vert + x),
+					 _mm_and_si128(_mm_packus_epi16(gx_lo, gx_hi), mask));
+		if (horiz)
+			_mm_storeu_si128((__m128i *)(horiz + x),
+					 _mm_and_si128(_mm_packus_epi16(gy_lo, gy_hi), mask));
+	}
+
+	sobel_row_scalar(mag ? mag + x : NULL, vert ? vert + x : NULL,
+			 horiz ? horiz + x : NULL, src + x, stride, count - x);
+}
+
+static AVX2_TARGET void sobel_row_avx2(uint32_t * mag, uint32_t * vert, uint32_t * horiz,
+				       const uint32_t * src, size_t stride, uint32_t count)
+{
+	const __m256i mask = _mm256_set1_epi32(PIXEL_MASK);
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t x = 0;
+
+	for (; x + 8 <= count; x += 8) {
+		const uint32_t * p = src + x;
+		__m256i lo[9], hi[9];
+		int i;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			__m256i v;
+			if (!SOBEL_TAP(i)) {
+				lo[i] = hi[i] = zero;
+				continue;
+			}
+			v = _mm256_loadu_si256((const __m256i *)
+					       (p + (i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)));
+			lo[i] = _mm256_unpacklo_epi8(v, zero);
+			hi[i] = _mm256_unpackhi_epi8(v, zero);
+		}
+
+		__m256i gx_lo = conv_combine_avx2(lo, 9, vertedges_kernel, NORM_NONE);
+		__m256i gx_hi = conv_combine_avx2(hi, 9, vertedges_kernel, NORM_NONE);
+		__m256i gy_lo = conv_combine_avx2(lo, 9, horizedges_kernel, NORM_NONE);
+		__m256i gy_hi = conv_combine_avx2(hi, 9, horizedges_kernel, NORM_NONE);
+
+		if (mag) {
+			__m256i m_lo = _mm256_add_epi16(_mm256_abs_epi16(gx_lo),
+							_mm256_abs_epi16(gy_lo));
+			__m256i m_hi = _mm256_add_epi16(_mm256_abs_epi16(gx_hi),
+							_mm256_abs_epi16(gy_hi));
+			_mm256_storeu_si256((__m256i *)(mag + x),
+					    _mm256_and_si256(_mm256_packus_epi16(m_lo, m_hi), mask));
+		}
+		if (vert)
+			_mm256_storeu_si256((__m256i *)(vert + x),
+					    _mm256_and_si256(_mm256_packus_epi16(gx_lo, gx_hi), mask));
+		if (horiz)
+			_mm256_storeu_si256((__m256i *)(horiz + x),
+					    _mm256_and_si256(_mm256_packus_epi16(gy_lo, gy_hi), mask));
+	}
+
+	sobel_row_sse2(mag ? mag + x : NULL, vert ? vert + x : NULL,
+		       horiz ? horiz + x : NULL, src + x, stride, count - x);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+static void sobel_row_scalar_fn(uint32_t * mag, uint32_t * vert, uint32_t * horiz,
+				const uint32_t * src, size_t stride, uint32_t count)
+{
+	sobel_row_scalar(mag, vert, horiz, src, stride, count);
+}
+
+static const sobel_row_fn sobel_rows[ISA_COUNT] = {
+	sobel_row_scalar_fn,
+#ifdef IMGLIB_X86_SIMD
+	sobel_row_sse2,
+	sobel_row_avx2
+#endif
+};
+
+/* Fused Sobel kernels on a channel plane */
+CONV_INLINE void sobel_plane_scalar(uint8_t * mag, uint8_t * vert, uint8_t * horiz,
+				    const uint8_t * src, size_t stride, uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x) {
+		const uint8_t * p = src + x;
+		int gx = 0, gy = 0, i;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			int ch;
+			if (!SOBEL_TAP(i))
+				continue;
+			ch = p[(i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)];
+			gx += ch * vertedges_kernel[i];
+			gy += ch * horizedges_kernel[i];
+		}
+
+		if (mag)
+			mag[x] = CLIP_CHANNEL((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy));
+		if (vert)
+			vert[x] = CLIP_CHANNEL(gx);
+		if (horiz)
+			horiz[x] = CLIP_CHANNEL(gy);
+	}
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+static void sobel_plane_sse2(uint8_t * mag, uint8_t * vert, uint8_t * horiz,
+			     const uint8_t * src, size_t stride, uint32_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t x = 0;
+
+	for (; x + 16 <= count; x += 16) {
+		const uint8_t * p = src + x;
+		__m128i lo[9], hi[9];
+		int i;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			__m128i v;
+			if (!SOBEL_TAP(i)) {
+				lo[i] = hi[i] = zero;
+				continue;
+			}
+			v = _mm_loadu_si128((const __m128i *)
+					    (p + (i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)));
+			lo[i] = _mm_unpacklo_epi8(v, zero);
+			hi[i] = _mm_unpackhi_epi8(v, zero);
+		}
+
+		__m128i gx_lo = conv_combine_sse2(lo, 9, vertedges_kernel, NORM_NONE);
+		__m128i gx_hi = conv_combine_sse2(hi, 9, vertedges_kernel, NORM_NONE);
+		__m128i gy_lo = conv_combine_sse2(lo, 9, horizedges_kernel, NORM_NONE);
+		__m128i gy_hi = conv_combine_sse2(hi, 9, horizedges_kernel, NORM_NONE);
+
+		if (mag) {
+			__m128i m_lo = _mm_add_epi16(
+				_mm_max_epi16(gx_lo, _mm_sub_epi16(zero, gx_lo)),
+				_mm_max_epi16(gy_lo, _mm_sub_epi16(zero, gy_lo)));
+			__m128i m_hi = _mm_add_epi16(
+				_mm_max_epi16(gx_hi, _mm_sub_epi16(zero, gx_hi)),
+				_mm_max_epi16(gy_hi, _mm_sub_epi16(zero, gy_hi)));
+			_mm_storeu_si128((__m128i *)(mag + x), _mm_packus_epi16(m_lo, m_hi));
+		}
+		if (vert)
+			_mm_storeu_si128((__m128i *)(vert + x), _mm_packus_epi16(gx_lo, gx_hi));
+		if (horiz)
+			_mm_storeu_si128((__m128i *)(horiz + x), _mm_packus_epi16(gy_lo, gy_hi));
+	}
+
+	sobel_plane_scalar(mag ? mag + x : NULL, vert ? vert + x : NULL,
+			   horiz ? horiz + x : NULL, src + x, stride, count - x);
+}
+
+static AVX2_TARGET void sobel_plane_avx2(uint8_t * mag, uint8_t * vert, uint8_t * horiz,
+					 const uint8_t * src, size_t stride, uint32_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t x = 0;
+
+	for (; x + 32 <= count; x += 32) {
+		const uint8_t * p = src + x;
+		__m256i lo[9], hi[9];
+		int i;
+
+#pragma GCC unroll 9
+		for (i = 0; i < 9; ++i) {
+			__m256i v;
+			if (!SOBEL_TAP(i)) {
+				lo[i] = hi[i] = zero;
+				continue;
+			}
+			v = _mm256_loadu_si256((const __m256i *)
+					       (p + (i / 3 - 1) * (ptrdiff_t)stride + (i % 3 - 1)));
+			lo[i] = _mm256_unpacklo_epi8(v, zero);
+			hi[i] = _mm256_unpackhi_epi8(v, zero);
+		}
+
+		__m256i gx_lo = conv_combine_avx2(lo, 9, vertedges_kernel, NORM_NONE);
+		__m256i gx_hi = conv_combine_avx2(hi, 9, vertedges_kernel, NORM_NONE);
+		__m256i gy_lo = conv_combine_avx2(lo, 9, horizedges_kernel, NORM_NONE);
+		__m256i gy_hi = conv_combine_avx2(hi, 9, horizedges_kernel, NORM_NONE);
+
+		if (mag) {
+			__m256i m_lo = _mm256_add_epi16(_mm256_abs_epi16(gx_lo),
+							_mm256_abs_epi16(gy_lo));
+			__m256i m_hi = _mm256_add_epi16(_mm256_abs_epi16(gx_hi),
+							_mm256_abs_epi16(gy_hi));
+			_mm256_storeu_si256((__m256i *)(mag + x), _mm256_packus_epi16(m_lo, m_hi));
+		}
+		if (vert)
+			_mm256_storeu_si256((__m256i *)(vert + x), _mm256_packus_epi16(gx_lo, gx_hi));
+		if (horiz)
+			_mm256_storeu_si256((__m256i *)(horiz + x), _mm256_packus_epi16(gy_lo, gy_hi));
+	}
+
+	sobel_plane_sse2(mag ? mag + x : NULL, vert ? vert + x : NULL,
+			 horiz ? horiz + x : NULL, src + x, stride, count - x);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+static void sobel_plane_scalar_fn(uint8_t * mag, uint8_t * vert, uint8_t * horiz,
+				  const uint8_t * src, size_t stride, uint32_t count)
+{
+	sobel_plane_scalar(mag, vert, horiz, src, stride, count);
+}
+
+static const sobel_plane_fn sobel_planes[ISA_COUNT] = {
+	sobel_plane_scalar_fn,
+#ifdef IMGLIB_X86_SIMD
+	sobel_plane_sse2,
+	sobel_plane_avx2
+#endif
+};
+
+/* Run the fused Sobel kernels over the rows [y0, y1) of <img>. Any
+ * of the outputs may be NULL. */
+static void sobel_band(const struct image * img, struct image * mag,
+		       struct image * vert, struct image * horiz,
+		       uint32_t y0, uint32_t y1)
+{
+	uint32_t w = img->width, h = img->height;
+	struct image * outs[3] = { mag, vert, horiz };
+	uint32_t y;
+	sobel_row_fn row;
+	int i, isa;
+
+	for (isa = conv_select_isa(); !sobel_rows[isa]; --isa);
+	row = sobel_rows[isa];
+
+	if (img->layout == IMG_LAYOUT_TILED) {
+		stencil_tiled(img, outs, 1, BORDER_ZERO, NULL, row, y0, y1);
+		return;
+	}
+	if (img->layout == IMG_LAYOUT_PLANAR) {
+		for (isa = conv_select_isa(); !sobel_planes[isa]; --isa);
+		stencil_planar(img, outs, 1, BORDER_ZERO, NULL, sobel_planes[isa], y0, y1);
+		return;
+	}
+
+	for (i = 0; i < 3; ++i)
+		if (outs[i])
+			conv_fill_border(img, outs[i], 1, BORDER_ZERO, y0, y1);
+
+	if (w < 3 || h < 3)
+		return;
+
+	for (y = (y0 > 1) ? y0 : 1; y + 1 < h && y < y1; ++y)
+		row(mag ? &pix(mag, 1, y) : NULL,
+		    vert ? &pix(vert, 1, y) : NULL,
+		    horiz ? &pix(horiz, 1, y) : NULL,
+		    &pix(img, 1, y), w, w - 2);
+}
+
+/* Allocate the requested outputs and run the fused Sobel kernels
+ * over <img>. */
+static void sobel(const struct image * img, struct image ** mag,
+		  struct image ** vert, struct image ** horiz)
+{
+	struct image ** outs[3] = { mag, vert, horiz };
+	int i;
+
+	for (i = 0; i < 3; ++i)
+		if (outs[i])
+			*outs[i] = create_like(img, img->width, img->height);
+
+	sobel_band(img, mag ? *mag : NULL, vert ? *vert : NULL,
+		   horiz ? *horiz : NULL, 0, img->height);
+}
+
+/**
+ * @brief Blur an image using a 3x3 averaging kernel.
+ *
+ * This function applies a 3x3 averaging kernel to each pixel in the image, resulting in 
+ * a blurred effect. Edge pixels are not blurred to keep the implementation simple.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains 
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* blurImage(const struct image* img) {
+	return convolve(img, &blur_filter);
+}
+
+/**
+ * @brief Sharpen an image using a 3x3 sharpening kernel.
+ *
+ * This function applies a 3x3 sharpening kernel to each pixel in the image to enhance its
+ * details. Edge pixels are not sharpened to keep the implementation simple.
+ *
+ * @param img The original image to be sharpened.
+ * @return A new image structure containing the sharpened image. The original image remains 
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* sharpenImage(const struct image* img) {
+	return convolve(img, &sharpen_filter);
+}
+
+/**
+ * @brief Detect vertical edges in an image using the Sobel operator.
+ *
+ * This function applies the Sobel vertical operator to each pixel in the image to detect
+ * vertical edges. Edge pixels are not processed to keep the implementation simple.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the edge detected image. The original image remains 
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* detectVerticalEdges(const struct image* img) {
+	return convolve(img, &vertedges_filter);
+}
+
+/**
+ * @brief Detect horizontal edges in an image using the Sobel operator.
+ *
+ * This function applies the Sobel horizontal operator to each pixel in the image to detect
+ * horizontal edges. Edge pixels are not processed to keep the implementation simple.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the edge detected image. The original image remains 
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* detectHorizontalEdges(const struct image* img) {
+	return convolve(img, &horizedges_filter);
+}
+
+/**
+ * @brief Blur an image using a 5x5 Gaussian kernel.
+ *
+ * This function applies the 5x5 binomial approximation of a Gaussian kernel
+ * (outer product of [1 4 6 4 1], normalized by 256) to each pixel in the image.
+ * The two outermost rows and columns are copied over unchanged.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* gaussianBlurImage(const struct image* img) {
+	return convolve(img, &gaussian_filter);
+}
+
+/**
+ * @brief Emboss an image using a 3x3 directional kernel.
+ *
+ * This function applies a 3x3 emboss kernel to each pixel in the image, which
+ * highlights intensity changes along the top-left to bottom-right diagonal. Edge
+ * pixels are copied over unchanged.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the embossed image. The original image remains
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* embossImage(const struct image* img) {
+	return convolve(img, &emboss_filter);
+}
+
+/**
+ * @brief Compute the Sobel gradient magnitude of an image in a single pass.
+ *
+ * This function computes both the vertical and the horizontal Sobel responses from
+ * a single load of each 3x3 neighbourhood and combines them, per channel, into the
+ * gradient magnitude approximated as |Gx| + |Gy| and clipped to [0, 255]. Edge
+ * pixels are set to black.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the gradient magnitude. The original image
+ *         remains unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* detectEdges(const struct image* img) {
+	struct image * mag = NULL;
+
+	if (!img || !img->pixels)
+		return NULL;
+
+	sobel(img, &mag, NULL, NULL);
+	return mag;
+}
+
+/**
+ * @brief Compute the vertical and horizontal Sobel responses in a single pass.
+ *
+ * This function produces, from a single load of each 3x3 neighbourhood, the same
+ * two images that detectVerticalEdges() and detectHorizontalEdges() would return.
+ *
+ * @param img The original image.
+ * @param vert Filled with the vertical edges image. May be NULL if not needed.
+ * @param horiz Filled with the horizontal edges image. May be NULL if not needed.
+ * @return 0 on success, 1 on error.
+ *
+ * Note: The returned image structures should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+uint8_t detectEdgesSplit(const struct image* img, struct image** vert, struct image** horiz) {
+	if (!img || !img->pixels)
+		return 1;
+
+	sobel(img, NULL, vert, horiz);
+	return 0;
+}
+
+/**
+ * @brief Allocate the output image of a filter.
+ *
+ * This function allocates an image of the right geometry to hold the result of
+ * <filter> applied to <img>, to be filled with filterImageRows().
+ *
+ * @param img The original image.
+ * @param filter The filter that will be applied.
+ * @return The newly allocated image, or NULL on error.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* createFilterOutput(const struct image* img, enum img_filter filter) {
+	if (!img || !img->pixels)
+		return NULL;
+
+	if (filter == FILTER_ROT90CLKW)
+		return create_like(img, img->height, img->width);
+	return create_like(img, img->width, img->height);
+}
+
+/**
+ * @brief Compute one band of rows of a filter.
+ *
+ * This function applies <filter> to the source rows [y0, y1) of <img> and writes
+ * the corresponding output pixels into <out>, which must have been obtained from
+ * createFilterOutput(). For all filters but the rotations these are the same rows of
+ * the output; the rotation by 90 degrees writes them as the output columns [y0, y1),
+ * and the one by 180 degrees as the rows [height - y1, height - y0). Disjoint
+ * bands write disjoint pixels of <out> and only read <img>, so they can be computed
+ * by different threads at the same time. Running the bands that cover
+ * [0, img->height) gives the same result as the whole-image function.
+ *
+ * @param img The original image.
+ * @param out The output image.
+ * @param filter The filter to apply.
+ * @param y0 The first source row of the band.
+ * @param y1 One past the last source row of the band.
+ * @return 0 on success, 1 on error.
+ */
+uint8_t filterImageRows(const struct image* img, struct image* out,
+			enum img_filter filter, uint32_t y0, uint32_t y1) {
+	if (!img || !img->pixels || !out || !out->pixels)
+		return 1;
+
+	if (y1 > img->height)
+		y1 = img->height;
+	if (y0 >= y1)
+		return 0;
+
+	switch (filter) {
+	case FILTER_ROT90CLKW:
+		rotate_band(img, out, y0, y1);
+		break;
+	case FILTER_BLUR:
+		convolve_rows(img, out, &blur_filter, y0, y1);
+		break;
+	case FILTER_SHARPEN:
+		convolve_rows(img, out, &sharpen_filter, y0, y1);
+		break;
+	case FILTER_VERTEDGES:
+		convolve_rows(img, out, &vertedges_filter, y0, y1);
+		break;
+	case FILTER_HORIZEDGES:
+		convolve_rows(img, out, &horizedges_filter, y0, y1);
+		break;
+	case FILTER_GAUSSBLUR:
+		convolve_rows(img, out, &gaussian_filter, y0, y1);
+		break;
+	case FILTER_EMBOSS:
+		convolve_rows(img, out, &emboss_filter, y0, y1);
+		break;
+	case FILTER_SOBEL:
+		sobel_band(img, out, NULL, NULL, y0, y1);
+		break;
+	case FILTER_ROT180:
+		rotate180_band(img, out, y0, y1);
+		break;
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Filter pipelines
+*
+* A chain of filters is run with two output buffers that are used in
+* turns: each stage reads the output of the previous one and writes
+* into the other buffer. Every stage produces as many pixels as it
+* reads, so the same two buffers serve the whole chain even across
+* rotations, which only swap the width and the height.
+*
+* Consecutive convolutions are further fused: rather than running
+* each of them over the whole image, the last stage of the run is
+* computed one tile of rows at a time, and the earlier stages only
+* compute the rows that the tile depends on, into small per-stage
+* scratch tiles. The intermediate rows are thus consumed while they
+* are still in cache. The rows in the halo around a tile are computed
+* twice, once for each of the tiles that need them, which is why the
+* tiles are kept at least FUSE_MIN_ROWS tall. The results are the same
+* as those of the filters applied one after the other.
+*******************************************************************************/
+
+/* Target size of the tile of one stage, in bytes */
+#define FUSE_TILE_BYTES (128 * 1024)
+
+/* Minimum height of a tile, to bound the recomputed halo rows */
+#define FUSE_MIN_ROWS 32
+
+/* Rows on each side of an output row that <filter> reads, or -1 for
+ * the rotation, which cannot be computed tile by tile */
+static int filter_halo(enum img_filter filter)
+{
+	switch (filter) {
+	case FILTER_ROT90CLKW:
+	case FILTER_ROT180:
+		return -1;
+	case FILTER_GAUSSBLUR:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Run the convolutions <filters>[0..count) one after the other over
+ * <img>, writing the end result into <out>, one tile of rows at a
+ * time. Returns 0 on success, 1 on error. */
+static uint8_t fuse_rows(const struct image * img, struct image * out,
+			 const enum img_filter * filters, size_t count)
+{
+	uint32_t w = img->width, h = img->height;
+	struct image * scratch[IMG_PIPELINE_MAX];
+	uint32_t halo[IMG_PIPELINE_MAX];
+	uint32_t tile, y0;
+	uint8_t err = 0;
+	size_t i;
+
+	/* halo[i]: extra rows of the output of stage i, on each side of
+	 * a tile, needed by the stages after it */
+	halo[count - 1] = 0;
+	for (i = count - 1; i > 0; --i)
+		halo[i - 1] = halo[i] + filter_halo(filters[i]);
+
+	tile = FUSE_TILE_BYTES / ((size_t)w * sizeof(uint32_t));
+	if (tile < FUSE_MIN_ROWS)
+		tile = FUSE_MIN_ROWS;
+	if (tile > h)
+		tile = h;
+
+	memset(scratch, 0, sizeof(scratch));
+	for (i = 0; i + 1 < count; ++i) {
+		scratch[i] = createImageUninit(w, tile + 2 * halo[i]);
+		if (!scratch[i]) {
+			err = 1;
+			goto out;
+		}
+	}
+
+	for (y0 = 0; y0 < h; y0 += tile) {
+		uint32_t y1 = (h - y0 > tile) ? y0 + tile : h;
+		const struct image * src = img;
+		struct image views[IMG_PIPELINE_MAX];
+
+		for (i = 0; i < count; ++i) {
+			uint32_t a = (y0 > halo[i]) ? y0 - halo[i] : 0;
+			uint32_t b = (h - y1 > halo[i]) ? y1 + halo[i] : h;
+			struct image * dst = out;
+
+			/* The scratch tile of this stage stands in for
+			 * rows [a, b) of a full-size intermediate image */
+			if (i + 1 < count) {
+				views[i].width = w;
+				views[i].height = h;
+				views[i].refs = 1;
+				views[i].layout = IMG_LAYOUT_LINEAR;
+				views[i].pixels = scratch[i]->pixels - (size_t)a * w;
+				dst = &views[i];
+			}
+
+			filterImageRows(src, dst, filters[i], a, b);
+			src = dst;
+		}
+	}
+
+out:
+	for (i = 0; i + 1 < count; ++i)
+		deleteImage(scratch[i]);
+	return err;
+}
+
+/**
+ * @brief Apply a chain of filters to an image.
+ *
+ * This function applies <filters>[0], then <filters>[1] to its result, and so on,
+ * and returns the final image. Rather than one new image per filter, the chain
+ * only allocates two buffers that the stages write to in turns, and consecutive
+ * convolutions are computed tile by tile so that their intermediate results stay
+ * in cache. The result is the same as that of the whole-image functions applied
+ * one after the other.
+ *
+ * @param img The original image.
+ * @param filters The filters to apply, in order.
+ * @param count The number of filters, between 1 and IMG_PIPELINE_MAX.
+ * @return A new image structure containing the result, or NULL on error. The original
+ *         image remains unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* filterImagePipeline(const struct image* img, const enum img_filter* filters,
+				  size_t count) {
+	struct image * bufs[2] = { NULL, NULL };
+	const struct image * src = img;
+	size_t i, run, next = 0;
+	uint8_t err = 0;
+
+	if (!img || !img->pixels || !filters || count == 0 || count > IMG_PIPELINE_MAX)
+		return NULL;
+
+	for (i = 0; i < count && !err; i += run) {
+		struct image * dst;
+
+		/* Group the convolutions that directly follow each other.
+		 * Tiled images already keep each stage within a few tiles
+		 * at a time, so they are not fused. */
+		run = 1;
+		if (src->layout == IMG_LAYOUT_LINEAR && filter_halo(filters[i]) >= 0) {
+			while (i + run < count && filter_halo(filters[i + run]) >= 0)
+				++run;
+		}
+
+		if (!bufs[next]) {
+			bufs[next] = createFilterOutput(src, filters[i]);
+			if (!bufs[next]) {
+				err = 1;
+				break;
+			}
+		}
+		dst = bufs[next];
+
+		/* Same amount of pixels at every stage: only the shape of
+		 * a recycled buffer may need to change */
+		if (filters[i] == FILTER_ROT90CLKW) {
+			dst->width = src->height;
+			dst->height = src->width;
+		} else {
+			dst->width = src->width;
+			dst->height = src->height;
+		}
+
+		if (run > 1)
+			err = fuse_rows(src, dst, &filters[i], run);
+		else
+			err = filterImageRows(src, dst, filters[i], 0, src->height);
+
+		src = dst;
+		next ^= 1;
+	}
+
+	/* The result is in the buffer written last */
+	deleteImage(bufs[next]);
+	if (err) {
+		deleteImage(bufs[next ^ 1]);
+		return NULL;
+	}
+	return bufs[next ^ 1];
+}
+
+/*******************************************************************************
+* BMP pixel conversion
+*
+* BMP files store each row as packed 24-bit BGR triplets, while the
+* images use one 0x00RRGGBB word per pixel, i.e. the bytes B, G, R, 0.
+* The conversion is thus a byte shuffle that inserts one zero byte
+* after every triplet, done 4 pixels at a time with SSSE3 or 8 pixels
+* at a time with AVX2, and the reverse when saving.
+*******************************************************************************/
+
+typedef void (*bgr_row_fn)(uint32_t * dst, const uint8_t * src, uint32_t count);
+
+static void bgr24_to_row_scalar(uint32_t * dst, const uint8_t * src, uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x, src += 3)
+		dst[x] = (src[2] << 16) | (src[1] << 8) | src[0];
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+
+/* Spread four BGR triplets over four 32-bit lanes */
+#define BGR24_TO_PIXEL_SHUFFLE						\
+	0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+
+static SSSE3_TARGET void bgr24_to_row_ssse3(uint32_t * dst, const uint8_t * src,
+					     uint32_t count)
+{
+	const __m128i shuf = _mm_setr_epi8(BGR24_TO_PIXEL_SHUFFLE);
+	uint32_t x = 0;
+
+	/* Each load reads 16 bytes but only consumes 12: stop while
+	 * the whole load is still inside the row. */
+	for (; 3 * (size_t)x + 16 <= 3 * (size_t)count; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * (size_t)x));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_shuffle_epi8(v, shuf));
+	}
+
+	bgr24_to_row_scalar(dst + x, src + 3 * (size_t)x, count - x);
+}
+
+static AVX2_TARGET void bgr24_to_row_avx2(uint32_t * dst, const uint8_t * src,
+					   uint32_t count)
+{
+	const __m256i shuf = _mm256_setr_epi8(BGR24_TO_PIXEL_SHUFFLE,
+					      BGR24_TO_PIXEL_SHUFFLE);
+	uint32_t x = 0;
+
+	/* Two overlapping 16-byte loads, 12 bytes apart, one per lane */
+	for (; 3 * (size_t)x + 28 <= 3 * (size_t)count; x += 8) {
+		const uint8_t * p = src + 3 * (size_t)x;
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+			_mm_loadu_si128((const __m128i *)(p + 12)), 1);
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_shuffle_epi8(v, shuf));
+	}
+
+	bgr24_to_row_scalar(dst + x, src + 3 * (size_t)x, count - x);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+static void row_to_bgr24_scalar(uint8_t * dst, const uint32_t * src, uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x, dst += 3) {
+		dst[0] = src[x] & 0xFF;
+		dst[1] = (src[x] >> 8) & 0xFF;
+		dst[2] = (src[x] >> 16) & 0xFF;
+	}
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+/* Drop the fourth byte of each 32-bit lane, packing the triplets at
+ * the bottom of the register */
+#define PIXEL_TO_BGR24_SHUFFLE						\
+	0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+static SSSE3_TARGET void row_to_bgr24_ssse3(uint8_t * dst, const uint32_t * src,
+					     uint32_t count)
+{
+	const __m128i shuf = _mm_setr_epi8(PIXEL_TO_BGR24_SHUFFLE);
+	uint32_t x = 0;
+
+	/* Each store writes 16 bytes for 12 useful ones: stop while the
+	 * whole store is still inside the row. */
+	for (; 3 * (size_t)x + 16 <= 3 * (size_t)count; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)(dst + 3 * (size_t)x), _mm_shuffle_epi8(v, shuf));
+	}
+
+	row_to_bgr24_scalar(dst + 3 * (size_t)x, src + x, count - x);
+}
+
+static AVX2_TARGET void row_to_bgr24_avx2(uint8_t * dst, const uint32_t * src,
+					   uint32_t count)
+{
+	const __m256i shuf = _mm256_setr_epi8(PIXEL_TO_BGR24_SHUFFLE,
+					      PIXEL_TO_BGR24_SHUFFLE);
+	uint32_t x = 0;
+
+	/* The upper lane is stored 12 bytes after the lower one, over
+	 * its 4 bytes of slack */
+	for (; 3 * (size_t)x + 28 <= 3 * (size_t)count; x += 8) {
+		uint8_t * p = dst + 3 * (size_t)x;
+		__m256i v = _mm256_shuffle_epi8(
+			_mm256_loadu_si256((const __m256i *)(src + x)), shuf);
+		_mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(p + 12), _mm256_extracti128_si256(v, 1));
+	}
+
+	row_to_bgr24_scalar(dst + 3 * (size_t)x, src + x, count - x);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+typedef void (*bgr_pack_fn)(uint8_t * dst, const uint32_t * src, uint32_t count);
+
+static bgr_pack_fn row_to_bgr24_select(void)
+{
+	enum conv_isa isa = conv_select_isa();
+
+#ifdef IMGLIB_X86_SIMD
+	if (isa == ISA_AVX2)
+		return row_to_bgr24_avx2;
+	if (isa == ISA_SSE2 && __builtin_cpu_supports("ssse3"))
+		return row_to_bgr24_ssse3;
+#endif
+	(void)isa;
+	return row_to_bgr24_scalar;
+}
+
+/* Write out all the buffers in <iov>, resuming after short writes.
+ * The entries of <iov> are consumed in the process. Returns 0 on
+ * success and 1 in case of error. */
+static uint8_t writev_all(int fd, struct iovec * iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static bgr_row_fn bgr24_to_row_select(void)
+{
+	enum conv_isa isa = conv_select_isa();
+
+#ifdef IMGLIB_X86_SIMD
+	if (isa == ISA_AVX2)
+		return bgr24_to_row_avx2;
+	if (isa == ISA_SSE2 && __builtin_cpu_supports("ssse3"))
+		return bgr24_to_row_ssse3;
+#endif
+	(void)isa;
+	return bgr24_to_row_scalar;
+}
+
+/**
+ * @brief Load a BMP image from a file.
+ *
+ * This function loads a 24-bit BMP image from the specified file and returns a pointer to 
+ * an image structure. The image is represented as a 2D array of uint32_t values where 
+ * each entry corresponds to an RGB pixel.
+ *
+ * @param filename The path to the BMP file to be loaded.
+ * @return A pointer to a struct image containing the image data. Returns NULL if the 
+ *         file couldn't be opened or if the file is not a valid 24-bit BMP image.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function 
+ *       to avoid memory leaks.
+ */
+struct image* loadBMP(const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	const BMPHeader * header;
+	const BMPInfoHeader * infoHeader;
+	struct image * img = NULL;
+	const uint8_t * data;
+	uint8_t * copy = NULL;
+	struct stat st;
+	size_t stride;
+	bgr_row_fn row;
+	uint32_t y;
+
+	if (fd == -1) return NULL;
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(BMPHeader) + sizeof(BMPInfoHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Map the whole file. If that is not possible, e.g. because it
+	 * is not a regular file, fall back to a single bulk read. */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (data == MAP_FAILED) {
+		ssize_t done = 0, n = 0;
+
+		copy = (uint8_t *)malloc(st.st_size);
+		while (copy && done < st.st_size &&
+		       (n = read(fd, copy + done, st.st_size - done)) > 0)
+			done += n;
+
+		if (!copy || done < st.st_size) {
+			free(copy);
+			close(fd);
+			return NULL;
+		}
+		data = copy;
+	}
+	close(fd);
+
+	header = (const BMPHeader *)data;
+	infoHeader = (const BMPInfoHeader *)(data + sizeof(BMPHeader));
+	stride = ((size_t)infoHeader->width * 3 + 3) & ~(size_t)3;
+
+	if (header->type != 0x4D42 || infoHeader->bits != 24 ||
+	    header->offset > (size_t)st.st_size ||
+	    stride * infoHeader->height > (size_t)st.st_size - header->offset) {
+		goto out;
+	}
+
+	//printf("IMG: %d x %d x %d\n", infoHeader->width, infoHeader->height, infoHeader->bits);
+	img = createImageUninit(infoHeader->width, infoHeader->height);
+	if (!img)
+		goto out;
+
+	/* Rows are stored bottom-up, each padded to a multiple of 4
+	 * bytes */
+	row = bgr24_to_row_select();
+	for (y = 0; y < img->height; ++y)
+		row(&pix(img, 0, img->height - 1 - y),
+		    data + header->offset + y * stride, img->width);
+
+out:
+	if (copy)
+		free(copy);
+	else
+		munmap((void *)data, st.st_size);
+	return img;
+}
+
+/**
+ * @brief Save an image to a BMP file.
+ *
+ * This function saves the provided image to a 24-bit BMP file. The image is represented 
+ * as a 2D array of uint32_t values where each entry corresponds to an RGB pixel.
+ *
+ * @param filename The path where the BMP file should be saved.
+ * @param img A pointer to the struct image containing the image data.
+ * @return 0 if the image was saved successfully, 1 otherwise.
+ *
+ * Note: This function overwrites the file if it already exists. Ensure to have necessary 
+ *       backup or checks in place if overwriting is not desired.
+ */
+uint8_t saveBMP(const char* filename, const struct image* img) {
+	/* Create if the file does not exist, overwrite otherwise. Set
+	 * file permissions: 0644 */
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	size_t stride = ((size_t)img->width * 3 + 3) & ~(size_t)3;
+	size_t body = stride * img->height;
+	struct iovec iov[3];
+	bgr_pack_fn row;
+	uint32_t * line = NULL;
+	uint8_t * data;
+	uint8_t err;
+	uint32_t y;
+
+	if (fd == -1) return 1;
+
+	BMPHeader header = { 0x4D42, 54 + body, 0, 0, 54 };
+	BMPInfoHeader infoHeader = { 40, img->width, img->height, 1, 24, 0,
+				     body, 0, 0, 0, 0 };
+
+	/* Encode the whole file body in a buffer from the pixel pool,
+	 * then hand it to the kernel along with the headers in a
+	 * single writev(). */
+	data = (uint8_t *)pool_get(body);
+	if (!data) {
+		close(fd);
+		return 1;
+	}
+
+	/* Rows are stored bottom-up, padded to a multiple of 4 bytes.
+	 * Each row of a tiled or planar image is first put back together. */
+	row = row_to_bgr24_select();
+	if (img->layout != IMG_LAYOUT_LINEAR) {
+		line = (uint32_t *)malloc((size_t)img->width * sizeof(uint32_t));
+		if (!line) {
+			pool_put(data, body);
+			close(fd);
+			return 1;
+		}
+	}
+	for (y = 0; y < img->height; ++y) {
+		uint8_t * dst = data + y * stride;
+		const uint32_t * src = line;
+
+		if (line)
+			copy_row_span(img, 0, img->height - 1 - y, img->width, line, 0);
+		else
+			src = &pix(img, 0, img->height - 1 - y);
+		row(dst, src, img->width);
+		memset(dst + (size_t)img->width * 3, 0, stride - (size_t)img->width * 3);
+	}
+	free(line);
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(BMPHeader);
+	iov[1].iov_base = &infoHeader;
+	iov[1].iov_len = sizeof(BMPInfoHeader);
+	iov[2].iov_base = data;
+	iov[2].iov_len = body;
+	err = writev_all(fd, iov, 3);
+
+	pool_put(data, body);
+	close(fd);
+	return err;
+}
+
+/*******************************************************************************
+* Compressed encoding
+*
+* packImage() codes every channel plane of a row as its difference with
+* the row above, byte by byte modulo 256, so that the smooth parts of
+* an image turn into small residuals. The residuals are zigzag mapped
+* to unsigned bytes (0, -1, 1, -2, ... to 0, 1, 2, 3, ...) and coded in
+* groups of IMZ_GROUP: one byte with the number of bits <w> (0 to 8)
+* of the largest of the group, then the residuals in <w> bits each, 8
+* residuals to every <w> bytes, least significant first. That is what
+* PEXT makes of 8 bytes of <w>-bit values, and PDEP turns them back,
+* so that the AVX2 flavours below code and decode a whole group with
+* a few instructions, while the scalar ones produce the same bytes.
+* Rows are padded to a whole number of groups with zeros. Only the
+* row above is used as a predictor: every byte of a row can be decoded
+* on its own, which a prediction from the left would not allow.
+*
+* The unused top byte of the pixel values is not kept, as in the
+* planar layout. All the rows are coded in x-y order, whatever the
+* layout of the image.
+*******************************************************************************/
+
+#define IMZ_GROUP 32
+#define IMZ_SLACK 8 /* The coders write 8 bytes at a time */
+
+/* Groups needed for a row of <width> pixels */
+#define IMZ_GROUPS(width) (((size_t)(width) + IMZ_GROUP - 1) / IMZ_GROUP)
+
+typedef uint8_t * (*imz_code_fn)(uint8_t * out, const uint8_t * cur, const uint8_t * prev,
+				 size_t groups);
+typedef const uint8_t * (*imz_decode_fn)(uint8_t * cur, const uint8_t * prev,
+					 const uint8_t * in, const uint8_t * end,
+					 size_t groups);
+
+static inline uint8_t imz_zigzag(uint8_t cur, uint8_t prev)
+{
+	int8_t r = (int8_t)(cur - prev);
+
+	return (uint8_t)((uint8_t)r << 1) ^ (uint8_t)(r >> 7);
+}
+
+static inline uint8_t imz_unzigzag(uint8_t z)
+{
+	return (z >> 1) ^ (uint8_t)-(z & 1);
+}
 
-	do {
-		for (x = 0; x < infoHeader.width; x++) {
-			unsigned char color[3];
-			read(fd, color, sizeof(unsigned char) * 3);
-			pix(img, x, y) = (color[2] << 16) | (color[1] << 8) | color[0];
+/* Bits needed for the largest of the residuals OR-ed into <any> */
+static inline uint32_t imz_width(uint32_t any)
+{
+	return any ? 32 - __builtin_clz(any) : 0;
+}
+
+static uint8_t * imz_code_scalar(uint8_t * out, const uint8_t * cur, const uint8_t * prev,
+				 size_t groups)
+{
+	size_t g;
+
+	for (g = 0; g < groups; ++g, cur += IMZ_GROUP, prev += IMZ_GROUP) {
+		uint8_t z[IMZ_GROUP];
+		uint32_t any = 0, w, i, j;
+
+		for (i = 0; i < IMZ_GROUP; ++i) {
+			z[i] = imz_zigzag(cur[i], prev[i]);
+			any |= z[i];
 		}
-		lseek(fd, padding, SEEK_CUR);
-	} while (y-- > 0); /* The post-increment here is important not
-			    * to miss the last row. */
 
-	close(fd);
-	return img;
+		w = imz_width(any);
+		*out++ = w;
+		for (i = 0; i < IMZ_GROUP && w; i += 8) {
+			uint64_t acc = 0;
+
+			for (j = 0; j < 8; ++j)
+				acc |= (uint64_t)z[i + j] << (j * w);
+			memcpy(out, &acc, sizeof(acc));
+			out += w;
+		}
+	}
+
+	return out;
 }
 
-/**
- * @brief Save an image to a BMP file.
- *
- * This function saves the provided image to a 24-bit BMP file. The image is represented 
- * as a 2D array of uint32_t values where each entry corresponds to an RGB pixel.
- *
- * @param filename The path where the BMP file should be saved.
- * @param img A pointer to the struct image containing the image data.
- * @return 0 if the image was saved successfully, 1 otherwise.
- *
- * Note: This function overwrites the file if it already exists. Ensure to have necessary 
- *       backup or checks in place if overwriting is not desired.
- */
-uint8_t saveBMP(const char* filename, const struct image* img) {
-	/* Create if the file does not exist, overwrite otherwise. Set
-	 * file permissions: 0644 */
-	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
-		      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	uint32_t x, y;
+static const uint8_t * imz_decode_scalar(uint8_t * cur, const uint8_t * prev,
+					 const uint8_t * in, const uint8_t * end,
+					 size_t groups)
+{
+	size_t g;
 
-	if (fd == -1) return 1;
+	for (g = 0; g < groups; ++g, cur += IMZ_GROUP, prev += IMZ_GROUP) {
+		uint32_t w, i, j;
+		uint8_t mask;
 
-	BMPHeader header = { 0x4D42, 54 + img->width * img->height * 3, 0, 0, 54 };
-	BMPInfoHeader infoHeader = { 40, img->width, img->height, 1, 24, 0,
-				     img->width * img->height * 3, 0, 0, 0, 0 };
+		if (in == end || *in > 8 || (size_t)(end - in - 1) < 4 * (size_t)*in)
+			return NULL;
+		w = *in++;
+		mask = (1U << w) - 1;
+
+		for (i = 0; i < IMZ_GROUP; i += 8) {
+			uint64_t acc = 0;
+
+			memcpy(&acc, in, w);
+			in += w;
+			for (j = 0; j < 8; ++j)
+				cur[i + j] = prev[i + j] + imz_unzigzag((acc >> (j * w)) & mask);
+		}
+	}
+
+	return in;
+}
+
+/* Split a row of packed pixels into its three channel planes */
+static void imz_split_scalar(uint8_t * b, uint8_t * g, uint8_t * r, const uint32_t * src,
+			     uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x) {
+		b[x] = src[x];
+		g[x] = src[x] >> 8;
+		r[x] = src[x] >> 16;
+	}
+}
+
+static void imz_merge_scalar(uint32_t * dst, const uint8_t * b, const uint8_t * g,
+			     const uint8_t * r, uint32_t count)
+{
+	uint32_t x;
+
+	for (x = 0; x < count; ++x)
+		dst[x] = b[x] | ((uint32_t)g[x] << 8) | ((uint32_t)r[x] << 16);
+}
+
+#ifdef IMGLIB_X86_SIMD
+
+#define IMZ_TARGET __attribute__((target("avx2,bmi2")))
+
+/* Bit positions of <w>-bit values in each byte of a word */
+static inline uint64_t imz_lanes(uint32_t w)
+{
+	return 0x0101010101010101ULL * ((1U << w) - 1);
+}
+
+static IMZ_TARGET uint8_t * imz_code_avx2(uint8_t * out, const uint8_t * cur,
+					  const uint8_t * prev, size_t groups)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t g;
+
+	for (g = 0; g < groups; ++g, cur += IMZ_GROUP, prev += IMZ_GROUP) {
+		__m256i r = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)cur),
+					    _mm256_loadu_si256((const __m256i *)prev));
+		__m256i z = _mm256_xor_si256(_mm256_add_epi8(r, r), _mm256_cmpgt_epi8(zero, r));
+		__m128i o = _mm_or_si128(_mm256_castsi256_si128(z), _mm256_extracti128_si256(z, 1));
+		uint64_t words[4], any;
+		uint32_t w, i;
+
+		any = (uint64_t)_mm_cvtsi128_si64(o) | (uint64_t)_mm_extract_epi64(o, 1);
+		any |= any >> 32;
+		any |= any >> 16;
+		any |= any >> 8;
+
+		w = imz_width(any & 0xff);
+		*out++ = w;
+		if (!w)
+			continue;
+
+		_mm256_storeu_si256((__m256i *)words, z);
+		for (i = 0; i < 4; ++i) {
+			uint64_t bits = _pext_u64(words[i], imz_lanes(w));
+
+			memcpy(out, &bits, sizeof(bits));
+			out += w;
+		}
+	}
+
+	return out;
+}
+
+static IMZ_TARGET const uint8_t * imz_decode_avx2(uint8_t * cur, const uint8_t * prev,
+						  const uint8_t * in, const uint8_t * end,
+						  size_t groups)
+{
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i low7 = _mm256_set1_epi8(0x7f);
+	size_t g;
+
+	for (g = 0; g < groups; ++g, cur += IMZ_GROUP, prev += IMZ_GROUP) {
+		uint64_t words[4] = { 0, 0, 0, 0 };
+		__m256i z, r;
+		uint32_t w, i;
 
-	write(fd, &header, sizeof(BMPHeader));
-	write(fd, &infoHeader, sizeof(BMPInfoHeader));
+		if (in == end || *in > 8 || (size_t)(end - in - 1) < 4 * (size_t)*in)
+			return NULL;
+		w = *in++;
+
+		for (i = 0; i < 4 && w; ++i) {
+			uint64_t bits = 0;
+
+			/* Whole words, but not beyond the end of the input */
+			memcpy(&bits, in, end - in >= 8 ? 8 : w);
+			words[i] = _pdep_u64(bits, imz_lanes(w));
+			in += w;
+		}
+
+		z = _mm256_loadu_si256((const __m256i *)words);
+		r = _mm256_xor_si256(_mm256_and_si256(_mm256_srli_epi16(z, 1), low7),
+				     _mm256_cmpeq_epi8(_mm256_and_si256(z, one), one));
+		_mm256_storeu_si256((__m256i *)cur,
+				    _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)prev), r));
+	}
+
+	return in;
+}
+
+/* Each 128-bit lane gathers its 4 blue, green and red bytes, and the
+ * lanes are then merged 4 bytes at a time */
+static IMZ_TARGET void imz_split_avx2(uint8_t * b, uint8_t * g, uint8_t * r,
+				      const uint32_t * src, uint32_t count)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+					      0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	uint32_t x;
+
+	for (x = 0; x + 8 <= count; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + x));
+		int64_t b8, g8, r8;
+
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+		b8 = _mm256_extract_epi64(v, 0);
+		g8 = _mm256_extract_epi64(v, 1);
+		r8 = _mm256_extract_epi64(v, 2);
+		memcpy(b + x, &b8, 8);
+		memcpy(g + x, &g8, 8);
+		memcpy(r + x, &r8, 8);
+	}
+
+	imz_split_scalar(b + x, g + x, r + x, src + x, count - x);
+}
+
+static IMZ_TARGET void imz_merge_avx2(uint32_t * dst, const uint8_t * b, const uint8_t * g,
+				      const uint8_t * r, uint32_t count)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 4, 8, -1, 1, 5, 9, -1, 2, 6, 10, -1, 3, 7, 11, -1,
+					      0, 4, 8, -1, 1, 5, 9, -1, 2, 6, 10, -1, 3, 7, 11, -1);
+	const __m256i perm = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	uint32_t x;
+
+	for (x = 0; x + 8 <= count; x += 8) {
+		int64_t b8, g8, r8;
+		__m256i v;
+
+		memcpy(&b8, b + x, 8);
+		memcpy(&g8, g + x, 8);
+		memcpy(&r8, r + x, 8);
+		v = _mm256_permutevar8x32_epi32(_mm256_set_epi64x(0, r8, g8, b8), perm);
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_shuffle_epi8(v, shuf));
+	}
+
+	imz_merge_scalar(dst + x, b + x, g + x, r + x, count - x);
+}
+
+#endif /* IMGLIB_X86_SIMD */
+
+struct imz_kernels {
+	imz_code_fn code;
+	imz_decode_fn decode;
+	void (*split)(uint8_t * b, uint8_t * g, uint8_t * r, const uint32_t * src,
+		      uint32_t count);
+	void (*merge)(uint32_t * dst, const uint8_t * b, const uint8_t * g,
+		      const uint8_t * r, uint32_t count);
+};
+
+static struct imz_kernels imz_select(void)
+{
+	struct imz_kernels k = {
+		imz_code_scalar, imz_decode_scalar, imz_split_scalar, imz_merge_scalar
+	};
+
+#ifdef IMGLIB_X86_SIMD
+	if (conv_select_isa() == ISA_AVX2 && __builtin_cpu_supports("bmi2")) {
+		k.code = imz_code_avx2;
+		k.decode = imz_decode_avx2;
+		k.split = imz_split_avx2;
+		k.merge = imz_merge_avx2;
+	}
+#endif
+	return k;
+}
+
+/* Rows of channel planes for packImage() and unpackImage(): the
+ * current and previous row of each channel, padded to whole groups */
+struct imz_rows {
+	uint32_t * pixels;
+	uint8_t * planes[2][3];
+	size_t stride;
+	void * mem;
+};
+
+static uint8_t imz_rows_init(struct imz_rows * rows, uint32_t width)
+{
+	uint8_t * p;
+	int i, c;
+
+	rows->stride = IMZ_GROUPS(width) * IMZ_GROUP;
+	rows->mem = calloc(1, (size_t)width * sizeof(uint32_t) + 6 * rows->stride);
+	if (!rows->mem)
+		return 1;
+
+	rows->pixels = (uint32_t *)rows->mem;
+	p = (uint8_t *)(rows->pixels + width);
+	for (i = 0; i < 2; ++i)
+		for (c = 0; c < 3; ++c, p += rows->stride)
+			rows->planes[i][c] = p;
+	return 0;
+}
 
-	int padding = (4 - (img->width * 3) % 4) % 4;
+size_t packImageBound(uint32_t width, uint32_t height)
+{
+	return (size_t)height * 3 * IMZ_GROUPS(width) * (1 + IMZ_GROUP) + IMZ_SLACK;
+}
+
+uint8_t packImage(const struct image * img, void * dst, size_t * len)
+{
+	struct imz_kernels k = imz_select();
+	size_t groups = IMZ_GROUPS(img->width);
+	uint8_t * out = (uint8_t *)dst;
+	struct imz_rows rows;
+	uint32_t y;
+	int c;
+
+	if (imz_rows_init(&rows, img->width))
+		return 1;
 
-	/* Start by serializing the last row. */
-	y = img->height - 1;
-	do {
-		for (x = 0; x < img->width; x++) {
-			uint32_t pixel = pix(img, x, y);
-			unsigned char color[3] = { pixel & 0xFF,
-						   (pixel >> 8) & 0xFF,
-						   (pixel >> 16) & 0xFF };
-			write(fd, color, sizeof(unsigned char) * 3);
+	for (y = 0; y < img->height; ++y) {
+		uint8_t ** cur = rows.planes[y & 1];
+		uint8_t ** prev = rows.planes[(y & 1) ^ 1];
+
+		if (img->layout == IMG_LAYOUT_PLANAR) {
+			for (c = 0; c < 3; ++c)
+				memcpy(cur[c], image_plane(img, c) + (size_t)y * img->width,
+				       img->width);
+		} else {
+			copy_row_span(img, 0, y, img->width, rows.pixels, 0);
+			k.split(cur[0], cur[1], cur[2], rows.pixels, img->width);
 		}
-		for (int i = 0; i < padding; i++) {
-			unsigned char pad = 0;
-			write(fd, &pad, 1);
+		for (c = 0; c < 3; ++c)
+			out = k.code(out, cur[c], prev[c], groups);
+	}
+
+	free(rows.mem);
+	*len = out - (uint8_t *)dst;
+	return 0;
+}
+
+uint8_t unpackImage(struct image * img, const void * src, size_t len)
+{
+	struct imz_kernels k = imz_select();
+	size_t groups = IMZ_GROUPS(img->width);
+	const uint8_t * in = (const uint8_t *)src;
+	const uint8_t * end = in + len;
+	struct imz_rows rows;
+	uint32_t y;
+	int c;
+
+	if (imz_rows_init(&rows, img->width))
+		return 1;
+
+	for (y = 0; y < img->height && in; ++y) {
+		uint8_t ** cur = rows.planes[y & 1];
+		uint8_t ** prev = rows.planes[(y & 1) ^ 1];
+
+		for (c = 0; c < 3 && in; ++c)
+			in = k.decode(cur[c], prev[c], in, end, groups);
+		if (!in)
+			break;
+
+		if (img->layout == IMG_LAYOUT_PLANAR) {
+			for (c = 0; c < 3; ++c)
+				memcpy(image_plane(img, c) + (size_t)y * img->width, cur[c],
+				       img->width);
+		} else {
+			k.merge(rows.pixels, cur[0], cur[1], cur[2], img->width);
+			copy_row_span(img, 0, y, img->width, rows.pixels, 1);
 		}
-	} while ( y-- > 0); /* The post-increment here is important
-			    * not to miss the last row. */
+	}
+
+	free(rows.mem);
+	return !in || in != end;
+}
+
+/* Serialize the image header of the wire format */
+static void img_header_pack(char * header, const struct image * img)
+{
+	memcpy(header, "IMG", 3);
+	memcpy(header + 3, &img->width, sizeof(uint32_t));
+	memcpy(header + 7, &img->height, sizeof(uint32_t));
+}
+
+/* Same for the compressed wire format, with <len> bytes of payload */
+static void imz_header_pack(char * header, const struct image * img, uint32_t len)
+{
+	img_header_pack(header, img);
+	header[2] = 'Z';
+	memcpy(header + 11, &len, sizeof(uint32_t));
+}
+
+/* Receive exactly <len> bytes from <sockfd> into <buf>. Returns 0 on
+ * success and 1 on error or if the peer closes the connection. */
+static uint8_t recv_all(int sockfd, char * buf, size_t len)
+{
+	while (len) {
+		ssize_t cur = recv(sockfd, buf, len, MSG_WAITALL);
+		if (cur < 0 && errno == EINTR)
+			continue;
+		if (cur <= 0)
+			return 1;
+		buf += cur;
+		len -= cur;
+	}
 
-	close(fd);
 	return 0;
 }
 
@@ -504,36 +3373,179 @@ uint8_t saveBMP(const char* filename, const struct image* img) {
  * @param sockfd The socket descriptor to send data over.
  * @return 0 on success, 1 on error.
  */
+/* Sends the pieces of an image handed out by readImageRows() */
+struct send_rows_state {
+	int sockfd;
+	uint8_t err;
+};
+
+static void send_rows(void * arg, const void * data, size_t len)
+{
+	struct send_rows_state * st = (struct send_rows_state *)arg;
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	if (!st->err)
+		st->err = writev_all(st->sockfd, &iov, 1);
+}
+
 uint8_t sendImage(struct image* img, int sockfd) {
-    char magic[3] = {'I', 'M', 'G'};
-    size_t to_send = img->width * img->height * sizeof(uint32_t);
-    char * bufptr = (char *)(img->pixels);
+    char header[IMG_HEADER_SIZE];
+    struct iovec iov[2];
 
-    /* Send the magic bytes */
-    if (send(sockfd, magic, 3, 0) != 3) {
-        return 1;
-    }
+    img_header_pack(header, img);
 
-    /* Send the width and height */
-    if (send(sockfd, &(img->width), sizeof(img->width), 0) != sizeof(img->width) ||
-        send(sockfd, &(img->height), sizeof(img->height), 0) != sizeof(img->height)) {
-        return 1;
-    }
+    /* The wire format is in x-y order of packed pixels: the other
+     * layouts are put back together a few rows at a time as they are
+     * sent */
+    if (img->layout != IMG_LAYOUT_LINEAR) {
+	    struct send_rows_state st = { sockfd, 0 };
 
-    /* Send all the pixel data on the socket */
-    while (to_send) {
-	    size_t cur = send(sockfd, bufptr, to_send, 0);
-	    if (cur <= 0) {
+	    send_rows(&st, header, IMG_HEADER_SIZE);
+	    readImageRows(img, send_rows, &st);
+	    if (st.err) {
 		    perror("Unable to send image on socket");
 		    return 1;
 	    }
-	    bufptr += cur;
-	    to_send -= cur;
+	    return 0;
+    }
+
+    /* Header and pixel data leave in a single writev() */
+    iov[0].iov_base = header;
+    iov[0].iov_len = IMG_HEADER_SIZE;
+    iov[1].iov_base = img->pixels;
+    iov[1].iov_len = (size_t)img->width * img->height * sizeof(uint32_t);
+
+    if (writev_all(sockfd, iov, 2)) {
+	    perror("Unable to send image on socket");
+	    return 1;
     }
 
     return 0;
 }
 
+uint8_t sendImagePacked(struct image * img, int sockfd)
+{
+	char header[IMZ_HEADER_SIZE];
+	struct iovec iov[2];
+	size_t len;
+	uint8_t * packed = (uint8_t *)malloc(packImageBound(img->width, img->height));
+	uint8_t err;
+
+	if (!packed || packImage(img, packed, &len) || len > UINT32_MAX) {
+		free(packed);
+		return 1;
+	}
+
+	imz_header_pack(header, img, len);
+	iov[0].iov_base = header;
+	iov[0].iov_len = IMZ_HEADER_SIZE;
+	iov[1].iov_base = packed;
+	iov[1].iov_len = len;
+
+	err = writev_all(sockfd, iov, 2);
+	if (err)
+		perror("Unable to send image on socket");
+	free(packed);
+	return err;
+}
+
+/* Turn on MSG_ZEROCOPY support on <sockfd>. Returns 0 on success and 1
+ * if the kernel does not support it. */
+uint8_t enableZeroCopy(int sockfd) {
+	int one = 1;
+
+	return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0;
+}
+
+/* Same as sendImage(), but the pixels are sent with MSG_ZEROCOPY: the
+ * kernel transmits straight from the image buffer, which must not be
+ * modified or released until zeroCopyDone() reports that the sends up
+ * to the sequence number stored in <seq> have completed. Calls on the
+ * same socket must be serialized. If the kernel runs out of pinned
+ * memory the remainder is sent with a regular copy. */
+uint8_t sendImageZeroCopy(struct image* img, int sockfd, struct zerocopy_state * zc,
+			  uint32_t * seq) {
+	char header[IMG_HEADER_SIZE];
+	size_t to_send = (size_t)img->width * img->height * sizeof(uint32_t);
+	char * bufptr = (char *)(img->pixels);
+	int flags = MSG_ZEROCOPY;
+
+	/* The pixels of the other layouts are reordered into a temporary
+	 * buffer anyway: there is nothing to gain from zerocopy */
+	if (img->layout != IMG_LAYOUT_LINEAR) {
+		*seq = zc->next_seq;
+		return sendImage(img, sockfd);
+	}
+
+	img_header_pack(header, img);
+
+	/* Copying the header is cheaper than pinning it */
+	if (send(sockfd, header, IMG_HEADER_SIZE, MSG_MORE) != IMG_HEADER_SIZE) {
+		return 1;
+	}
+
+	while (to_send) {
+		ssize_t cur = send(sockfd, bufptr, to_send, flags);
+		if (cur < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS && flags) {
+				flags = 0;
+				continue;
+			}
+			perror("Unable to send image on socket");
+			return 1;
+		}
+		/* Every successful zerocopy send gets a sequence number */
+		if (flags)
+			zc->next_seq++;
+		bufptr += cur;
+		to_send -= cur;
+	}
+
+	*seq = zc->next_seq;
+	return 0;
+}
+
+/* Collect the completion notifications of zerocopy sends on <sockfd>
+ * and return 1 if all the sends before sequence number <seq> are
+ * complete, 0 otherwise. Does not block. Calls on the same state must
+ * be serialized. */
+uint8_t zeroCopyDone(int sockfd, struct zerocopy_state * zc, uint32_t seq) {
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+	struct msghdr msg;
+	struct cmsghdr * cm;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err * serr;
+
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+
+			/* Sends [ee_info, ee_data] have completed, in order */
+			if ((int32_t)(serr->ee_data + 1 - zc->completed) > 0)
+				zc->completed = serr->ee_data + 1;
+		}
+	}
+
+	return (int32_t)(zc->completed - seq) >= 0;
+}
+
 /**
  * recvImage - Deserialize and receive an image structure over a given socket.
  *
@@ -548,38 +3560,384 @@ uint8_t sendImage(struct image* img, int sockfd) {
  * @return a valid image pointer on success, NULL on error.
  */
 struct image * recvImage(int sockfd) {
-	char magic[3];
+	return recvImageStream(sockfd, NULL, NULL);
+}
+
+/* Size of the pieces handed to the consumer of recvImageStream() */
+#define RECV_STREAM_CHUNK (256 * 1024)
+
+/* Receive the rest of an image in the compressed wire format into
+ * <img>, whose size is known. Returns 1 on error. */
+static uint8_t recv_packed(int sockfd, struct image * img, img_stream_fn consume, void * arg)
+{
+	uint32_t len;
+	char * packed;
+	uint8_t err;
+
+	if (recv_all(sockfd, (char *)&len, sizeof(len)) ||
+	    len > packImageBound(img->width, img->height))
+		return 1;
+
+	packed = (char *)malloc(len ? len : 1);
+	if (!packed)
+		return 1;
+	err = recv_all(sockfd, packed, len) || unpackImage(img, packed, len);
+	free(packed);
+
+	if (!err && consume)
+		consume(arg, img->pixels, (size_t)img->width * img->height * sizeof(uint32_t));
+	return err;
+}
+
+struct image * recvImageStream(int sockfd, img_stream_fn consume, void * arg)
+{
+	char header[IMG_HEADER_SIZE];
 	size_t to_recv;
 	char * bufptr;
 	uint32_t width, height;
 	struct image * img = NULL;
+	int packed;
 
-	/* Receive the magic bytes */
-	if (recv(sockfd, magic, 3, 0) != 3 || strncmp(magic, "IMG", 3) != 0) {
+	/* Receive the magic bytes, width and height in one go, however
+	 * the stream happens to be segmented */
+	if (recv_all(sockfd, header, IMG_HEADER_SIZE)) {
+		return NULL;
+	}
+	packed = !strncmp(header, "IMZ", 3);
+	if (!packed && strncmp(header, "IMG", 3) != 0) {
 		return NULL;
 	}
+	memcpy(&width, header + 3, sizeof(uint32_t));
+	memcpy(&height, header + 7, sizeof(uint32_t));
 
-	/* Receive the width and height */
-	if (recv(sockfd, &(width), sizeof(uint32_t), 0) != sizeof(uint32_t) ||
-	    recv(sockfd, &(height), sizeof(uint32_t), 0) != sizeof(uint32_t)) {
+	/* Every pixel is about to be received: no need to clear them */
+	img = createImageUninit(width, height);
+	if (!img) {
 		return NULL;
 	}
 
-	/* Create a new image to fill up */
-	img = createImage(width, height);
-	to_recv = img->width * img->height * sizeof(uint32_t);
+	if (packed) {
+		if (recv_packed(sockfd, img, consume, arg)) {
+			deleteImage(img);
+			return NULL;
+		}
+		return img;
+	}
+	to_recv = (size_t)img->width * img->height * sizeof(uint32_t);
 	bufptr = (char *)(img->pixels);
 
 	/* Receive all the pixel bytes on the socket */
-	while(to_recv) {
-		size_t cur = recv(sockfd, bufptr, to_recv, 0);
-		if (cur <= 0) {
+	if (!consume) {
+		if (recv_all(sockfd, bufptr, to_recv)) {
 			deleteImage(img);
 			return NULL;
 		}
-		bufptr += cur;
-		to_recv -= cur;
+		return img;
+	}
+
+	/* One piece at a time, so that the consumer works on a piece
+	 * while the kernel is already queueing up the next one */
+	while (to_recv) {
+		size_t len = to_recv < RECV_STREAM_CHUNK ? to_recv : RECV_STREAM_CHUNK;
+
+		if (recv_all(sockfd, bufptr, len)) {
+			deleteImage(img);
+			return NULL;
+		}
+		consume(arg, bufptr, len);
+		bufptr += len;
+		to_recv -= len;
 	}
 
 	return img;
 }
+
+/* Most bytes moved by one call of recvImageSome() */
+#define XFER_RECV_BUDGET (1024 * 1024)
+
+/* Most bytes sent by one call of sendImageSome(), in fewer and larger
+ * steps than the receives, which the pinning of zerocopy favours */
+#define XFER_SEND_BUDGET (256 * 1024)
+
+/* Rows of a non-linear image put back together at a time for
+ * sendImageSome(), in bytes */
+#define XFER_STAGE_BYTES (64 * 1024)
+
+void recvImageBegin(struct img_xfer * xfer)
+{
+	memset(xfer, 0, sizeof(struct img_xfer));
+	xfer->receiving = 1;
+	xfer->header_len = IMG_HEADER_SIZE;
+}
+
+size_t recvImageTarget(struct img_xfer * xfer, void ** buf)
+{
+	if (xfer->done < xfer->header_len) {
+		*buf = xfer->header + xfer->done;
+		return xfer->header_len - xfer->done;
+	}
+	if (xfer->packed) {
+		*buf = xfer->packed + (xfer->done - xfer->header_len);
+		return xfer->total - xfer->done;
+	}
+	*buf = (char *)xfer->img->pixels + (xfer->done - xfer->header_len);
+	return xfer->total - xfer->done;
+}
+
+/* Take in the header of the image received by <xfer>, once it is all
+ * there. Returns 1 if it is malformed or if out of memory. */
+static uint8_t xfer_recv_header(struct img_xfer * xfer)
+{
+	uint32_t width, height, len;
+
+	if (xfer->header_len == IMG_HEADER_SIZE && !strncmp(xfer->header, "IMZ", 3)) {
+		/* The length of the payload comes next */
+		xfer->header_len = IMZ_HEADER_SIZE;
+		return 0;
+	}
+	if (xfer->header_len == IMG_HEADER_SIZE && strncmp(xfer->header, "IMG", 3) != 0)
+		return 1;
+	memcpy(&width, xfer->header + 3, sizeof(uint32_t));
+	memcpy(&height, xfer->header + 7, sizeof(uint32_t));
+
+	if (xfer->header_len == IMZ_HEADER_SIZE) {
+		memcpy(&len, xfer->header + 11, sizeof(uint32_t));
+		if (len > packImageBound(width, height))
+			return 1;
+		xfer->packed = (uint8_t *)malloc(len ? len : 1);
+		if (!xfer->packed)
+			return 1;
+		xfer->packed_len = len;
+	}
+
+	/* Every pixel is about to be received or decoded */
+	xfer->img = createImageUninit(width, height);
+	if (!xfer->img)
+		return 1;
+	xfer->total = xfer->header_len + (xfer->packed ? xfer->packed_len
+					  : (size_t)width * height * sizeof(uint32_t));
+	return 0;
+}
+
+enum img_xfer_status recvImageAdvance(struct img_xfer * xfer, size_t len,
+				      img_stream_fn consume, void * arg)
+{
+	if (xfer->done >= xfer->header_len && !xfer->packed && consume && len)
+		consume(arg, (char *)xfer->img->pixels + (xfer->done - xfer->header_len), len);
+	xfer->done += len;
+
+	/* The size of the payload is known once the header is in */
+	if (xfer->done == xfer->header_len && !xfer->total && xfer_recv_header(xfer))
+		return IMG_XFER_ERROR;
+
+	if (!xfer->total || xfer->done < xfer->total)
+		return IMG_XFER_AGAIN;
+
+	/* A compressed payload is decoded once it is all in */
+	if (xfer->packed) {
+		struct image * img = xfer->img;
+
+		if (unpackImage(img, xfer->packed, xfer->packed_len)) {
+			deleteImage(img);
+			xfer->img = NULL;
+			return IMG_XFER_ERROR;
+		}
+		if (consume)
+			consume(arg, img->pixels, (size_t)img->width * img->height * sizeof(uint32_t));
+	}
+	return IMG_XFER_DONE;
+}
+
+enum img_xfer_status recvImageSome(int sockfd, struct img_xfer * xfer,
+				   img_stream_fn consume, void * arg)
+{
+	size_t budget = XFER_RECV_BUDGET;
+	enum img_xfer_status status = IMG_XFER_AGAIN;
+
+	while (status == IMG_XFER_AGAIN && budget) {
+		void * buf;
+		size_t len = recvImageTarget(xfer, &buf);
+		ssize_t cur;
+
+		if (len > budget)
+			len = budget;
+
+		cur = recv(sockfd, buf, len, MSG_DONTWAIT);
+		if (cur < 0 && errno == EINTR)
+			continue;
+		if (cur < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return IMG_XFER_AGAIN;
+		if (cur <= 0)
+			return IMG_XFER_ERROR;
+
+		budget -= cur;
+		status = recvImageAdvance(xfer, cur, consume, arg);
+	}
+
+	return status;
+}
+
+void sendImageBegin(struct img_xfer * xfer, struct image * img)
+{
+	memset(xfer, 0, sizeof(struct img_xfer));
+	xfer->img = img;
+	xfer->zerocopy = (img->layout == IMG_LAYOUT_LINEAR);
+	xfer->header_len = IMG_HEADER_SIZE;
+	xfer->total = IMG_HEADER_SIZE + (size_t)img->width * img->height * sizeof(uint32_t);
+	img_header_pack(xfer->header, img);
+}
+
+void sendImageBeginPacked(struct img_xfer * xfer, struct image * img,
+			  const void * packed, size_t len)
+{
+	memset(xfer, 0, sizeof(struct img_xfer));
+	xfer->img = img;
+	xfer->zerocopy = 1;
+	xfer->header_len = IMZ_HEADER_SIZE;
+	xfer->packed = (uint8_t *)packed;
+	xfer->packed_len = len;
+	xfer->total = IMZ_HEADER_SIZE + len;
+	imz_header_pack(xfer->header, img, len);
+}
+
+/* Put back together the rows of a non-linear image that hold byte
+ * <offset> of the pixel payload. Returns 1 if out of memory. */
+static uint8_t xfer_stage(struct img_xfer * xfer, size_t offset)
+{
+	const struct image * img = xfer->img;
+	size_t row_bytes = (size_t)img->width * sizeof(uint32_t);
+	uint32_t rows = XFER_STAGE_BYTES / row_bytes;
+	uint32_t y = offset / row_bytes;
+
+	if (!rows)
+		rows = 1;
+	if (!xfer->stage) {
+		xfer->stage = (uint32_t *)malloc(rows * row_bytes);
+		if (!xfer->stage)
+			return 1;
+	}
+	if (rows > img->height - y)
+		rows = img->height - y;
+
+	readImageBlock(img, 0, y, img->width, rows, xfer->stage, img->width);
+	xfer->stage_start = (size_t)y * row_bytes;
+	xfer->stage_len = rows * row_bytes;
+	return 0;
+}
+
+int sendImageTarget(struct img_xfer * xfer, struct iovec * iov)
+{
+	const struct image * img = xfer->img;
+	size_t payload = xfer->total - xfer->header_len;
+	size_t offset = 0;
+	int iovcnt = 0;
+
+	if (xfer->done < xfer->header_len) {
+		iov[0].iov_base = xfer->header + xfer->done;
+		iov[0].iov_len = xfer->header_len - xfer->done;
+		iovcnt = 1;
+	} else {
+		offset = xfer->done - xfer->header_len;
+	}
+
+	if (offset == payload) {
+		/* Nothing but the header, if anything */
+	} else if (xfer->packed) {
+		iov[iovcnt].iov_base = xfer->packed + offset;
+		iov[iovcnt].iov_len = payload - offset;
+		++iovcnt;
+	} else if (img->layout == IMG_LAYOUT_LINEAR) {
+		iov[iovcnt].iov_base = (char *)img->pixels + offset;
+		iov[iovcnt].iov_len = payload - offset;
+		++iovcnt;
+	} else {
+		if (offset < xfer->stage_start ||
+		    offset >= xfer->stage_start + xfer->stage_len) {
+			if (xfer_stage(xfer, offset))
+				return -1;
+		}
+		iov[iovcnt].iov_base = (char *)xfer->stage + (offset - xfer->stage_start);
+		iov[iovcnt].iov_len = xfer->stage_start + xfer->stage_len - offset;
+		++iovcnt;
+	}
+
+	return iovcnt;
+}
+
+enum img_xfer_status sendImageAdvance(struct img_xfer * xfer, size_t len)
+{
+	xfer->done += len;
+	return xfer->done == xfer->total ? IMG_XFER_DONE : IMG_XFER_AGAIN;
+}
+
+enum img_xfer_status sendImageSome(int sockfd, struct img_xfer * xfer,
+				   struct zerocopy_state * zc)
+{
+	size_t budget = XFER_SEND_BUDGET;
+
+	while (xfer->done < xfer->total) {
+		struct iovec iov[2];
+		struct msghdr msg;
+		int iovcnt, flags = MSG_DONTWAIT;
+		ssize_t cur;
+
+		iovcnt = sendImageTarget(xfer, iov);
+		if (iovcnt < 0)
+			return IMG_XFER_ERROR;
+
+		/* Copying the header is cheaper than pinning it, and the
+		 * header buffer does not outlive the transfer */
+		if (zc && xfer->zerocopy) {
+			if (xfer->done < xfer->header_len) {
+				if (iovcnt == 2)
+					flags |= MSG_MORE;
+				iovcnt = 1;
+			} else {
+				flags |= MSG_ZEROCOPY;
+			}
+		}
+
+		if (!budget)
+			return IMG_XFER_AGAIN;
+		if (iov[iovcnt - 1].iov_len > budget)
+			iov[iovcnt - 1].iov_len = budget;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		cur = sendmsg(sockfd, &msg, flags);
+		if (cur < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return IMG_XFER_AGAIN;
+			/* Out of pinned memory: copy the rest */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				xfer->zerocopy = 0;
+				continue;
+			}
+			return IMG_XFER_ERROR;
+		}
+
+		/* Every successful zerocopy send gets a sequence number */
+		if (flags & MSG_ZEROCOPY)
+			zc->next_seq++;
+		sendImageAdvance(xfer, cur);
+		budget -= (size_t)cur < budget ? (size_t)cur : budget;
+	}
+
+	if (zc)
+		xfer->seq = zc->next_seq;
+	return IMG_XFER_DONE;
+}
+
+void endImageXfer(struct img_xfer * xfer)
+{
+	if (xfer->receiving && (!xfer->total || xfer->done < xfer->total))
+		deleteImage(xfer->img);
+	if (xfer->receiving)
+		free(xfer->packed);
+	free(xfer->stage);
+	memset(xfer, 0, sizeof(struct img_xfer));
+}
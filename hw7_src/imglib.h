@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -35,10 +36,48 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+/* How the pixels of an image are arranged in memory */
+enum img_layout {
+	IMG_LAYOUT_LINEAR = 0, /* Row after row, in x-y order */
+	IMG_LAYOUT_TILED,      /* Square tiles of IMG_TILE x IMG_TILE pixels */
+	IMG_LAYOUT_PLANAR      /* One 8-bit plane per channel, see below */
+};
+
+/* Side of the tiles of IMG_LAYOUT_TILED, in pixels. The tiles are
+ * stored one after the other in x-y order of the tile grid, and the
+ * pixels of each tile in x-y order. The last row and column of tiles
+ * are padded to full tiles. */
+#define IMG_TILE_BITS 6
+#define IMG_TILE (1U << IMG_TILE_BITS)
+
+/* IMG_LAYOUT_PLANAR stores the blue, green and red channels (bits
+ * 0-7, 8-15 and 16-23 of a pixel value) as three consecutive planes
+ * of width x height bytes, each in x-y order. The unused top byte of
+ * the pixel values is not kept, which saves a quarter of the memory. */
+
 struct image {
 	uint32_t width; /* The width of the image */
 	uint32_t height; /* The height of the image */
-	uint32_t * pixels; /* Array of pixel values in x-y order */
+	uint32_t * pixels; /* Array of pixel values, see <layout> */
+	uint32_t refs; /* References held on the image, see retainImage() */
+	uint32_t layout; /* One of enum img_layout */
+};
+
+/* Callback that receives the pixels of an image in pieces */
+typedef void (*img_stream_fn)(void * arg, const void * data, size_t len);
+
+/* Filters that can be computed one band of rows at a time, see
+ * filterImageRows() */
+enum img_filter {
+	FILTER_ROT90CLKW,
+	FILTER_BLUR,
+	FILTER_SHARPEN,
+	FILTER_VERTEDGES,
+	FILTER_HORIZEDGES,
+	FILTER_GAUSSBLUR,
+	FILTER_EMBOSS,
+	FILTER_SOBEL,
+	FILTER_ROT180   /* Two FILTER_ROT90CLKW, in one pass */
 };
 
 #pragma pack(push, 1)  // Ensure structure is packed
@@ -69,9 +108,77 @@ typedef struct {
  * <width>x<height> pixels. */
 struct image * createImage(uint32_t width, uint32_t height);
 
-/* Deallocate all the memory for a given image. */
+/* Same as createImage(), but the pixels are left uninitialized. The
+ * pixel buffer comes from a pool of recycled, 64-byte aligned
+ * buffers. Returns NULL on allocation failure. */
+struct image * createImageUninit(uint32_t width, uint32_t height);
+
+/* Same as createImageUninit(), with the pixels arranged in <layout> */
+struct image * createImageUninitLayout(uint32_t width, uint32_t height,
+				       enum img_layout layout);
+
+/* Most NUMA nodes that the pool keeps buffers apart for */
+#define IMG_POOL_MAX_NODES 8
+
+/* Keep the idle buffers of the pool apart per NUMA node, for nodes 0
+ * to <nodes> - 1 as the kernel numbers them, with <cpu_node[c]> the
+ * node of CPU c, for <cpus> CPUs, or -1. Nodes beyond the first
+ * IMG_POOL_MAX_NODES share lists. The table must outlive the pool.
+ * Must be set before any image is created, and only once. */
+void setPoolNodes(const int * cpu_node, size_t cpus, int nodes);
+
+/* Pixel buffers within the <len> bytes at <base> are not the pool's:
+ * deleteImage() leaves them alone rather than recycling them. Meant
+ * for a file of images mapped in memory, see createImageOver(). Must
+ * be set before any image is created over the range, and only once. */
+void setForeignPixels(const void * base, size_t len);
+
+/* An image of the given size and layout over the pixels at <pixels>,
+ * imageBytes() of them, instead of a buffer of the pool. The buffer
+ * must be within the range of setForeignPixels() and outlive all the
+ * images over it. Returns NULL on allocation failure. */
+struct image * createImageOver(uint32_t width, uint32_t height, enum img_layout layout,
+			       void * pixels);
+
+/* Size of the pixel buffer of <img>, in bytes, which depends on its
+ * layout */
+size_t imageBytes(const struct image * img);
+
+/* Rearrange the pixels of <img> in <layout>, replacing its pixel
+ * buffer. All the functions of this library accept images in either
+ * layout and return images in the layout of their input, which can
+ * thus be chosen once, when an image is created or received. Returns
+ * 0 on success and 1 in case of error. */
+uint8_t convertImageLayout(struct image * img, enum img_layout layout);
+
+/* Copy the <bw>x<bh> block of <img> whose top-left corner is at
+ * (<x0>,<y0>) into <dst>, in x-y order with rows <stride> pixels
+ * apart. The block may extend past the edges of the image, in which
+ * case the pixels outside are set to 0: this is meant to gather a tile
+ * together with the halo of its neighbours that a filter reads. */
+void readImageBlock(const struct image * img, int64_t x0, int64_t y0,
+		    uint32_t bw, uint32_t bh, uint32_t * dst, size_t stride);
+
+/* Call <consume> on the pixels of <img> in x-y order, whatever its
+ * layout, in one or more pieces of whole rows. */
+void readImageRows(const struct image * img, img_stream_fn consume, void * arg);
+
+/* Returns 0 if <a> and <b> have the same size and pixels, whatever
+ * their layout, and 1 otherwise. */
+uint8_t compareImages(const struct image * a, const struct image * b);
+
+/* Deallocate all the memory for a given image. The pixel buffer is
+ * recycled for later images of a similar size. */
 void deleteImage(struct image * img);
 
+/* Take one more reference on <img> and return it. A new image starts
+ * with one reference. Safe to call from any thread. */
+struct image * retainImage(struct image * img);
+
+/* Drop a reference on <img>, deleting it with deleteImage() when the
+ * last one goes away. Safe to call from any thread. */
+void releaseImage(struct image * img);
+
 /* Set a specific pixel at position (<x>,<y>) in the image <img> to a
  * specific <value>. The function returns 0 if the operation is
  * successful and 1 in case of error. */
@@ -98,6 +205,18 @@ uint32_t getPixel(const struct image * img, uint32_t x, uint32_t y, uint8_t * er
 */
 struct image * cloneImage(const struct image * src, uint8_t * err);
 
+/* Largest downscale factor of regionImage() */
+#define IMG_REGION_SCALE_MAX 64
+
+/* Creates a new image with the <width>x<height> rectangle of <img>
+ * whose top-left corner is at (<x>,<y>), shrunk <scale> times in each
+ * direction: every pixel of the result is the average of a <scale> x
+ * <scale> block, or of what is left of one at the right and bottom
+ * edges. A <scale> of 1 only crops. The rectangle must be within the
+ * image. Returns NULL in case of error. */
+struct image * regionImage(const struct image * img, uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height, uint32_t scale);
+
 /* Creates a new image by rotating the input image by 90 degreees
  * clockwise. NOTE: the original image must be manually deallocated if
  * not needed. If successful, the function returns a pointer to the
@@ -109,6 +228,13 @@ struct image * cloneImage(const struct image * src, uint8_t * err);
 */
 struct image * rotate90Clockwise(const struct image * img, uint8_t * err);
 
+/* Rotates the input image by 90 degrees clockwise, replacing its
+ * content. Square images are rotated in place without allocating a
+ * second buffer; for other images the pixel buffer of <img> is
+ * replaced with a newly allocated one. The function returns 0 on
+ * success and 1 in case of error. */
+uint8_t rotate90ClockwiseInPlace(struct image * img);
+
 /**
  * @brief Blur an image using a 3x3 averaging kernel.
  *
@@ -170,6 +296,133 @@ struct image* detectVerticalEdges(const struct image* img);
  */
 struct image* detectHorizontalEdges(const struct image* img);
 
+/**
+ * @brief Blur an image using a 5x5 Gaussian kernel.
+ *
+ * This function applies the 5x5 binomial approximation of a Gaussian kernel
+ * (outer product of [1 4 6 4 1], normalized by 256) to each pixel in the image.
+ * The two outermost rows and columns are copied over unchanged.
+ *
+ * @param img The original image to be blurred.
+ * @return A new image structure containing the blurred image. The original image remains
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* gaussianBlurImage(const struct image* img);
+
+/**
+ * @brief Emboss an image using a 3x3 directional kernel.
+ *
+ * This function applies a 3x3 emboss kernel to each pixel in the image, which
+ * highlights intensity changes along the top-left to bottom-right diagonal. Edge
+ * pixels are copied over unchanged.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the embossed image. The original image remains
+ *         unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* embossImage(const struct image* img);
+
+/**
+ * @brief Compute the Sobel gradient magnitude of an image in a single pass.
+ *
+ * This function computes both the vertical and the horizontal Sobel responses from
+ * a single load of each 3x3 neighbourhood and combines them, per channel, into the
+ * gradient magnitude approximated as |Gx| + |Gy| and clipped to [0, 255]. Edge
+ * pixels are set to black.
+ *
+ * @param img The original image.
+ * @return A new image structure containing the gradient magnitude. The original image
+ *         remains unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* detectEdges(const struct image* img);
+
+/**
+ * @brief Compute the vertical and horizontal Sobel responses in a single pass.
+ *
+ * This function produces, from a single load of each 3x3 neighbourhood, the same
+ * two images that detectVerticalEdges() and detectHorizontalEdges() would return.
+ *
+ * @param img The original image.
+ * @param vert Filled with the vertical edges image. May be NULL if not needed.
+ * @param horiz Filled with the horizontal edges image. May be NULL if not needed.
+ * @return 0 on success, 1 on error.
+ *
+ * Note: The returned image structures should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+uint8_t detectEdgesSplit(const struct image* img, struct image** vert, struct image** horiz);
+
+/**
+ * @brief Allocate the output image of a filter.
+ *
+ * This function allocates an image of the right geometry to hold the result of
+ * <filter> applied to <img>, to be filled with filterImageRows().
+ *
+ * @param img The original image.
+ * @param filter The filter that will be applied.
+ * @return The newly allocated image, or NULL on error.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* createFilterOutput(const struct image* img, enum img_filter filter);
+
+/**
+ * @brief Compute one band of rows of a filter.
+ *
+ * This function applies <filter> to the source rows [y0, y1) of <img> and writes
+ * the corresponding output pixels into <out>, which must have been obtained from
+ * createFilterOutput(). For all filters but the rotations these are the same rows of
+ * the output; the rotation by 90 degrees writes them as the output columns [y0, y1),
+ * and the one by 180 degrees as the rows [height - y1, height - y0). Disjoint
+ * bands write disjoint pixels of <out> and only read <img>, so they can be computed
+ * by different threads at the same time. Running the bands that cover
+ * [0, img->height) gives the same result as the whole-image function.
+ *
+ * @param img The original image.
+ * @param out The output image.
+ * @param filter The filter to apply.
+ * @param y0 The first source row of the band.
+ * @param y1 One past the last source row of the band.
+ * @return 0 on success, 1 on error.
+ */
+uint8_t filterImageRows(const struct image* img, struct image* out,
+			enum img_filter filter, uint32_t y0, uint32_t y1);
+
+/* Longest chain of filters accepted by filterImagePipeline() */
+#define IMG_PIPELINE_MAX 5
+
+/**
+ * @brief Apply a chain of filters to an image.
+ *
+ * This function applies <filters>[0], then <filters>[1] to its result, and so on,
+ * and returns the final image. Rather than one new image per filter, the chain
+ * only allocates two buffers that the stages write to in turns, and consecutive
+ * convolutions are computed tile by tile so that their intermediate results stay
+ * in cache. The result is the same as that of the whole-image functions applied
+ * one after the other.
+ *
+ * @param img The original image.
+ * @param filters The filters to apply, in order.
+ * @param count The number of filters, between 1 and IMG_PIPELINE_MAX.
+ * @return A new image structure containing the result, or NULL on error. The original
+ *         image remains unchanged.
+ *
+ * Note: The returned image structure should be freed using the deleteImage function
+ *       to avoid memory leaks.
+ */
+struct image* filterImagePipeline(const struct image* img, const enum img_filter* filters,
+				  size_t count);
+
 /**
  * @brief Load a BMP image from a file.
  *
@@ -218,6 +471,50 @@ uint8_t saveBMP(const char* filename, const struct image* img);
  */
 uint8_t sendImage(struct image* img, int sockfd);
 
+/* Per-socket bookkeeping of MSG_ZEROCOPY sends, see sendImageZeroCopy() */
+struct zerocopy_state {
+	uint32_t next_seq;  /* Sequence number of the next zerocopy send */
+	uint32_t completed; /* All the sends before this one have completed */
+};
+
+/**
+ * enableZeroCopy - Turn on MSG_ZEROCOPY support on a socket.
+ *
+ * @param sockfd The socket descriptor.
+ * @return 0 on success, 1 if zerocopy sends are not supported.
+ */
+uint8_t enableZeroCopy(int sockfd);
+
+/**
+ * sendImageZeroCopy - Send an image like sendImage(), without copying the pixels.
+ *
+ * The pixel data is transmitted by the kernel straight from the image buffer, which
+ * must not be modified nor released until zeroCopyDone() returns 1 for the sequence
+ * number stored in <seq>. Calls on the same socket must be serialized.
+ *
+ * @param img Pointer to the image structure to be sent.
+ * @param sockfd The socket descriptor to send data over, see enableZeroCopy().
+ * @param zc The zerocopy bookkeeping of the socket, initially all zeros.
+ * @param seq Filled with the sequence number to wait for.
+ * @return 0 on success, 1 on error.
+ */
+uint8_t sendImageZeroCopy(struct image* img, int sockfd, struct zerocopy_state * zc,
+			  uint32_t * seq);
+
+/**
+ * zeroCopyDone - Check whether zerocopy sends have completed.
+ *
+ * This function collects the pending completion notifications of the socket without
+ * blocking. The socket reports POLLERR when new notifications are available. Calls
+ * on the same state must be serialized.
+ *
+ * @param sockfd The socket descriptor.
+ * @param zc The zerocopy bookkeeping of the socket.
+ * @param seq A sequence number returned by sendImageZeroCopy().
+ * @return 1 if all the sends up to <seq> have completed, 0 otherwise.
+ */
+uint8_t zeroCopyDone(int sockfd, struct zerocopy_state * zc, uint32_t seq);
+
 /**
  * recvImage - Deserialize and receive an image structure over a given socket.
  *
@@ -233,5 +530,132 @@ uint8_t sendImage(struct image* img, int sockfd);
  */
 struct image * recvImage(int sockfd);
 
+/* Same as recvImage(), but <consume> (if not NULL) is called on each
+ * piece of the pixel payload, in order, as soon as it is received.
+ * Meant to compute a hash of the pixels while the rest is in flight. */
+struct image * recvImageStream(int sockfd, img_stream_fn consume, void * arg);
+
+/* Size of the header of the wire format: "IMG", width, height */
+#define IMG_HEADER_SIZE 11
+
+/**
+ * packImage - Encode the pixels of an image losslessly in fewer bytes.
+ *
+ * The pixels are coded row by row in x-y order, whatever the layout of <img>, as
+ * bit-packed differences with the row above, channel by channel. The unused top
+ * byte of the pixel values is not kept. <dst> must have room for
+ * packImageBound(img->width, img->height) bytes, which is always less than the
+ * pixels take in any layout; the actual size is returned in <len>.
+ *
+ * @return 0 on success, 1 if out of memory.
+ */
+size_t packImageBound(uint32_t width, uint32_t height);
+uint8_t packImage(const struct image * img, void * dst, size_t * len);
+
+/**
+ * unpackImage - Decode the <len> bytes at <src> made by packImage().
+ *
+ * <img> must already have the size of the packed image, in any layout, and all
+ * of its pixels are overwritten.
+ *
+ * @return 0 on success, 1 if the bytes are not a packed image of that size or
+ *         if out of memory.
+ */
+uint8_t unpackImage(struct image * img, const void * src, size_t len);
+
+/* The compressed wire format: "IMZ", width, height, the number of bytes
+ * of the packed pixels that follow, and the output of packImage().
+ * Every receive of this library accepts either format. */
+#define IMZ_HEADER_SIZE 15
+
+/**
+ * sendImagePacked - Send an image like sendImage(), in the compressed wire format.
+ *
+ * @return 0 on success, 1 on error.
+ */
+uint8_t sendImagePacked(struct image * img, int sockfd);
+
+/* Progress of the transfer of one image on a nonblocking socket, see
+ * recvImageSome() and sendImageSome(). All the fields are private. */
+struct img_xfer {
+	struct image * img;
+	char header[IMZ_HEADER_SIZE];
+	uint8_t header_len; /* Of the format of the image */
+	uint8_t receiving;
+	uint8_t zerocopy;   /* Pixels still sent with MSG_ZEROCOPY */
+	size_t done;        /* Bytes transferred so far, header included */
+	size_t total;       /* Bytes of the whole transfer, 0 if not known yet */
+	uint32_t * stage;   /* Rows of a non-linear image, in wire order */
+	size_t stage_start; /* Offset of <stage> in the pixel payload */
+	size_t stage_len;   /* Valid bytes in <stage> */
+	uint32_t seq;       /* Sequence number to wait for, see zeroCopyDone() */
+	uint8_t * packed;   /* Payload in the compressed format, if so */
+	size_t packed_len;
+};
+
+/* Outcome of recvImageSome() and sendImageSome() */
+enum img_xfer_status {
+	IMG_XFER_DONE,  /* The whole image has been transferred */
+	IMG_XFER_AGAIN, /* Call again when the socket is ready */
+	IMG_XFER_ERROR  /* Socket error, malformed header or end of stream */
+};
+
+/**
+ * recvImageBegin / recvImageSome - Receive an image without blocking.
+ *
+ * recvImageBegin() prepares <xfer> for a new image. Each call to recvImageSome()
+ * then receives whatever is available on <sockfd>, up to a bounded amount so that
+ * one large image does not hold up the other sockets of an event loop, and calls
+ * <consume> (if not NULL) on the new pieces of the pixel payload, in order. Once it
+ * returns IMG_XFER_DONE the image is in xfer->img and belongs to the caller. After
+ * an IMG_XFER_ERROR, or to give up early, call endImageXfer(). An image in the
+ * compressed format reaches <consume> all at once, when it has been decoded.
+ */
+void recvImageBegin(struct img_xfer * xfer);
+enum img_xfer_status recvImageSome(int sockfd, struct img_xfer * xfer,
+				   img_stream_fn consume, void * arg);
+
+/* The same one step at a time, for callers that do the receiving
+ * themselves, e.g. through io_uring: recvImageTarget() tells where the
+ * next bytes go and how many are expected, and recvImageAdvance()
+ * accounts for <len> bytes received there. recvImageAdvance() returns
+ * like recvImageSome(), but never reads from a socket. */
+size_t recvImageTarget(struct img_xfer * xfer, void ** buf);
+enum img_xfer_status recvImageAdvance(struct img_xfer * xfer, size_t len,
+				      img_stream_fn consume, void * arg);
+
+/**
+ * sendImageBegin / sendImageSome - Send an image without blocking.
+ *
+ * Same wire format as sendImage(). sendImageBegin() prepares <xfer> to send <img>,
+ * which must stay unchanged until the transfer is over. Each call to sendImageSome()
+ * sends as much as the socket accepts, up to a bounded amount like recvImageSome(),
+ * and returns IMG_XFER_AGAIN if there is more. If <zc> is not NULL the pixels of a linear
+ * image go with MSG_ZEROCOPY, and once the transfer is done xfer->seq is the
+ * sequence number to pass to zeroCopyDone() before <img> can be changed or released.
+ * endImageXfer() must be called in any case at the end.
+ */
+void sendImageBegin(struct img_xfer * xfer, struct image * img);
+
+/* Same as sendImageBegin(), but in the compressed wire format, with the
+ * <len> bytes at <packed> made by packImage() from <img>. The bytes go
+ * out with MSG_ZEROCOPY like the pixels of a linear image, and must
+ * stay unchanged as long as those would. */
+void sendImageBeginPacked(struct img_xfer * xfer, struct image * img,
+			  const void * packed, size_t len);
+enum img_xfer_status sendImageSome(int sockfd, struct img_xfer * xfer,
+				   struct zerocopy_state * zc);
+
+/* The same one step at a time: sendImageTarget() fills <iov> (room for
+ * two entries) with the next bytes to send and returns the number of
+ * entries, or -1 if out of memory, and sendImageAdvance() accounts for
+ * <len> of them sent. Never uses zerocopy. */
+int sendImageTarget(struct img_xfer * xfer, struct iovec * iov);
+enum img_xfer_status sendImageAdvance(struct img_xfer * xfer, size_t len);
+
+/* Release the resources of <xfer>, including the image of an unfinished
+ * receive */
+void endImageXfer(struct img_xfer * xfer);
+
 /* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
 #endif
@@ -0,0 +1,1708 @@
+/*******************************************************************************
+* Open-Loop Load Generator
+*
+* Description:
+*     Drives the image server with requests that arrive at a given rate
+*     whatever the server does, over many connections and from several
+*     threads, and reports the percentiles of the response times. Each
+*     connection is a Poisson stream of requests, at an equal share of
+*     the total arrival rate, on the images that were registered before
+*     the start.
+*
+* Usage:
+*     <build directory>/loadgen [-a <arrival rate>] [-n <nr. of requests>]
+*                               [-d <seconds>] [-c <connections>]
+*                               [-t <threads>] [-I <images folder>]
+*                               [-m <op mix>] [-k] [-S] [-r <seed>]
+*                               [-R <trace> [-x <speed>]] [-Z]
+*                               [-D <deadline_ms>] <port number>
+*
+*     e.g. ./build/loadgen -a 20000 -d 10 -c 32 -t 4 -I ../images \
+*               -m BLUR=2,SHARPEN=1,RETRIEVE=1 2222
+*          ./build/loadgen -R server.log -x 2 -c 8 -I ../images 2222
+*
+* Parameters:
+*     -a  - Total arrival rate, in requests per second (default 100)
+*     -n  - Requests to send over all the connections (default 1000)
+*     -d  - Send for this many seconds, and without -n for as many
+*           requests as arrive meanwhile
+*     -c  - Connections to the server (default 1)
+*     -t  - Threads sharing the connections (default 1)
+*     -I  - Register the BMP images of this folder, instead of a few
+*           random ones
+*     -m  - Weights of the operations, as comma-separated OP=weight
+*           pairs with the names of the opcodes (default: every filter
+*           and IMG_RETRIEVE, evenly). IMG_PIPELINE chains 2 to
+*           IMG_PIPELINE_MAX random filters, IMG_RETRIEVE_REGION asks
+*           for a random rectangle shrunk 1, 2, 4 or 8 times,
+*           IMG_REGISTER sends one of the images again.
+*     -k  - Keep the registered images: the operations create new
+*           images instead of overwriting them
+*     -S  - Spin on the TSC between arrivals instead of sleeping on a
+*           timerfd
+*     -r  - Seed of the random numbers (default 1)
+*     -R  - Replay the requests of a trace of the server instead, either
+*           its text output or a binary trace of -T, with the same times
+*           between arrivals, operations and images. -a, -n, -m and -k
+*           do not apply.
+*     -x  - Speed of the replay: 2 sends the requests twice as fast as
+*           they were traced (default 1)
+*     -Z  - Register the images in the compressed wire format, and ask
+*           the server for the images it sends back in that format too
+*     -D  - Give every request a deadline of this many milliseconds from
+*           the time it was meant to be sent (see REQ_FRAME_DEADLINE),
+*           and count the responses within it as the goodput
+*
+* Notes:
+*     The time of a response is taken from the time at which its request
+*     was meant to be sent, not from when it actually was: a client that
+*     falls behind shows up in the percentiles, and separately in the
+*     send lag, rather than hiding the delays it caused. The arrivals
+*     are kept in a hashed timer wheel per thread, with a tick of
+*     WHEEL_TICK_NS: all the requests due within a tick leave together,
+*     in a single send() per connection. A connection has up to
+*     PENDING_WINDOW requests in flight, and any arrival beyond that is
+*     dropped and counted. Responses that have not arrived DRAIN_NS
+*     after the last request was sent are counted as lost.
+*
+*     A replay maps the images of the trace to those of this server as
+*     it goes: the images that already existed when the trace starts
+*     are stood for by the registered ones, and a request on an image
+*     that a request of the trace made waits for the response with its
+*     new ID. All the requests on images that derive from one another
+*     are sent on the same connection. The stages of a pipeline and the
+*     rectangles of the regions are not traced: the stages are drawn at
+*     random, and the regions are whole images at a random scale.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "histo.h"
+#include "trace.h"
+
+#define USAGE_STRING							\
+	"Usage: %s [-a <arrival rate>] [-n <nr. of requests>] [-d <seconds>] "	\
+	"[-c <connections>] [-t <threads>] [-I <images folder>] "	\
+	"[-m <op mix>] [-k] [-S] [-r <seed>] [-R <trace> [-x <speed>]] [-Z] "	\
+	"[-D <deadline_ms>] <port number>\n"
+
+#define OPCODE_COUNT (sizeof(__opcode_strings) / sizeof(__opcode_strings[0]))
+
+#define DEFAULT_REQUESTS 1000
+
+/* Random images registered without -I */
+#define SYNTH_IMAGES 4
+#define SYNTH_SIDE   256
+
+/* Granularity of the timer wheel, and number of its slots: arrivals up
+ * to WHEEL_SLOTS ticks ahead (about 10 ms) take a single visit */
+#define WHEEL_TICK_NS 10000
+#define WHEEL_BITS    10
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+
+/* IDs of the images of a replayed trace, up to this many */
+#define REPLAY_MAX_IDS (1ULL << 26)
+#define REPLAY_UNMAPPED UINT64_MAX
+#define REPLAY_NONE     UINT64_MAX
+
+/* Requests in flight on a connection, a power of two */
+#define PENDING_WINDOW 8192
+
+/* How long to wait for the last responses */
+#define DRAIN_NS (5ULL * NANO_IN_SEC)
+
+/* Delay between the setup and the first arrivals, for all the threads
+ * to be up by then */
+#define START_DELAY_NS (20 * 1000 * 1000)
+
+#define RX_BUF_SIZE (64 * 1024)
+#define MAX_EVENTS  64
+
+/* An image as registered, and its wire format for IMG_REGISTER */
+struct lg_image {
+	struct image * img;
+	uint64_t server_id;
+	char * wire;
+	size_t wire_len;
+};
+
+/* A request in flight */
+struct pending {
+	uint64_t req_id;
+	nstime_t due;      /* When it was meant to be sent */
+	uint64_t produces; /* Image of the trace it makes, or REPLAY_NONE */
+	uint64_t fallback; /* Server image that stands for it on a failure */
+	uint8_t busy;
+	uint8_t op;
+};
+
+struct lg_thread;
+
+struct lg_conn {
+	int fd;
+	int dead;
+	struct lg_thread * thread;
+
+	/* Next arrival, in the timer wheel of the thread */
+	struct lg_conn * wheel_next;
+	nstime_t due;
+	uint64_t left;     /* Arrivals still to come */
+	nstime_t stop_ns;  /* No arrival from this time on */
+	uint64_t next_id;
+
+	struct pending * pending;
+	uint64_t outstanding;
+
+	/* Requests of the trace for this connection, as indices into
+	 * <replay>, and the image of the trace that the next one waits for
+	 * if <held> */
+	size_t * script;
+	size_t script_len, script_pos;
+	int held;
+	uint64_t awaiting;
+
+	/* Bytes to send, from tx_head to tx_tail */
+	char * tx_buf;
+	size_t tx_head, tx_tail, tx_cap;
+	int tx_dirty;      /* In the list of connections to flush */
+	int tx_waiting;    /* Waiting for EPOLLOUT */
+	struct lg_conn * dirty_next;
+
+	/* Bytes received and not parsed yet, and the image that follows
+	 * the response to a retrieve */
+	char * rx_buf;
+	size_t rx_len;
+	int rx_image;
+	struct pending rx_pending;
+	struct img_xfer rx_xfer;
+};
+
+struct wheel {
+	struct lg_conn * slots[WHEEL_SLOTS];
+	uint64_t busy[WHEEL_SLOTS / 64]; /* Slots with any entry */
+	uint64_t tick;                   /* The first tick not visited yet */
+	size_t count;
+};
+
+struct lg_stats {
+	struct histo resp[OPCODE_COUNT]; /* From the intended send time */
+	uint64_t rejected[OPCODE_COUNT];
+	struct histo lag;                /* Actual minus intended send time */
+	uint64_t sent, completed, dropped, lost, failed;
+	uint64_t expired;                /* Dropped by the server, see -D */
+	uint64_t on_time;                /* Completed within the deadline */
+	nstime_t last_ns;                /* Time of the last response */
+};
+
+struct lg_thread {
+	pthread_t tid;
+	int id;
+	int epoll_fd;
+	int timer_fd;
+	nstime_t timer_armed;
+	struct lg_conn ** conns;
+	size_t count;
+	struct lg_conn * dirty;
+	size_t held;       /* Connections waiting for an image of the trace */
+	struct wheel wheel;
+	uint64_t rng;
+	struct lg_stats stats;
+};
+
+/* The setup, shared read-only by the threads */
+struct lg_image * images;
+size_t image_count;
+uint32_t op_weights[OPCODE_COUNT];
+uint32_t op_total;
+double conn_rate;   /* Arrivals per second and per connection */
+nstime_t start_ns;
+uint8_t overwrite = 1;
+int spin;
+int compress;       /* Images in the compressed format both ways, see -Z */
+nstime_t deadline_ns; /* Of every request, 0 for none, see -D */
+
+/* A request of the trace being replayed */
+struct replay_rec {
+	nstime_t at;          /* Since the first request of the trace */
+	uint64_t seq;         /* Position in the trace file */
+	uint64_t img_id;
+	uint64_t out_img_id;
+	uint8_t op;
+	uint8_t overwrite;
+	uint8_t produces;     /* <out_img_id> is a new image */
+};
+
+/* The trace of -R, in the order of the requests. The images of the
+ * trace are known by their IDs on the traced server, and mapped to
+ * the IDs on this one as the requests that make them complete: each
+ * entry of <replay_map> is only used by the connection that replays
+ * the requests on that image. */
+struct replay_rec * replay;
+size_t replay_count;
+double replay_speed = 1;
+uint64_t * replay_map;
+uint8_t * replay_made;  /* Made by a request of the trace */
+uint64_t replay_ids;
+
+/* xorshift64*: a fast generator that is plenty for the arrivals */
+static uint64_t rng_next(uint64_t * state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in [0, 1) */
+static double rng_uniform(uint64_t * state)
+{
+	return (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+/* Time to the next arrival of a connection */
+static nstime_t next_interarrival(uint64_t * state)
+{
+	return double_to_ns(-log(1.0 - rng_uniform(state)) / conn_rate);
+}
+
+/* Add <conn> to the slot of its next arrival. Arrivals that are already
+ * due go in the first tick not visited yet. */
+static void wheel_add(struct wheel * w, struct lg_conn * conn)
+{
+	uint64_t tick = conn->due / WHEEL_TICK_NS;
+	size_t slot;
+
+	if (tick < w->tick) {
+		tick = w->tick;
+	}
+	slot = tick & (WHEEL_SLOTS - 1);
+	conn->wheel_next = w->slots[slot];
+	w->slots[slot] = conn;
+	w->busy[slot / 64] |= 1ULL << (slot % 64);
+	w->count++;
+}
+
+/* The first tick from w->tick on whose slot has an entry, which may be
+ * due on a later turn of the wheel. UINT64_MAX if the wheel is empty. */
+static uint64_t wheel_next_busy(const struct wheel * w)
+{
+	size_t start = w->tick & (WHEEL_SLOTS - 1);
+	size_t i;
+
+	if (!w->count) {
+		return UINT64_MAX;
+	}
+
+	for (i = 0; i <= WHEEL_SLOTS / 64; ++i) {
+		size_t word = (start / 64 + i) % (WHEEL_SLOTS / 64);
+		uint64_t bits = w->busy[word];
+		size_t slot;
+
+		/* Only the bits from <start> on, the first time around */
+		if (i == 0) {
+			bits &= ~0ULL << (start % 64);
+		}
+		if (!bits) {
+			continue;
+		}
+		slot = word * 64 + __builtin_ctzll(bits);
+		return w->tick + ((slot - start) & (WHEEL_SLOTS - 1));
+	}
+
+	return UINT64_MAX;
+}
+
+static void issue_requests(struct lg_conn * conn, nstime_t now);
+static int conn_scheduled(const struct lg_conn * conn);
+
+/* Visit all the ticks that are over at <now>: every arrival that was
+ * due by then is sent, and the next one of its connection scheduled */
+static void wheel_run(struct wheel * w, nstime_t now)
+{
+	uint64_t last = now / WHEEL_TICK_NS;
+
+	for (;;) {
+		uint64_t tick = wheel_next_busy(w);
+		struct lg_conn * conn, * next;
+		size_t slot;
+
+		if (tick >= last) {
+			break;
+		}
+
+		slot = tick & (WHEEL_SLOTS - 1);
+		conn = w->slots[slot];
+		w->slots[slot] = NULL;
+		w->busy[slot / 64] &= ~(1ULL << (slot % 64));
+		w->tick = tick;
+
+		for (; conn; conn = next) {
+			next = conn->wheel_next;
+			w->count--;
+
+			/* On a later turn of the wheel */
+			if (conn->due / WHEEL_TICK_NS > tick) {
+				wheel_add(w, conn);
+				continue;
+			}
+
+			/* Sends all that is due by <now>, so the next
+			 * arrival is in a later tick */
+			issue_requests(conn, now);
+			if (conn_scheduled(conn)) {
+				wheel_add(w, conn);
+			}
+		}
+		w->tick = tick + 1;
+	}
+
+	if (w->tick < last) {
+		w->tick = last;
+	}
+}
+
+static int tx_reserve(struct lg_conn * conn, size_t len)
+{
+	if (conn->tx_tail + len <= conn->tx_cap) {
+		return 0;
+	}
+
+	/* Make room at the front first */
+	if (conn->tx_head) {
+		memmove(conn->tx_buf, conn->tx_buf + conn->tx_head,
+			conn->tx_tail - conn->tx_head);
+		conn->tx_tail -= conn->tx_head;
+		conn->tx_head = 0;
+	}
+	if (conn->tx_tail + len > conn->tx_cap) {
+		size_t cap = conn->tx_cap ? conn->tx_cap : 4096;
+		char * buf;
+
+		while (conn->tx_tail + len > cap) {
+			cap *= 2;
+		}
+		buf = (char *)realloc(conn->tx_buf, cap);
+		if (!buf) {
+			return 1;
+		}
+		conn->tx_buf = buf;
+		conn->tx_cap = cap;
+	}
+
+	return 0;
+}
+
+static void tx_append(struct lg_conn * conn, const void * data, size_t len)
+{
+	memcpy(conn->tx_buf + conn->tx_tail, data, len);
+	conn->tx_tail += len;
+}
+
+static void conn_fail(struct lg_conn * conn, const char * what)
+{
+	if (!conn->dead) {
+		ERROR_INFO();
+		if (errno) {
+			perror(what);
+		} else {
+			fprintf(stderr, "%s\n", what);
+		}
+		conn->dead = 1;
+		conn->thread->stats.failed++;
+	}
+}
+
+/* Fill in the stages of an IMG_PIPELINE with random filters */
+static void random_pipeline(struct request * req, uint64_t * rng)
+{
+	uint8_t i;
+
+	req->pipeline_len = 2 + rng_next(rng) % (IMG_PIPELINE_MAX - 1);
+	for (i = 0; i < req->pipeline_len; ++i) {
+		req->pipeline[i] = IMG_ROT90CLKW + rng_next(rng) % (IMG_SOBEL - IMG_ROT90CLKW + 1);
+		if (req->pipeline[i] == IMG_RETRIEVE) {
+			req->pipeline[i] = IMG_BLUR;
+		}
+	}
+}
+
+/* Fill in a random rectangle of <target>, or the whole image if NULL,
+ * at a random scale. The rectangle fits in the smaller side of the
+ * image, so it stays valid whichever way the image gets rotated. */
+static void random_region(struct img_region * region, const struct lg_image * target,
+			  uint64_t * rng)
+{
+	memset(region, 0, sizeof(*region));
+	region->scale = 1 << (rng_next(rng) % 4);
+	if (target) {
+		uint32_t side = target->img->width < target->img->height ?
+			target->img->width : target->img->height;
+		uint32_t w = 1 + rng_next(rng) % side, h = 1 + rng_next(rng) % side;
+
+		region->x = htole32(rng_next(rng) % (side - w + 1));
+		region->y = htole32(rng_next(rng) % (side - h + 1));
+		region->width = htole32(w);
+		region->height = htole32(h);
+	}
+}
+
+/* Server ID of the image <trace_id> of the trace being replayed, or
+ * REPLAY_UNMAPPED if the request that makes it has not completed yet.
+ * The images that are already there when the trace starts stand for
+ * the registered ones. */
+static uint64_t replay_lookup(uint64_t trace_id)
+{
+	if (trace_id >= replay_ids) {
+		return images[trace_id % image_count].server_id;
+	}
+	if (replay_map[trace_id] == REPLAY_UNMAPPED && !replay_made[trace_id]) {
+		replay_map[trace_id] = images[trace_id % image_count].server_id;
+	}
+	return replay_map[trace_id];
+}
+
+static void replay_resolve(struct lg_conn * conn, uint64_t trace_id, uint64_t server_id,
+			   nstime_t now);
+
+/* Queue <req>, followed by the image <payload> or the rectangle
+ * <region> if not NULL, on <conn> to be sent at the next flush.
+ * <produces> is the image of the trace that the request makes, if any,
+ * and <fallback> the server image that stands for it if the request
+ * fails. */
+static void queue_request(struct lg_conn * conn, struct request * req,
+			  const struct lg_image * payload, const struct img_region * region,
+			  uint64_t produces, uint64_t fallback, nstime_t now)
+{
+	struct lg_thread * thread = conn->thread;
+	struct pending * slot;
+	size_t len = sizeof(*req) + (payload ? payload->wire_len : 0) +
+		(region ? sizeof(*region) : 0) + (deadline_ns ? sizeof(uint32_t) : 0);
+
+	slot = &conn->pending[conn->next_id & (PENDING_WINDOW - 1)];
+	if (slot->busy) {
+		thread->stats.dropped++;
+		if (produces != REPLAY_NONE) {
+			replay_resolve(conn, produces, fallback, now);
+		}
+		return;
+	}
+
+	if (tx_reserve(conn, len)) {
+		conn_fail(conn, "Unable to allocate the send buffer");
+		return;
+	}
+
+	req->req_id = conn->next_id;
+	req->req_timestamp = ns_to_timespec(now);
+	tx_append(conn, req, sizeof(*req));
+	if (deadline_ns) {
+		/* What is left of it, once late to leave */
+		nstime_t lag = now - conn->due;
+		uint32_t timeout_us = htole32(lag < deadline_ns ? (deadline_ns - lag + 999) / 1000 : 1);
+
+		tx_append(conn, &timeout_us, sizeof(timeout_us));
+	}
+	if (payload) {
+		tx_append(conn, payload->wire, payload->wire_len);
+	}
+	if (region) {
+		tx_append(conn, region, sizeof(*region));
+	}
+
+	slot->req_id = conn->next_id;
+	slot->due = conn->due;
+	slot->produces = produces;
+	slot->fallback = fallback;
+	slot->op = req->img_op;
+	slot->busy = 1;
+	conn->outstanding++;
+	conn->next_id++;
+
+	histo_record(&thread->stats.lag, now - conn->due);
+	thread->stats.sent++;
+
+	if (!conn->tx_dirty) {
+		conn->tx_dirty = 1;
+		conn->dirty_next = thread->dirty;
+		thread->dirty = conn;
+	}
+}
+
+/* Queue the request of one random arrival on <conn> */
+static void issue_one(struct lg_conn * conn, nstime_t now)
+{
+	struct lg_thread * thread = conn->thread;
+	struct request req;
+	struct img_region region;
+	struct lg_image * target;
+	uint32_t pick;
+	uint8_t op;
+
+	pick = rng_next(&thread->rng) % op_total;
+	for (op = 0; pick >= op_weights[op]; ++op) {
+		pick -= op_weights[op];
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.img_op = op;
+	req.overwrite = overwrite;
+	target = &images[rng_next(&thread->rng) % image_count];
+
+	if (op == IMG_PIPELINE) {
+		random_pipeline(&req, &thread->rng);
+	}
+
+	if (op == IMG_RETRIEVE_REGION) {
+		random_region(&region, target, &thread->rng);
+	}
+
+	if (op == IMG_REGISTER) {
+		queue_request(conn, &req, target, NULL, REPLAY_NONE, 0, now);
+	} else {
+		req.img_id = target->server_id;
+		queue_request(conn, &req, NULL, op == IMG_RETRIEVE_REGION ? &region : NULL,
+			      REPLAY_NONE, 0, now);
+	}
+}
+
+/* Queue the next request of the trace on <conn>. Returns 0, and holds
+ * the connection, if the image it works on has not been made yet. */
+static int issue_replay(struct lg_conn * conn, nstime_t now)
+{
+	const struct replay_rec * rec = &replay[conn->script[conn->script_pos]];
+	struct img_region region;
+	struct request req;
+
+	memset(&req, 0, sizeof(req));
+	req.img_op = rec->op;
+	req.overwrite = rec->overwrite;
+
+	if (rec->op == IMG_REGISTER) {
+		const struct lg_image * payload = &images[rec->out_img_id % image_count];
+
+		queue_request(conn, &req, payload, NULL, rec->out_img_id, payload->server_id, now);
+	} else {
+		req.img_id = replay_lookup(rec->img_id);
+		if (req.img_id == REPLAY_UNMAPPED) {
+			conn->held = 1;
+			conn->awaiting = rec->img_id;
+			conn->thread->held++;
+			return 0;
+		}
+		if (rec->op == IMG_PIPELINE) {
+			random_pipeline(&req, &conn->thread->rng);
+		}
+		if (rec->op == IMG_RETRIEVE_REGION) {
+			random_region(&region, NULL, &conn->thread->rng);
+		}
+		queue_request(conn, &req, NULL, rec->op == IMG_RETRIEVE_REGION ? &region : NULL,
+			      rec->produces ? rec->out_img_id : REPLAY_NONE, req.img_id, now);
+	}
+
+	conn->script_pos++;
+	return 1;
+}
+
+/* Intended send time of the next request of the trace on <conn> */
+static nstime_t replay_due(const struct lg_conn * conn)
+{
+	if (conn->script_pos == conn->script_len) {
+		return conn->due;
+	}
+	return start_ns + (nstime_t)(replay[conn->script[conn->script_pos]].at / replay_speed);
+}
+
+/* Every arrival of <conn> due by <now>, late ones included */
+static void issue_requests(struct lg_conn * conn, nstime_t now)
+{
+	while (conn->left && conn->due <= now && conn->due < conn->stop_ns && !conn->dead) {
+		if (replay) {
+			if (!issue_replay(conn, now)) {
+				return;
+			}
+			conn->left--;
+			conn->due = replay_due(conn);
+		} else {
+			issue_one(conn, now);
+			conn->left--;
+			conn->due += next_interarrival(&conn->thread->rng);
+		}
+	}
+}
+
+/* Whether <conn> has arrivals left to schedule */
+static int conn_scheduled(const struct lg_conn * conn)
+{
+	return conn->left && !conn->held && conn->due < conn->stop_ns && !conn->dead;
+}
+
+/* The image <trace_id> of the trace is now <server_id>: send the
+ * request of <conn> that was waiting for it, if any */
+static void replay_resolve(struct lg_conn * conn, uint64_t trace_id, uint64_t server_id,
+			   nstime_t now)
+{
+	replay_map[trace_id] = server_id;
+	if (!conn->held || conn->awaiting != trace_id) {
+		return;
+	}
+
+	conn->held = 0;
+	conn->thread->held--;
+	issue_requests(conn, now);
+	if (conn_scheduled(conn)) {
+		wheel_add(&conn->thread->wheel, conn);
+	}
+}
+
+static void conn_watch_tx(struct lg_conn * conn, int waiting)
+{
+	struct epoll_event ev;
+
+	if (conn->tx_waiting == waiting) {
+		return;
+	}
+	ev.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+	epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->tx_waiting = waiting;
+}
+
+/* Send what the socket takes of the queued bytes of <conn> */
+static void conn_flush(struct lg_conn * conn)
+{
+	while (conn->tx_head < conn->tx_tail && !conn->dead) {
+		ssize_t sent = send(conn->fd, conn->tx_buf + conn->tx_head,
+				    conn->tx_tail - conn->tx_head, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn_watch_tx(conn, 1);
+				return;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			conn_fail(conn, "Unable to send requests");
+			return;
+		}
+		conn->tx_head += sent;
+	}
+
+	conn->tx_head = conn->tx_tail = 0;
+	conn_watch_tx(conn, 0);
+}
+
+/* Account for the response to <p>, now complete */
+static void complete_pending(struct lg_conn * conn, const struct pending * p,
+			     uint8_t ack, uint64_t img_id, nstime_t now)
+{
+	struct lg_stats * stats = &conn->thread->stats;
+
+	if (p->produces != REPLAY_NONE) {
+		replay_resolve(conn, p->produces, ack == RESP_COMPLETED ? img_id : p->fallback, now);
+	}
+
+	if (ack == RESP_COMPLETED) {
+		histo_record(&stats->resp[p->op], now - p->due);
+		if (now - p->due <= deadline_ns) {
+			stats->on_time++;
+		}
+	} else if (ack == RESP_EXPIRED) {
+		stats->expired++;
+	} else {
+		stats->rejected[p->op]++;
+	}
+	stats->completed++;
+	stats->last_ns = now;
+	conn->outstanding--;
+}
+
+/* Parse the responses in the receive buffer of <conn>, and any image
+ * payload that follows. Returns the number of bytes consumed. */
+static size_t conn_parse(struct lg_conn * conn, nstime_t now)
+{
+	size_t pos = 0;
+
+	while (!conn->dead) {
+		size_t avail = conn->rx_len - pos;
+
+		if (conn->rx_image) {
+			enum img_xfer_status status;
+			void * buf;
+			size_t len;
+
+			if (!avail) {
+				break;
+			}
+			len = recvImageTarget(&conn->rx_xfer, &buf);
+			if (len > avail) {
+				len = avail;
+			}
+			memcpy(buf, conn->rx_buf + pos, len);
+			pos += len;
+			status = recvImageAdvance(&conn->rx_xfer, len, NULL, NULL);
+			if (status == IMG_XFER_ERROR) {
+				errno = 0;
+				conn_fail(conn, "Malformed image from the server");
+			} else if (status == IMG_XFER_DONE) {
+				deleteImage(conn->rx_xfer.img);
+				endImageXfer(&conn->rx_xfer);
+				conn->rx_image = 0;
+				complete_pending(conn, &conn->rx_pending, RESP_COMPLETED, 0, now);
+			}
+		} else {
+			struct response resp;
+			struct pending * slot;
+
+			if (avail < sizeof(resp)) {
+				break;
+			}
+			memcpy(&resp, conn->rx_buf + pos, sizeof(resp));
+			pos += sizeof(resp);
+
+			slot = &conn->pending[resp.req_id & (PENDING_WINDOW - 1)];
+			if (!slot->busy || slot->req_id != resp.req_id) {
+				errno = 0;
+				conn_fail(conn, "Response to an unknown request");
+				break;
+			}
+			slot->busy = 0;
+
+			if ((slot->op == IMG_RETRIEVE || slot->op == IMG_RETRIEVE_REGION) &&
+			    resp.ack == RESP_COMPLETED) {
+				conn->rx_pending = *slot;
+				recvImageBegin(&conn->rx_xfer);
+				conn->rx_image = 1;
+			} else {
+				complete_pending(conn, slot, resp.ack, resp.img_id, now);
+			}
+		}
+	}
+
+	return pos;
+}
+
+/* Receive and parse whatever is available on <conn> */
+static void conn_receive(struct lg_conn * conn)
+{
+	while (!conn->dead) {
+		ssize_t len;
+
+		/* Large payloads go straight to the image */
+		if (conn->rx_image && !conn->rx_len) {
+			enum img_xfer_status status;
+			void * buf;
+			size_t want = recvImageTarget(&conn->rx_xfer, &buf);
+
+			len = recv(conn->fd, buf, want, MSG_DONTWAIT);
+			if (len > 0) {
+				status = recvImageAdvance(&conn->rx_xfer, len, NULL, NULL);
+				if (status == IMG_XFER_ERROR) {
+					errno = 0;
+					conn_fail(conn, "Malformed image from the server");
+				} else if (status == IMG_XFER_DONE) {
+					deleteImage(conn->rx_xfer.img);
+					endImageXfer(&conn->rx_xfer);
+					conn->rx_image = 0;
+					complete_pending(conn, &conn->rx_pending, RESP_COMPLETED, 0,
+							 tsc_now_ns());
+				}
+				continue;
+			}
+		} else {
+			size_t used;
+
+			len = recv(conn->fd, conn->rx_buf + conn->rx_len,
+				   RX_BUF_SIZE - conn->rx_len, MSG_DONTWAIT);
+			if (len > 0) {
+				conn->rx_len += len;
+				used = conn_parse(conn, tsc_now_ns());
+				memmove(conn->rx_buf, conn->rx_buf + used, conn->rx_len - used);
+				conn->rx_len -= used;
+				continue;
+			}
+		}
+
+		if (len == 0) {
+			errno = 0;
+			conn_fail(conn, "Connection closed by the server");
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			conn_fail(conn, "Unable to receive responses");
+		}
+		return;
+	}
+}
+
+/* Sleep on the timerfd until the end of the next busy tick, unless it
+ * is already set for then */
+static void arm_timer(struct lg_thread * thread, nstime_t when)
+{
+	struct itimerspec its;
+
+	if (thread->timer_armed == when) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value = ns_to_timespec(when);
+	timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	thread->timer_armed = when;
+}
+
+void * thread_main(void * arg)
+{
+	struct lg_thread * thread = (struct lg_thread *)arg;
+	struct epoll_event events[MAX_EVENTS];
+	nstime_t drain_deadline = 0;
+	size_t i;
+
+	for (;;) {
+		nstime_t now = tsc_now_ns();
+		uint64_t outstanding = 0;
+		int count, timeout = -1, live = 0;
+
+		wheel_run(&thread->wheel, now);
+
+		while (thread->dirty) {
+			struct lg_conn * conn = thread->dirty;
+
+			thread->dirty = conn->dirty_next;
+			conn->tx_dirty = 0;
+			conn_flush(conn);
+		}
+
+		for (i = 0; i < thread->count; ++i) {
+			if (!thread->conns[i]->dead) {
+				outstanding += thread->conns[i]->outstanding;
+				live++;
+			}
+		}
+
+		if (!thread->wheel.count && thread->held) {
+			/* Held connections only resume on a response */
+			if (!outstanding || !live) {
+				break;
+			}
+		} else if (!thread->wheel.count) {
+			if (!outstanding || !live) {
+				break;
+			}
+			if (!drain_deadline) {
+				drain_deadline = now + DRAIN_NS;
+			}
+			if (now >= drain_deadline) {
+				thread->stats.lost += outstanding;
+				break;
+			}
+			arm_timer(thread, drain_deadline);
+		} else if (!spin) {
+			arm_timer(thread, (wheel_next_busy(&thread->wheel) + 1) * WHEEL_TICK_NS);
+		}
+		if (spin) {
+			timeout = 0;
+		}
+
+		count = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, timeout);
+		for (i = 0; i < (size_t)(count > 0 ? count : 0); ++i) {
+			struct lg_conn * conn = (struct lg_conn *)events[i].data.ptr;
+
+			if (!conn) {
+				uint64_t expirations;
+
+				if (read(thread->timer_fd, &expirations, sizeof(expirations)) > 0) {
+					thread->timer_armed = 0;
+				}
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				conn_receive(conn);
+			}
+			if (events[i].events & EPOLLOUT) {
+				conn_flush(conn);
+			}
+		}
+	}
+
+	for (i = 0; i < thread->count; ++i) {
+		if (thread->conns[i]->dead) {
+			thread->stats.lost += thread->conns[i]->outstanding;
+		}
+	}
+
+	return NULL;
+}
+
+/* Load the BMP images of <dir>, in the order of their names */
+static size_t load_images(const char * dir)
+{
+	struct dirent ** names;
+	int i, count = scandir(dir, &names, NULL, alphasort);
+
+	if (count < 0) {
+		ERROR_INFO();
+		perror("Unable to open the images folder");
+		return 0;
+	}
+
+	images = (struct lg_image *)calloc(count ? count : 1, sizeof(struct lg_image));
+	for (i = 0; i < count; ++i) {
+		size_t len = strlen(names[i]->d_name);
+		char path[4096];
+
+		if (len > 4 && !strcasecmp(names[i]->d_name + len - 4, ".bmp")) {
+			snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+			images[image_count].img = loadBMP(path);
+			if (images[image_count].img) {
+				image_count++;
+			} else {
+				ERROR_INFO();
+				fprintf(stderr, "Unable to load image %s\n", path);
+			}
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return image_count;
+}
+
+static size_t make_images(uint64_t seed)
+{
+	size_t i, p;
+
+	images = (struct lg_image *)calloc(SYNTH_IMAGES, sizeof(struct lg_image));
+	for (i = 0; i < SYNTH_IMAGES; ++i) {
+		struct image * img = createImage(SYNTH_SIDE, SYNTH_SIDE);
+
+		for (p = 0; p < SYNTH_SIDE * SYNTH_SIDE; ++p) {
+			img->pixels[p] = rng_next(&seed) & 0xffffff;
+		}
+		images[image_count++].img = img;
+	}
+
+	return image_count;
+}
+
+/* Serialize <im> as it goes on the wire after an IMG_REGISTER */
+static int make_wire(struct lg_image * im)
+{
+	struct img_xfer xfer;
+	uint8_t * packed = NULL;
+	size_t pos = 0, len;
+
+	if (compress) {
+		packed = (uint8_t *)malloc(packImageBound(im->img->width, im->img->height));
+		if (!packed || packImage(im->img, packed, &len)) {
+			free(packed);
+			return 1;
+		}
+		sendImageBeginPacked(&xfer, im->img, packed, len);
+	} else {
+		sendImageBegin(&xfer, im->img);
+	}
+	im->wire = (char *)malloc(xfer.total);
+	im->wire_len = xfer.total;
+	while (im->wire && pos < im->wire_len) {
+		struct iovec iov[2];
+		int i, count = sendImageTarget(&xfer, iov);
+
+		if (count < 0) {
+			break;
+		}
+		for (i = 0; i < count; ++i) {
+			memcpy(im->wire + pos, iov[i].iov_base, iov[i].iov_len);
+			pos += iov[i].iov_len;
+			sendImageAdvance(&xfer, iov[i].iov_len);
+		}
+	}
+	endImageXfer(&xfer);
+	free(packed);
+
+	return !im->wire || pos < im->wire_len;
+}
+
+static int recv_all(int fd, void * buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t res = recv(fd, (char *)buf + done, len - done, 0);
+
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		done += res;
+	}
+
+	return 0;
+}
+
+/* Register all the images on <conn>, still blocking, one at a time */
+static int register_images(struct lg_conn * conn)
+{
+	size_t i;
+
+	for (i = 0; i < image_count; ++i) {
+		struct request req;
+		struct response resp;
+		uint32_t no_deadline = 0;
+
+		memset(&req, 0, sizeof(req));
+		req.req_id = conn->next_id++;
+		tsc_gettime(&req.req_timestamp);
+		req.img_op = IMG_REGISTER;
+
+		if (send(conn->fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+		    (deadline_ns && send(conn->fd, &no_deadline, sizeof(no_deadline),
+					 MSG_NOSIGNAL) != sizeof(no_deadline)) ||
+		    (compress ? sendImagePacked(images[i].img, conn->fd)
+		     : sendImage(images[i].img, conn->fd)) ||
+		    recv_all(conn->fd, &resp, sizeof(resp))) {
+			ERROR_INFO();
+			perror("Unable to register the images");
+			return 1;
+		}
+		if (resp.ack != RESP_COMPLETED) {
+			ERROR_INFO();
+			fprintf(stderr, "Registration of image %ld rejected\n", i);
+			return 1;
+		}
+		images[i].server_id = resp.img_id;
+	}
+
+	return 0;
+}
+
+static int connect_to_server(int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		ERROR_INFO();
+		perror("Unable to create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERROR_INFO();
+		perror("Unable to connect to the server");
+		close(fd);
+		return -1;
+	}
+
+	/* Requests are small and must not wait for one another */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* An empty frame asks for compressed images, and says that the
+	 * requests carry deadlines, from then on */
+	if (compress || deadline_ns) {
+		struct frame_header hdr;
+
+		hdr.magic = htole32(REQ_FRAME_MAGIC);
+		hdr.version = htole16(REQ_FRAME_VERSION | (compress ? REQ_FRAME_COMPRESSED : 0) |
+				      (deadline_ns ? REQ_FRAME_DEADLINE : 0));
+		hdr.count = 0;
+		if (send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr)) {
+			ERROR_INFO();
+			perror("Unable to set the mode of the connection");
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static int replay_append(size_t * cap, nstime_t sent_ns, uint8_t op, uint8_t overwrite,
+			 uint64_t img_id, uint64_t out_img_id)
+{
+	struct replay_rec * rec;
+
+	if (replay_count == *cap) {
+		struct replay_rec * grown;
+
+		*cap = *cap ? *cap * 2 : 4096;
+		grown = (struct replay_rec *)realloc(replay, *cap * sizeof(struct replay_rec));
+		if (!grown) {
+			return 1;
+		}
+		replay = grown;
+	}
+
+	rec = &replay[replay_count];
+	rec->seq = replay_count++;
+	rec->at = sent_ns;
+	rec->op = op;
+	rec->overwrite = overwrite;
+	rec->img_id = img_id;
+	rec->out_img_id = out_img_id;
+	rec->produces = (op == IMG_REGISTER || out_img_id != img_id);
+
+	return 0;
+}
+
+static int replay_cmp(const void * a, const void * b)
+{
+	const struct replay_rec * ra = (const struct replay_rec *)a;
+	const struct replay_rec * rb = (const struct replay_rec *)b;
+
+	/* Ties in the order of the trace */
+	return ns_cmp(ra->at, rb->at) ? ns_cmp(ra->at, rb->at) : ns_cmp(ra->seq, rb->seq);
+}
+
+/* Read the requests of the trace <path>: either a binary trace of -T
+ * or the text output of the server, of which only the T lines count.
+ * The rejected requests are only in binary traces. */
+static int load_replay(const char * path)
+{
+	FILE * in = fopen(path, "rb");
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	size_t cap = 0, i;
+	uint64_t max_id = 0;
+	nstime_t first;
+
+	if (!in) {
+		ERROR_INFO();
+		perror("Unable to open the trace");
+		return 1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, in) == 1 && !memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		struct trace_reader reader;
+		struct trace_record * recs;
+		size_t rows;
+
+		rewind(in);
+		recs = (struct trace_record *)malloc(TRACE_BLOCK_ROWS * sizeof(struct trace_record));
+		if (!recs || trace_reader_open(&reader, in)) {
+			ERROR_INFO();
+			fprintf(stderr, "Not a trace of this server: %s\n", path);
+			free(recs);
+			fclose(in);
+			return 1;
+		}
+		while ((rows = trace_reader_next(&reader, recs)) > 0) {
+			for (i = 0; i < rows; ++i) {
+				struct trace_record * r = &recs[i];
+				uint64_t out = r->kind == TRACE_REJECT ? r->img_id : r->out_img_id;
+
+				if (r->opcode == IMG_UNUSED || r->opcode >= OPCODE_COUNT ||
+				    (r->kind == TRACE_REJECT && r->opcode == IMG_REGISTER)) {
+					continue;
+				}
+				replay_append(&cap, r->sent_ns, r->opcode, r->overwrite,
+					      r->img_id, out);
+			}
+		}
+		trace_reader_close(&reader);
+		free(recs);
+	} else {
+		char * line = NULL;
+		size_t len = 0;
+
+		rewind(in);
+		while (getline(&line, &len, in) > 0) {
+			unsigned int thread, overwrite;
+			unsigned long req_id, img_id, out_img_id;
+			char opname[32];
+			double sent;
+			size_t op;
+
+			if (line[0] != 'T' ||
+			    sscanf(line, "T%u R%lu:%lf,%31[^,],%u,%lu,%lu", &thread, &req_id, &sent,
+				   opname, &overwrite, &img_id, &out_img_id) != 7) {
+				continue;
+			}
+			for (op = IMG_REGISTER; op < OPCODE_COUNT; ++op) {
+				if (!strcmp(opname, __opcode_strings[op])) {
+					break;
+				}
+			}
+			if (op < OPCODE_COUNT) {
+				replay_append(&cap, double_to_ns(sent), op, overwrite,
+					      img_id, out_img_id);
+			}
+		}
+		free(line);
+	}
+	fclose(in);
+
+	if (!replay_count) {
+		ERROR_INFO();
+		fprintf(stderr, "No request in the trace %s\n", path);
+		return 1;
+	}
+
+	/* The flusher of the server groups the records by thread */
+	qsort(replay, replay_count, sizeof(struct replay_rec), replay_cmp);
+
+	first = replay[0].at;
+	for (i = 0; i < replay_count; ++i) {
+		replay[i].at -= first;
+		if (replay[i].img_id > max_id) {
+			max_id = replay[i].img_id;
+		}
+		if (replay[i].out_img_id > max_id) {
+			max_id = replay[i].out_img_id;
+		}
+	}
+	if (max_id >= REPLAY_MAX_IDS) {
+		ERROR_INFO();
+		fprintf(stderr, "Image IDs of the trace too large: %lu\n", max_id);
+		return 1;
+	}
+
+	replay_ids = max_id + 1;
+	replay_map = (uint64_t *)malloc(replay_ids * sizeof(uint64_t));
+	replay_made = (uint8_t *)calloc(replay_ids, 1);
+	if (!replay_map || !replay_made) {
+		ERROR_INFO();
+		perror("Unable to allocate the image map of the trace");
+		return 1;
+	}
+	for (i = 0; i < replay_ids; ++i) {
+		replay_map[i] = REPLAY_UNMAPPED;
+	}
+	for (i = 0; i < replay_count; ++i) {
+		if (replay[i].produces) {
+			replay_made[replay[i].out_img_id] = 1;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t chain_find(uint64_t * parent, uint64_t id)
+{
+	while (parent[id] != id) {
+		parent[id] = parent[parent[id]];
+		id = parent[id];
+	}
+	return id;
+}
+
+/* Split the trace among the connections: all the requests on the
+ * images that derive from one another go to the same connection, in
+ * order, so that each one waits at most for a response of its own
+ * connection */
+static int assign_replay(struct lg_conn * conns, size_t conn_count)
+{
+	uint64_t * parent = (uint64_t *)malloc(replay_ids * sizeof(uint64_t));
+	size_t * owner = (size_t *)malloc(replay_count * sizeof(size_t));
+	size_t i;
+
+	if (!parent || !owner) {
+		free(parent);
+		free(owner);
+		return 1;
+	}
+
+	for (i = 0; i < replay_ids; ++i) {
+		parent[i] = i;
+	}
+	for (i = 0; i < replay_count; ++i) {
+		const struct replay_rec * rec = &replay[i];
+
+		if (rec->produces && rec->op != IMG_REGISTER) {
+			uint64_t a = chain_find(parent, rec->out_img_id);
+			uint64_t b = chain_find(parent, rec->img_id);
+
+			parent[a] = b;
+		}
+	}
+
+	for (i = 0; i < replay_count; ++i) {
+		const struct replay_rec * rec = &replay[i];
+		uint64_t root = chain_find(parent, rec->op == IMG_REGISTER ?
+					   rec->out_img_id : rec->img_id);
+
+		owner[i] = ((root * 0x9E3779B97F4A7C15ULL) >> 32) % conn_count;
+		conns[owner[i]].script_len++;
+	}
+	for (i = 0; i < conn_count; ++i) {
+		conns[i].script = (size_t *)malloc((conns[i].script_len + 1) * sizeof(size_t));
+		if (!conns[i].script) {
+			free(parent);
+			free(owner);
+			return 1;
+		}
+		conns[i].script_len = 0;
+	}
+	for (i = 0; i < replay_count; ++i) {
+		struct lg_conn * conn = &conns[owner[i]];
+
+		conn->script[conn->script_len++] = i;
+	}
+
+	free(parent);
+	free(owner);
+	return 0;
+}
+
+/* Parse the weights of -m, e.g. "BLUR=2,RETRIEVE=1" */
+static int parse_mix(char * mix)
+{
+	char * tok, * save;
+
+	memset(op_weights, 0, sizeof(op_weights));
+	for (tok = strtok_r(mix, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char * eq = strchr(tok, '=');
+		unsigned long weight = 1;
+		size_t op;
+
+		if (eq) {
+			*eq = '\0';
+			weight = strtoul(eq + 1, NULL, 10);
+		}
+		if (!strncasecmp(tok, "IMG_", 4)) {
+			tok += 4;
+		}
+		for (op = IMG_REGISTER; op < OPCODE_COUNT; ++op) {
+			if (!strcasecmp(tok, __opcode_strings[op] + 4)) {
+				break;
+			}
+		}
+		if (op == OPCODE_COUNT) {
+			fprintf(stderr, "Unknown operation: %s\n", tok);
+			return 1;
+		}
+		op_weights[op] = weight;
+	}
+
+	return 0;
+}
+
+static void print_stats(struct lg_thread * threads, size_t count, size_t conns,
+			double rate, nstime_t end_ns)
+{
+	static struct lg_stats total;
+	static struct histo all;
+	uint64_t all_rejected = 0;
+	size_t i, op;
+	double elapsed;
+
+	for (i = 0; i < count; ++i) {
+		struct lg_stats * st = &threads[i].stats;
+
+		for (op = 0; op < OPCODE_COUNT; ++op) {
+			histo_merge(&total.resp[op], &st->resp[op]);
+			total.rejected[op] += st->rejected[op];
+		}
+		histo_merge(&total.lag, &st->lag);
+		total.sent += st->sent;
+		total.completed += st->completed;
+		total.dropped += st->dropped;
+		total.lost += st->lost;
+		total.failed += st->failed;
+		total.expired += st->expired;
+		total.on_time += st->on_time;
+	}
+
+	elapsed = end_ns > start_ns ? ns_to_double(end_ns - start_ns) : 0;
+	printf("INFO: connections=%ld threads=%ld sent=%lu completed=%lu dropped=%lu "
+	       "lost=%lu failed_connections=%lu\n", conns, count, total.sent,
+	       total.completed, total.dropped, total.lost, total.failed);
+	printf("INFO: offered=%.1lf achieved=%.1lf (req/s) over %.3lf s\n", rate,
+	       elapsed > 0 ? total.completed / elapsed : 0, elapsed);
+	if (deadline_ns) {
+		printf("INFO: deadline=%.3lf ms expired=%lu on_time=%lu goodput=%.1lf (req/s)\n",
+		       deadline_ns / 1e6, total.expired, total.on_time,
+		       elapsed > 0 ? total.on_time / elapsed : 0);
+	}
+
+	for (op = 0; op < OPCODE_COUNT; ++op) {
+		struct histo * h = &total.resp[op];
+
+		if (!h->count && !total.rejected[op]) {
+			continue;
+		}
+		printf("STATS client op=%s n=%lu rejected=%lu "
+		       "resp_p50=%.3lf resp_p90=%.3lf resp_p99=%.3lf resp_p999=%.3lf "
+		       "resp_max=%.3lf (ms)\n", OPCODE_TO_STRING(op), h->count,
+		       total.rejected[op],
+		       histo_percentile(h, 0.5) / 1e6, histo_percentile(h, 0.9) / 1e6,
+		       histo_percentile(h, 0.99) / 1e6, histo_percentile(h, 0.999) / 1e6,
+		       h->max / 1e6);
+		histo_merge(&all, h);
+		all_rejected += total.rejected[op];
+	}
+
+	/* The operations together, for the scripts that only look at one line */
+	printf("STATS client op=ALL n=%lu rejected=%lu "
+	       "resp_p50=%.3lf resp_p90=%.3lf resp_p99=%.3lf resp_p999=%.3lf "
+	       "resp_max=%.3lf (ms)\n", all.count, all_rejected,
+	       histo_percentile(&all, 0.5) / 1e6, histo_percentile(&all, 0.9) / 1e6,
+	       histo_percentile(&all, 0.99) / 1e6, histo_percentile(&all, 0.999) / 1e6,
+	       all.max / 1e6);
+
+	printf("STATS client send_lag n=%lu lag_p50=%.3lf lag_p99=%.3lf lag_p999=%.3lf "
+	       "lag_max=%.3lf (ms)\n", total.lag.count,
+	       histo_percentile(&total.lag, 0.5) / 1e6,
+	       histo_percentile(&total.lag, 0.99) / 1e6,
+	       histo_percentile(&total.lag, 0.999) / 1e6, total.lag.max / 1e6);
+}
+
+int main (int argc, char ** argv)
+{
+	struct lg_thread * threads;
+	struct lg_conn * conns;
+	char * image_dir = NULL, * mix = NULL, * replay_path = NULL;
+	double rate = 100, duration = 0;
+	uint64_t requests = 0, seed = 1;
+	size_t conn_count = 1, thread_count = 1, i;
+	nstime_t end_ns = 0;
+	int opt, port, res = EXIT_SUCCESS;
+
+	while((opt = getopt(argc, argv, "a:n:d:c:t:I:m:kSr:R:x:ZD:")) != -1) {
+		switch (opt) {
+		case 'a':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'n':
+			requests = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		case 'c':
+			conn_count = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			thread_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'I':
+			image_dir = optarg;
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'k':
+			overwrite = 0;
+			break;
+		case 'S':
+			spin = 1;
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'x':
+			replay_speed = strtod(optarg, NULL);
+			break;
+		case 'Z':
+			compress = 1;
+			break;
+		case 'D':
+			deadline_ns = double_to_ns(strtod(optarg, NULL) / 1e3);
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || !(rate > 0) || !conn_count || !thread_count ||
+	    !(replay_speed > 0)) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!requests && !(duration > 0)) {
+		requests = DEFAULT_REQUESTS;
+	}
+	port = strtol(argv[optind], NULL, 10);
+	if (thread_count > conn_count) {
+		thread_count = conn_count;
+	}
+
+	if (mix) {
+		if (parse_mix(mix)) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		size_t op;
+
+		for (op = IMG_ROT90CLKW; op <= IMG_SOBEL; ++op) {
+			op_weights[op] = 1;
+		}
+	}
+	for (i = 0; i < OPCODE_COUNT; ++i) {
+		op_total += op_weights[i];
+	}
+	if (!op_total) {
+		fprintf(stderr, "No operation to send\n");
+		return EXIT_FAILURE;
+	}
+
+	tsc_init();
+
+	if (replay_path) {
+		if (load_replay(replay_path)) {
+			return EXIT_FAILURE;
+		}
+		rate = replay[replay_count - 1].at ?
+			replay_count / (ns_to_double(replay[replay_count - 1].at) / replay_speed) : 0;
+	}
+
+	if (!(image_dir ? load_images(image_dir) : make_images(seed))) {
+		ERROR_INFO();
+		fprintf(stderr, "No image to register\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < image_count; ++i) {
+		if (make_wire(&images[i])) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to serialize image %ld\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	conns = (struct lg_conn *)calloc(conn_count, sizeof(struct lg_conn));
+	threads = (struct lg_thread *)calloc(thread_count, sizeof(struct lg_thread));
+	for (i = 0; i < conn_count; ++i) {
+		conns[i].fd = connect_to_server(port);
+		conns[i].pending = (struct pending *)calloc(PENDING_WINDOW, sizeof(struct pending));
+		conns[i].rx_buf = (char *)malloc(RX_BUF_SIZE);
+		if (conns[i].fd < 0 || !conns[i].pending || !conns[i].rx_buf) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (register_images(&conns[0])) {
+		return EXIT_FAILURE;
+	}
+	if (replay && assign_replay(conns, conn_count)) {
+		ERROR_INFO();
+		fprintf(stderr, "Unable to split the trace among the connections\n");
+		return EXIT_FAILURE;
+	}
+	PRINT_BUILD_INFO();
+	printf("INFO: registered %ld images, timestamps use the TSC at %.3lf MHz\n",
+	       image_count, tsc_hz() / 1e6);
+
+	/* Every connection gets an equal share of the arrivals */
+	conn_rate = rate / conn_count;
+	start_ns = tsc_now_ns() + START_DELAY_NS;
+
+	for (i = 0; i < thread_count; ++i) {
+		struct epoll_event ev;
+
+		threads[i].id = i;
+		threads[i].rng = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+		threads[i].conns = (struct lg_conn **)calloc(conn_count, sizeof(struct lg_conn *));
+		threads[i].epoll_fd = epoll_create1(0);
+		threads[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (threads[i].epoll_fd < 0 || threads[i].timer_fd < 0 || !threads[i].conns) {
+			ERROR_INFO();
+			perror("Unable to set up the threads");
+			return EXIT_FAILURE;
+		}
+		threads[i].wheel.tick = start_ns / WHEEL_TICK_NS;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(threads[i].epoll_fd, EPOLL_CTL_ADD, threads[i].timer_fd, &ev);
+	}
+
+	for (i = 0; i < conn_count; ++i) {
+		struct lg_conn * conn = &conns[i];
+		struct lg_thread * thread = &threads[i % thread_count];
+		struct epoll_event ev;
+
+		fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+		conn->thread = thread;
+		conn->stop_ns = duration > 0 ? start_ns + double_to_ns(duration) : UINT64_MAX;
+		if (replay) {
+			conn->left = conn->script_len;
+			conn->due = replay_due(conn);
+		} else {
+			conn->left = requests ? requests / conn_count + (i < requests % conn_count) :
+				UINT64_MAX;
+			conn->due = start_ns + next_interarrival(&thread->rng);
+		}
+		thread->conns[thread->count++] = conn;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+		if (conn->left && conn->due < conn->stop_ns) {
+			wheel_add(&thread->wheel, conn);
+		}
+	}
+
+	for (i = 0; i < thread_count; ++i) {
+		if (pthread_create(&threads[i].tid, NULL, thread_main, &threads[i])) {
+			ERROR_INFO();
+			perror("Unable to create thread");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].stats.last_ns > end_ns) {
+			end_ns = threads[i].stats.last_ns;
+		}
+		if (threads[i].stats.failed) {
+			res = EXIT_FAILURE;
+		}
+	}
+
+	print_stats(threads, thread_count, conn_count, rate, end_ns);
+
+	for (i = 0; i < conn_count; ++i) {
+		if (conns[i].rx_image) {
+			endImageXfer(&conns[i].rx_xfer);
+		}
+		close(conns[i].fd);
+		free(conns[i].pending);
+		free(conns[i].rx_buf);
+		free(conns[i].tx_buf);
+		free(conns[i].script);
+	}
+	for (i = 0; i < thread_count; ++i) {
+		close(threads[i].epoll_fd);
+		close(threads[i].timer_fd);
+		free(threads[i].conns);
+	}
+	for (i = 0; i < image_count; ++i) {
+		deleteImage(images[i].img);
+		free(images[i].wire);
+	}
+	free(images);
+	free(replay);
+	free(replay_map);
+	free(replay_made);
+	free(threads);
+	free(conns);
+
+	return res;
+}
@@ -6,7 +6,9 @@
 *     (https://www.netlib.org/). It has been modified to export the
 *     md5sum function without a main function. The original comment is
 *     kept below to provide appropriate credit to the original
-*     creator.
+*     creator. The block function has since been unrolled and reads the
+*     words of the blocks directly, and an AVX2 version of it hashes
+*     several buffers at once (see md5_multi()).
 *
 * Author:
 *     Renato Mancuso <rmancuso@bu.edu>
@@ -53,11 +55,12 @@
 
 #include "md5sum.h"
 
-typedef struct MD5state
-{
-	uint len;
-	uint state[4];
-} MD5state;
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5_X86_SIMD
+#include <immintrin.h>
+#endif
 
 /*
  *	Rotate amounts used in the algorithm
@@ -85,87 +88,92 @@ enum
 	S44=	21
 };
 
-typedef struct Table
-{
-	uint	sin;	/* integer part of 4294967296 times abs(sin(i)) */
-	byte	x;	/* index into data block */
-	byte	rot;	/* amount to rotate left by */
-} Table;
-
-Table tab[] =
-{
-	/* round 1 */
-	{ 0xd76aa478, 0, S11},
-	{ 0xe8c7b756, 1, S12},
-	{ 0x242070db, 2, S13},
-	{ 0xc1bdceee, 3, S14},
-	{ 0xf57c0faf, 4, S11},
-	{ 0x4787c62a, 5, S12},
-	{ 0xa8304613, 6, S13},
-	{ 0xfd469501, 7, S14},
-	{ 0x698098d8, 8, S11},
-	{ 0x8b44f7af, 9, S12},
-	{ 0xffff5bb1, 10, S13},
-	{ 0x895cd7be, 11, S14},
-	{ 0x6b901122, 12, S11},
-	{ 0xfd987193, 13, S12},
-	{ 0xa679438e, 14, S13},
-	{ 0x49b40821, 15, S14},
-
-	/* round 2 */
-	{ 0xf61e2562, 1, S21},
-	{ 0xc040b340, 6, S22},
-	{ 0x265e5a51, 11, S23},
-	{ 0xe9b6c7aa, 0, S24},
-	{ 0xd62f105d, 5, S21},
-	{  0x2441453, 10, S22},
-	{ 0xd8a1e681, 15, S23},
-	{ 0xe7d3fbc8, 4, S24},
-	{ 0x21e1cde6, 9, S21},
-	{ 0xc33707d6, 14, S22},
-	{ 0xf4d50d87, 3, S23},
-	{ 0x455a14ed, 8, S24},
-	{ 0xa9e3e905, 13, S21},
-	{ 0xfcefa3f8, 2, S22},
-	{ 0x676f02d9, 7, S23},
-	{ 0x8d2a4c8a, 12, S24},
-
-	/* round 3 */
-	{ 0xfffa3942, 5, S31},
-	{ 0x8771f681, 8, S32},
-	{ 0x6d9d6122, 11, S33},
-	{ 0xfde5380c, 14, S34},
-	{ 0xa4beea44, 1, S31},
-	{ 0x4bdecfa9, 4, S32},
-	{ 0xf6bb4b60, 7, S33},
-	{ 0xbebfbc70, 10, S34},
-	{ 0x289b7ec6, 13, S31},
-	{ 0xeaa127fa, 0, S32},
-	{ 0xd4ef3085, 3, S33},
-	{  0x4881d05, 6, S34},
-	{ 0xd9d4d039, 9, S31},
-	{ 0xe6db99e5, 12, S32},
-	{ 0x1fa27cf8, 15, S33},
-	{ 0xc4ac5665, 2, S34},
-
-	/* round 4 */
-	{ 0xf4292244, 0, S41},
-	{ 0x432aff97, 7, S42},
-	{ 0xab9423a7, 14, S43},
-	{ 0xfc93a039, 5, S44},
-	{ 0x655b59c3, 12, S41},
-	{ 0x8f0ccc92, 3, S42},
-	{ 0xffeff47d, 10, S43},
-	{ 0x85845dd1, 1, S44},
-	{ 0x6fa87e4f, 8, S41},
-	{ 0xfe2ce6e0, 15, S42},
-	{ 0xa3014314, 6, S43},
-	{ 0x4e0811a1, 13, S44},
-	{ 0xf7537e82, 4, S41},
-	{ 0xbd3af235, 11, S42},
-	{ 0x2ad7d2bb, 2, S43},
-	{ 0xeb86d391, 9, S44},
-};
+/*
+ *	The 64 steps of a block, unrolled: the function of the round, the
+ *	variables in their rotated order, the index of the word of the
+ *	block, the integer part of 4294967296 times abs(sin(i)), and the
+ *	amount to rotate left by. The scalar and the multi-buffer cores
+ *	expand it with their own STEP and round functions.
+ */
+#define MD5_STEPS(STEP, F, G, H, I)					\
+	/* round 1 */							\
+	STEP(F, a, b, c, d,  0, 0xd76aa478, S11)			\
+	STEP(F, d, a, b, c,  1, 0xe8c7b756, S12)			\
+	STEP(F, c, d, a, b,  2, 0x242070db, S13)			\
+	STEP(F, b, c, d, a,  3, 0xc1bdceee, S14)			\
+	STEP(F, a, b, c, d,  4, 0xf57c0faf, S11)			\
+	STEP(F, d, a, b, c,  5, 0x4787c62a, S12)			\
+	STEP(F, c, d, a, b,  6, 0xa8304613, S13)			\
+	STEP(F, b, c, d, a,  7, 0xfd469501, S14)			\
+	STEP(F, a, b, c, d,  8, 0x698098d8, S11)			\
+	STEP(F, d, a, b, c,  9, 0x8b44f7af, S12)			\
+	STEP(F, c, d, a, b, 10, 0xffff5bb1, S13)			\
+	STEP(F, b, c, d, a, 11, 0x895cd7be, S14)			\
+	STEP(F, a, b, c, d, 12, 0x6b901122, S11)			\
+	STEP(F, d, a, b, c, 13, 0xfd987193, S12)			\
+	STEP(F, c, d, a, b, 14, 0xa679438e, S13)			\
+	STEP(F, b, c, d, a, 15, 0x49b40821, S14)			\
+	/* round 2 */							\
+	STEP(G, a, b, c, d,  1, 0xf61e2562, S21)			\
+	STEP(G, d, a, b, c,  6, 0xc040b340, S22)			\
+	STEP(G, c, d, a, b, 11, 0x265e5a51, S23)			\
+	STEP(G, b, c, d, a,  0, 0xe9b6c7aa, S24)			\
+	STEP(G, a, b, c, d,  5, 0xd62f105d, S21)			\
+	STEP(G, d, a, b, c, 10, 0x02441453, S22)			\
+	STEP(G, c, d, a, b, 15, 0xd8a1e681, S23)			\
+	STEP(G, b, c, d, a,  4, 0xe7d3fbc8, S24)			\
+	STEP(G, a, b, c, d,  9, 0x21e1cde6, S21)			\
+	STEP(G, d, a, b, c, 14, 0xc33707d6, S22)			\
+	STEP(G, c, d, a, b,  3, 0xf4d50d87, S23)			\
+	STEP(G, b, c, d, a,  8, 0x455a14ed, S24)			\
+	STEP(G, a, b, c, d, 13, 0xa9e3e905, S21)			\
+	STEP(G, d, a, b, c,  2, 0xfcefa3f8, S22)			\
+	STEP(G, c, d, a, b,  7, 0x676f02d9, S23)			\
+	STEP(G, b, c, d, a, 12, 0x8d2a4c8a, S24)			\
+	/* round 3 */							\
+	STEP(H, a, b, c, d,  5, 0xfffa3942, S31)			\
+	STEP(H, d, a, b, c,  8, 0x8771f681, S32)			\
+	STEP(H, c, d, a, b, 11, 0x6d9d6122, S33)			\
+	STEP(H, b, c, d, a, 14, 0xfde5380c, S34)			\
+	STEP(H, a, b, c, d,  1, 0xa4beea44, S31)			\
+	STEP(H, d, a, b, c,  4, 0x4bdecfa9, S32)			\
+	STEP(H, c, d, a, b,  7, 0xf6bb4b60, S33)			\
+	STEP(H, b, c, d, a, 10, 0xbebfbc70, S34)			\
+	STEP(H, a, b, c, d, 13, 0x289b7ec6, S31)			\
+	STEP(H, d, a, b, c,  0, 0xeaa127fa, S32)			\
+	STEP(H, c, d, a, b,  3, 0xd4ef3085, S33)			\
+	STEP(H, b, c, d, a,  6, 0x04881d05, S34)			\
+	STEP(H, a, b, c, d,  9, 0xd9d4d039, S31)			\
+	STEP(H, d, a, b, c, 12, 0xe6db99e5, S32)			\
+	STEP(H, c, d, a, b, 15, 0x1fa27cf8, S33)			\
+	STEP(H, b, c, d, a,  2, 0xc4ac5665, S34)			\
+	/* round 4 */							\
+	STEP(I, a, b, c, d,  0, 0xf4292244, S41)			\
+	STEP(I, d, a, b, c,  7, 0x432aff97, S42)			\
+	STEP(I, c, d, a, b, 14, 0xab9423a7, S43)			\
+	STEP(I, b, c, d, a,  5, 0xfc93a039, S44)			\
+	STEP(I, a, b, c, d, 12, 0x655b59c3, S41)			\
+	STEP(I, d, a, b, c,  3, 0x8f0ccc92, S42)			\
+	STEP(I, c, d, a, b, 10, 0xffeff47d, S43)			\
+	STEP(I, b, c, d, a,  1, 0x85845dd1, S44)			\
+	STEP(I, a, b, c, d,  8, 0x6fa87e4f, S41)			\
+	STEP(I, d, a, b, c, 15, 0xfe2ce6e0, S42)			\
+	STEP(I, c, d, a, b,  6, 0xa3014314, S43)			\
+	STEP(I, b, c, d, a, 13, 0x4e0811a1, S44)			\
+	STEP(I, a, b, c, d,  4, 0xf7537e82, S41)			\
+	STEP(I, d, a, b, c, 11, 0xbd3af235, S42)			\
+	STEP(I, c, d, a, b,  2, 0x2ad7d2bb, S43)			\
+	STEP(I, b, c, d, a,  9, 0xeb86d391, S44)
+
+/* The round functions of the rfc, with one operation less for F and G */
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, i, t, s)				\
+	a += f(b, c, d) + x[i] + (t);					\
+	a = ((a << (s)) | (a >> (32 - (s)))) + b;
 
 int test_main(int argc, char **argv)
 {
@@ -180,160 +188,127 @@ int test_main(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
-/*
- *	encodes input (uint) into output (byte). Assumes len is
- *	a multiple of 4.
- */
-static void encode(byte *output, uint *input, uint len)
+static inline uint load_le32(const byte * p)
 {
-	uint x;
-	byte *e;
-
-	for(e = output + len; output < e;) {
-		x = *input++;
-		*output++ = x;
-		*output++ = x >> 8;
-		*output++ = x >> 16;
-		*output++ = x >> 24;
-	}
+	uint w;
+
+	memcpy(&w, p, sizeof(w));
+	return le32toh(w);
 }
 
-/*
- *	decodes input (byte) into output (uint). Assumes len is
- *	a multiple of 4.
- */
-static void decode(uint *output, byte *input, uint len)
+static inline void store_le32(byte * p, uint w)
 {
-	byte *e;
-
-	for(e = input+len; input < e; input += 4)
-		*output++ = input[0] | (input[1] << 8) |
-			(input[2] << 16) | (input[3] << 24);
+	w = htole32(w);
+	memcpy(p, &w, sizeof(w));
 }
 
-/*
- *  I require len to be a multiple of 64 for all but
- *  the last call
- */
-static MD5state* md5(byte *p, uint len, byte *digest, MD5state *s)
+/* Run <blocks> 64-byte blocks at <p> through <state> */
+static void md5_blocks(uint state[4], const byte * p, size_t blocks)
 {
-	uint a, b, c, d, tmp;
-	uint i, done;
-	Table *t;
-	byte *end;
-	uint x[16];
-
-	if(s == NULL){
-		s = calloc(sizeof(*s),1);
-		if(s == NULL)
-			return NULL;
-
-		/* seed the state, these constants would look nicer big-endian */
-		s->state[0] = 0x67452301;
-		s->state[1] = 0xefcdab89;
-		s->state[2] = 0x98badcfe;
-		s->state[3] = 0x10325476;
+	uint a, b, c, d, x[16];
+	int i;
+
+	for (; blocks; --blocks, p += 64) {
+		for (i = 0; i < 16; ++i)
+			x[i] = load_le32(p + 4 * i);
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+
+		MD5_STEPS(MD5_STEP, MD5_F, MD5_G, MD5_H, MD5_I)
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
 	}
-	s->len += len;
-
-	i = len & 0x3f;
-	if(i || len == 0){
-		done = 1;
-
-		/* pad the input, assume there's room */
-		if(i < 56)
-			i = 56 - i;
-		else
-			i = 120 - i;
-		if(i > 0){
-			memset(p + len, 0, i);
-			p[len] = 0x80;
-		}
-		len += i;
-
-		/* append the count */
-		x[0] = s->len<<3;
-		x[1] = s->len>>29;
-		encode(p+len, x, 8);
-	} else
-		done = 0;
-
-	for(end = p+len; p < end; p += 64){
-		a = s->state[0];
-		b = s->state[1];
-		c = s->state[2];
-		d = s->state[3];
-
-		decode(x, p, 64);
-
-		for(i = 0; i < 64; i++){
-			t = tab + i;
-			switch(i>>4){
-			case 0:
-				a += (b & c) | (~b & d);
-				break;
-			case 1:
-				a += (b & d) | (c & ~d);
-				break;
-			case 2:
-				a += b ^ c ^ d;
-				break;
-			case 3:
-				a += c ^ (b | ~d);
-				break;
-			}
-			a += x[t->x] + t->sin;
-			a = (a << t->rot) | (a >> (32 - t->rot));
-			a += b;
-
-			/* rotate variables */
-			tmp = d;
-			d = c;
-			c = b;
-			b = a;
-			a = tmp;
-		}
+}
 
-		s->state[0] += a;
-		s->state[1] += b;
-		s->state[2] += c;
-		s->state[3] += d;
+void md5_init(struct md5ctx * ctx)
+{
+	memset(ctx, 0, sizeof(struct md5ctx));
+	/* seed the state, these constants would look nicer big-endian */
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+}
+
+void md5_update(struct md5ctx * ctx, const void * data, size_t len)
+{
+	const byte * p = (const byte *)data;
+	size_t whole;
+
+	ctx->len += len;
+
+	/* Top up a partial block first */
+	if (ctx->buffered) {
+		size_t n = 64 - ctx->buffered;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buffered, p, n);
+		ctx->buffered += n;
+		p += n;
+		len -= n;
+
+		if (ctx->buffered < 64)
+			return;
+		md5_blocks(ctx->state, ctx->buf, 1);
+		ctx->buffered = 0;
 	}
 
-	/* return result */
-	if(done){
-		encode(digest, s->state, 16);
-		free(s);
-		return NULL;
+	/* Whole blocks are hashed in place */
+	whole = len / 64;
+	if (whole) {
+		md5_blocks(ctx->state, p, whole);
+		p += whole * 64;
+		len -= whole * 64;
 	}
-	return s;
+
+	memcpy(ctx->buf, p, len);
+	ctx->buffered = len;
 }
 
-struct md5digest buf_md5sum(const char * orig_buf, size_t len)
+struct md5digest md5_final(struct md5ctx * ctx)
 {
 	struct md5digest digest;
-	MD5state * s = NULL;
-
-	byte * buf = calloc(1, len + 256);
-	memcpy(buf, orig_buf, len);
+	uint64_t bits = ctx->len << 3;
+	int i;
+
+	/* pad with a 1 bit and zeros up to the count, in the last 8 bytes */
+	ctx->buf[ctx->buffered++] = 0x80;
+	if (ctx->buffered > 56) {
+		memset(ctx->buf + ctx->buffered, 0, 64 - ctx->buffered);
+		md5_blocks(ctx->state, ctx->buf, 1);
+		ctx->buffered = 0;
+	}
+	memset(ctx->buf + ctx->buffered, 0, 56 - ctx->buffered);
+	store_le32(ctx->buf + 56, (uint)bits);
+	store_le32(ctx->buf + 60, (uint)(bits >> 32));
+	md5_blocks(ctx->state, ctx->buf, 1);
 
-	/* For the first call, n must be a multiple of 64 */
-	size_t n = (len >> 6) << 6;
-	s = md5(buf, n, NULL, s);
+	for (i = 0; i < 4; ++i)
+		store_le32(digest.__digest + 4 * i, ctx->state[i]);
+	return digest;
+}
 
-	/* Set n to the remainder, potentially 0 */
-	md5(buf+n, len % 64, digest.__digest, s);
+struct md5digest buf_md5sum(const char * orig_buf, size_t len)
+{
+	struct md5ctx ctx;
 
-	free(buf);
-	return digest;
+	md5_init(&ctx);
+	md5_update(&ctx, orig_buf, len);
+	return md5_final(&ctx);
 }
 
 struct md5digest file_md5sum(const char *name)
 {
-	byte *buf;
 	struct md5digest digest;
-	int i, n;
-	MD5state *s;
+	struct md5ctx ctx;
+	byte *buf;
+	ssize_t n;
 
 	int fd = open(name, O_RDONLY);
 	if(fd < 0){
@@ -342,22 +317,268 @@ struct md5digest file_md5sum(const char *name)
 		return digest;
 	}
 
-	s = NULL;
-	n = 0;
-	buf = calloc(256,64);
-	for(;;){
-		i = read(fd, buf+n, 128*64-n);
-		if(i <= 0)
-			break;
-		n += i;
-		if(n & 0x3f)
-			continue;
-		s = md5(buf, n, NULL, s);
-		n = 0;
+	buf = malloc(128*64);
+	if (!buf) {
+		memset(&digest, 0, sizeof(struct md5digest));
+		close(fd);
+		return digest;
 	}
-	md5(buf, n, digest.__digest, s);
+
+	md5_init(&ctx);
+	while ((n = read(fd, buf, 128*64)) > 0)
+		md5_update(&ctx, buf, n);
 	free(buf);
 	close(fd);
-	return digest;
+	return md5_final(&ctx);
 }
 
+/*******************************************************************************
+* Multi-buffer hashing
+*
+* MD5 is a chain of dependent steps within a buffer, which leaves most
+* of a wide core idle. The AVX2 core below runs the steps of MD5_LANES
+* independent buffers side by side, one per 32-bit lane: the state of
+* lane l is word l of the vectors a, b, c and d, and the words of the
+* blocks are transposed so that vector i holds word i of every lane.
+*
+* A lane that runs out of whole blocks is finished with the scalar code
+* (its last partial block and the padding) and takes the next buffer,
+* so buffers of different lengths keep the lanes busy. Lanes without a
+* buffer hash a block of zeros that is thrown away. Once fewer than
+* MD5_MULTI_MIN lanes are busy, the rest is left to the scalar code.
+*
+* Setting the environment variable MD5_SIMD to "scalar" disables the
+* AVX2 core.
+*******************************************************************************/
+
+/* Fewest busy lanes that are worth the AVX2 core */
+#define MD5_MULTI_MIN 3
+
+#ifdef MD5_X86_SIMD
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define MD5_F8(x, y, z)							\
+	_mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define MD5_G8(x, y, z)							\
+	_mm256_xor_si256(y, _mm256_and_si256(z, _mm256_xor_si256(x, y)))
+#define MD5_H8(x, y, z)							\
+	_mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define MD5_I8(x, y, z)							\
+	_mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, ones)))
+
+#define MD5_STEP8(f, a, b, c, d, i, t, s)				\
+	a = _mm256_add_epi32(a, _mm256_add_epi32(f(b, c, d),		\
+		_mm256_add_epi32(x[i], _mm256_set1_epi32((int)(t)))));	\
+	a = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(a, s),	\
+		_mm256_srli_epi32(a, 32 - (s))), b);
+
+/* Transpose the 8x8 words in <r>: r[l] holds 8 words of lane l going
+ * in, and word l of the 8 lanes coming out */
+static inline AVX2_TARGET void md5_transpose8(__m256i r[8])
+{
+	__m256i t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; ++i) {
+		r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/* Run <blocks> blocks of every lane through <state>, state[j][l]
+ * being word j of the state of lane l. The blocks of lane l start at
+ * p[l], and follow each other <step[l]> bytes apart. */
+static AVX2_TARGET void md5_blocks_x8(uint state[4][MD5_LANES], const byte * p[MD5_LANES],
+				      const size_t step[MD5_LANES], size_t blocks)
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+	__m256i a, b, c, d, sa, sb, sc, sd, x[16];
+	size_t off[MD5_LANES] = { 0 };
+	int l;
+
+	a = _mm256_loadu_si256((const __m256i *)state[0]);
+	b = _mm256_loadu_si256((const __m256i *)state[1]);
+	c = _mm256_loadu_si256((const __m256i *)state[2]);
+	d = _mm256_loadu_si256((const __m256i *)state[3]);
+
+	for (; blocks; --blocks) {
+		for (l = 0; l < MD5_LANES; ++l) {
+			x[l] = _mm256_loadu_si256((const __m256i *)(p[l] + off[l]));
+			x[l + 8] = _mm256_loadu_si256((const __m256i *)(p[l] + off[l] + 32));
+			off[l] += step[l];
+		}
+		md5_transpose8(x);
+		md5_transpose8(x + 8);
+
+		sa = a;
+		sb = b;
+		sc = c;
+		sd = d;
+
+		MD5_STEPS(MD5_STEP8, MD5_F8, MD5_G8, MD5_H8, MD5_I8)
+
+		a = _mm256_add_epi32(a, sa);
+		b = _mm256_add_epi32(b, sb);
+		c = _mm256_add_epi32(c, sc);
+		d = _mm256_add_epi32(d, sd);
+	}
+
+	_mm256_storeu_si256((__m256i *)state[0], a);
+	_mm256_storeu_si256((__m256i *)state[1], b);
+	_mm256_storeu_si256((__m256i *)state[2], c);
+	_mm256_storeu_si256((__m256i *)state[3], d);
+}
+
+static int md5_use_avx2(void)
+{
+	static int selected = -1;
+	int cached = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+	const char * cap;
+
+	if (cached >= 0)
+		return cached;
+
+	__builtin_cpu_init();
+	cached = __builtin_cpu_supports("avx2");
+	cap = getenv("MD5_SIMD");
+	if (cap && !strcmp(cap, "scalar"))
+		cached = 0;
+
+	/* Threads that race here all pick the same */
+	__atomic_store_n(&selected, cached, __ATOMIC_RELAXED);
+	return cached;
+}
+
+/* The buffer in a lane, and how far into it the lane is */
+struct md5_lane {
+	size_t buf;          /* Index of the buffer, or <count> if idle */
+	const byte * p;      /* Next whole block */
+	size_t blocks;       /* Whole blocks left */
+};
+
+/* Finish the buffer of lane <l>, whose whole blocks are all done */
+static void md5_lane_finish(uint state[4][MD5_LANES], struct md5_lane * lane, int l,
+			    const size_t * lens, struct md5digest * digests)
+{
+	struct md5ctx ctx;
+	int j;
+
+	md5_init(&ctx);
+	for (j = 0; j < 4; ++j)
+		ctx.state[j] = state[j][l];
+	ctx.len = lens[lane->buf] & ~(size_t)63;
+	md5_update(&ctx, lane->p, lens[lane->buf] & 63);
+	digests[lane->buf] = md5_final(&ctx);
+}
+
+static void md5_multi_avx2(const void * const * bufs, const size_t * lens, size_t count,
+			   struct md5digest * digests)
+{
+	static const byte zeros[64];
+	uint state[4][MD5_LANES];
+	struct md5_lane lanes[MD5_LANES];
+	const byte * p[MD5_LANES];
+	size_t step[MD5_LANES];
+	size_t next = 0, busy, min;
+	int l, j;
+
+	for (l = 0; l < MD5_LANES; ++l)
+		lanes[l].buf = count;
+
+	for (;;) {
+		/* Refill the idle lanes, finishing at once the buffers
+		 * without any whole block */
+		busy = 0;
+		min = SIZE_MAX;
+		for (l = 0; l < MD5_LANES; ++l) {
+			struct md5_lane * lane = &lanes[l];
+
+			while (lane->buf == count && next < count) {
+				lane->buf = next++;
+				lane->p = (const byte *)bufs[lane->buf];
+				lane->blocks = lens[lane->buf] / 64;
+				state[0][l] = 0x67452301;
+				state[1][l] = 0xefcdab89;
+				state[2][l] = 0x98badcfe;
+				state[3][l] = 0x10325476;
+				if (!lane->blocks) {
+					md5_lane_finish(state, lane, l, lens, digests);
+					lane->buf = count;
+				}
+			}
+			if (lane->buf < count) {
+				busy++;
+				if (lane->blocks < min)
+					min = lane->blocks;
+			}
+		}
+		if (busy < MD5_MULTI_MIN)
+			break;
+
+		for (l = 0; l < MD5_LANES; ++l) {
+			int idle = lanes[l].buf == count;
+
+			p[l] = idle ? zeros : lanes[l].p;
+			step[l] = idle ? 0 : 64;
+		}
+		md5_blocks_x8(state, p, step, min);
+
+		for (l = 0; l < MD5_LANES; ++l) {
+			struct md5_lane * lane = &lanes[l];
+
+			if (lane->buf == count)
+				continue;
+			lane->p += min * 64;
+			lane->blocks -= min;
+			if (!lane->blocks) {
+				md5_lane_finish(state, lane, l, lens, digests);
+				lane->buf = count;
+			}
+		}
+	}
+
+	/* The few lanes left go on one at a time */
+	for (l = 0; l < MD5_LANES; ++l) {
+		struct md5_lane * lane = &lanes[l];
+		uint s[4];
+
+		if (lane->buf == count)
+			continue;
+		for (j = 0; j < 4; ++j)
+			s[j] = state[j][l];
+		md5_blocks(s, lane->p, lane->blocks);
+		for (j = 0; j < 4; ++j)
+			state[j][l] = s[j];
+		lane->p += lane->blocks * 64;
+		md5_lane_finish(state, lane, l, lens, digests);
+	}
+}
+
+#endif /* MD5_X86_SIMD */
+
+void md5_multi(const void * const * bufs, const size_t * lens, size_t count,
+	       struct md5digest * digests)
+{
+	size_t i;
+
+#ifdef MD5_X86_SIMD
+	if (count >= MD5_MULTI_MIN && md5_use_avx2()) {
+		md5_multi_avx2(bufs, lens, count, digests);
+		return;
+	}
+#endif
+
+	for (i = 0; i < count; ++i)
+		digests[i] = buf_md5sum((const char *)bufs[i], lens[i]);
+}
@@ -47,6 +47,18 @@ struct md5digest
 	byte __digest [16];
 };
 
+/* Running state of an incremental MD5 computation, see md5_init() */
+struct md5ctx
+{
+	uint64_t len;  /* Bytes hashed so far */
+	uint state[4];
+	byte buf[64];  /* Partial block */
+	uint buffered;
+};
+
+/* Buffers that md5_multi() hashes side by side */
+#define MD5_LANES 8
+
 #define print_digest(digest)						\
 	do {								\
 		int i;							\
@@ -61,5 +73,21 @@ struct md5digest file_md5sum(const char * name);
 /* Compute the MD5 hash of a memory buffer */
 struct md5digest buf_md5sum(const char * orig_buf, size_t len);
 
+/* Incremental interface: the data can be fed to md5_update() in
+ * pieces of any size, e.g. as it arrives from the network, and
+ * md5_final() returns the same digest that buf_md5sum() would have
+ * computed on the whole of it. */
+void md5_init(struct md5ctx * ctx);
+void md5_update(struct md5ctx * ctx, const void * data, size_t len);
+struct md5digest md5_final(struct md5ctx * ctx);
+
+/* Compute the MD5 hashes of <count> memory buffers at once: bufs[i]
+ * is lens[i] bytes long, and its digest goes to digests[i]. With AVX2,
+ * up to MD5_LANES of them are hashed in parallel, at about the cost of
+ * hashing one; otherwise, and for fewer than 3 buffers, they are
+ * hashed one after the other. */
+void md5_multi(const void * const * bufs, const size_t * lens, size_t count,
+	       struct md5digest * digests);
+
 /* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
 #endif
@@ -0,0 +1,1095 @@
+/*******************************************************************************
+* Sharding Proxy for the Image Server
+*
+* Description:
+*     Spreads the images of its clients over several instances of the
+*     image server, the shards, and looks like a single server to them:
+*     it speaks the same protocol on both sides. A new image goes to the
+*     shard that a consistent hash ring picks for it, and every later
+*     request on it, or on the images made from it, to the same shard.
+*
+* Usage:
+*     <build directory>/mimgproxy -s <host:port>[,<host:port>...]
+*                                 [-V <vnodes>] <port_number>
+*
+*     e.g. ./build/mimgproxy -s 10.0.0.1:2222,10.0.0.2:2222 2000
+*
+* Parameters:
+*     port_number - The port number to accept the clients on.
+*     -s          - The shards, in order. The order matters: IDs made
+*                   with one list are only understood with the same one,
+*                   or one with more shards at the end.
+*     vnodes      - Points of each shard on the hash ring (default: 64).
+*
+* Notes:
+*     The image IDs seen by the clients carry the index of their shard
+*     in their low PROXY_SHARD_BITS, and the ID on that shard in the
+*     rest: the proxy keeps no table of the images, and a new ID that an
+*     operation makes on a shard names that same shard. Registrations
+*     are placed on the ring by a hash of the connection and the request
+*     ID. Adding a shard at the end of the list only moves the share of
+*     the new registrations that it takes over, and leaves every ID
+*     valid. An ID with an index beyond the list is rejected by shard 0.
+*
+*     Each client gets a connection of its own to every shard, opened
+*     once its first request or frame says whether it wants packed
+*     responses and compressed images, which the proxy then asks the
+*     shards for too. Two threads serve each client: one reads its
+*     requests and sends each to its shard as a plain request, under an
+*     ID of the proxy that says where the response goes back to, and
+*     one forwards the responses of all the shards as they come, in the
+*     encoding of the client. Requests and responses go through buffers
+*     in user space, to rewrite their IDs, but the payloads of the
+*     registrations and of the retrieves are moved from one socket to
+*     the other with splice(), through a pipe, unless the kernel cannot.
+*
+*     The deadlines of the requests are passed on to the shards, and an
+*     IMG_CANCEL goes to the shard that the request it names is pending
+*     on, found by looking through all of them.
+*
+*     The proxy runs until it gets SIGINT or SIGTERM, and then prints
+*     its counters.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/signalfd.h>
+
+#include "common.h"
+
+#define USAGE_STRING							\
+	"Usage: %s -s <host:port>[,<host:port>...] [-V <vnodes: 64>] <port_number>\n"
+
+#define BACKLOG_COUNT 100
+
+/* Low bits of the image IDs of the clients with the index of the shard */
+#define PROXY_SHARD_BITS 8
+#define PROXY_MAX_SHARDS (1 << PROXY_SHARD_BITS)
+#define PROXY_SHARD_MASK (PROXY_MAX_SHARDS - 1)
+
+/* No shard has an image with this ID */
+#define PROXY_UNKNOWN_ID UINT64_MAX
+
+#define DEFAULT_VNODES 64
+
+/* Buffers of the requests and responses, per client and per shard */
+#define PROXY_BUF_SIZE (64 * 1024)
+
+/* Of the pipes of splice(), as asked for with F_SETPIPE_SZ */
+#define PROXY_PIPE_SIZE (1 << 20)
+
+/* Requests in flight on a shard connection at first, a power of two */
+#define PENDING_INITIAL 1024
+
+struct shard {
+	char * host;
+	char * port;
+};
+
+/* A point of a shard on the hash ring */
+struct ring_point {
+	uint64_t hash;
+	uint32_t shard;
+};
+
+struct shard shards[PROXY_MAX_SHARDS];
+size_t shard_count = 0;
+struct ring_point * ring = NULL;
+size_t ring_len = 0;
+
+/* Cleared once splice() fails for lack of support, after which the
+ * payloads are copied */
+int splice_enabled = 1;
+
+struct {
+	uint64_t conns;
+	uint64_t requests;
+	uint64_t responses;
+	uint64_t spliced;  /* Payload bytes moved by splice() */
+	uint64_t copied;   /* And through user space */
+} proxy_stats;
+
+/* A request sent to a shard, waiting for its response */
+struct pending {
+	uint64_t seq;     /* Its ID on the shard connection */
+	uint64_t req_id;  /* Its ID for the client */
+	uint8_t op;
+	uint8_t used;
+};
+
+/* A byte stream read in chunks, consumed from <start> */
+struct rx_buf {
+	char * data;
+	size_t start;
+	size_t end;
+};
+
+/* The connection of a client to one shard. <pending> is shared by the
+ * two threads of the client, the rest belongs to one of them. */
+struct link {
+	int fd;
+	pthread_mutex_t lock;
+	struct pending * pending; /* Indexed by seq, modulo its size */
+	size_t pending_size;
+	uint64_t next_seq;
+	char * tx;                /* Requests not sent yet */
+	size_t tx_len;
+	struct rx_buf rx;         /* Responses not forwarded yet */
+	int eof;
+};
+
+struct proxy_conn {
+	int fd;
+	uint64_t number;
+	int started;       /* The first request or frame has been seen */
+	int packed;
+	int compressed;
+	int deadlines;     /* See REQ_FRAME_DEADLINE */
+	uint32_t frame_left;
+	struct link links[PROXY_MAX_SHARDS];
+	int links_open;
+	int up_pipe[2];    /* Registrations, client to shard */
+	int down_pipe[2];  /* Retrieves, shard to client */
+	struct rx_buf rx;  /* Requests not forwarded yet */
+	char * tx;         /* Responses not sent yet */
+	size_t tx_len;
+	int refs;          /* Threads still running on the connection */
+};
+
+static uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t hash_string(const char * s)
+{
+	uint64_t h = 1469598103934665603ULL;
+
+	while (*s) {
+		h = (h ^ (uint8_t)*s++) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static int ring_point_cmp(const void * a, const void * b)
+{
+	uint64_t ha = ((const struct ring_point *)a)->hash;
+	uint64_t hb = ((const struct ring_point *)b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/* Put <vnodes> points of each shard on the ring, drawn from its
+ * address so that they do not depend on its place in the list */
+static int ring_build(size_t vnodes)
+{
+	size_t s, v;
+
+	ring_len = shard_count * vnodes;
+	ring = (struct ring_point *)malloc(ring_len * sizeof(struct ring_point));
+	if (!ring) {
+		return 1;
+	}
+	for (s = 0; s < shard_count; ++s) {
+		uint64_t base = hash_string(shards[s].host) ^ mix64(hash_string(shards[s].port));
+
+		for (v = 0; v < vnodes; ++v) {
+			ring[s * vnodes + v].hash = mix64(base + v);
+			ring[s * vnodes + v].shard = s;
+		}
+	}
+	qsort(ring, ring_len, sizeof(struct ring_point), ring_point_cmp);
+	return 0;
+}
+
+/* The shard of the first point of the ring at or after <hash> */
+static uint32_t ring_lookup(uint64_t hash)
+{
+	size_t lo = 0, hi = ring_len;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return ring[lo == ring_len ? 0 : lo].shard;
+}
+
+static int write_all(int fd, const void * data, size_t len)
+{
+	const char * buf = (const char *)data;
+
+	while (len) {
+		ssize_t cur = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (cur < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cur <= 0) {
+			return 1;
+		}
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/* Make sure that <rx> has at least <need> bytes, of at most
+ * PROXY_BUF_SIZE, reading from <fd>. Returns 1 on end of file or
+ * error. */
+static int rx_fill(int fd, struct rx_buf * rx, size_t need)
+{
+	if (rx->start && PROXY_BUF_SIZE - rx->start < need) {
+		memmove(rx->data, rx->data + rx->start, rx->end - rx->start);
+		rx->end -= rx->start;
+		rx->start = 0;
+	}
+	while (rx->end - rx->start < need) {
+		ssize_t cur = recv(fd, rx->data + rx->end, PROXY_BUF_SIZE - rx->end, 0);
+
+		if (cur < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cur <= 0) {
+			return 1;
+		}
+		rx->end += cur;
+	}
+	return 0;
+}
+
+/* Move <len> bytes from <from> to <to>: those already in <rx> first,
+ * and the rest through <pipe> with splice(), or through <rx> if that
+ * is not supported. Returns 1 on error. */
+static int forward_payload(int from, int to, struct rx_buf * rx, int * pipe, uint64_t len)
+{
+	size_t have = rx->end - rx->start;
+
+	if (have > len) {
+		have = len;
+	}
+	if (have && write_all(to, rx->data + rx->start, have)) {
+		return 1;
+	}
+	rx->start += have;
+	len -= have;
+	__atomic_add_fetch(&proxy_stats.copied, have, __ATOMIC_RELAXED);
+
+	while (len && __atomic_load_n(&splice_enabled, __ATOMIC_RELAXED)) {
+		ssize_t in = splice(from, NULL, pipe[1], NULL,
+				    len < PROXY_PIPE_SIZE ? len : PROXY_PIPE_SIZE,
+				    SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (in < 0 && errno == EINTR) {
+			continue;
+		}
+		if (in < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			__atomic_store_n(&splice_enabled, 0, __ATOMIC_RELAXED);
+			break;
+		}
+		if (in <= 0) {
+			return 1;
+		}
+		len -= in;
+		__atomic_add_fetch(&proxy_stats.spliced, in, __ATOMIC_RELAXED);
+
+		while (in) {
+			ssize_t out = splice(pipe[0], NULL, to, NULL, in,
+					     SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (out < 0 && errno == EINTR) {
+				continue;
+			}
+			if (out <= 0) {
+				return 1;
+			}
+			in -= out;
+		}
+	}
+
+	/* The buffer is empty by now */
+	while (len) {
+		size_t chunk = len < PROXY_BUF_SIZE ? len : PROXY_BUF_SIZE;
+
+		rx->start = rx->end = 0;
+		if (rx_fill(from, rx, 1)) {
+			return 1;
+		}
+		if (rx->end > chunk) {
+			rx->end = chunk;
+		}
+		if (write_all(to, rx->data, rx->end)) {
+			return 1;
+		}
+		len -= rx->end;
+		__atomic_add_fetch(&proxy_stats.copied, rx->end, __ATOMIC_RELAXED);
+		rx->start = rx->end = 0;
+	}
+	return 0;
+}
+
+/* Bytes of the payload of an image whose wire header is at <header>,
+ * of IMG_HEADER_SIZE or IMZ_HEADER_SIZE bytes as said by its magic */
+static uint64_t payload_bytes(const char * header)
+{
+	uint32_t width, height, len;
+
+	memcpy(&width, header + 3, sizeof(width));
+	memcpy(&height, header + 7, sizeof(height));
+	if (!memcmp(header, "IMZ", 3)) {
+		memcpy(&len, header + 11, sizeof(len));
+		return len;
+	}
+	return (uint64_t)width * height * sizeof(uint32_t);
+}
+
+/* Read the wire header of an image from <rx>, into <header>. Returns
+ * its size, or 0 on error. */
+static size_t read_image_header(int fd, struct rx_buf * rx, char * header)
+{
+	size_t len;
+
+	if (rx_fill(fd, rx, 3)) {
+		return 0;
+	}
+	if (!memcmp(rx->data + rx->start, "IMG", 3)) {
+		len = IMG_HEADER_SIZE;
+	} else if (!memcmp(rx->data + rx->start, "IMZ", 3)) {
+		len = IMZ_HEADER_SIZE;
+	} else {
+		return 0;
+	}
+	if (rx_fill(fd, rx, len)) {
+		return 0;
+	}
+	memcpy(header, rx->data + rx->start, len);
+	rx->start += len;
+	return len;
+}
+
+static int connect_to_shard(const struct shard * shard)
+{
+	struct addrinfo hints, * res, * ai;
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(shard->host, shard->port, &hints, &res)) {
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && !connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			break;
+		}
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	if (fd >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+/* Send what is buffered for the shard of <link> */
+static int link_flush(struct link * link)
+{
+	int err = link->tx_len && write_all(link->fd, link->tx, link->tx_len);
+
+	link->tx_len = 0;
+	return err;
+}
+
+static int links_flush(struct proxy_conn * conn)
+{
+	size_t s;
+	int err = 0;
+
+	for (s = 0; s < shard_count; ++s) {
+		err |= link_flush(&conn->links[s]);
+	}
+	return err;
+}
+
+static int link_append(struct link * link, const void * data, size_t len)
+{
+	if (link->tx_len + len > PROXY_BUF_SIZE && link_flush(link)) {
+		return 1;
+	}
+	memcpy(link->tx + link->tx_len, data, len);
+	link->tx_len += len;
+	return 0;
+}
+
+/* Note a request of the client with ID <req_id> going to the shard of
+ * <link>, and return its ID there */
+static uint64_t link_track(struct link * link, uint64_t req_id, uint8_t op)
+{
+	struct pending * p;
+	uint64_t seq;
+
+	pthread_mutex_lock(&link->lock);
+	seq = link->next_seq++;
+
+	/* The slot is still taken by a request that many back */
+	if (link->pending[seq & (link->pending_size - 1)].used) {
+		size_t size = 2 * link->pending_size, i;
+		struct pending * grown = (struct pending *)calloc(size, sizeof(struct pending));
+
+		if (!grown) {
+			pthread_mutex_unlock(&link->lock);
+			return UINT64_MAX;
+		}
+		for (i = 0; i < link->pending_size; ++i) {
+			if (link->pending[i].used) {
+				grown[link->pending[i].seq & (size - 1)] = link->pending[i];
+			}
+		}
+		free(link->pending);
+		link->pending = grown;
+		link->pending_size = size;
+	}
+
+	p = &link->pending[seq & (link->pending_size - 1)];
+	p->seq = seq;
+	p->req_id = req_id;
+	p->op = op;
+	p->used = 1;
+	pthread_mutex_unlock(&link->lock);
+	return seq;
+}
+
+/* Take the request that the response with ID <seq> on <link> is for.
+ * Returns 1 if there is none. */
+static int link_untrack(struct link * link, uint64_t seq, struct pending * out)
+{
+	struct pending * p;
+	int err;
+
+	pthread_mutex_lock(&link->lock);
+	p = &link->pending[seq & (link->pending_size - 1)];
+	err = !p->used || p->seq != seq;
+	if (!err) {
+		*out = *p;
+		p->used = 0;
+	}
+	pthread_mutex_unlock(&link->lock);
+	return err;
+}
+
+/* Shard that request <req_id> of the client is pending on, with its ID
+ * there in <seq>. Returns shard_count if it is not pending anywhere. */
+static size_t links_find(struct proxy_conn * conn, uint64_t req_id, uint64_t * seq)
+{
+	size_t s, i;
+
+	for (s = 0; s < shard_count; ++s) {
+		struct link * link = &conn->links[s];
+
+		pthread_mutex_lock(&link->lock);
+		for (i = 0; i < link->pending_size; ++i) {
+			if (link->pending[i].used && link->pending[i].req_id == req_id) {
+				*seq = link->pending[i].seq;
+				pthread_mutex_unlock(&link->lock);
+				return s;
+			}
+		}
+		pthread_mutex_unlock(&link->lock);
+	}
+	return shard_count;
+}
+
+/* Connect to all the shards, in the mode of the client */
+static int links_open(struct proxy_conn * conn)
+{
+	size_t s;
+
+	for (s = 0; s < shard_count; ++s) {
+		struct link * link = &conn->links[s];
+
+		link->fd = connect_to_shard(&shards[s]);
+		if (link->fd < 0) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to connect to shard %s:%s\n",
+				shards[s].host, shards[s].port);
+			return 1;
+		}
+		conn->links_open++;
+
+		/* As the client asked for it, see REQ_FRAME_COMPRESSED
+		 * and REQ_FRAME_DEADLINE */
+		if (conn->compressed || conn->deadlines) {
+			struct frame_header hdr;
+
+			hdr.magic = htole32(REQ_FRAME_MAGIC);
+			hdr.version = htole16(REQ_FRAME_VERSION |
+					      (conn->compressed ? REQ_FRAME_COMPRESSED : 0) |
+					      (conn->deadlines ? REQ_FRAME_DEADLINE : 0));
+			hdr.count = 0;
+			if (link_append(link, &hdr, sizeof(hdr))) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void conn_release(struct proxy_conn * conn)
+{
+	size_t s;
+
+	if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	for (s = 0; s < PROXY_MAX_SHARDS; ++s) {
+		struct link * link = &conn->links[s];
+
+		if ((int)s < conn->links_open) {
+			close(link->fd);
+		}
+		pthread_mutex_destroy(&link->lock);
+		free(link->pending);
+		free(link->tx);
+		free(link->rx.data);
+	}
+	close(conn->up_pipe[0]);
+	close(conn->up_pipe[1]);
+	close(conn->down_pipe[0]);
+	close(conn->down_pipe[1]);
+	close(conn->fd);
+	free(conn->rx.data);
+	free(conn->tx);
+	free(conn);
+}
+
+/* Stop both threads of <conn>: whatever they are blocked on fails */
+static void conn_abort(struct proxy_conn * conn)
+{
+	int s;
+
+	shutdown(conn->fd, SHUT_RDWR);
+	for (s = 0; s < conn->links_open; ++s) {
+		shutdown(conn->links[s].fd, SHUT_RDWR);
+	}
+}
+
+static int conn_reply_flush(struct proxy_conn * conn)
+{
+	int err = conn->tx_len && write_all(conn->fd, conn->tx, conn->tx_len);
+
+	conn->tx_len = 0;
+	return err;
+}
+
+/* Queue <resp> for the client in its encoding */
+static int conn_reply(struct proxy_conn * conn, const struct response * resp)
+{
+	size_t len = conn->packed ? sizeof(struct response_v2) : sizeof(struct response);
+
+	if (conn->tx_len + len > PROXY_BUF_SIZE && conn_reply_flush(conn)) {
+		return 1;
+	}
+	if (conn->packed) {
+		response_to_v2((struct response_v2 *)(conn->tx + conn->tx_len), resp);
+	} else {
+		memcpy(conn->tx + conn->tx_len, resp, sizeof(*resp));
+	}
+	conn->tx_len += len;
+	return 0;
+}
+
+/* Forward the response at the front of the buffer of the shard <s>,
+ * with the payload that follows it. Returns 1 on error. */
+static int forward_response(struct proxy_conn * conn, size_t s)
+{
+	struct link * link = &conn->links[s];
+	struct response resp;
+	struct pending req;
+	char header[IMZ_HEADER_SIZE];
+	size_t header_len;
+
+	memcpy(&resp, link->rx.data + link->rx.start, sizeof(resp));
+	link->rx.start += sizeof(resp);
+	if (link_untrack(link, resp.req_id, &req)) {
+		ERROR_INFO();
+		fprintf(stderr, "Response to an unknown request from shard %ld\n", s);
+		return 1;
+	}
+	__atomic_add_fetch(&proxy_stats.responses, 1, __ATOMIC_RELAXED);
+
+	resp.req_id = req.req_id;
+	if (resp.ack == RESP_COMPLETED && req.op != IMG_CANCEL) {
+		resp.img_id = resp.img_id << PROXY_SHARD_BITS | s;
+	}
+	if (conn_reply(conn, &resp)) {
+		return 1;
+	}
+	if (resp.ack != RESP_COMPLETED ||
+	    (req.op != IMG_RETRIEVE && req.op != IMG_RETRIEVE_REGION)) {
+		return 0;
+	}
+
+	/* The payload leaves right after its response */
+	header_len = read_image_header(link->fd, &link->rx, header);
+	return !header_len || conn_reply_flush(conn) ||
+		write_all(conn->fd, header, header_len) ||
+		forward_payload(link->fd, conn->fd, &link->rx, conn->down_pipe,
+				payload_bytes(header));
+}
+
+/* Thread that forwards to the client what the shards send back */
+static void * down_main(void * arg)
+{
+	struct proxy_conn * conn = (struct proxy_conn *)arg;
+	struct pollfd fds[PROXY_MAX_SHARDS];
+	size_t s, open = shard_count;
+
+	for (s = 0; s < shard_count; ++s) {
+		fds[s].fd = conn->links[s].fd;
+		fds[s].events = POLLIN;
+	}
+
+	while (open) {
+		if (conn_reply_flush(conn)) {
+			goto fail;
+		}
+		if (poll(fds, shard_count, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+
+		for (s = 0; s < shard_count; ++s) {
+			struct link * link = &conn->links[s];
+			struct rx_buf * rx = &link->rx;
+
+			if (!fds[s].revents) {
+				continue;
+			}
+
+			/* One read, which does not block, and then every
+			 * response that it completed */
+			if (rx_fill(link->fd, rx, rx->end - rx->start + 1)) {
+				fds[s].fd = -1;
+				open--;
+				continue;
+			}
+			while (rx->end - rx->start >= sizeof(struct response)) {
+				if (forward_response(conn, s)) {
+					goto fail;
+				}
+			}
+		}
+	}
+
+	/* The shards are done with the client */
+	conn_reply_flush(conn);
+	shutdown(conn->fd, SHUT_WR);
+	conn_release(conn);
+	return NULL;
+
+fail:
+	conn_abort(conn);
+	conn_release(conn);
+	return NULL;
+}
+
+/* Send request <req> of the client, and its deadline, rectangle or
+ * payload, to its shard. Returns 1 on error. */
+static int forward_request(struct proxy_conn * conn, struct request * req,
+			   const uint32_t * deadline, const struct img_region * region)
+{
+	char header[IMZ_HEADER_SIZE];
+	size_t header_len = 0;
+	struct link * link;
+	uint64_t shard;
+
+	if (req->img_op == IMG_REGISTER) {
+		shard = ring_lookup(mix64(conn->number * 0x100000001B3ULL ^ req->req_id));
+		header_len = read_image_header(conn->fd, &conn->rx, header);
+		if (!header_len) {
+			ERROR_INFO();
+			fprintf(stderr, "Invalid image payload.\n");
+			return 1;
+		}
+	} else if (req->img_op == IMG_CANCEL) {
+		/* Goes where the request is, under its ID there. One that
+		 * is not pending is rejected by shard 0. */
+		shard = links_find(conn, req->img_id, &req->img_id);
+		if (shard == shard_count) {
+			shard = 0;
+			req->img_id = PROXY_UNKNOWN_ID;
+		}
+	} else {
+		shard = req->img_id & PROXY_SHARD_MASK;
+		req->img_id >>= PROXY_SHARD_BITS;
+		if (shard >= shard_count) {
+			shard = 0;
+			req->img_id = PROXY_UNKNOWN_ID;
+		}
+	}
+
+	link = &conn->links[shard];
+	req->req_id = link_track(link, req->req_id, req->img_op);
+	__atomic_add_fetch(&proxy_stats.requests, 1, __ATOMIC_RELAXED);
+	if (req->req_id == UINT64_MAX || link_append(link, req, sizeof(*req)) ||
+	    (deadline && link_append(link, deadline, sizeof(*deadline))) ||
+	    (region && link_append(link, region, sizeof(*region)))) {
+		return 1;
+	}
+	if (!header_len) {
+		return 0;
+	}
+
+	return link_append(link, header, header_len) || link_flush(link) ||
+		forward_payload(conn->fd, link->fd, &conn->rx, conn->up_pipe,
+				payload_bytes(header));
+}
+
+/* Thread that reads the requests of the client, in any of the
+ * encodings of the server, and sends them to the shards */
+static void * up_main(void * arg)
+{
+	struct proxy_conn * conn = (struct proxy_conn *)arg;
+	struct rx_buf * rx = &conn->rx;
+	pthread_t down;
+
+	for (;;) {
+		struct request req;
+		struct img_region region;
+		uint32_t deadline;
+		size_t len;
+
+		/* Nothing buffered: the shards get what they have before
+		 * waiting on the client */
+		if (rx->end - rx->start < sizeof(struct frame_header) &&
+		    ((conn->started && links_flush(conn)) ||
+		     rx_fill(conn->fd, rx, sizeof(struct frame_header)))) {
+			break;
+		}
+
+		if (!conn->frame_left) {
+			struct frame_header hdr;
+			int frame, valid, version;
+
+			memcpy(&hdr, rx->data + rx->start, sizeof(hdr));
+			frame = le32toh(hdr.magic) == REQ_FRAME_MAGIC;
+			version = le16toh(hdr.version) & ~REQ_FRAME_FLAGS;
+
+			/* The first frame sets the mode, as on the server */
+			if (!conn->started) {
+				conn->started = 1;
+				if (frame) {
+					conn->packed = version == REQ_FRAME_VERSION_PACKED;
+					conn->compressed =
+						!!(le16toh(hdr.version) & REQ_FRAME_COMPRESSED);
+					conn->deadlines =
+						!!(le16toh(hdr.version) & REQ_FRAME_DEADLINE);
+				}
+				if (links_open(conn)) {
+					break;
+				}
+				__atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+				if (pthread_create(&down, NULL, down_main, conn)) {
+					__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+					break;
+				}
+				pthread_detach(down);
+			}
+
+			valid = conn->packed ? frame && version == REQ_FRAME_VERSION_PACKED
+				: !frame || version == REQ_FRAME_VERSION;
+			if (!valid || (frame && le16toh(hdr.count) > REQ_FRAME_MAX)) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid request frame.\n");
+				break;
+			}
+			if (frame) {
+				conn->frame_left = le16toh(hdr.count);
+				rx->start += sizeof(hdr);
+				continue;
+			}
+		}
+
+		len = conn->packed ? sizeof(struct request_v2) : sizeof(struct request);
+		if (rx_fill(conn->fd, rx, len)) {
+			break;
+		}
+		if (conn->packed) {
+			request_from_v2(&req, (const struct request_v2 *)(rx->data + rx->start));
+		} else {
+			memcpy(&req, rx->data + rx->start, sizeof(req));
+		}
+		rx->start += len;
+		if (conn->frame_left) {
+			conn->frame_left--;
+		}
+
+		/* Passed on as they are, little-endian. The deadline counts
+		 * from the receipt by the shard, a little later. */
+		if (conn->deadlines) {
+			if (rx_fill(conn->fd, rx, sizeof(deadline))) {
+				break;
+			}
+			memcpy(&deadline, rx->data + rx->start, sizeof(deadline));
+			rx->start += sizeof(deadline);
+		}
+		if (req.img_op == IMG_RETRIEVE_REGION) {
+			if (rx_fill(conn->fd, rx, sizeof(region))) {
+				break;
+			}
+			memcpy(&region, rx->data + rx->start, sizeof(region));
+			rx->start += sizeof(region);
+		}
+
+		if (forward_request(conn, &req, conn->deadlines ? &deadline : NULL,
+				    req.img_op == IMG_RETRIEVE_REGION ? &region : NULL)) {
+			conn_abort(conn);
+			break;
+		}
+	}
+
+	/* The shards answer what they got and then close their end, which
+	 * is where the other thread stops */
+	if (conn->started) {
+		size_t s;
+
+		links_flush(conn);
+		for (s = 0; s < (size_t)conn->links_open; ++s) {
+			shutdown(conn->links[s].fd, SHUT_WR);
+		}
+		if ((size_t)conn->links_open < shard_count) {
+			conn_abort(conn);
+		}
+	}
+	conn_release(conn);
+	return NULL;
+}
+
+static struct proxy_conn * conn_create(int fd, uint64_t number)
+{
+	struct proxy_conn * conn = (struct proxy_conn *)calloc(1, sizeof(struct proxy_conn));
+	size_t s;
+	int err;
+
+	if (!conn) {
+		return NULL;
+	}
+	conn->fd = fd;
+	conn->number = number;
+	conn->refs = 1;
+	conn->rx.data = (char *)malloc(PROXY_BUF_SIZE);
+	conn->tx = (char *)malloc(PROXY_BUF_SIZE);
+	err = !conn->rx.data || !conn->tx;
+
+	for (s = 0; s < PROXY_MAX_SHARDS; ++s) {
+		struct link * link = &conn->links[s];
+
+		pthread_mutex_init(&link->lock, NULL);
+		if (s < shard_count) {
+			link->pending_size = PENDING_INITIAL;
+			link->pending = (struct pending *)calloc(PENDING_INITIAL,
+								 sizeof(struct pending));
+			link->tx = (char *)malloc(PROXY_BUF_SIZE);
+			link->rx.data = (char *)malloc(PROXY_BUF_SIZE);
+			err |= !link->pending || !link->tx || !link->rx.data;
+		}
+	}
+
+	conn->up_pipe[0] = conn->up_pipe[1] = conn->down_pipe[0] = conn->down_pipe[1] = -1;
+	err |= pipe2(conn->up_pipe, O_CLOEXEC) || pipe2(conn->down_pipe, O_CLOEXEC);
+	if (!err) {
+		fcntl(conn->up_pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+		fcntl(conn->down_pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+	}
+
+	if (err) {
+		conn->fd = -1; /* Closed by the caller */
+		conn_release(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/* Add the shards of the comma-separated <list> of host:port pairs */
+static int parse_shards(char * list)
+{
+	char * tok, * save;
+
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char * colon = strrchr(tok, ':');
+
+		if (!colon || colon == tok || !colon[1] || shard_count == PROXY_MAX_SHARDS) {
+			return 1;
+		}
+		*colon = '\0';
+		shards[shard_count].host = tok;
+		shards[shard_count].port = colon + 1;
+		shard_count++;
+	}
+	return !shard_count;
+}
+
+int main (int argc, char ** argv)
+{
+	struct sockaddr_in addr;
+	struct pollfd fds[2];
+	size_t vnodes = DEFAULT_VNODES;
+	sigset_t sigs;
+	int sockfd, signal_fd, opt, optval = 1;
+	in_port_t port;
+	uint64_t number = 0;
+
+	while ((opt = getopt(argc, argv, "s:V:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (parse_shards(optarg)) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid shard list.\n" USAGE_STRING, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'V':
+			vnodes = strtol(optarg, NULL, 10);
+			if (!vnodes) {
+				vnodes = 1;
+			}
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!shard_count || optind >= argc) {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+	port = strtol(argv[optind], NULL, 10);
+	if (ring_build(vnodes)) {
+		ERROR_INFO();
+		perror("Unable to build the hash ring");
+		return EXIT_FAILURE;
+	}
+
+	printf("INFO: sharding over %ld servers, %ld points each on the ring\n",
+	       shard_count, vnodes);
+	for (size_t s = 0; s < shard_count; ++s) {
+		printf("INFO: shard %ld at %s:%s\n", s, shards[s].host, shards[s].port);
+	}
+	printf("INFO: setting proxy port as: %d\n", port);
+	PRINT_BUILD_INFO();
+
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		ERROR_INFO();
+		perror("Unable to create socket");
+		return EXIT_FAILURE;
+	}
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sockfd, BACKLOG_COUNT) < 0) {
+		ERROR_INFO();
+		perror("Unable to listen on socket");
+		return EXIT_FAILURE;
+	}
+
+	/* Only delivered through signal_fd, before any thread starts */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	signal(SIGPIPE, SIG_IGN);
+	if (signal_fd < 0) {
+		ERROR_INFO();
+		perror("Unable to create the signal descriptor");
+		return EXIT_FAILURE;
+	}
+
+	fds[0].fd = sockfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		struct proxy_conn * conn;
+		pthread_t up;
+		int fd;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+
+		fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+		conn = conn_create(fd, number++);
+		if (!conn) {
+			ERROR_INFO();
+			perror("Unable to set up a connection");
+			close(fd);
+			continue;
+		}
+		if (pthread_create(&up, NULL, up_main, conn)) {
+			ERROR_INFO();
+			perror("Unable to start a connection");
+			conn_release(conn);
+			continue;
+		}
+		pthread_detach(up);
+		__atomic_add_fetch(&proxy_stats.conns, 1, __ATOMIC_RELAXED);
+	}
+
+	printf("INFO: proxy connections=%lu requests=%lu responses=%lu "
+	       "spliced=%lu bytes copied=%lu bytes\n",
+	       __atomic_load_n(&proxy_stats.conns, __ATOMIC_RELAXED),
+	       __atomic_load_n(&proxy_stats.requests, __ATOMIC_RELAXED),
+	       __atomic_load_n(&proxy_stats.responses, __ATOMIC_RELAXED),
+	       __atomic_load_n(&proxy_stats.spliced, __ATOMIC_RELAXED),
+	       __atomic_load_n(&proxy_stats.copied, __ATOMIC_RELAXED));
+
+	/* The ring stays: the connections still open use it until exit */
+	close(signal_fd);
+	close(sockfd);
+	return EXIT_SUCCESS;
+}
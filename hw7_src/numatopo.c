@@ -0,0 +1,197 @@
+/*******************************************************************************
+* NUMA Topology and Page Placement (implementation)
+*
+* Description:
+*     Discovery of the NUMA nodes and moving of pages, see numatopo.h.
+*
+* Notes:
+*     The kernel numbers the nodes as it likes, with holes: the nodes of
+*     struct numatopo are numbered from 0 instead, and <kernel_node> maps
+*     them back for mbind() and get_mempolicy().
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numatopo.h"
+
+#define NUMATOPO_SYSFS "/sys/devices/system/node"
+
+/* Of the node masks of mbind(), in bits */
+#define NUMATOPO_MASK_BITS 1024
+
+/* Add the CPUs of the list at <path>, e.g. 0-3,8,10-11, to <set> */
+static int read_cpulist(const char * path, cpu_set_t * set)
+{
+	char buf[4096], * p, * tok, * save;
+	FILE * f = fopen(path, "r");
+	size_t len;
+
+	if (!f) {
+		return 1;
+	}
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	CPU_ZERO(set);
+	for (p = buf; (tok = strtok_r(p, ",\n", &save)); p = NULL) {
+		long first = strtol(tok, &tok, 10), last = first;
+
+		if (*tok == '-') {
+			last = strtol(tok + 1, NULL, 10);
+		}
+		for (; first <= last && first < CPU_SETSIZE; ++first) {
+			CPU_SET(first, set);
+		}
+	}
+	return 0;
+}
+
+/* A single node with all the allowed CPUs */
+static void single_node(struct numatopo * topo, const cpu_set_t * allowed)
+{
+	int cpu;
+
+	topo->nodes = 1;
+	topo->kernel_node[0] = 0;
+	CPU_ZERO(&topo->node_cpus[0]);
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		topo->cpu_node[cpu] = CPU_ISSET(cpu, allowed) ? 0 : -1;
+		if (CPU_ISSET(cpu, allowed)) {
+			CPU_SET(cpu, &topo->node_cpus[0]);
+		}
+	}
+}
+
+static int kernel_node_cmp(const void * a, const void * b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+int numatopo_discover(struct numatopo * topo)
+{
+	int found[NUMATOPO_MAX_NODES], count = 0, i, cpu;
+	cpu_set_t allowed;
+	struct dirent * entry;
+	DIR * dir;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		return 1;
+	}
+
+	dir = opendir(NUMATOPO_SYSFS);
+	if (!dir) {
+		single_node(topo, &allowed);
+		return 0;
+	}
+	while ((entry = readdir(dir)) && count < NUMATOPO_MAX_NODES) {
+		char * end;
+		long node;
+
+		if (strncmp(entry->d_name, "node", 4)) {
+			continue;
+		}
+		node = strtol(entry->d_name + 4, &end, 10);
+		if (end != entry->d_name + 4 && !*end) {
+			found[count++] = node;
+		}
+	}
+	closedir(dir);
+	qsort(found, count, sizeof(int), kernel_node_cmp);
+
+	topo->nodes = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		topo->cpu_node[cpu] = -1;
+	}
+	for (i = 0; i < count; ++i) {
+		char path[sizeof(NUMATOPO_SYSFS) + 64];
+		cpu_set_t cpus;
+
+		snprintf(path, sizeof(path), NUMATOPO_SYSFS "/node%d/cpulist", found[i]);
+		if (read_cpulist(path, &cpus)) {
+			continue;
+		}
+		CPU_AND(&cpus, &cpus, &allowed);
+		if (!CPU_COUNT(&cpus)) {
+			continue;
+		}
+
+		topo->node_cpus[topo->nodes] = cpus;
+		topo->kernel_node[topo->nodes] = found[i];
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				topo->cpu_node[cpu] = topo->nodes;
+			}
+		}
+		topo->nodes++;
+	}
+
+	/* The allowed CPUs that no node lists go to the first one */
+	if (!topo->nodes) {
+		single_node(topo, &allowed);
+		return 0;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && topo->cpu_node[cpu] < 0) {
+			topo->cpu_node[cpu] = 0;
+			CPU_SET(cpu, &topo->node_cpus[0]);
+		}
+	}
+	return 0;
+}
+
+int numatopo_current_node(const struct numatopo * topo)
+{
+	int cpu = sched_getcpu();
+
+	return cpu >= 0 && cpu < CPU_SETSIZE && topo->cpu_node[cpu] >= 0 ?
+		topo->cpu_node[cpu] : 0;
+}
+
+int numatopo_node_of(const struct numatopo * topo, const void * addr)
+{
+	int kernel_node;
+	size_t node;
+
+	if (syscall(SYS_get_mempolicy, &kernel_node, NULL, 0, addr,
+		    MPOL_F_NODE | MPOL_F_ADDR)) {
+		return -1;
+	}
+	for (node = 0; node < topo->nodes; ++node) {
+		if (topo->kernel_node[node] == kernel_node) {
+			return node;
+		}
+	}
+	return -1;
+}
+
+int numatopo_move(const struct numatopo * topo, void * addr, size_t len, int node)
+{
+	unsigned long mask[NUMATOPO_MASK_BITS / (8 * sizeof(unsigned long))];
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+	uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+	int kernel_node;
+
+	if (node < 0 || (size_t)node >= topo->nodes) {
+		return 1;
+	}
+	kernel_node = topo->kernel_node[node];
+	if (kernel_node >= NUMATOPO_MASK_BITS) {
+		return 1;
+	}
+
+	memset(mask, 0, sizeof(mask));
+	mask[kernel_node / (8 * sizeof(unsigned long))] |=
+		1UL << (kernel_node % (8 * sizeof(unsigned long)));
+	return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+		       NUMATOPO_MASK_BITS + 1, MPOL_MF_MOVE) != 0;
+}
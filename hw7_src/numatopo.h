@@ -0,0 +1,50 @@
+/*******************************************************************************
+* NUMA Topology and Page Placement (header)
+*
+* Description:
+*     The NUMA nodes of the machine, with the CPUs of each, as listed by
+*     the kernel in /sys/devices/system/node, and the moving of memory
+*     from one node to another. A machine without that directory, or a
+*     kernel without NUMA support, has a single node with all the CPUs.
+*
+* Notes:
+*     Talks to the kernel through the system calls directly rather than
+*     libnuma, which is not always installed. Only the CPUs the process
+*     may run on are counted in the nodes.
+*
+*******************************************************************************/
+#ifndef __NUMATOPO_H__
+#define __NUMATOPO_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+/* With _GNU_SOURCE, for cpu_set_t */
+#include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define NUMATOPO_MAX_NODES 64
+
+struct numatopo {
+	size_t nodes;
+	int cpu_node[CPU_SETSIZE];              /* -1 if not allowed */
+	cpu_set_t node_cpus[NUMATOPO_MAX_NODES];
+	int kernel_node[NUMATOPO_MAX_NODES];    /* Its number for the kernel */
+};
+
+/* Fill <topo> with the nodes of the machine. Nodes without any
+ * allowed CPU are left out, and the ones after them renumbered.
+ * Returns 0 on success and 1 on error. */
+int numatopo_discover(struct numatopo * topo);
+
+/* Node that the calling thread runs on */
+int numatopo_current_node(const struct numatopo * topo);
+
+/* Node of <topo> that the page at <addr> is on, -1 if unknown */
+int numatopo_node_of(const struct numatopo * topo, const void * addr);
+
+/* Move the pages of the <len> bytes at <addr> to <node>, and prefer it
+ * for those not faulted in yet. Returns 0 on success and 1 on error. */
+int numatopo_move(const struct numatopo * topo, void * addr, size_t len, int node);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
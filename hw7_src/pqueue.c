@@ -0,0 +1,144 @@
+/*******************************************************************************
+* Request Priority Queue (implementation)
+*
+* Description:
+*     A bounded binary min-heap of fixed-size elements, see pqueue.h.
+*
+* Notes:
+*     The heap is stored in an array, with the children of node <i> at
+*     2i + 1 and 2i + 2. Nodes are compared on their key first and on
+*     their sequence number second, so no two nodes are ever equal and
+*     the order of the pops does not depend on the shape of the heap.
+*
+*******************************************************************************/
+
+#include <string.h>
+
+#include "pqueue.h"
+
+static int node_less(const struct pqueue_node * a, const struct pqueue_node * b)
+{
+	return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static int node_cmp(const void * a, const void * b)
+{
+	const struct pqueue_node * na = (const struct pqueue_node *)a;
+	const struct pqueue_node * nb = (const struct pqueue_node *)b;
+
+	return node_less(na, nb) ? -1 : node_less(nb, na);
+}
+
+static void * pqueue_elem(struct pqueue * q, uint32_t slot)
+{
+	return q->elems + (size_t)slot * q->elem_size;
+}
+
+int pqueue_init(struct pqueue * q, size_t capacity, size_t elem_size)
+{
+	size_t i;
+
+	memset(q, 0, sizeof(struct pqueue));
+	q->capacity = capacity;
+	q->elem_size = elem_size;
+
+	q->heap = (struct pqueue_node *)malloc(capacity * sizeof(struct pqueue_node));
+	q->scratch = (struct pqueue_node *)malloc(capacity * sizeof(struct pqueue_node));
+	q->free_slots = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+	q->elems = (char *)malloc(capacity * elem_size);
+
+	if (!q->heap || !q->scratch || !q->free_slots || !q->elems) {
+		pqueue_destroy(q);
+		return 1;
+	}
+
+	/* The free slots are a stack: the top is at <capacity - count - 1> */
+	for (i = 0; i < capacity; ++i) {
+		q->free_slots[i] = capacity - 1 - i;
+	}
+
+	return 0;
+}
+
+void pqueue_destroy(struct pqueue * q)
+{
+	free(q->heap);
+	free(q->scratch);
+	free(q->free_slots);
+	free(q->elems);
+	memset(q, 0, sizeof(struct pqueue));
+}
+
+int pqueue_push(struct pqueue * q, uint64_t key, const void * elem)
+{
+	struct pqueue_node node;
+	size_t pos;
+
+	if (q->count == q->capacity) {
+		return 1;
+	}
+
+	node.key = key;
+	node.seq = q->next_seq++;
+	node.slot = q->free_slots[q->capacity - q->count - 1];
+	memcpy(pqueue_elem(q, node.slot), elem, q->elem_size);
+
+	/* Sift up: move parents down until <node> fits */
+	for (pos = q->count++; pos > 0; ) {
+		size_t parent = (pos - 1) / 2;
+
+		if (!node_less(&node, &q->heap[parent])) {
+			break;
+		}
+		q->heap[pos] = q->heap[parent];
+		pos = parent;
+	}
+	q->heap[pos] = node;
+
+	return 0;
+}
+
+int pqueue_pop(struct pqueue * q, void * out)
+{
+	struct pqueue_node last;
+	size_t pos, child;
+
+	if (q->count == 0) {
+		return 1;
+	}
+
+	memcpy(out, pqueue_elem(q, q->heap[0].slot), q->elem_size);
+	q->free_slots[q->capacity - q->count] = q->heap[0].slot;
+
+	/* Sift down: the last node takes the place of the root */
+	last = q->heap[--q->count];
+	for (pos = 0; (child = 2 * pos + 1) < q->count; pos = child) {
+		if (child + 1 < q->count && node_less(&q->heap[child + 1], &q->heap[child])) {
+			++child;
+		}
+		if (!node_less(&q->heap[child], &last)) {
+			break;
+		}
+		q->heap[pos] = q->heap[child];
+	}
+	if (q->count) {
+		q->heap[pos] = last;
+	}
+
+	return 0;
+}
+
+size_t pqueue_snapshot(struct pqueue * q, void * out)
+{
+	size_t i;
+
+	memcpy(q->scratch, q->heap, q->count * sizeof(struct pqueue_node));
+	qsort(q->scratch, q->count, sizeof(struct pqueue_node), node_cmp);
+
+	for (i = 0; i < q->count; ++i) {
+		memcpy((char *)out + i * q->elem_size,
+		       pqueue_elem(q, q->scratch[i].slot), q->elem_size);
+	}
+
+	return q->count;
+}
@@ -0,0 +1,76 @@
+/*******************************************************************************
+* Request Priority Queue (header)
+*
+* Description:
+*     A bounded binary min-heap of fixed-size elements ordered by a
+*     64-bit key, for the policies that do not serve requests in arrival
+*     order. Insertions and removals take O(log n) steps, regardless of
+*     how many requests are queued.
+*
+* Notes:
+*     The heap only moves small (key, sequence, slot) nodes around: the
+*     elements themselves stay in a pool of slots and are copied exactly
+*     once on the way in and once on the way out. Elements with the same
+*     key come out in the order they went in. Not thread-safe: callers
+*     provide their own locking.
+*
+*******************************************************************************/
+#ifndef __PQUEUE_H__
+#define __PQUEUE_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct pqueue_node {
+	uint64_t key;
+	uint64_t seq;  /* Insertion order, to break ties */
+	uint32_t slot; /* Where the element lives in <elems> */
+};
+
+struct pqueue {
+	struct pqueue_node * heap;
+	struct pqueue_node * scratch; /* For pqueue_snapshot() */
+	uint32_t * free_slots;
+	char * elems;
+	size_t elem_size;
+	size_t capacity;
+	size_t count;
+	uint64_t next_seq;
+};
+
+/* Initialize <q> to hold up to <capacity> elements of <elem_size>
+ * bytes each. Returns 0 on success and 1 on allocation failure. */
+int pqueue_init(struct pqueue * q, size_t capacity, size_t elem_size);
+
+/* Release the memory of <q> */
+void pqueue_destroy(struct pqueue * q);
+
+/* Copy <elem> into <q> with priority <key>, lower first. Returns 0 on
+ * success and 1 if the queue is full. */
+int pqueue_push(struct pqueue * q, uint64_t key, const void * elem);
+
+/* Copy the element with the lowest key into <out> and remove it.
+ * Returns 0 on success and 1 if the queue is empty. */
+int pqueue_pop(struct pqueue * q, void * out);
+
+/* Key of the element that pqueue_pop() would return. <q> must not be
+ * empty. */
+static inline uint64_t pqueue_min_key(const struct pqueue * q)
+{
+	return q->heap[0].key;
+}
+
+/* Number of elements in <q> */
+static inline size_t pqueue_count(const struct pqueue * q)
+{
+	return q->count;
+}
+
+/* Copy the queued elements into <out> in the order in which they
+ * would be popped. <out> must have room for the capacity of <q>.
+ * Returns the number of elements copied. */
+size_t pqueue_snapshot(struct pqueue * q, void * out);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
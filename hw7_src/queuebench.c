@@ -0,0 +1,294 @@
+/*******************************************************************************
+* Request Queue Benchmark
+*
+* Description:
+*     Compares the lock-free ring in ringq.c and the per-consumer rings
+*     with work stealing in workq.c against the semaphore-guarded
+*     circular queue that the servers used before, which is reproduced
+*     below as the baseline. A number of producer threads push requests
+*     into a queue drained by a number of consumer threads, and the
+*     throughput of each implementation is reported, together with the
+*     speedup of the two lock-free queues over the baseline.
+*
+* Usage:
+*     <build directory>/queuebench [-p <producers>] [-c <consumers>]
+*                                  [-q <queue size>] [-n <requests>]
+*
+*     e.g. ./build/queuebench -p 1 -c 8 -q 100
+*
+* Notes:
+*     A push on a full queue fails in both implementations, as it does in
+*     the servers. Here the producers retry until they succeed, so that
+*     every run moves the same number of requests; the number of failed
+*     pushes is reported as well. With work stealing, the producers
+*     deal their requests out to the consumers round-robin, and every
+*     ring can hold <queue size> requests; the number of requests taken
+*     from the ring of another consumer is reported as well.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common.h"
+#include "ringq.h"
+#include "workq.h"
+
+#define USAGE_STRING							\
+	"Usage: %s [-p <producers>] [-c <consumers>] "			\
+	"[-q <queue size>] [-n <requests>]\n"
+
+/* Same layout as the request_meta of the servers */
+struct request_meta {
+	struct request request;
+	struct timespec receipt_timestamp;
+	struct timespec start_timestamp;
+	struct timespec completion_timestamp;
+	void * conn;
+	void * reply;
+};
+
+/* The baseline: a circular buffer protected by a mutex semaphore, with
+ * a counting semaphore for the consumers to wait on */
+struct sem_queue {
+	sem_t mutex;
+	sem_t notify;
+	size_t wr_pos;
+	size_t rd_pos;
+	size_t max_size;
+	size_t available;
+	struct request_meta * requests;
+};
+
+static void sem_queue_init(struct sem_queue * q, size_t size)
+{
+	sem_init(&q->mutex, 0, 1);
+	sem_init(&q->notify, 0, 0);
+	q->wr_pos = q->rd_pos = 0;
+	q->max_size = q->available = size;
+	q->requests = (struct request_meta *)malloc(size * sizeof(struct request_meta));
+}
+
+static int sem_queue_push(struct sem_queue * q, const struct request_meta * req)
+{
+	int retval = 0;
+
+	sem_wait(&q->mutex);
+	if (q->available == 0) {
+		retval = 1;
+	} else {
+		q->requests[q->wr_pos] = *req;
+		q->wr_pos = (q->wr_pos + 1) % q->max_size;
+		q->available--;
+		sem_post(&q->notify);
+	}
+	sem_post(&q->mutex);
+
+	return retval;
+}
+
+static void sem_queue_pop(struct sem_queue * q, struct request_meta * req)
+{
+	sem_wait(&q->notify);
+	sem_wait(&q->mutex);
+	*req = q->requests[q->rd_pos];
+	q->rd_pos = (q->rd_pos + 1) % q->max_size;
+	q->available++;
+	sem_post(&q->mutex);
+}
+
+enum bench_impl {
+	IMPL_SEM,
+	IMPL_RING,
+	IMPL_STEAL
+};
+
+struct bench {
+	enum bench_impl impl;
+	struct sem_queue sq;
+	struct ringq ring;
+	struct workq work;
+	size_t next_consumer;
+	size_t per_producer;
+	uint64_t full;
+	uint64_t checksum;
+};
+
+static int bench_push(struct bench * b, size_t i, const struct request_meta * req)
+{
+	switch (b->impl) {
+	case IMPL_SEM:
+		return sem_queue_push(&b->sq, req);
+	case IMPL_RING:
+		return ringq_push(&b->ring, req);
+	default:
+		return workq_push(&b->work, i, req);
+	}
+}
+
+static void * producer_main(void * arg)
+{
+	struct bench * b = (struct bench *)arg;
+	struct request_meta req;
+	uint64_t full = 0;
+	size_t i;
+
+	memset(&req, 0, sizeof(req));
+	for (i = 0; i < b->per_producer; ++i) {
+		req.request.req_id = i + 1;
+		while (bench_push(b, i, &req)) {
+			++full;
+			sched_yield();
+		}
+	}
+
+	__atomic_add_fetch(&b->full, full, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* A request with ID 0 tells the consumer to stop */
+static void * consumer_main(void * arg)
+{
+	struct bench * b = (struct bench *)arg;
+	struct request_meta req;
+	uint64_t sum = 0;
+	size_t self = __atomic_fetch_add(&b->next_consumer, 1, __ATOMIC_RELAXED);
+
+	for (;;) {
+		if (b->impl == IMPL_SEM)
+			sem_queue_pop(&b->sq, &req);
+		else if (b->impl == IMPL_RING ? ringq_pop(&b->ring, &req)
+			 : workq_pop(&b->work, self, &req))
+			break;
+		if (req.request.req_id == 0)
+			break;
+		sum += req.request.req_id;
+	}
+
+	__atomic_add_fetch(&b->checksum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static double run(enum bench_impl impl, int producers, int consumers,
+		  size_t queue_size, size_t requests, uint64_t * full,
+		  uint64_t * steals, int * ok)
+{
+	pthread_t * threads = (pthread_t *)malloc((producers + consumers) * sizeof(pthread_t));
+	struct timespec start, end;
+	struct bench b;
+	uint64_t expected;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.impl = impl;
+	b.per_producer = requests / producers;
+	if (impl == IMPL_SEM)
+		sem_queue_init(&b.sq, queue_size);
+	else if (impl == IMPL_RING)
+		ringq_init(&b.ring, queue_size, sizeof(struct request_meta));
+	else
+		workq_init(&b.work, consumers, queue_size, sizeof(struct request_meta));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < consumers; ++i)
+		pthread_create(&threads[producers + i], NULL, consumer_main, &b);
+	for (i = 0; i < producers; ++i)
+		pthread_create(&threads[i], NULL, producer_main, &b);
+	for (i = 0; i < producers; ++i)
+		pthread_join(threads[i], NULL);
+
+	/* Stop the consumers once everything has been pushed */
+	if (impl == IMPL_SEM) {
+		struct request_meta stop;
+		memset(&stop, 0, sizeof(stop));
+		for (i = 0; i < consumers; ++i)
+			while (sem_queue_push(&b.sq, &stop))
+				sched_yield();
+	} else if (impl == IMPL_RING) {
+		ringq_close(&b.ring);
+	} else {
+		workq_close(&b.work);
+	}
+	for (i = 0; i < consumers; ++i)
+		pthread_join(threads[producers + i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	expected = (uint64_t)producers * b.per_producer * (b.per_producer + 1) / 2;
+	*ok = (b.checksum == expected);
+	*full = b.full;
+	*steals = b.work.steals;
+
+	if (impl == IMPL_SEM)
+		free(b.sq.requests);
+	else if (impl == IMPL_RING)
+		ringq_destroy(&b.ring);
+	else
+		workq_destroy(&b.work);
+	free(threads);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main (int argc, char ** argv)
+{
+	const char * names[] = { "sem", "ring", "steal" };
+	int opt, producers = 1, consumers = 4, ok[3], all_ok = 1;
+	size_t queue_size = 100, requests = 1000000;
+	double secs[3];
+	uint64_t full[3], steals[3];
+	int i;
+
+	while((opt = getopt(argc, argv, "p:c:q:n:")) != -1) {
+		switch (opt) {
+		case 'p':
+			producers = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			consumers = strtol(optarg, NULL, 10);
+			break;
+		case 'q':
+			queue_size = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			requests = strtol(optarg, NULL, 10);
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (producers <= 0 || consumers <= 0 || !queue_size || requests < (size_t)producers) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Same share for every producer */
+	requests -= requests % producers;
+
+	for (i = IMPL_SEM; i <= IMPL_STEAL; ++i) {
+		secs[i] = run((enum bench_impl)i, producers, consumers, queue_size, requests,
+			      &full[i], &steals[i], &ok[i]);
+		all_ok = all_ok && ok[i];
+	}
+
+	PRINT_BUILD_INFO();
+	printf("%-6s %4s %4s %6s %10s %12s %12s %12s\n", "IMPL", "PROD", "CONS", "QSIZE",
+	       "TIME(s)", "MREQ/s", "FULL", "STEALS");
+	for (i = IMPL_SEM; i <= IMPL_STEAL; ++i) {
+		printf("%-6s %4d %4d %6ld %10.3f %12.3f %12lu %12lu%s\n", names[i], producers,
+		       consumers, queue_size, secs[i], requests / secs[i] / 1e6, full[i],
+		       steals[i], ok[i] ? "" : "  LOST!");
+	}
+	printf("speedup: ring %.2fx, steal %.2fx\n", secs[IMPL_SEM] / secs[IMPL_RING],
+	       secs[IMPL_SEM] / secs[IMPL_STEAL]);
+
+	return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
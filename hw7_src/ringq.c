@@ -0,0 +1,227 @@
+/*******************************************************************************
+* Lock-Free Request Ring (implementation)
+*
+* Description:
+*     A bounded multi-producer/multi-consumer FIFO ring of fixed-size
+*     elements, see ringq.h.
+*
+* Notes:
+*     Every slot carries a sequence number that tells the two sides
+*     whose turn it is. A slot at position <pos> is free for a producer
+*     when its sequence number equals <pos>, and holds an element ready
+*     for a consumer when it equals <pos> + 1. After popping, the
+*     consumer sets it to <pos> + <capacity>, i.e. the position at
+*     which the slot comes around again for the next producer.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ringq.h"
+
+static char * ringq_cell(struct ringq * q, size_t pos)
+{
+	return q->cells + (pos % q->capacity) * q->cell_size;
+}
+
+static size_t * ringq_seq(char * cell)
+{
+	return (size_t *)cell;
+}
+
+static void * ringq_data(char * cell)
+{
+	return cell + sizeof(size_t);
+}
+
+static void futex_wait(uint32_t * addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t * addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int ringq_init(struct ringq * q, size_t capacity, size_t elem_size)
+{
+	size_t i;
+
+	memset(q, 0, sizeof(struct ringq));
+	q->capacity = capacity ? capacity : 1;
+	q->elem_size = elem_size;
+	/* Keep the payload of every slot 8-byte aligned */
+	q->cell_size = (sizeof(size_t) + elem_size + 7) & ~(size_t)7;
+
+	if (posix_memalign((void **)&q->cells, RINGQ_CACHELINE,
+			   q->capacity * q->cell_size)) {
+		q->cells = NULL;
+		return 1;
+	}
+
+	for (i = 0; i < q->capacity; ++i)
+		*ringq_seq(ringq_cell(q, i)) = i;
+
+	return 0;
+}
+
+void ringq_destroy(struct ringq * q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+int ringq_push_nowake(struct ringq * q, const void * elem)
+{
+	size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	char * cell;
+
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+
+		cell = ringq_cell(q, pos);
+		seq = __atomic_load_n(ringq_seq(cell), __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			/* The slot is free: try to claim it */
+			if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* Still holding the element from one lap ago */
+			return 1;
+		} else {
+			/* Another producer got here first */
+			pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(ringq_data(cell), elem, q->elem_size);
+	__atomic_store_n(ringq_seq(cell), pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int ringq_push(struct ringq * q, const void * elem)
+{
+	if (ringq_push_nowake(q, elem))
+		return 1;
+
+	/* Only pay for the system call if a consumer may be asleep */
+	__atomic_add_fetch(&q->events, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST))
+		futex_wake(&q->events, 1);
+
+	return 0;
+}
+
+int ringq_try_pop(struct ringq * q, void * out)
+{
+	size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	char * cell;
+
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+
+		cell = ringq_cell(q, pos);
+		seq = __atomic_load_n(ringq_seq(cell), __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* Nothing published at the head */
+			return 1;
+		} else {
+			pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(out, ringq_data(cell), q->elem_size);
+	__atomic_store_n(ringq_seq(cell), pos + q->capacity, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int ringq_pop(struct ringq * q, void * out)
+{
+	for (;;) {
+		uint32_t events;
+
+		if (!ringq_try_pop(q, out))
+			return 0;
+
+		/* Announce the intention to sleep, then look again: a
+		 * producer either sees us in <sleepers> or has already
+		 * bumped <events>, so the wake-up cannot be missed. */
+		__atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+		events = __atomic_load_n(&q->events, __ATOMIC_SEQ_CST);
+
+		if (!ringq_try_pop(q, out)) {
+			__atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+			return 0;
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+			__atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+			return 1;
+		}
+
+		futex_wait(&q->events, events);
+		__atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void ringq_close(struct ringq * q)
+{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&q->events, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->events, INT_MAX);
+}
+
+size_t ringq_length(struct ringq * q)
+{
+	size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+	/* A consumer may claim a slot just pushed before we see it */
+	return tail > head ? tail - head : 0;
+}
+
+size_t ringq_snapshot(struct ringq * q, void * out)
+{
+	size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+	size_t pos, count = 0;
+
+	for (pos = head; pos != tail && count < q->capacity; ++pos) {
+		char * cell = ringq_cell(q, pos);
+		char * dst = (char *)out + count * q->elem_size;
+
+		if (__atomic_load_n(ringq_seq(cell), __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+
+		memcpy(dst, ringq_data(cell), q->elem_size);
+
+		/* Keep the copy only if the slot did not change under it.
+		 * The release half of the read-modify-write, which writes
+		 * the same number back, keeps the copy before the re-read,
+		 * where a plain load would need a fence. */
+		if (__atomic_fetch_add(ringq_seq(cell), 0, __ATOMIC_ACQ_REL) == pos + 1)
+			++count;
+	}
+
+	return count;
+}
@@ -0,0 +1,84 @@
+/*******************************************************************************
+* Lock-Free Request Ring (header)
+*
+* Description:
+*     A bounded multi-producer/multi-consumer FIFO ring of fixed-size
+*     elements. Producers and consumers claim slots with a single
+*     compare-and-swap on a shared position counter and hand them over
+*     through a per-slot sequence number (D. Vyukov's bounded MPMC
+*     queue), so neither side ever takes a lock. Consumers that find the
+*     ring empty sleep on a futex until a producer publishes an element.
+*
+* Notes:
+*     The capacity does not need to be a power of two: the ring holds
+*     exactly the number of elements it is created with, and a push on a
+*     full ring fails right away so that the caller can reject the
+*     request.
+*
+*******************************************************************************/
+#ifndef __RINGQ_H__
+#define __RINGQ_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define RINGQ_CACHELINE 64
+
+struct ringq {
+	/* Written by producers only */
+	size_t enqueue_pos __attribute__((aligned(RINGQ_CACHELINE)));
+
+	/* Written by consumers only */
+	size_t dequeue_pos __attribute__((aligned(RINGQ_CACHELINE)));
+
+	/* Sleep/wake-up state, touched only around empty periods */
+	uint32_t events __attribute__((aligned(RINGQ_CACHELINE)));
+	uint32_t sleepers;
+	int closed;
+
+	/* Read-only after ringq_init() */
+	size_t capacity __attribute__((aligned(RINGQ_CACHELINE)));
+	size_t elem_size;
+	size_t cell_size;
+	char * cells;
+};
+
+/* Initialize <q> to hold up to <capacity> elements of <elem_size>
+ * bytes each. Returns 0 on success and 1 on allocation failure. */
+int ringq_init(struct ringq * q, size_t capacity, size_t elem_size);
+
+/* Release the memory of <q>. No thread may be using it anymore. */
+void ringq_destroy(struct ringq * q);
+
+/* Copy <elem> at the tail of <q>. Returns 0 on success and 1 if the
+ * ring is full. */
+int ringq_push(struct ringq * q, const void * elem);
+
+/* Same as ringq_push(), without waking up any consumer sleeping in
+ * ringq_pop(), for callers that have sleep protocols of their own */
+int ringq_push_nowake(struct ringq * q, const void * elem);
+
+/* Copy the element at the head of <q> into <out>. Returns 0 on
+ * success and 1 if the ring is empty. Never blocks. */
+int ringq_try_pop(struct ringq * q, void * out);
+
+/* Same as ringq_try_pop(), but sleeps while the ring is empty. Returns
+ * 1 only once the ring has been closed with ringq_close(). */
+int ringq_pop(struct ringq * q, void * out);
+
+/* Wake up all the sleeping consumers and make the ones that find the
+ * ring empty return from ringq_pop(). */
+void ringq_close(struct ringq * q);
+
+/* Approximate number of elements in <q>, for heuristics only */
+size_t ringq_length(struct ringq * q);
+
+/* Best-effort copy of the queued elements, oldest first, into <out>,
+ * which must have room for the capacity of <q>. Elements that are
+ * being pushed or popped while the snapshot is taken may be left out.
+ * Returns the number of elements copied. */
+size_t ringq_snapshot(struct ringq * q, void * out);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
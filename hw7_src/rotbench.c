@@ -0,0 +1,170 @@
+/*******************************************************************************
+* Rotation Benchmark
+*
+* Description:
+*     Compares the tiled rotate90Clockwise() and rotate90ClockwiseInPlace()
+*     in the imglib against the original row-by-row implementation, which
+*     is reproduced below as the baseline. For each BMP image passed on
+*     the command line, every variant is run a number of times and the
+*     median time per run is reported, together with the speedup over
+*     the baseline. The output of the tiled and in-place variants is
+*     also checked against the baseline.
+*
+* Usage:
+*     <build directory>/rotbench [-r <repetitions>] <image.bmp> [...]
+*
+*     e.g. ./build/rotbench ../hw6_src/images/test*.bmp
+*
+* Notes:
+*     The in-place variant only avoids the second buffer on square
+*     images. Non-square inputs go through a temporary buffer, so its
+*     numbers for those are reported for completeness only.
+*
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define USAGE_STRING						\
+	"Usage: %s [-r <repetitions>] <image.bmp> [...]\n"
+
+#define DEFAULT_REPS 20
+
+#define pix(img, x, y)				\
+	img->pixels[((y) * img->width) + (x)]
+
+/* The original implementation, kept as the baseline */
+static struct image * rotate90Clockwise_base(const struct image * img)
+{
+	struct image * rotated = createImage(img->height, img->width);
+	uint32_t y, x;
+
+	for (y = 0; y < img->height; y++) {
+		for (x = 0; x < img->width; x++) {
+			uint32_t newX = y;
+			uint32_t newY = img->width - x - 1;
+			pix(rotated, newX, newY) = pix(img, x, y);
+		}
+	}
+
+	return rotated;
+}
+
+static int cmp_double(const void * a, const void * b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+static double elapsed_ms(struct timespec * start, struct timespec * end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 +
+		(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int same_image(const struct image * a, const struct image * b)
+{
+	return a->width == b->width && a->height == b->height &&
+		!memcmp(a->pixels, b->pixels,
+			(size_t)a->width * a->height * sizeof(uint32_t));
+}
+
+int main (int argc, char ** argv)
+{
+	int opt, reps = DEFAULT_REPS;
+	double * samples;
+
+	while((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reps = strtol(optarg, NULL, 10);
+			break;
+		default: /* '?' */
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || reps <= 0) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	samples = (double *)malloc(reps * sizeof(double));
+
+	PRINT_BUILD_INFO();
+	printf("%-30s %11s %10s %10s %8s %10s %8s\n", "IMAGE", "SIZE",
+	       "BASE(ms)", "TILED(ms)", "SPEEDUP", "INPL(ms)", "SPEEDUP");
+
+	for (; optind < argc; ++optind) {
+		struct image * img = loadBMP(argv[optind]);
+		struct image * base_out, * tiled_out, * work;
+		struct timespec start, end;
+		double base_ms, tiled_ms, inpl_ms;
+		int i, ok;
+
+		if (!img) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to load image %s\n", argv[optind]);
+			continue;
+		}
+
+		/* Baseline */
+		for (i = 0; i < reps; ++i) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			base_out = rotate90Clockwise_base(img);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			samples[i] = elapsed_ms(&start, &end);
+			if (i + 1 < reps)
+				deleteImage(base_out);
+		}
+		qsort(samples, reps, sizeof(double), cmp_double);
+		base_ms = samples[reps / 2];
+
+		/* Tiled */
+		for (i = 0; i < reps; ++i) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			tiled_out = rotate90Clockwise(img, NULL);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			samples[i] = elapsed_ms(&start, &end);
+			if (i + 1 < reps)
+				deleteImage(tiled_out);
+		}
+		qsort(samples, reps, sizeof(double), cmp_double);
+		tiled_ms = samples[reps / 2];
+
+		/* In-place: rotate the same copy over and over. After
+		 * a multiple of 4 runs it is back to the original. */
+		work = cloneImage(img, NULL);
+		for (i = 0; i < reps; ++i) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			rotate90ClockwiseInPlace(work);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			samples[i] = elapsed_ms(&start, &end);
+		}
+		qsort(samples, reps, sizeof(double), cmp_double);
+		inpl_ms = samples[reps / 2];
+
+		/* Bring the in-place copy to exactly one rotation */
+		for (i = reps % 4; i != 1; i = (i + 1) % 4)
+			rotate90ClockwiseInPlace(work);
+
+		ok = same_image(base_out, tiled_out) && same_image(base_out, work);
+
+		printf("%-30s %5ux%-5u %10.3f %10.3f %7.2fx %10.3f %7.2fx%s\n",
+		       argv[optind], img->width, img->height, base_ms,
+		       tiled_ms, base_ms / tiled_ms, inpl_ms, base_ms / inpl_ms,
+		       ok ? "" : "  MISMATCH!");
+
+		deleteImage(base_out);
+		deleteImage(tiled_out);
+		deleteImage(work);
+		deleteImage(img);
+	}
+
+	free(samples);
+	return EXIT_SUCCESS;
+}
@@ -10,13 +10,79 @@
 *     size.
 *
 * Usage:
-*     <build directory>/server -q <queue_size> -w <workers> -p <policy> <port_number>
+*     <build directory>/server -q <queue_size> -w <workers> -p <policy>
+*                              [-C <client_queue>]
+*                              [-W <max_workers>] [-f <fast_workers>]
+*                              [-t <cheap_us>] [-K <stack_kb>] [-N]
+*                              [-B <spin_us>] [-Y <busy_poll_us>]
+*                              [-j <helpers>] [-b <band_pixels>] [-z]
+*                              [-c <cache_mb>] [-l <layout>] [-u] [-S <slo_ms>]
+*                              [-A] [-T <trace_file>] [-Q <dump_period>]
+*                              [-P <stats_ms>] [-L <lazy_chain>]
+*                              [-M <memory_mb>] [-F <spill_file>] [-Z]
+*                              [-R <snapshot_file>] [-I <snapshot_ms>]
+*                              <port_number>
 *
 * Parameters:
 *     port_number - The port number to bind the server to.
 *     queue_size  - The maximum number of queued requests.
+*     client_queue - The maximum number of requests of one client that are
+*                   queued or being processed (default: a fair share of
+*                   <queue_size> under FAIR, no limit of its own otherwise).
 *     workers     - The number of parallel threads to process requests.
-*     policy      - The queue policy to use for request dispatching.
+*     max_workers - Let the number of workers grow up to this many with the
+*                   load, and shrink back to <workers> (default: <workers>).
+*     fast_workers - Keep this many of the workers for the requests that are
+*                   estimated to be cheap, under FIFO (default: 0).
+*     cheap_us    - The estimated service time under which a request is
+*                   cheap, in microseconds (default: 500).
+*     stack_kb    - The stack of the worker and helper threads, in KB
+*                   (default: 64, 1024 in the sanitizer builds).
+*     -N          - Spread the workers over the NUMA nodes, and keep the
+*                   images on the node of the workers that use them.
+*     spin_us     - Let the idle workers spin on the queue for this many
+*                   microseconds before they sleep (default: 0).
+*     busy_poll_us - Busy poll the sockets of the clients for this many
+*                   microseconds, with SO_BUSY_POLL (default: 0, off).
+*     policy      - The queue policy to use for request dispatching: FIFO,
+*                   SJN (shortest estimated operation first), SJNA (SJN
+*                   with aging) or FAIR (fair queueing of the clients).
+*     helpers     - The number of helper threads that split a single large
+*                   image operation in row bands (default: 0, disabled).
+*     band_pixels - The minimum number of pixels in a band. Images smaller
+*                   than twice this size are always processed by one thread.
+*     -z          - Send large image payloads with MSG_ZEROCOPY.
+*     cache_mb    - The budget of the cache of operation results, in MB
+*                   (default: 64, 0 disables the cache).
+*     layout      - The layout of imglib to keep the images in: linear
+*                   (row after row, the default), tiled or planar (one
+*                   8-bit plane per channel).
+*     -u          - Serve the sockets through io_uring instead of epoll.
+*     slo_ms      - Reject the requests that are not expected to complete
+*                   within this many milliseconds of their receipt (default:
+*                   0, only reject when the queue is full).
+*     -A          - Pin each worker to one of the CPUs the server may run on.
+*     trace_file  - Write the trace of the requests, with the length of the
+*                   queue, to this file as binary columns instead of
+*                   printing it (see tracedec and trace_load.py).
+*     dump_period - Print the queue every this many completed requests
+*                   (default: 16, 1 prints it after every request).
+*     stats_ms    - Print the latency percentiles every this many
+*                   milliseconds (default: 0, only when the server exits).
+*     lazy_chain  - Defer the filters that overwrite an image until its
+*                   pixels are needed, up to this many per image, at most
+*                   IMG_PIPELINE_MAX (default: 0, run them right away).
+*     memory_mb   - The budget of the pixels of the images kept in memory,
+*                   in MB, beyond which the coldest ones are spilled to disk
+*                   (default: 0, no limit).
+*     spill_file  - The file to spill the images to (default: an unlinked
+*                   temporary file in $TMPDIR or /tmp).
+*     -Z          - Compress the coldest images in memory before spilling
+*                   them, and spill them compressed.
+*     snapshot_file - Start with the images of this snapshot file, if it
+*                   exists, and keep a snapshot of the images in it.
+*     snapshot_ms - Write the images changed since the last snapshot every
+*                   this many milliseconds (default: 1000).
 *
 * Author:
 *     Renato Mancuso
@@ -33,6 +99,166 @@
 *     guaranteeing the order of processing. If the queue is full at the time a
 *     new request is received, the request is rejected with a negative ack.
 *
+*     Any number of clients can be connected at the same time: they are all
+*     served by an epoll event loop in the main thread, on nonblocking
+*     sockets, and share the workers, the queue and the registered images.
+*     The server runs until it gets SIGINT or SIGTERM.
+*
+*     Requests are read in large chunks and parsed many at a time. They
+*     may come one at a time, or in frames of many requests (see struct
+*     frame_header) from clients that support it. A client that starts
+*     with a frame of version 2 gets the packed encoding of the requests
+*     and responses instead (see struct request_v2).
+*
+*     IMG_RETRIEVE_REGION sends back a rectangle of an image, possibly
+*     shrunk, instead of all of it (see struct img_region). Any payload
+*     goes out at most CONN_TX_BURST bytes at a time per connection, in
+*     turn with the responses to the other clients, so that the small
+*     responses are not held up behind a retrieve of many MB.
+*
+*     With -u, the event loop submits its socket operations through
+*     io_uring instead: all the receives and sends of one round of
+*     completions go to the kernel with a single system call. Zerocopy
+*     sends are not used in that mode.
+*
+*     Image requests carry no length: under SJN, SJNA and FAIR, the
+*     service time of a request is estimated from its opcode and the size
+*     of its image when it becomes runnable, with a cost model that the
+*     workers keep learning from the operations they complete (see
+*     costmodel.h).
+*
+*     The same estimates drive the admission control of -S: a request is
+*     rejected on arrival if the work ahead of it, spread over the
+*     workers, plus its own go beyond the SLO (see admission.h). The
+*     counters of rejections and response times are printed whenever a
+*     client disconnects.
+*
+*     Clients may also give their requests deadlines (see
+*     REQ_FRAME_DEADLINE), and cancel the ones they no longer want (see
+*     IMG_CANCEL). A worker that takes a request past its deadline, or
+*     cancelled, answers it with RESP_EXPIRED or RESP_CANCELLED without
+*     running it, and the next request on its image goes ahead. The
+*     requests of a client whose connection fails are dropped the same
+*     way. A request that is expected to miss its deadline is rejected
+*     on arrival, like one that would miss the SLO. The dropped requests
+*     are counted along with the rejections.
+*
+*     Under FAIR, the clients get the workers in turn, in proportion to
+*     the estimated service time of their requests rather than to their
+*     number, so that a client that sends many or costly requests does
+*     not hold up the latency of the others (see fair_key()). Each one
+*     may also only fill its share of the queue: -C requests, or an
+*     equal part of it with the other clients that have some queued,
+*     one part being left for a client that comes next. The requests
+*     over the share are rejected, and counted as rejected_share. -C
+*     applies under the other policies as well.
+*
+*     Under FIFO, each worker has its own queue of runnable requests and
+*     idle workers steal from the queues of the others (see workq.h). The
+*     requests of an image go to the queue of the worker that last ran an
+*     operation on it, so that its pixels are still in that worker's
+*     caches, and to a worker picked by hashing the image ID the first
+*     time. With -A, the workers are also pinned to CPUs, so that the
+*     worker stays on the same core. The number of steals, and how often
+*     an operation ran on the worker that last touched its image, are
+*     printed when the server exits.
+*
+*     With -f, the first workers form a fast lane that only runs the
+*     requests estimated to take less than -t, such as the retrieves and
+*     the filters of small images, which then do not wait behind the
+*     filters of large images. The other workers run everything: the
+*     cheap requests go to the rings of the fast lane, and the others to
+*     theirs, but they also steal from the fast lane when it falls
+*     behind or they have nothing else to do (see workq_set_local()). The
+*     operations run by the fast lane are printed when the server exits.
+*
+*     With -W, the threads of all the workers up to that many are started,
+*     but only the first <workers> of them take requests at first: the
+*     others wait on a futex (see workerpool.h). Every POOL_PERIOD_MS, a
+*     thread looks at the length of the queue and the CPU time of the
+*     workers, and lets more of them in when the active ones are busy
+*     and fall behind while there are idle CPUs, or parks one of them
+*     again when they have been mostly idle for a while. New requests
+*     only go to the queues of the active workers, and the admission
+*     control of -S counts on those. The number of workers let in and
+*     parked is printed when the server exits. The stacks of the threads
+*     are mapped with a guard page below them, which turns an overflow
+*     into a crash; -K gives them more room.
+*
+*     With -N, the workers take the NUMA nodes in turn and only run on the
+*     CPUs of theirs (on one of them each with -A as well). Under FIFO,
+*     a worker steals from the other workers of its node first, and from
+*     those of another node only once they fall behind, or when its own
+*     node has nothing left (see workq.h). The pixels of a registered
+*     image are moved to the node of the worker that registers it, which
+*     the next operations on the image go to, and the images that the
+*     workers make come from buffers of their node (see setPoolNodes()).
+*     The requests, steals and moves of each node are printed along with
+*     the STATS lines.
+*
+*     With -B, a worker that finds the queue empty keeps looking at it,
+*     with a pause in between, for up to that long before it sleeps:
+*     requests that come meanwhile are taken without any wake-up, and the
+*     event loop makes no system call to push them while a worker spins
+*     (see workq_set_spin()). This trades a CPU for the latency of the
+*     wake-ups at moderate loads. With -Y, the kernel busy polls the
+*     network device for the receives of the clients rather than waiting
+*     for its interrupts (see SO_BUSY_POLL in socket(7)). The requests
+*     taken while spinning, and the wake-ups, are printed when the server
+*     exits.
+*
+*     With -L, a filter that overwrites an image is acked without running:
+*     it joins the chain of filters deferred on the image, which runs in
+*     one go through the fused pipeline of imglib when the image is
+*     retrieved, is the input of an operation that makes a new image, or
+*     has as many filters as asked for. Consecutive rotations cancel out
+*     or merge in the chain. The numbers of deferred, merged and run
+*     filters are printed when the server exits.
+*
+*     With -M, the pixels of the current versions of the images are kept
+*     within a budget: once they go over it, a spiller thread writes the
+*     least recently used ones to a spill store (see spill.h), in the
+*     file of -F or an unlinked temporary one, and frees them. The next
+*     operation on a spilled image reads it back first. The spiller takes
+*     an image over through its mailbox, like an operation would, so it
+*     never races with the workers. Images whose pixels are shared, with
+*     the result cache or through deduplication, stay in memory. The
+*     counters of the budget are printed whenever a client disconnects.
+*     With -Z as well, the spiller first compresses the coldest images in
+*     memory (see packImage()), which then count for their compressed
+*     size, and only spills the ones that are compressed already.
+*
+*     Clients may ask for the images they retrieve to be sent compressed
+*     (see REQ_FRAME_COMPRESSED), which costs the worker that runs the
+*     retrieve some time and saves the link about half of the bytes for
+*     photos. The images to register may come compressed from any client.
+*     The number of compressed payloads, and their bytes before and after,
+*     are printed when the server exits.
+*
+*     With -R, the server starts with the images of its snapshot file,
+*     under the same IDs, and keeps writing the ones that change to it
+*     from a snapshot thread (see snapshot.h). The file is mapped in
+*     memory and the images are used over their pixels there, straight
+*     away: only the pages that are read come from the disk, and only
+*     those that are written get a copy. The thread takes an image over
+*     through its mailbox like the spiller, but only for as long as it
+*     takes to pin its current version, so the workers never wait for
+*     the disk. An image that is busy at every pass is only written once
+*     it is not. The last snapshot is taken once the workers are gone,
+*     and its counters printed.
+*
+*     The workers and the event loop do not print the trace of the
+*     requests themselves: they record it in their own lock-free ring,
+*     which a flusher thread drains to stdout in the usual text format or,
+*     with -T, to a binary trace (see trace.h).
+*
+*     Each thread also keeps histograms of the queue wait, service and
+*     response times of the requests it completes, per operation (see
+*     histo.h), and the event loop one of the length of the queue at every
+*     arrival. Their percentiles since the start, along with the counters
+*     of the admission control, are printed as STATS lines every -P
+*     milliseconds and when the server exits.
+*
 *******************************************************************************/
 
 #define _GNU_SOURCE
@@ -43,27 +269,176 @@
 #include <signal.h>
 #include <assert.h>
 
-/* Needed for wait(...) */
 #include <sys/types.h>
-#include <sys/wait.h>
 
 /* Needed for semaphores */
 #include <semaphore.h>
 
+/* Needed for the worker and helper threads */
+#include <pthread.h>
+#include <errno.h>
+
+/* Needed for TCP_NODELAY */
+#include <netinet/tcp.h>
+
+/* Needed for the event loop of the connections */
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
 /* Include struct definitions and other libraries that need to be
  * included by both client and server */
 #include "common.h"
 
+/* Per-worker lock-free rings with stealing, the request queue under FIFO */
+#include "workq.h"
+
+/* Parking of the workers that the load does not need */
+#include "workerpool.h"
+
+/* NUMA nodes of the machine, for -N */
+#include "numatopo.h"
+
+/* Per-thread buffers for the trace of the requests */
+#include "trace.h"
+
+/* Histograms of the latencies, for the STATS lines */
+#include "histo.h"
+
+/* Heap used as the shared request queue under the other policies */
+#include "pqueue.h"
+
+/* Estimates of the service time of the image operations */
+#include "costmodel.h"
+
+/* Early rejection of the requests that would miss the SLO */
+#include "admission.h"
+
+/* Cache of image operation results */
+#include "imgcache.h"
+
+/* Optional io_uring engine of the event loop */
+#include "uring.h"
+
+/* Include the spill store of the cold images */
+#include "spill.h"
+
+/* Snapshot file of the registry, to start again from */
+#include "snapshot.h"
+
 #define BACKLOG_COUNT 100
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
 	"Usage: %s -q <queue size> "		\
+	"[-C <client queue>] "			\
 	"-w <workers: 1> "			\
-	"-p <policy: FIFO> "			\
+	"[-W <max workers>] "			\
+	"[-f <fast workers: 0>] "		\
+	"[-t <cheap us: 500>] "			\
+	"[-K <stack KB: 64>] "			\
+	"[-N] "					\
+	"[-B <spin us: 0>] "			\
+	"[-Y <busy poll us: 0>] "		\
+	"-p <policy: FIFO | SJN | SJNA | FAIR> "	\
+	"[-j <helpers: 0>] "			\
+	"[-b <band pixels>] "			\
+	"[-z] "					\
+	"[-c <cache MB: 64>] "			\
+	"[-l <layout: linear>] "		\
+	"[-u] "					\
+	"[-S <SLO ms: 0>] "			\
+	"[-A] "					\
+	"[-T <trace file>] "			\
+	"[-Q <dump period: 16>] "		\
+	"[-P <stats ms: 0>] "			\
+	"[-L <lazy chain: 0>] "			\
+	"[-M <memory MB: 0>] "			\
+	"[-F <spill file>] "			\
+	"[-Z] "					\
+	"[-R <snapshot file>] "			\
+	"[-I <snapshot ms: 1000>] "		\
 	"<port_number>\n"
 
-/* 4KB of stack for the worker thread */
-#define STACK_SIZE (4096)
+/* Default stack of the worker and helper threads, see -K. The imglib
+ * row kernels keep several KB of SIMD temporaries on the stack when
+ * built without optimizations, and the sanitizer builds make every
+ * frame much larger. */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define STACK_SIZE (1024 * 1024)
+#else
+#define STACK_SIZE (64 * 1024)
+#endif
+
+/* Estimated service time under which a request is cheap enough for
+ * the fast lane of -f, see -t */
+#define DEFAULT_CHEAP_US 500
+
+/* Period of the sizing of the pool of workers under -W */
+#define POOL_PERIOD_MS 10
+
+/* Smallest image payload worth the page pinning of MSG_ZEROCOPY */
+#define ZEROCOPY_MIN_BYTES (64 * 1024)
+
+/* Default minimum size of a row band, in pixels */
+#define DEFAULT_BAND_PIXELS (128 * 1024)
+
+/* Default budget of the result cache, in MB */
+#define DEFAULT_CACHE_MB 64
+
+/* Print the cache counters every this many cacheable operations */
+#define CACHE_STATS_PERIOD 100
+
+/* Print the queue every this many completed requests by default */
+#define DEFAULT_DUMP_PERIOD 16
+
+/* The spiller checks the memory budget at least this often */
+#define SPILL_PERIOD_MS 100
+
+/* Once over the memory budget, images are spilled until this fraction
+ * of it is left, so that it does not start over at the next publish */
+#define SPILL_LOW_WATER(budget) ((budget) / 8 * 7)
+
+/* Default period of the snapshots of the registry */
+#define DEFAULT_SNAPSHOT_MS 1000
+
+/* Records out of date that the snapshot file may hold, beyond as many
+ * bytes as the current ones, before it is compacted */
+#define SNAPSHOT_COMPACT_SLACK ((uint64_t)64 << 20)
+
+/* Records in the trace ring of each thread */
+#define TRACE_RING_RECORDS 4096
+
+/* Most events handled per call to epoll_wait() */
+#define MAX_EVENTS 64
+
+/* Most reads from one connection per event, so that a busy client
+ * does not hold up the others */
+#define CONN_RX_BUDGET 64
+
+/* Requests are read in chunks of up to this many bytes, and parsed
+ * many at a time */
+#define CONN_RX_BUF (16 * 1024)
+
+/* Most pieces of responses gathered in one sendmsg(): a run of small
+ * responses, possibly ending with an image payload */
+#define CONN_TX_IOV 64
+
+/* Most bytes sent on one connection per round of events, and of an
+ * image payload per send: a large retrieve goes out in chunks, in
+ * turn with the responses to the other connections, instead of
+ * holding up the event loop until the whole of it is out */
+#define CONN_TX_BURST (256 * 1024)
+
+/* Size of the io_uring submission queue: one receive and one send per
+ * connection, plus the accept and the reads of the event loop */
+#define URING_ENTRIES 256
+
+/* Kind of io_uring operation, in the low bits of its user data. The
+ * rest is the connection, or one of the tags of serve_clients(). */
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_MASK 3
 
 /* Mutex needed to protect the threaded printf. DO NOT TOUCH */
 sem_t * printf_mutex;
@@ -76,50 +451,352 @@ sem_t * printf_mutex;
 		sem_post(printf_mutex);		\
 	} while (0)
 
-/* START - Variables needed to protect the shared queue. DO NOT TOUCH */
-sem_t * queue_mutex;
-sem_t * queue_notify;
-/* END - Variables needed to protect the shared queue. DO NOT TOUCH */
+/* Images are kept in a segmented table: a fixed directory of blocks
+ * that are allocated on first use and never move, so looking up an
+ * image ID takes no lock even while new images are being added. */
+#define REGISTRY_BLOCK_BITS 10
+#define REGISTRY_BLOCK_SIZE (1UL << REGISTRY_BLOCK_BITS)
+#define REGISTRY_MAX_BLOCKS 4096
+#define REGISTRY_FULL ((uint64_t)-1)
+
+/* The digest of the current version is computed on first use and
+ * kept until a new version is published. Like the image itself, it is
+ * only ever accessed by the worker that owns the image. A registered
+ * image is <staged> until a worker publishes it. */
+struct registry_entry {
+	struct image * img;
+	struct image * staged;
+	uint64_t pixels; /* The same for all the versions */
+	int digest_valid;
+	struct md5digest digest;
+	uint8_t chain[IMG_PIPELINE_MAX]; /* Filters deferred on <img>, see -L */
+	uint8_t chain_len;
+	uint64_t last_use;         /* Value of use_clock when last accessed */
+	int spilled;               /* <img> is packed or in the spill store, see -M */
+	struct spill_extent spill;
+	uint8_t * packed;          /* Pixels compressed in memory, see -Z */
+	size_t packed_len;         /* Of the compressed pixels, in memory or spilled */
+	uint32_t spill_width;
+	uint32_t spill_height;
+	enum img_layout spill_layout;
+	uint64_t version;          /* Bumped when <img> or its chain changes */
+	uint64_t snap_version;     /* Of the last record of the image, see -R */
+	uint64_t snap_gen;         /* Snapshot file that record is in */
+	uint64_t snap_bytes;       /* Taken by that record in the file */
+};
+
+struct image_registry {
+	uint64_t next_id;
+	struct registry_entry * blocks[REGISTRY_MAX_BLOCKS];
+};
 
-struct image ** images = NULL;
-uint64_t image_counter = 0;
+struct image_registry registry;
 
-sem_t arr_mutex;
-sem_t * img_semaphores = NULL; //Array for handling semaphores for each image
-struct img_req_array *wait_op;
+/* Per-image mailboxes, protected by operation_mutex */
+struct img_mailbox * mailboxes = NULL;
+size_t mailbox_count = 0;
 sem_t * operation_mutex;
 
-sem_t conn_socket_mutex;
+/* Send image payloads with MSG_ZEROCOPY where supported */
+int zerocopy_enabled = 0;
+
+/* Run the event loop on io_uring rather than epoll */
+int uring_enabled = 0;
+
+/* Pin the workers to the CPUs in <worker_cpus>, one each */
+int pin_workers = 0;
+cpu_set_t worker_cpus;
+
+/* The workers that take requests, between -w and -W of them, and the
+ * thread that sizes their pool every POOL_PERIOD_MS */
+struct workerpool worker_pool;
+pthread_t pool_thread;
+sem_t pool_stop;
+
+/* Of the worker and helper threads, with a guard page below */
+size_t stack_size = STACK_SIZE;
+
+/* Under -N, the workers are spread over the NUMA nodes in turn and keep
+ * to the CPUs of their node, with a ring of requests on that node each
+ * (see workq_set_nodes()) */
+int numa_aware = 0;
+struct numatopo numa_topo;
+size_t * worker_node = NULL;
+
+/* Under -B, how long an idle worker spins on the queue before it
+ * sleeps, and under -Y, the SO_BUSY_POLL of the client sockets */
+nstime_t spin_ns = 0;
+int busy_poll_us = 0;
+
+/* Requests that one client may have queued or at the workers, see -C.
+ * 0 under FAIR leaves it to conn_share(), and elsewhere to the size of
+ * the queue only. */
+size_t client_queue = 0;
 
+/* The first <fast_workers> workers only run the requests estimated to
+ * take less than <cheap_ns>, see -f and -t */
+size_t fast_workers = 0;
+nstime_t cheap_ns = DEFAULT_CHEAP_US * 1000;
+struct node_stats {
+	uint64_t ops;         /* Requests completed by the workers of the node */
+	uint64_t moved;       /* Registered images moved to the node */
+	uint64_t moved_bytes;
+} node_stats[NUMATOPO_MAX_NODES];
+
+/* Layout of the pixels of the registered images and of their results */
+enum img_layout image_layout = IMG_LAYOUT_LINEAR;
+
+/* Overwriting filters deferred on an image at most, 0 to run them
+ * right away (see lazy_defer()) */
+size_t lazy_max = 0;
+struct {
+	uint64_t deferred;     /* Operations that did not run when dequeued */
+	uint64_t collapsed;    /* Filters that cancelled out or merged */
+	uint64_t materialized; /* Chains that ran */
+} lazy_stats;
+
+/* Bytes of pixels that the current versions of the images may keep in
+ * memory, 0 for no limit. Beyond that, the least recently used ones go
+ * to the spill store (see spill_main()). */
+size_t memory_budget = 0;
+struct spill_store spill_store;
+uint64_t resident_bytes = 0; /* Of the current versions in memory */
+uint64_t use_clock = 0;      /* Ticks at every access to an image */
+uint64_t resident_hits = 0;  /* Accesses that did not need a fault */
+
+/* Compress the coldest images in memory first, and only spill them
+ * once compressed (see -Z) */
+int compress_cold = 0;
+struct {
+	uint64_t packs;   /* Images compressed */
+	uint64_t unpacks; /* Compressed images accessed again */
+	uint64_t bytes;   /* Of the compressed images in memory */
+} cold_stats;
+
+/* Payloads of the responses sent compressed, and what they would have
+ * taken otherwise */
+struct {
+	uint64_t payloads;
+	uint64_t bytes;
+	uint64_t raw_bytes;
+} wire_stats;
+sem_t spill_wake;
+int spill_kicked = 0;
+int spill_stop = 0;
+
+/* Snapshot of the registry, see -R: the images that changed since the
+ * last pass are appended to the file that snapshot_gen names every
+ * snapshot_period_ms, by the thread below */
+int snapshot_enabled = 0;
+struct snap_file snapshot;
+uint64_t snapshot_gen = 1;
+uint64_t snapshot_period_ms = DEFAULT_SNAPSHOT_MS;
+uint64_t snapshot_restored = 0;
+pthread_t snapshot_thread;
+sem_t snapshot_stop;
+
+/* Results of earlier operations, NULL if disabled */
+struct imgcache * result_cache = NULL;
+uint64_t cache_ops = 0;
+
+/* Trace of the requests, one ring per worker plus one for the event
+ * loop, and the sampling of the queue dumps */
+struct trace tracer;
+size_t dump_period = DEFAULT_DUMP_PERIOD;
+uint64_t completed_ops = 0;
+
+#define OPCODE_COUNT (sizeof(__opcode_strings) / sizeof(__opcode_strings[0]))
+
+/* Latencies of the requests completed by one thread, per operation.
+ * Only the event loop records the lengths of the queue. */
+struct thread_stats {
+	struct histo wait[OPCODE_COUNT];
+	struct histo service[OPCODE_COUNT];
+	struct histo response[OPCODE_COUNT];
+	struct histo queue_len;
+};
+
+/* One per worker plus one for the event loop, like the trace rings */
+struct thread_stats * thread_stats = NULL;
+size_t thread_stats_count = 0;
+
+/* Period of the STATS lines, and the thread that prints them */
+uint64_t stats_period_ms = 0;
+pthread_t stats_thread;
+sem_t stats_stop;
+
+struct connection;
+struct send_item;
+
+/* <conn> is the client the request came from, and <reply> the
+ * response to fill in and hand back to it once done. <cost_ns> is the
+ * estimated service time, set when the request becomes runnable, and
+ * <deadline_ns> the time after which it is dropped rather than run, 0
+ * if never (see REQ_FRAME_DEADLINE). */
 struct request_meta {
 	struct request request;
 	struct timespec receipt_timestamp;
 	struct timespec start_timestamp;
 	struct timespec completion_timestamp;
+	struct connection * conn;
+	struct send_item * reply;
+	nstime_t cost_ns;
+	nstime_t deadline_ns;
+	struct img_region region; /* Of an IMG_RETRIEVE_REGION, host order */
 };
 
 enum queue_policy {
 	QUEUE_FIFO,
-	QUEUE_SJN
+	QUEUE_SJN,
+	QUEUE_SJN_AGING,
+	QUEUE_FAIR,
+	QUEUE_POLICIES
+};
+
+/* Under SJNA, waiting this long makes up for one unit of service time */
+#define AGING_RATE 10
+
+/* Every policy but FIFO serves the runnable requests in increasing
+ * order of a key, which is computed once for each request as it
+ * becomes runnable, with operation_mutex held */
+struct queue;
+typedef uint64_t (*policy_key_fn)(struct queue * the_queue, const struct request_meta * req);
+
+uint64_t sjn_key(struct queue * the_queue, const struct request_meta * req)
+{
+	(void)the_queue;
+	return req->cost_ns;
+}
+
+/* The effective cost is the estimate minus the time waited so far
+ * over AGING_RATE. All the queued requests age at the same pace, so at
+ * any point in time they are in the same order as cost + receipt time
+ * over AGING_RATE, which never changes. */
+uint64_t sjn_aging_key(struct queue * the_queue, const struct request_meta * req)
+{
+	(void)the_queue;
+	return req->cost_ns + timespec_to_ns(&req->receipt_timestamp) / AGING_RATE;
+}
+
+uint64_t fair_key(struct queue * the_queue, const struct request_meta * req);
+
+struct policy {
+	const char * name;
+	policy_key_fn key; /* NULL: in order of arrival, in the rings */
+};
+
+const struct policy policies[QUEUE_POLICIES] = {
+	[QUEUE_FIFO]      = { "FIFO", NULL },
+	[QUEUE_SJN]       = { "SJN",  sjn_key },
+	[QUEUE_SJN_AGING] = { "SJNA", sjn_aging_key },
+	[QUEUE_FAIR]      = { "FAIR", fair_key },
+};
+
+/* Work in the queue and at the workers, for all the clients */
+struct admission admission;
+
+/* Learned from all the completed operations, starting from priors in
+ * picoseconds per pixel. These are in the right order of magnitude for
+ * imglib on one core: rotations and copies touch every pixel once, the
+ * 3x3 filters nine times and the 5x5 Gaussian 25 times. */
+struct costmodel cost_model;
+
+const uint64_t cost_priors[] = {
+	[IMG_REGISTER]   = 1000,
+	[IMG_ROT90CLKW]  = 2000,
+	[IMG_BLUR]       = 10000,
+	[IMG_SHARPEN]    = 10000,
+	[IMG_VERTEDGES]  = 10000,
+	[IMG_HORIZEDGES] = 10000,
+	[IMG_RETRIEVE]   = 500,
+	[IMG_GAUSSBLUR]  = 25000,
+	[IMG_EMBOSS]     = 10000,
+	[IMG_SOBEL]      = 20000,
+	[IMG_RETRIEVE_REGION] = 2000,
 };
 
+/* Pixels that <req> reads of an image of <pixels> pixels: those of
+ * the rectangle of a region, as far as it is known before it runs */
+uint64_t request_pixels(const struct request_meta * req, uint64_t pixels)
+{
+	uint64_t area = (uint64_t)req->region.width * req->region.height;
+
+	if (req->request.img_op == IMG_RETRIEVE_REGION && area && area < pixels) {
+		return area;
+	}
+	return pixels;
+}
+
+/* Estimated service time of <req> on an image of <pixels> pixels: a
+ * pipeline costs as much as its stages */
+uint64_t estimate_cost(const struct request_meta * req, uint64_t pixels)
+{
+	const struct request * r = &req->request;
+
+	if (r->img_op == IMG_PIPELINE) {
+		return costmodel_estimate(&cost_model, r->pipeline,
+					  r->pipeline_len, pixels);
+	}
+	return costmodel_estimate(&cost_model, &r->img_op, 1, request_pixels(req, pixels));
+}
+
+/* Operations on the same image must run one at a time and in order of
+ * arrival. Each image has a mailbox with the requests waiting for it,
+ * and at most one request per image is runnable at any time: the next
+ * request of an image is moved among the runnable ones only when the
+ * previous one is done.
+ *
+ * Under FIFO, every worker has its own lock-free ring of runnable
+ * requests. A request goes to the ring of the worker that last ran an
+ * operation on its image, where the image is still warm in the caches
+ * (see queue_home()). Workers with an empty ring steal from the others
+ * before sleeping on the futex of workq_pop().
+ *
+ * Under the policies other than FIFO, the runnable requests are kept
+ * in a heap instead, protected by operation_mutex like the mailboxes,
+ * and idle workers sleep on <notify>. */
 struct queue {
-	size_t wr_pos;
-	size_t rd_pos;
-	size_t max_size;
-	size_t available;
+	struct workq work;
+	struct pqueue heap;
+	sem_t notify;
+	int closed;
 	enum queue_policy policy;
-	struct request_meta * requests;
+	size_t max_size;
+	size_t queued; /* Requests runnable or in a mailbox */
+	size_t workers;
+	uint64_t runs;        /* Operations completed, under operation_mutex */
+	uint64_t affine_runs; /* ... by the worker that ran the previous one */
+	uint64_t fast_runs;   /* ... by a worker of the fast lane */
+	uint64_t spin_pops;   /* Wake-ups taken while spinning, see -B */
+	uint64_t vtime;       /* Virtual time of FAIR, under operation_mutex */
+	struct request_meta * snapshot; /* Scratch space for dump_queue_status() */
+};
+
+/* FIFO of the requests that wait for an operation on the same image
+ * to complete. <busy> is set while a request of the image is runnable
+ * or being processed. <last_worker> is the worker that completed the
+ * latest operation on the image, -1 if none did yet. */
+struct img_mailbox {
+	struct request_meta * reqs;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	int busy;
+	int last_worker;
 };
 
 struct connection_params {
 	size_t queue_size;
-	size_t workers;
+	size_t workers;     /* Active at least, and threads started... */
+	size_t max_workers; /* ... of which at most this many active */
 	enum queue_policy queue_policy;
+	size_t helpers;
+	size_t band_pixels;
+	size_t cache_mb;
+	nstime_t slo_ns;
 };
 
 struct worker_params {
-	int conn_socket;
 	int worker_done;
 	struct queue * the_queue;
 	int worker_id;
@@ -130,466 +807,3858 @@ enum worker_command {
 	WORKERS_STOP
 };
 
-struct img_req_array {
-    uint64_t *request_ids; 
-    size_t count;           
-    size_t capacity; 
+/* Completion tracking for the bands of one image operation */
+struct band_group {
+	int pending;
+	sem_t done;
 };
 
+/* One row band of an image operation */
+struct band_task {
+	const struct image * src;
+	struct image * dst;
+	enum img_filter filter;
+	uint32_t y0;
+	uint32_t y1;
+	struct band_group * group;
+};
 
-void queue_init(struct queue * the_queue, size_t queue_size, enum queue_policy policy)
-{
-	the_queue->rd_pos = 0;
-	the_queue->wr_pos = 0;
-	the_queue->max_size = queue_size;
-	the_queue->requests = (struct request_meta *)malloc(sizeof(struct request_meta)
-						     * the_queue->max_size);
-	the_queue->available = queue_size;
-	the_queue->policy = policy;
-}
+/* Fork/join pool: a worker that picks a large image operation splits
+ * it in row bands and queues all but the first one here, where they
+ * are picked up by the helper threads. */
+struct band_pool {
+	sem_t mutex;
+	sem_t notify;
+	size_t wr_pos;
+	size_t rd_pos;
+	size_t max_size;
+	struct band_task ** tasks;
+	size_t helpers;
+	size_t band_pixels;
+};
 
-/* Add a new request <request> to the shared queue <the_queue> */
-int add_to_queue(struct request_meta to_add, struct queue * the_queue)
-{
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+struct helper_params {
+	int helper_done;
+	int helper_id;
+};
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
+struct band_pool * band_pool = NULL;
 
-	/* Make sure that the queue is not full */
-	if (the_queue->available == 0) {
-		retval = 1;
-	} else {
-		the_queue->requests[the_queue->wr_pos] = to_add;
-		the_queue->wr_pos = (the_queue->wr_pos + 1) % the_queue->max_size;
-		the_queue->available--;
+/* A response waiting to be sent, followed by the image payload of a
+ * retrieve when <img> is not NULL. The response to a request that is
+ * queued or at a worker is also on the list of the requests pending on
+ * its connection, for IMG_CANCEL: only the event loop uses that list,
+ * and only <cancelled> is shared with the workers. */
+struct send_item {
+	struct response resp;
+	struct response_v2 packed;
+	const void * wire;  /* Encoding of <resp> for the connection */
+	size_t wire_len;
+	struct image * img; /* Reference held until the payload is sent */
+	uint8_t * compressed; /* Payload for a client that asked for it */
+	size_t compressed_len;
+	uint32_t seq;       /* Zerocopy sequence number of the payload */
+	struct send_item * next;
+	uint64_t req_id;    /* Of the pending request */
+	int cancelled;
+	struct send_item * pend_prev;
+	struct send_item * pend_next;
+};
 
-		sem_wait(operation_mutex);
-		struct img_req_array *img_arr = &wait_op[to_add.request.img_id];
-		if (img_arr->count == img_arr->capacity) {
-			img_arr->capacity = (img_arr->capacity == 0) ? 1 : img_arr->capacity * 2;
-			img_arr->request_ids = realloc(img_arr->request_ids, img_arr->capacity * sizeof(uint64_t));
-		}
-		img_arr->request_ids[img_arr->count++] = to_add.request.req_id;
-		sem_post(operation_mutex);
+/* One client. All the clients are served by a single event loop in
+ * the main thread, which is the only one to read from and write to
+ * the sockets: the workers push their responses on the lock-free
+ * completion stack of the connection and put it on the ready list of
+ * the event loop. Only <completions> and <ready_next> are shared; the
+ * rest belongs to the event loop. */
+struct connection {
+	int fd;
+	int rx_open;     /* Still receiving requests */
+	int dead;        /* Socket error: the responses are dropped */
+	int closing;     /* On the list of connections to free */
+	uint32_t events; /* Current epoll interest */
+	size_t inflight; /* Requests whose response has not been sent */
 
-		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-		sem_post(queue_notify);
-	}
+	/* Request being received, and the payload of an IMG_REGISTER */
+	struct request_meta rx_req;
+	size_t rx_len;        /* Bytes at the front of <rx_buf> */
+	size_t rx_frame_left; /* Requests still to come in the current frame */
+	int rx_started;       /* The first message has been seen */
+	int packed;           /* Packed encoding, see struct request_v2 */
+	int compressed;       /* Compressed payloads, see REQ_FRAME_COMPRESSED */
+	int deadlines;        /* Requests with deadlines, see REQ_FRAME_DEADLINE */
+	int rx_image;
+	struct img_xfer rx_xfer;
+	struct md5ctx rx_md5;
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	/* Responses pushed by the workers, newest first. The first push
+	 * on an empty stack puts the connection on the ready list. */
+	struct send_item * completions;
+	struct connection * ready_next;
+
+	/* Responses to send, oldest first */
+	struct send_item * send_head;
+	struct send_item * send_tail;
+
+	/* Requests queued or at a worker, oldest first */
+	struct send_item * pend_head;
+	struct send_item * pend_tail;
+	size_t pending;
+
+	/* Virtual time at which the last request of FAIR made runnable
+	 * finishes, under operation_mutex, see fair_key() */
+	uint64_t fair_finish;
+
+	/* Progress on the response at the head of the queue */
+	size_t tx_bytes;
+	int tx_image;
+	struct img_xfer tx_xfer;
+
+	/* Payloads sent with MSG_ZEROCOPY that the kernel may still be
+	 * reading from, oldest first */
+	int zerocopy;
+	struct zerocopy_state zc;
+	struct send_item * zc_head;
+	struct send_item * zc_tail;
+
+	/* io_uring engine: operations submitted and not completed yet,
+	 * which the kernel may still be writing to or reading from */
+	int ops;
+	int rx_armed;
+	int tx_armed;
+	struct msghdr tx_msg;
+	struct iovec tx_iov[CONN_TX_IOV];
+
+	struct connection * prev;
+	struct connection * next;
+
+	/* Received and not parsed yet. Always empty while the rest of
+	 * a payload is received straight into the pixels. */
+	char rx_buf[CONN_RX_BUF];
+};
+
+/* State of the event loop */
+struct event_loop {
+	int epoll_fd;
+	int listen_fd;
+	int signal_fd;
+	struct queue * the_queue;
+	size_t thread_id;           /* Printed for the registrations */
+	struct connection * conns;  /* All the open connections */
+	struct connection * closed; /* To be freed after the current events */
+	size_t backlogged;          /* Connections with requests pending */
+	int stopping;               /* The workers are gone */
+#ifdef HAVE_URING
+	struct uring * ring;        /* NULL when running on epoll */
+	uint64_t ready_count;       /* Read buffers of the io_uring engine */
+	struct signalfd_siginfo siginfo;
+#endif
+};
+
+#ifdef HAVE_URING
+#define LOOP_URING(loop) ((loop)->ring != NULL)
+#else
+#define LOOP_URING(loop) 0
+#endif
+
+/* Lock-free stack of the connections with new responses to send. The
+ * worker that pushes on an empty stack wakes up the event loop through
+ * ready_fd; the event loop takes the whole stack at once. */
+struct connection * ready_list = NULL;
+int ready_fd = -1;
+
+/* Start-time fair queueing of the clients, by estimated service time:
+ * in virtual time, a request starts when the previous one of its
+ * client finishes, or at the virtual time of the queue if that is
+ * later, and lasts its cost. The virtual time is the start of the
+ * request taken last, so that a client gets no credit for the time it
+ * was idle, and one that keeps many requests queued has them start
+ * further and further away, behind those of the other clients. The
+ * registrations have no client to charge, and go first. */
+uint64_t fair_key(struct queue * the_queue, const struct request_meta * req)
+{
+	struct connection * conn = req->conn;
+	uint64_t start = the_queue->vtime;
+
+	if (conn) {
+		if (conn->fair_finish > start) {
+			start = conn->fair_finish;
+		}
+		conn->fair_finish = start + req->cost_ns;
+	}
+	return start;
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue * the_queue)
+/* Put the rings of the workers on their NUMA nodes, and those of the
+ * fast lane on a local node of their own after them, which the other
+ * workers still steal from when it falls behind or they run out of
+ * work (see workq_set_local()). Returns 1 on allocation failure. */
+int queue_set_lanes(struct queue * the_queue)
 {
-	struct request_meta retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	size_t nodes = numa_aware ? numa_topo.nodes : 1;
+	size_t * ring_node, i;
+	int res;
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	retval = the_queue->requests[the_queue->rd_pos];
-	the_queue->rd_pos = (the_queue->rd_pos + 1) % the_queue->max_size;
-	the_queue->available++;
+	ring_node = (size_t *)malloc(the_queue->workers * sizeof(size_t));
+	if (!ring_node) {
+		return 1;
+	}
+	for (i = 0; i < the_queue->workers; ++i) {
+		ring_node[i] = i < fast_workers ? nodes : numa_aware ? worker_node[i] : 0;
+	}
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	res = workq_set_nodes(&the_queue->work, ring_node, nodes + !!fast_workers);
+	if (!res && fast_workers) {
+		workq_set_local(&the_queue->work, nodes);
+	}
+	free(ring_node);
+	return res;
 }
 
-void dump_queue_status(struct queue * the_queue)
+int queue_init(struct queue * the_queue, size_t queue_size, enum queue_policy policy,
+	       size_t workers)
 {
-	size_t i, j;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	/* Any ring may briefly hold all the requests */
+	size_t snapshot_size = policies[policy].key ? queue_size : queue_size * workers;
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	sem_wait(printf_mutex);
-	printf("Q:[");
-
-	for (i = the_queue->rd_pos, j = 0; j < the_queue->max_size - the_queue->available;
-	     i = (i + 1) % the_queue->max_size, ++j)
-	{
-		printf("R%ld%s", the_queue->requests[i].request.req_id,
-		       ((j+1 != the_queue->max_size - the_queue->available)?",":""));
+	the_queue->policy = policy;
+	the_queue->max_size = queue_size;
+	the_queue->queued = 0;
+	the_queue->closed = 0;
+	the_queue->workers = workers;
+	the_queue->runs = the_queue->affine_runs = the_queue->fast_runs = 0;
+	the_queue->spin_pops = 0;
+	the_queue->vtime = 0;
+	the_queue->snapshot = (struct request_meta *)malloc(sizeof(struct request_meta)
+							    * snapshot_size);
+	if (!the_queue->snapshot) {
+		return EXIT_FAILURE;
 	}
 
-	printf("]\n");
-	sem_post(printf_mutex);
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	if (!policies[policy].key) {
+		if (workq_init(&the_queue->work, workers, queue_size,
+			       sizeof(struct request_meta))) {
+			free(the_queue->snapshot);
+			return EXIT_FAILURE;
+		}
+		if ((numa_aware || fast_workers) && queue_set_lanes(the_queue)) {
+			workq_destroy(&the_queue->work);
+			free(the_queue->snapshot);
+			return EXIT_FAILURE;
+		}
+		workq_set_spin(&the_queue->work, spin_ns);
+	} else {
+		if (pqueue_init(&the_queue->heap, queue_size, sizeof(struct request_meta))) {
+			free(the_queue->snapshot);
+			return EXIT_FAILURE;
+		}
+		sem_init(&the_queue->notify, 0, 0);
+	}
+	return EXIT_SUCCESS;
 }
 
-void register_new_image(int conn_socket, struct request * req)
+void queue_destroy(struct queue * the_queue)
 {
-    sem_wait(&arr_mutex);
+	if (!policies[the_queue->policy].key) {
+		workq_destroy(&the_queue->work);
+	} else {
+		pqueue_destroy(&the_queue->heap);
+		sem_destroy(&the_queue->notify);
+	}
+	free(the_queue->snapshot);
+}
 
-    image_counter++;
+/* Slot of image <img_id> in the registry, allocating its block if
+ * <create> is set. Returns NULL if the block does not exist. */
+struct registry_entry * registry_slot(uint64_t img_id, int create)
+{
+	uint64_t b = img_id >> REGISTRY_BLOCK_BITS;
+	struct registry_entry * block;
 
-    images = realloc(images, image_counter * sizeof(struct image *));
-    img_semaphores = realloc(img_semaphores, image_counter * sizeof(sem_t));
+	if (b >= REGISTRY_MAX_BLOCKS) {
+		return NULL;
+	}
 
-	sem_wait(operation_mutex);
+	block = __atomic_load_n(&registry.blocks[b], __ATOMIC_ACQUIRE);
+	if (!block && create) {
+		struct registry_entry * expected = NULL;
 
-	wait_op = realloc(wait_op, image_counter * sizeof(struct img_req_array));
-	wait_op[image_counter - 1].request_ids = NULL;
-	wait_op[image_counter - 1].count = 0;
-	wait_op[image_counter - 1].capacity = 0;
+		block = (struct registry_entry *)calloc(REGISTRY_BLOCK_SIZE,
+							sizeof(struct registry_entry));
+		if (!block) {
+			return NULL;
+		}
+		/* Someone else may have added the same block meanwhile */
+		if (!__atomic_compare_exchange_n(&registry.blocks[b], &expected, block, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(block);
+			block = expected;
+		}
+	}
 
-	sem_post(operation_mutex);
+	return block ? &block[img_id & (REGISTRY_BLOCK_SIZE - 1)] : NULL;
+}
 
-    struct image * new_img = recvImage(conn_socket);
+/* Take the next image ID and make sure that its slot exists. Returns
+ * REGISTRY_FULL if no more images can be added. */
+uint64_t registry_reserve(void)
+{
+	uint64_t img_id = __atomic_fetch_add(&registry.next_id, 1, __ATOMIC_RELAXED);
 
-    images[image_counter - 1] = new_img;
+	if (!registry_slot(img_id, 1)) {
+		return REGISTRY_FULL;
+	}
+	return img_id;
+}
 
-    sem_init(&img_semaphores[image_counter - 1], 0, 1);
-    sem_post(&arr_mutex);
+/* Make <img> visible as image <img_id>, which must have been reserved.
+ * <digest> is the MD5 of its pixels, or NULL if not known yet. */
+void registry_publish(uint64_t img_id, struct image * img, const struct md5digest * digest)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	struct image * old = slot->img;
 
-    struct response resp;
-    resp.req_id = req->req_id;
-    resp.img_id = image_counter - 1;
-    resp.ack = RESP_COMPLETED;
+	slot->digest_valid = (digest != NULL);
+	if (digest) {
+		slot->digest = *digest;
+	}
+	__atomic_store_n(&slot->pixels, (uint64_t)img->width * img->height, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->version, slot->version + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->img, img, __ATOMIC_RELEASE);
 
-    sem_wait(&conn_socket_mutex);
-	send(conn_socket, &resp, sizeof(struct response), 0);
-	sem_post(&conn_socket_mutex);
+	if (memory_budget) {
+		/* <old> is still alive: the caller releases it afterwards */
+		uint64_t resident = __atomic_add_fetch(&resident_bytes, imageBytes(img) -
+						       (old ? imageBytes(old) : 0),
+						       __ATOMIC_RELAXED);
+		if (resident > memory_budget &&
+		    !__atomic_exchange_n(&spill_kicked, 1, __ATOMIC_RELAXED)) {
+			sem_post(&spill_wake);
+		}
+	}
 }
 
+/* Current version of image <img_id>, or NULL if there is none */
+struct image * registry_lookup(uint64_t img_id)
+{
+	struct registry_entry * slot;
 
-/* Main logic of the worker thread */
-int worker_main (void * arg) {
-    struct timespec now;
-    struct worker_params * params = (struct worker_params *)arg;
+	if (img_id >= __atomic_load_n(&registry.next_id, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	slot = registry_slot(img_id, 0);
+	return slot ? __atomic_load_n(&slot->img, __ATOMIC_ACQUIRE) : NULL;
+}
 
-    /* Print the first alive message. */
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    sync_printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
+/* Park <img>, just registered as image <img_id>, until a worker
+ * publishes it. <digest> is the MD5 of its pixels, or NULL. */
+void registry_stage(uint64_t img_id, struct image * img, const struct md5digest * digest)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
 
-    while (!params->worker_done) {
-        struct request_meta req = get_from_queue(params->the_queue);
+	slot->digest_valid = (digest != NULL);
+	if (digest) {
+		slot->digest = *digest;
+	}
+	__atomic_store_n(&slot->pixels, (uint64_t)img->width * img->height, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->staged, img, __ATOMIC_RELEASE);
+}
 
-        struct response resp;
-		uint64_t img_id = req.request.img_id;
-        if (params->worker_done)
-            break;
+/* Whether image <img_id> exists, published, still staged or spilled.
+ * The staged image is only cleared once it has been published, and a
+ * spilled one is marked so before it leaves the registry. */
+int registry_known(uint64_t img_id)
+{
+	struct registry_entry * slot;
 
-		sem_wait(&img_semaphores[img_id]); 
-		struct img_req_array *img_array = &wait_op[img_id];
-		while (img_array->count > 0 && img_array->request_ids[0] != req.request.req_id) {
-			sem_post(&img_semaphores[img_id]); 
-			sem_wait(&img_semaphores[img_id]); 
-		}
+	if (img_id >= __atomic_load_n(&registry.next_id, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	slot = registry_slot(img_id, 0);
+	return slot && (__atomic_load_n(&slot->staged, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&slot->img, __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&slot->spilled, __ATOMIC_ACQUIRE));
+}
 
-		sem_wait(operation_mutex);
-		memmove(img_array->request_ids, img_array->request_ids + 1, (img_array->count - 1) * sizeof(uint64_t));
-		img_array->count--;
-		sem_post(operation_mutex);
+/* Note an access to image <img_id> by the worker that owns it, and
+ * read its pixels back from the spill store if they were spilled.
+ * Returns 1 if they could not be, leaving the spilled copy as it is. */
+int registry_touch(uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	struct md5digest digest = slot->digest;
+	uint64_t version = slot->version;
+	struct image * img;
 
-		clock_gettime(CLOCK_MONOTONIC, &req.start_timestamp);
+	if (!memory_budget) {
+		return 0;
+	}
+	__atomic_store_n(&slot->last_use,
+			 __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	if (!__atomic_load_n(&slot->spilled, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&resident_hits, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
 
-		struct image * img = NULL;
-		img = images[img_id];
-		assert(img != NULL);
+	img = createImageUninitLayout(slot->spill_width, slot->spill_height,
+				      slot->spill_layout);
+	if (!img) {
+		ERROR_INFO();
+		perror("Unable to read a spilled image back");
+		return 1;
+	}
 
-		/* Image processing operations */
-		switch (req.request.img_op) {
-			case IMG_ROT90CLKW:
-				img = rotate90Clockwise(img, NULL);
-				break;
-			case IMG_BLUR:
-				img = blurImage(img);
-				break;
-			case IMG_SHARPEN:
-				img = sharpenImage(img);
-				break;
-			case IMG_VERTEDGES:
-				img = detectVerticalEdges(img);
-				break;
-			case IMG_HORIZEDGES:
-				img = detectHorizontalEdges(img);
-				break;
+	if (slot->packed) {
+		if (unpackImage(img, slot->packed, slot->packed_len)) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to decompress image %lu.\n", img_id);
+			releaseImage(img);
+			return 1;
 		}
+		free(slot->packed);
+		__atomic_store_n(&slot->packed, NULL, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&resident_bytes, slot->packed_len, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&cold_stats.bytes, slot->packed_len, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cold_stats.unpacks, 1, __ATOMIC_RELAXED);
+	} else {
+		const void * bytes = spill_map(&spill_store, &slot->spill);
 
-		if (req.request.img_op != IMG_RETRIEVE) {
-			sem_wait(&arr_mutex); 
-			if (req.request.overwrite) {
-				images[img_id] = img;        
-			} else {
-				/* Generate new ID and Increase the count of registered images */
-				img_id = image_counter++;
-				images = realloc(images, image_counter * sizeof(struct image *));
-				images[img_id] = img;
-			}
-			sem_post(&arr_mutex); 
+		if (!slot->packed_len) {
+			memcpy(img->pixels, bytes, imageBytes(img));
+		} else if (unpackImage(img, bytes, slot->packed_len)) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to decompress image %lu.\n", img_id);
+			releaseImage(img);
+			return 1;
 		}
-		sem_post(&img_semaphores[img_id]); 
+		spill_release(&spill_store, &slot->spill, 1);
+	}
+	slot->packed_len = 0;
 
-        clock_gettime(CLOCK_MONOTONIC, &req.completion_timestamp);
+	/* The same pixels as before, as far as the snapshot goes */
+	registry_publish(img_id, img, slot->digest_valid ? &digest : NULL);
+	__atomic_store_n(&slot->version, version, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->spilled, 0, __ATOMIC_RELEASE);
+	return 0;
+}
 
-        /* Response to the client */
-        resp.req_id = req.request.req_id;
-        resp.ack = RESP_COMPLETED;
-        resp.img_id = img_id;
+/* Number of pixels of image <img_id>, published or still staged. No
+ * operation changes it, so it can be read at any time. */
+uint64_t registry_pixels(uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
 
-		sem_wait(&conn_socket_mutex);
-		send(params->conn_socket, &resp, sizeof(struct response), 0);
-		sem_post(&conn_socket_mutex);
+	return slot ? __atomic_load_n(&slot->pixels, __ATOMIC_RELAXED) : 0;
+}
 
-        /* Send the actual image payload for IMG_RETRIEVE operation */
-        if (req.request.img_op == IMG_RETRIEVE) {
-			sem_wait(&conn_socket_mutex);
-            uint8_t err = sendImage(img, params->conn_socket);
-            if(err) {
-                ERROR_INFO();
-                perror("Unable to send image payload to client.");
-            }
-			sem_post(&conn_socket_mutex);
-        }
+/* Feed a piece of an image to a running MD5 */
+void md5_consume(void * arg, const void * data, size_t len)
+{
+	md5_update((struct md5ctx *)arg, data, len);
+}
 
-        sync_printf("T%d R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
-                   params->worker_id, req.request.req_id,
-                   TSPEC_TO_DOUBLE(req.request.req_timestamp),
-                   OPCODE_TO_STRING(req.request.img_op),
-                   req.request.overwrite, req.request.img_id, img_id,
-                   TSPEC_TO_DOUBLE(req.receipt_timestamp),
-                   TSPEC_TO_DOUBLE(req.start_timestamp),
-                   TSPEC_TO_DOUBLE(req.completion_timestamp));
+/* MD5 digest of the pixels of the current version of image <img_id>,
+ * in x-y order whatever the layout. Must only be called by the worker
+ * that owns the image. */
+const struct md5digest * registry_digest(uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
 
-        dump_queue_status(params->the_queue);
+	if (!slot->digest_valid) {
+		struct md5ctx md5;
+
+		md5_init(&md5);
+		readImageRows(slot->img, md5_consume, &md5);
+		slot->digest = md5_final(&md5);
+		slot->digest_valid = 1;
+	}
+	return &slot->digest;
+}
+
+/* Drop the references of the registry to the images, published or
+ * still staged, and release the memory of the registry */
+void registry_destroy(void)
+{
+	size_t b, i;
+
+	for (b = 0; b < REGISTRY_MAX_BLOCKS; ++b) {
+		struct registry_entry * block = registry.blocks[b];
+
+		for (i = 0; block && i < REGISTRY_BLOCK_SIZE; ++i) {
+			releaseImage(block[i].img);
+			releaseImage(block[i].staged);
+			free(block[i].packed);
+		}
+		free(block);
+		registry.blocks[b] = NULL;
+	}
+}
+
+/* Make room for the mailboxes of the first <count> images. Must be
+ * called with operation_mutex held. */
+int mailboxes_grow(size_t count)
+{
+	struct img_mailbox * grown;
+
+	if (count <= mailbox_count) {
+		return EXIT_SUCCESS;
+	}
+
+	grown = realloc(mailboxes, count * sizeof(struct img_mailbox));
+	if (!grown) {
+		return EXIT_FAILURE;
+	}
+	memset(grown + mailbox_count, 0, (count - mailbox_count) * sizeof(struct img_mailbox));
+	for (size_t i = mailbox_count; i < count; i++) {
+		grown[i].last_worker = -1;
+	}
+
+	mailboxes = grown;
+	mailbox_count = count;
+	return EXIT_SUCCESS;
+}
+
+/* Append <req> to the FIFO of <mb>. Returns 1 if out of memory. */
+int mailbox_append(struct img_mailbox * mb, const struct request_meta * req)
+{
+	if (mb->count == mb->capacity) {
+		size_t capacity = mb->capacity ? mb->capacity * 2 : 4;
+		struct request_meta * reqs;
+		size_t i;
+
+		reqs = (struct request_meta *)malloc(capacity * sizeof(struct request_meta));
+		if (!reqs) {
+			return 1;
+		}
+		for (i = 0; i < mb->count; ++i) {
+			reqs[i] = mb->reqs[(mb->head + i) % mb->capacity];
+		}
+		free(mb->reqs);
+		mb->reqs = reqs;
+		mb->head = 0;
+		mb->capacity = capacity;
+	}
+
+	mb->reqs[(mb->head + mb->count) % mb->capacity] = *req;
+	mb->count++;
+	return 0;
+}
+
+/* Worker that should run the next operation on the image of <mb>,
+ * <img_id>: the one that ran the previous operation, whose caches may
+ * still hold the pixels, or one of the active ones picked by hashing
+ * <img_id> if none did yet or it has been parked since. Must be
+ * called with operation_mutex held. */
+size_t queue_home(const struct img_mailbox * mb, uint64_t img_id)
+{
+	/* Only the active workers of the pool, see -W */
+	size_t active = workerpool_active(&worker_pool);
+
+	if (mb->last_worker >= 0 && (size_t)mb->last_worker < active) {
+		return mb->last_worker;
+	}
+	/* Fibonacci hashing, so that consecutive IDs spread out */
+	return ((img_id * 0x9E3779B97F4A7C15ULL) >> 32) % active;
+}
+
+/* Worker of the lane of <req> to run it: <target> if it is in that
+ * lane, or else one of the lane picked by hashing the image ID, like
+ * queue_home() does. Only the cheap requests go to the fast lane. */
+size_t queue_lane(const struct request_meta * req, size_t target)
+{
+	size_t active = workerpool_active(&worker_pool);
+	uint64_t hash = (req->request.img_id * 0x9E3779B97F4A7C15ULL) >> 32;
+	int cheap = req->cost_ns < cheap_ns;
+
+	if (!fast_workers || cheap == (target < fast_workers)) {
+		return target;
+	}
+	return cheap ? hash % fast_workers : fast_workers + hash % (active - fast_workers);
+}
+
+/* Hand <req> over to the workers, preferably to worker <target>.
+ * Returns 1 if there is no room. Must be called with operation_mutex
+ * held. */
+int queue_push_runnable(struct queue * the_queue, struct request_meta * req,
+			size_t target)
+{
+	const struct policy * policy = &policies[the_queue->policy];
+
+	if (!policy->key) {
+		return workq_push(&the_queue->work, queue_lane(req, target), req);
+	}
+
+	if (pqueue_push(&the_queue->heap, policy->key(the_queue, req), req)) {
+		return 1;
+	}
+	sem_post(&the_queue->notify);
+	return 0;
+}
+
+/* Add a new request <request>, with its estimated cost set, to the
+ * shared queue <the_queue> */
+int add_to_queue(struct request_meta to_add, struct queue * the_queue)
+{
+	struct img_mailbox * mb;
+	int retval = 0;
+
+	/* Accounted for before any worker can get to it */
+	admission_enqueue(&admission, to_add.cost_ns);
+
+	sem_wait(operation_mutex);
+
+	/* Make sure that the queue is not full. Only this thread adds
+	 * requests, so the count cannot grow behind our back. */
+	if (__atomic_load_n(&the_queue->queued, __ATOMIC_ACQUIRE) >= the_queue->max_size ||
+	    mailboxes_grow(to_add.request.img_id + 1)) {
+		retval = 1;
+	} else {
+		mb = &mailboxes[to_add.request.img_id];
+
+		if (mb->busy) {
+			/* Wait for the operation in progress on the image */
+			retval = mailbox_append(mb, &to_add);
+		} else {
+			/* Every ring can hold max_size requests, and
+			 * there are no more than that overall, so there
+			 * is always room for it. */
+			mb->busy = 1;
+			retval = queue_push_runnable(the_queue, &to_add,
+						     queue_home(mb, to_add.request.img_id));
+		}
+
+		if (!retval) {
+			__atomic_add_fetch(&the_queue->queued, 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	sem_post(operation_mutex);
+
+	if (retval) {
+		admission_dequeue(&admission, to_add.cost_ns);
+	}
+
+	return retval;
+}
+
+/* Take a wake-up of the heap of <the_queue>, spinning on it for up to
+ * spin_ns before sleeping. sem_post() only makes a system call when a
+ * worker sleeps on the semaphore, so the spinners save the event loop
+ * that too. */
+void queue_wait_notify(struct queue * the_queue)
+{
+	/* Requests already waiting do not count as spinning */
+	if (!sem_trywait(&the_queue->notify)) {
+		return;
+	}
+	if (spin_ns) {
+		nstime_t deadline = tsc_now_ns() + spin_ns;
+		int i;
+
+		do {
+			for (i = 0; i < WORKQ_SPIN_PAUSES; ++i) {
+				workq_cpu_relax();
+			}
+			if (!sem_trywait(&the_queue->notify)) {
+				__atomic_add_fetch(&the_queue->spin_pops, 1, __ATOMIC_RELAXED);
+				return;
+			}
+		} while (tsc_now_ns() < deadline);
+	}
+	sem_wait(&the_queue->notify);
+}
+
+/* Get the next request for worker <self> from <the_queue>, waiting for
+ * one if it is empty. Returns 1 once the queue has been shut down. */
+int get_from_queue(struct queue * the_queue, size_t self, struct request_meta * req)
+{
+	if (!policies[the_queue->policy].key) {
+		if (workq_pop(&the_queue->work, self, req))
+			return 1;
+	} else {
+		queue_wait_notify(the_queue);
+
+		/* Pass the wake-up on to the next sleeping worker */
+		if (__atomic_load_n(&the_queue->closed, __ATOMIC_ACQUIRE)) {
+			sem_post(&the_queue->notify);
+			return 1;
+		}
+
+		sem_wait(operation_mutex);
+		if (the_queue->policy == QUEUE_FAIR) {
+			the_queue->vtime = pqueue_min_key(&the_queue->heap);
+		}
+		pqueue_pop(&the_queue->heap, req);
+		sem_post(operation_mutex);
+	}
+
+	__atomic_sub_fetch(&the_queue->queued, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Make the next request waiting in <mb>, if any, runnable on worker
+ * <target>, or else mark its image as free. Must be called with
+ * operation_mutex held. */
+void mailbox_pass(struct queue * the_queue, struct img_mailbox * mb, size_t target)
+{
+	if (mb->count > 0) {
+		queue_push_runnable(the_queue, &mb->reqs[mb->head], target);
+		mb->head = (mb->head + 1) % mb->capacity;
+		mb->count--;
+	} else {
+		mb->busy = 0;
+	}
+}
+
+/* Mark the operation on image <img_id> as completed by worker <self>
+ * and make the next request waiting for the image, if any, runnable. */
+void complete_request(struct queue * the_queue, uint64_t img_id, size_t self)
+{
+	struct img_mailbox * mb;
+
+	sem_wait(operation_mutex);
+	mb = &mailboxes[img_id];
+
+	the_queue->runs++;
+	if (mb->last_worker == (int)self) {
+		the_queue->affine_runs++;
+	}
+	if (self < fast_workers) {
+		the_queue->fast_runs++;
+	}
+	mb->last_worker = self;
+
+	/* The next operation on the image is queued right here, where the
+	 * image is warm */
+	mailbox_pass(the_queue, mb, self);
+
+	sem_post(operation_mutex);
+}
+
+/* Make the next request waiting for image <img_id>, if any, runnable
+ * after one that was dropped without running. The image stays with
+ * the worker that last ran an operation on it. */
+void skip_request(struct queue * the_queue, uint64_t img_id)
+{
+	struct img_mailbox * mb;
+
+	sem_wait(operation_mutex);
+	mb = &mailboxes[img_id];
+	mailbox_pass(the_queue, mb, queue_home(mb, img_id));
+	sem_post(operation_mutex);
+}
+
+/* Take image <img_id> over as if an operation was running on it, so
+ * that nothing else touches it until mailbox_unclaim(). Returns 0 if
+ * an operation on it is queued or in progress already. */
+int mailbox_claim(uint64_t img_id)
+{
+	int claimed = 0;
+
+	sem_wait(operation_mutex);
+	if (!mailboxes_grow(img_id + 1) && !mailboxes[img_id].busy) {
+		mailboxes[img_id].busy = 1;
+		claimed = 1;
+	}
+	sem_post(operation_mutex);
+	return claimed;
+}
+
+/* Give image <img_id> back after mailbox_claim(), making the first
+ * request that arrived for it meanwhile runnable */
+void mailbox_unclaim(struct queue * the_queue, uint64_t img_id)
+{
+	struct img_mailbox * mb;
+
+	sem_wait(operation_mutex);
+	mb = &mailboxes[img_id];
+	mailbox_pass(the_queue, mb, queue_home(mb, img_id));
+	sem_post(operation_mutex);
+}
+
+/* Compress <img>, the current version of the image of <slot>, in
+ * memory. Returns 1 if out of memory. */
+int cold_pack(struct registry_entry * slot, const struct image * img)
+{
+	uint8_t * packed = (uint8_t *)malloc(packImageBound(img->width, img->height));
+	uint8_t * shrunk;
+	size_t len;
+
+	if (!packed || packImage(img, packed, &len)) {
+		free(packed);
+		return 1;
+	}
+	shrunk = (uint8_t *)realloc(packed, len ? len : 1);
+	__atomic_store_n(&slot->packed, shrunk ? shrunk : packed, __ATOMIC_RELAXED);
+	slot->packed_len = len;
+
+	__atomic_add_fetch(&resident_bytes, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cold_stats.bytes, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cold_stats.packs, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Move the pixels of image <img_id> a step further from memory, if it
+ * is still worth it once the image is ours: under -Z, compressed in
+ * memory first and then to the spill store, otherwise straight there */
+void spill_image(struct queue * the_queue, uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	struct image * img;
+
+	if (!mailbox_claim(img_id)) {
+		return;
+	}
+
+	/* Shared pixels, with the result cache or with the other images
+	 * registered with the same ones, would stay in memory anyway */
+	img = slot->img;
+	if (img && !__atomic_load_n(&slot->staged, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&img->refs, __ATOMIC_ACQUIRE) == 1 &&
+	    (compress_cold ? !cold_pack(slot, img) :
+	     !spill_write(&spill_store, img->pixels, imageBytes(img), &slot->spill))) {
+		slot->spill_width = img->width;
+		slot->spill_height = img->height;
+		slot->spill_layout = (enum img_layout)img->layout;
+		__atomic_store_n(&slot->spilled, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->img, NULL, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&resident_bytes, imageBytes(img), __ATOMIC_RELAXED);
+		releaseImage(img);
+	} else if (!img && slot->packed &&
+		   !spill_write(&spill_store, slot->packed, slot->packed_len, &slot->spill)) {
+		free(slot->packed);
+		__atomic_store_n(&slot->packed, NULL, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&resident_bytes, slot->packed_len, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&cold_stats.bytes, slot->packed_len, __ATOMIC_RELAXED);
+	}
+
+	mailbox_unclaim(the_queue, img_id);
+}
+
+/* An image of the registry that could be spilled */
+struct spill_candidate {
+	uint64_t img_id;
+	uint64_t last_use;
+};
+
+int spill_candidate_cmp(const void * a, const void * b)
+{
+	uint64_t ua = ((const struct spill_candidate *)a)->last_use;
+	uint64_t ub = ((const struct spill_candidate *)b)->last_use;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/* One pass of spill_cold() over the images that still take memory,
+ * coldest first */
+void spill_pass(struct queue * the_queue)
+{
+	uint64_t count = __atomic_load_n(&registry.next_id, __ATOMIC_ACQUIRE);
+	struct spill_candidate * cands;
+	size_t n = 0, i;
+
+	cands = (struct spill_candidate *)malloc(count * sizeof(struct spill_candidate));
+	if (!cands) {
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct registry_entry * slot = registry_slot(i, 0);
+
+		if (slot && (__atomic_load_n(&slot->img, __ATOMIC_RELAXED) ||
+			     __atomic_load_n(&slot->packed, __ATOMIC_RELAXED))) {
+			cands[n].img_id = i;
+			cands[n].last_use = __atomic_load_n(&slot->last_use, __ATOMIC_RELAXED);
+			n++;
+		}
+	}
+	qsort(cands, n, sizeof(struct spill_candidate), spill_candidate_cmp);
+
+	for (i = 0; i < n && __atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) >
+		     SPILL_LOW_WATER(memory_budget); ++i) {
+		spill_image(the_queue, cands[i].img_id);
+	}
+	free(cands);
+}
+
+/* Make the least recently used images take less memory until they are
+ * back under SPILL_LOW_WATER() of the budget, with a second pass for
+ * the ones compressed by the first if that is not enough. The
+ * candidates are picked without owning them: their images may be
+ * freed meanwhile, and are only looked at by spill_image(). */
+void spill_cold(struct queue * the_queue)
+{
+	int pass;
+
+	for (pass = 0; pass < 1 + compress_cold &&
+		     __atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) >
+		     SPILL_LOW_WATER(memory_budget); ++pass) {
+		spill_pass(the_queue);
+	}
+}
+
+/* Thread that keeps the images in memory within memory_budget, woken up
+ * by registry_publish() when it goes over */
+void * spill_main(void * arg)
+{
+	struct queue * the_queue = (struct queue *)arg;
+
+	while (!__atomic_load_n(&spill_stop, __ATOMIC_ACQUIRE)) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SPILL_PERIOD_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / NANO_IN_SEC;
+		deadline.tv_nsec %= NANO_IN_SEC;
+		sem_timedwait(&spill_wake, &deadline);
+
+		__atomic_store_n(&spill_kicked, 0, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) > memory_budget) {
+			spill_cold(the_queue);
+		}
+	}
+	return NULL;
+}
+
+/* Print the counters of the memory budget */
+void dump_memory_stats(void)
+{
+	struct spill_stats stats;
+
+	if (!memory_budget) {
+		return;
+	}
+	spill_get_stats(&spill_store, &stats);
+	sync_printf("INFO: memory resident=%.1lf MB budget=%.1lf MB spilled=%.1lf MB "
+		    "file=%.1lf MB hits=%lu spills=%lu faults=%lu failures=%lu "
+		    "packed=%.1lf MB packs=%lu unpacks=%lu\n",
+		    (double)__atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) / (1 << 20),
+		    (double)memory_budget / (1 << 20), (double)stats.bytes / (1 << 20),
+		    (double)stats.file_size / (1 << 20),
+		    __atomic_load_n(&resident_hits, __ATOMIC_RELAXED),
+		    stats.spills, stats.faults, stats.failures,
+		    (double)__atomic_load_n(&cold_stats.bytes, __ATOMIC_RELAXED) / (1 << 20),
+		    __atomic_load_n(&cold_stats.packs, __ATOMIC_RELAXED),
+		    __atomic_load_n(&cold_stats.unpacks, __ATOMIC_RELAXED));
+}
+
+/* Wake up all the workers waiting on <the_queue> for termination */
+void queue_shutdown(struct queue * the_queue)
+{
+	if (!policies[the_queue->policy].key) {
+		workq_close(&the_queue->work);
+	} else {
+		__atomic_store_n(&the_queue->closed, 1, __ATOMIC_RELEASE);
+		sem_post(&the_queue->notify);
+	}
+}
+
+void dump_queue_status(struct queue * the_queue)
+{
+	size_t i, count;
+
+	/* printf_mutex also guards the scratch space of the snapshot */
+	sem_wait(printf_mutex);
+
+	/* Without a lock this is a snapshot: requests being added or
+	 * picked up at the same time may or may not show up. Requests
+	 * that wait in a mailbox are not runnable yet and are left out. */
+	if (!policies[the_queue->policy].key) {
+		count = workq_snapshot(&the_queue->work, the_queue->snapshot);
+	} else {
+		/* In service order, printed once the lock is released */
+		sem_wait(operation_mutex);
+		count = pqueue_snapshot(&the_queue->heap, the_queue->snapshot);
+		sem_post(operation_mutex);
+	}
+
+	/* The trace flusher prints without printf_mutex: hold the lock
+	 * of the stream for the whole line */
+	flockfile(stdout);
+	printf("Q:[");
+
+	for (i = 0; i < count; ++i) {
+		printf("R%ld%s", the_queue->snapshot[i].request.req_id,
+		       ((i+1 != count)?",":""));
+	}
+
+	printf("]\n");
+	funlockfile(stdout);
+	sem_post(printf_mutex);
+}
+
+/* Print the queue once every dump_period completed requests */
+void sample_queue_status(struct queue * the_queue)
+{
+	if (__atomic_add_fetch(&completed_ops, 1, __ATOMIC_RELAXED) % dump_period == 0) {
+		dump_queue_status(the_queue);
+	}
+}
+
+/* Record the completion of <req>, which produced image <out_img_id>,
+ * in the trace ring of <thread>, along with the length of <the_queue> */
+void trace_request(size_t thread, struct queue * the_queue,
+		   const struct request_meta * req, uint64_t out_img_id)
+{
+	struct trace_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = TRACE_DONE;
+	rec.thread = thread;
+	rec.req_id = req->request.req_id;
+	rec.opcode = req->request.img_op;
+	rec.overwrite = req->request.overwrite;
+	rec.img_id = req->request.img_id;
+	rec.out_img_id = out_img_id;
+	rec.sent_ns = timespec_to_ns(&req->request.req_timestamp);
+	rec.receipt_ns = timespec_to_ns(&req->receipt_timestamp);
+	rec.start_ns = timespec_to_ns(&req->start_timestamp);
+	rec.completion_ns = timespec_to_ns(&req->completion_timestamp);
+	rec.queue_len = __atomic_load_n(&the_queue->queued, __ATOMIC_RELAXED);
+	trace_add(&tracer, thread, &rec);
+}
+
+/* Record the rejection of <req> in the trace ring of <thread>, along
+ * with the length of <the_queue> */
+void trace_reject(size_t thread, struct queue * the_queue, const struct request_meta * req)
+{
+	struct trace_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = TRACE_REJECT;
+	rec.thread = thread;
+	rec.req_id = req->request.req_id;
+	rec.opcode = req->request.img_op;
+	rec.overwrite = req->request.overwrite;
+	rec.img_id = req->request.img_id;
+	rec.sent_ns = timespec_to_ns(&req->request.req_timestamp);
+	rec.length_ns = timespec_to_ns(&req->request.req_length);
+	rec.receipt_ns = timespec_to_ns(&req->receipt_timestamp);
+	rec.queue_len = __atomic_load_n(&the_queue->queued, __ATOMIC_RELAXED);
+	trace_add(&tracer, thread, &rec);
+}
+
+/* Print the counters of the admission control under the policy of
+ * <the_queue> */
+void dump_admission_stats(struct queue * the_queue)
+{
+	struct admission_stats stats;
+	uint64_t rejected, total;
+
+	admission_get_stats(&admission, &stats);
+	rejected = stats.rejected_full + stats.rejected_slo + stats.rejected_share;
+	total = stats.completed + rejected;
+
+	sync_printf("INFO: policy=%s completed=%lu rejected_full=%lu rejected_slo=%lu "
+		    "rejected_share=%lu rejection_rate=%.2f%% slo_misses=%lu expired=%lu "
+		    "cancelled=%lu mean_resp=%lf max_resp=%lf\n",
+		    policies[the_queue->policy].name, stats.completed, stats.rejected_full,
+		    stats.rejected_slo, stats.rejected_share,
+		    total ? 100.0 * rejected / total : 0.0,
+		    stats.slo_misses, stats.expired, stats.cancelled,
+		    stats.completed ? stats.resp_ns_sum / 1e9 / stats.completed : 0.0,
+		    stats.resp_ns_max / 1e9);
+}
+
+/* Add the latencies of <req>, just completed, to the histograms of
+ * <thread> */
+void stats_record(size_t thread, const struct request_meta * req)
+{
+	struct thread_stats * st = &thread_stats[thread];
+	nstime_t receipt = timespec_to_ns(&req->receipt_timestamp);
+	nstime_t start = timespec_to_ns(&req->start_timestamp);
+	nstime_t completion = timespec_to_ns(&req->completion_timestamp);
+	uint8_t op = req->request.img_op < OPCODE_COUNT ? req->request.img_op : 0;
+
+	histo_record(&st->wait[op], start - receipt);
+	histo_record(&st->service[op], completion - start);
+	histo_record(&st->response[op], completion - receipt);
+}
+
+/* Counters of each NUMA node under -N, with the steals of its workers
+ * under FIFO */
+void dump_node_stats(struct queue * the_queue)
+{
+	size_t node, i;
+
+	for (node = 0; node < numa_topo.nodes; ++node) {
+		uint64_t steals = 0, remote_steals = 0;
+		size_t workers = 0;
+
+		for (i = 0; i < worker_pool.max; ++i) {
+			workers += worker_node[i] == node;
+		}
+		if (!policies[the_queue->policy].key) {
+			steals = __atomic_load_n(&the_queue->work.nodes[node].steals,
+						 __ATOMIC_RELAXED);
+			remote_steals = __atomic_load_n(&the_queue->work.nodes[node].remote_steals,
+							__ATOMIC_RELAXED);
+		}
+		sync_printf("STATS node=%ld cpus=%d workers=%ld ops=%lu steals=%lu "
+			    "remote_steals=%lu moved=%lu moved_bytes=%lu\n", node,
+			    CPU_COUNT(&numa_topo.node_cpus[node]), workers,
+			    __atomic_load_n(&node_stats[node].ops, __ATOMIC_RELAXED),
+			    steals, remote_steals,
+			    __atomic_load_n(&node_stats[node].moved, __ATOMIC_RELAXED),
+			    __atomic_load_n(&node_stats[node].moved_bytes, __ATOMIC_RELAXED));
+	}
+}
+
+/* Print the percentiles of the latencies of every operation, and of
+ * the length of the queue, under the policy of <the_queue> */
+void dump_latency_stats(struct queue * the_queue)
+{
+	/* Too large for the stacks of the workers: never called there */
+	static struct histo merged[3];
+	const char * policy = policies[the_queue->policy].name;
+	size_t op, i;
+
+	for (op = 0; op < OPCODE_COUNT; ++op) {
+		memset(merged, 0, sizeof(merged));
+		for (i = 0; i < thread_stats_count; ++i) {
+			histo_merge(&merged[0], &thread_stats[i].wait[op]);
+			histo_merge(&merged[1], &thread_stats[i].service[op]);
+			histo_merge(&merged[2], &thread_stats[i].response[op]);
+		}
+		if (!merged[0].count) {
+			continue;
+		}
+
+		sync_printf("STATS policy=%s op=%s n=%lu "
+			    "wait_p50=%.3lf wait_p99=%.3lf wait_p999=%.3lf "
+			    "service_p50=%.3lf service_p99=%.3lf service_p999=%.3lf "
+			    "resp_p50=%.3lf resp_p99=%.3lf resp_p999=%.3lf resp_max=%.3lf (ms)\n",
+			    policy, OPCODE_TO_STRING(op), merged[0].count,
+			    histo_percentile(&merged[0], 0.5) / 1e6,
+			    histo_percentile(&merged[0], 0.99) / 1e6,
+			    histo_percentile(&merged[0], 0.999) / 1e6,
+			    histo_percentile(&merged[1], 0.5) / 1e6,
+			    histo_percentile(&merged[1], 0.99) / 1e6,
+			    histo_percentile(&merged[1], 0.999) / 1e6,
+			    histo_percentile(&merged[2], 0.5) / 1e6,
+			    histo_percentile(&merged[2], 0.99) / 1e6,
+			    histo_percentile(&merged[2], 0.999) / 1e6,
+			    merged[2].max / 1e6);
+	}
+
+	memset(merged, 0, sizeof(merged));
+	histo_merge(&merged[0], &thread_stats[thread_stats_count - 1].queue_len);
+	sync_printf("STATS policy=%s queue n=%lu len_p50=%lu len_p99=%lu len_p999=%lu "
+		    "len_max=%lu\n", policy, merged[0].count,
+		    histo_percentile(&merged[0], 0.5), histo_percentile(&merged[0], 0.99),
+		    histo_percentile(&merged[0], 0.999), merged[0].max);
+	dump_admission_stats(the_queue);
+	if (numa_aware) {
+		dump_node_stats(the_queue);
+	}
+}
+
+/* Print the STATS lines every stats_period_ms, until stats_stop */
+void * stats_main(void * arg)
+{
+	struct queue * the_queue = (struct queue *)arg;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	for (;;) {
+		uint64_t next = timespec_to_ns(&deadline) + stats_period_ms * 1000000;
+
+		deadline = ns_to_timespec(next);
+		if (sem_timedwait(&stats_stop, &deadline) == 0 || errno != ETIMEDOUT) {
+			break;
+		}
+		dump_latency_stats(the_queue);
+	}
+
+	return NULL;
+}
+
+/* Size the pool of workers to the queue every POOL_PERIOD_MS, until
+ * pool_stop */
+void * pool_main(void * arg)
+{
+	struct queue * the_queue = (struct queue *)arg;
+	struct timespec deadline;
+	size_t active = workerpool_active(&worker_pool);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	for (;;) {
+		uint64_t next = timespec_to_ns(&deadline) + POOL_PERIOD_MS * 1000000;
+		size_t now;
+
+		deadline = ns_to_timespec(next);
+		if (sem_timedwait(&pool_stop, &deadline) == 0 || errno != ETIMEDOUT) {
+			break;
+		}
+
+		now = workerpool_adjust(&worker_pool,
+					__atomic_load_n(&the_queue->queued, __ATOMIC_ACQUIRE));
+		if (now != active) {
+			admission_set_workers(&admission, now);
+			sync_printf("INFO: %ld workers active\n", now);
+			active = now;
+		}
+	}
+
+	return NULL;
+}
+
+void dump_pool_stats(void)
+{
+	struct workerpool_stats stats;
+
+	workerpool_get_stats(&worker_pool, &stats);
+	sync_printf("INFO: worker pool grows=%lu shrinks=%lu peak=%ld of %ld\n",
+		    stats.grows, stats.shrinks, stats.peak, worker_pool.max);
+}
+
+void dump_cache_stats(struct imgcache * cache)
+{
+	struct imgcache_stats stats;
+
+	imgcache_get_stats(cache, &stats);
+	sync_printf("INFO: cache hits=%lu misses=%lu evictions=%lu entries=%ld bytes=%ld\n",
+		    stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+}
+
+int band_pool_init(struct band_pool * pool, size_t helpers, size_t workers,
+		   size_t band_pixels)
+{
+	pool->wr_pos = 0;
+	pool->rd_pos = 0;
+	/* Each worker has at most one band per helper in flight */
+	pool->max_size = helpers * workers;
+	pool->helpers = helpers;
+	pool->band_pixels = band_pixels ? band_pixels : 1;
+	pool->tasks = (struct band_task **)malloc(pool->max_size * sizeof(struct band_task *));
+
+	if (!pool->tasks || sem_init(&pool->mutex, 0, 1) < 0 ||
+	    sem_init(&pool->notify, 0, 0) < 0) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void band_pool_push(struct band_pool * pool, struct band_task * task)
+{
+	sem_wait(&pool->mutex);
+	pool->tasks[pool->wr_pos] = task;
+	pool->wr_pos = (pool->wr_pos + 1) % pool->max_size;
+	sem_post(&pool->mutex);
+
+	sem_post(&pool->notify);
+}
+
+/* Must only be called after a successful wait on pool->notify */
+struct band_task * band_pool_pop(struct band_pool * pool)
+{
+	struct band_task * task;
+
+	sem_wait(&pool->mutex);
+	task = pool->tasks[pool->rd_pos];
+	pool->rd_pos = (pool->rd_pos + 1) % pool->max_size;
+	sem_post(&pool->mutex);
+
+	return task;
+}
+
+void run_band_task(struct band_task * task)
+{
+	struct band_group * group = task->group;
+
+	filterImageRows(task->src, task->dst, task->filter, task->y0, task->y1);
+
+	/* The last band to complete wakes up the owner of the group */
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		sem_post(&group->done);
+	}
+}
+
+/* Number of row bands that an operation on <img> is split into */
+size_t band_count(struct band_pool * pool, const struct image * img)
+{
+	size_t pixels = (size_t)img->width * img->height;
+	size_t bands = pixels / pool->band_pixels;
+
+	if (bands > pool->helpers + 1) {
+		bands = pool->helpers + 1;
+	}
+	if (bands > img->height) {
+		bands = img->height;
+	}
+	return bands ? bands : 1;
+}
+
+/* Map the image operations that can be split in row bands to the
+ * corresponding imglib filter. Returns 0 for all other operations. */
+int opcode_to_filter(uint8_t img_op, enum img_filter * filter)
+{
+	switch (img_op) {
+	case IMG_ROT90CLKW:  *filter = FILTER_ROT90CLKW;  return 1;
+	case IMG_BLUR:       *filter = FILTER_BLUR;       return 1;
+	case IMG_SHARPEN:    *filter = FILTER_SHARPEN;    return 1;
+	case IMG_VERTEDGES:  *filter = FILTER_VERTEDGES;  return 1;
+	case IMG_HORIZEDGES: *filter = FILTER_HORIZEDGES; return 1;
+	case IMG_GAUSSBLUR:  *filter = FILTER_GAUSSBLUR;  return 1;
+	case IMG_EMBOSS:     *filter = FILTER_EMBOSS;     return 1;
+	case IMG_SOBEL:      *filter = FILTER_SOBEL;      return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Map the opcodes of an IMG_PIPELINE request to imglib filters.
+ * Returns the number of stages, or 0 if the chain is empty, too long
+ * or has an opcode that is not a filter. */
+size_t pipeline_to_filters(const struct request * req, enum img_filter * filters)
+{
+	size_t i;
+
+	if (req->pipeline_len == 0 || req->pipeline_len > IMG_PIPELINE_MAX) {
+		return 0;
+	}
+	for (i = 0; i < req->pipeline_len; ++i) {
+		if (!opcode_to_filter(req->pipeline[i], &filters[i])) {
+			return 0;
+		}
+	}
+	return req->pipeline_len;
+}
+
+/* Lazy execution. Under -L, the filters that overwrite an image are
+ * not run when dequeued: they are appended to the chain of the image
+ * and acked right away. The chain runs through the fused pipeline of
+ * imglib once the pixels are needed, i.e. when the image is retrieved
+ * or is the input of an operation that makes a new image, or once it
+ * has lazy_max filters. Consecutive rotations merge on the way: four
+ * of them cancel out, and two are a single rotation by 180 degrees.
+ * The chain is only ever accessed by the worker that owns the image,
+ * like the image itself. */
+
+/* Merge the runs of rotations in <filters>[0..count), in place.
+ * Returns the new number of filters. */
+size_t lazy_collapse(uint8_t * filters, size_t count)
+{
+	size_t i = 0, n = 0;
+
+	while (i < count) {
+		unsigned turns = 0;
+
+		if (filters[i] != FILTER_ROT90CLKW && filters[i] != FILTER_ROT180) {
+			filters[n++] = filters[i++];
+			continue;
+		}
+		for (; i < count && (filters[i] == FILTER_ROT90CLKW ||
+				     filters[i] == FILTER_ROT180); ++i) {
+			turns += (filters[i] == FILTER_ROT180) ? 2 : 1;
+		}
+		if (turns & 2) {
+			filters[n++] = FILTER_ROT180;
+		}
+		if (turns & 1) {
+			filters[n++] = FILTER_ROT90CLKW;
+		}
+	}
+	return n;
+}
+
+/* Run <filters>[0..count) on image <img_id> and publish the result as
+ * its current version */
+void lazy_run(uint64_t img_id, const uint8_t * filters, size_t count)
+{
+	struct image * old = registry_lookup(img_id);
+	struct image * img = old;
+	size_t i, j, run;
+
+	__atomic_fetch_add(&lazy_stats.materialized, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < count && img; i += run) {
+		enum img_filter stages[IMG_PIPELINE_MAX];
+		struct image * next;
+
+		run = (count - i > IMG_PIPELINE_MAX) ? IMG_PIPELINE_MAX : count - i;
+		for (j = 0; j < run; ++j) {
+			stages[j] = (enum img_filter)filters[i + j];
+		}
+		next = filterImagePipeline(img, stages, run);
+		if (img != old) {
+			releaseImage(img);
+		}
+		img = next;
+	}
+
+	if (!img) {
+		ERROR_INFO();
+		fprintf(stderr, "Unable to run the deferred filters of image %lu.\n", img_id);
+		return;
+	}
+	if (img != old) {
+		registry_publish(img_id, img, NULL);
+		releaseImage(old);
+	}
+}
+
+/* Run the filters deferred on image <img_id>, if any. Returns 1 if
+ * there were some. */
+int lazy_materialize(uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	size_t count = slot->chain_len;
+
+	if (!count) {
+		return 0;
+	}
+	slot->chain_len = 0;
+	lazy_run(img_id, slot->chain, count);
+	return 1;
+}
+
+/* Defer the filters of <req>, which overwrites its image, running the
+ * chain if it gets too long. Returns 0 if <req> is not a filter. */
+int lazy_defer(const struct request * req)
+{
+	struct registry_entry * slot = registry_slot(req->img_id, 0);
+	uint8_t chain[2 * IMG_PIPELINE_MAX];
+	enum img_filter filters[IMG_PIPELINE_MAX];
+	size_t count, i, total;
+
+	if (req->img_op == IMG_PIPELINE) {
+		count = pipeline_to_filters(req, filters);
+	} else {
+		count = opcode_to_filter(req->img_op, &filters[0]);
+	}
+	if (!count) {
+		return 0;
+	}
+
+	memcpy(chain, slot->chain, slot->chain_len);
+	for (i = 0; i < count; ++i) {
+		chain[slot->chain_len + i] = filters[i];
+	}
+	total = lazy_collapse(chain, slot->chain_len + count);
+
+	__atomic_fetch_add(&lazy_stats.deferred, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lazy_stats.collapsed, slot->chain_len + count - total,
+			   __ATOMIC_RELAXED);
+
+	if (total >= lazy_max) {
+		slot->chain_len = 0;
+		lazy_run(req->img_id, chain, total);
+	} else {
+		memcpy(slot->chain, chain, total);
+		slot->chain_len = total;
+		__atomic_store_n(&slot->version, slot->version + 1, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+
+/* Append image <img_id> to the snapshot if it changed since its last
+ * record, or if that record is not in the file that is being written
+ * to, as while compacting. The image is only ours while its metadata
+ * is copied, or its pixels written out if they are spilled: a resident
+ * version is pinned instead, and written out while the operations on
+ * the image go on. Nothing changes the pixels of a version that more
+ * than the registry and one worker refer to (see IMG_ROT90CLKW). */
+void snapshot_image(struct queue * the_queue, uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	struct snap_record rec;
+	struct image * img;
+	uint64_t version, len;
+
+	if (!mailbox_claim(img_id)) {
+		return;
+	}
+
+	img = __atomic_load_n(&slot->img, __ATOMIC_ACQUIRE);
+	version = __atomic_load_n(&slot->version, __ATOMIC_RELAXED);
+	if ((!img && !slot->spilled) ||
+	    (version == slot->snap_version && slot->snap_gen == snapshot_gen)) {
+		mailbox_unclaim(the_queue, img_id);
+		return;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.img_id = img_id;
+	rec.digest_valid = slot->digest_valid;
+	memcpy(rec.digest, &slot->digest, sizeof(rec.digest));
+	rec.chain_len = slot->chain_len;
+	memcpy(rec.chain, slot->chain, slot->chain_len);
+
+	if (img) {
+		retainImage(img);
+		mailbox_unclaim(the_queue, img_id);
+
+		/* The digest is worth having on restart, for the cache */
+		if (!rec.digest_valid) {
+			struct md5ctx md5;
+			struct md5digest digest;
+
+			md5_init(&md5);
+			readImageRows(img, md5_consume, &md5);
+			digest = md5_final(&md5);
+			memcpy(rec.digest, &digest, sizeof(rec.digest));
+			rec.digest_valid = 1;
+		}
+		rec.encoding = SNAP_RAW;
+		rec.width = img->width;
+		rec.height = img->height;
+		rec.layout = img->layout;
+		rec.data_len = imageBytes(img);
+		len = snap_append(&snapshot, &rec, img->pixels);
+		releaseImage(img);
+	} else {
+		const void * data = slot->packed;
+
+		if (!data) {
+			data = spill_map(&spill_store, &slot->spill);
+		}
+		rec.encoding = slot->packed_len ? SNAP_PACKED : SNAP_RAW;
+		rec.width = slot->spill_width;
+		rec.height = slot->spill_height;
+		rec.layout = slot->spill_layout;
+		if (slot->packed_len) {
+			rec.data_len = slot->packed_len;
+		} else {
+			struct image shape = { rec.width, rec.height, NULL, 0, rec.layout };
+
+			rec.data_len = imageBytes(&shape);
+		}
+		len = snap_append(&snapshot, &rec, data);
+		mailbox_unclaim(the_queue, img_id);
+	}
+
+	/* Only this thread looks at the rest */
+	if (len) {
+		slot->snap_version = version;
+		slot->snap_gen = snapshot_gen;
+		slot->snap_bytes = len;
+	}
+}
+
+/* One pass of snapshot_main() over the registry. Once the records out
+ * of date take most of the file, a new one is started, into which all
+ * the images are written again: it only replaces the old one at the
+ * end of the first pass that got them all, busy ones included. */
+void snapshot_pass(struct queue * the_queue)
+{
+	uint64_t count = __atomic_load_n(&registry.next_id, __ATOMIC_ACQUIRE);
+	uint64_t failures = snapshot.stats.failures;
+	uint64_t live = 0, missing = 0, i;
+	int compacting = snapshot.new_fd >= 0, failed;
+
+	for (i = 0; i < count; ++i) {
+		struct registry_entry * slot = registry_slot(i, 0);
+
+		if (slot && slot->snap_gen == snapshot_gen) {
+			live += slot->snap_bytes;
+		}
+	}
+	if (!compacting && snap_size(&snapshot) > 2 * live + SNAPSHOT_COMPACT_SLACK &&
+	    !snap_begin_compact(&snapshot)) {
+		compacting = 1;
+		snapshot_gen++;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct registry_entry * slot = registry_slot(i, 0);
+
+		if (!slot) {
+			continue;
+		}
+		if (__atomic_load_n(&slot->version, __ATOMIC_RELAXED) != slot->snap_version ||
+		    slot->snap_gen != snapshot_gen) {
+			snapshot_image(the_queue, i);
+		}
+		/* Still not in the new file, and something to write */
+		missing += slot->snap_gen != snapshot_gen &&
+			(__atomic_load_n(&slot->img, __ATOMIC_RELAXED) ||
+			 __atomic_load_n(&slot->spilled, __ATOMIC_RELAXED));
+	}
+
+	failed = snapshot.stats.failures != failures;
+	if (compacting && (failed || !missing)) {
+		/* Otherwise, the old file is written to again, all of it */
+		if (snap_end_compact(&snapshot, !failed) || failed) {
+			snapshot_gen++;
+		}
+	} else if (snap_sync(&snapshot)) {
+		ERROR_INFO();
+		perror("Unable to sync the snapshot");
+	}
+}
+
+/* Thread that writes the changes of the registry to the snapshot every
+ * snapshot_period_ms, and once more when told to stop by snapshot_stop */
+void * snapshot_main(void * arg)
+{
+	struct queue * the_queue = (struct queue *)arg;
+	struct timespec deadline;
+	int stop = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while (!stop) {
+		uint64_t next = timespec_to_ns(&deadline) + snapshot_period_ms * 1000000;
+
+		deadline = ns_to_timespec(next);
+		stop = sem_timedwait(&snapshot_stop, &deadline) == 0 || errno != ETIMEDOUT;
+		snapshot_pass(the_queue);
+	}
+	return NULL;
+}
+
+/* Latest record of each image, as found by snapshot_restore() */
+struct snapshot_index {
+	const struct snap_record ** recs;
+	uint64_t count;
+};
+
+void snapshot_index_add(void * arg, const struct snap_record * rec, void * data)
+{
+	struct snapshot_index * index = (struct snapshot_index *)arg;
+	(void)data;
+
+	if (rec->img_id >= (uint64_t)REGISTRY_MAX_BLOCKS * REGISTRY_BLOCK_SIZE) {
+		return;
+	}
+	if (rec->img_id >= index->count) {
+		uint64_t count = 2 * rec->img_id + 1;
+		const struct snap_record ** recs = (const struct snap_record **)
+			realloc(index->recs, count * sizeof(*recs));
+
+		if (!recs) {
+			return;
+		}
+		memset(recs + index->count, 0, (count - index->count) * sizeof(*recs));
+		index->recs = recs;
+		index->count = count;
+	}
+	index->recs[rec->img_id] = rec;
+}
+
+/* The image of <rec>, over its pixels in the mapping of the snapshot
+ * file where they are kept as is, or NULL if they do not fit its size */
+struct image * snapshot_image_of(const struct snap_record * rec)
+{
+	struct image shape = { rec->width, rec->height, NULL, 0, rec->layout };
+	void * data = (char *)rec + SNAP_ALIGN;
+	struct image * img;
+
+	if (rec->layout > IMG_LAYOUT_PLANAR) {
+		return NULL;
+	}
+	if (rec->encoding == SNAP_RAW) {
+		return imageBytes(&shape) == rec->data_len ?
+			createImageOver(rec->width, rec->height, rec->layout, data) : NULL;
+	}
+
+	img = createImageUninitLayout(rec->width, rec->height, rec->layout);
+	if (img && unpackImage(img, data, rec->data_len)) {
+		deleteImage(img);
+		img = NULL;
+	}
+	return img;
+}
+
+/* Bring the images of the snapshot back into the registry, under the
+ * same IDs, before anything else uses it. Returns 1 if the snapshot
+ * cannot be read. */
+int snapshot_restore(void)
+{
+	struct snapshot_index index = { NULL, 0 };
+	uint64_t i;
+
+	if (snap_replay(&snapshot, snapshot_index_add, &index) < 0) {
+		return 1;
+	}
+	setForeignPixels(snapshot.map, snapshot.map_len);
+
+	for (i = 0; i < index.count; ++i) {
+		const struct snap_record * rec = index.recs[i];
+		struct registry_entry * slot;
+		struct md5digest digest;
+		struct image * img;
+
+		if (!rec) {
+			continue;
+		}
+		img = snapshot_image_of(rec);
+		slot = registry_slot(i, 1);
+		if (!img || !slot) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to restore image %lu.\n", i);
+			if (img) {
+				deleteImage(img);
+			}
+			continue;
+		}
+
+		if (registry.next_id <= i) {
+			registry.next_id = i + 1;
+		}
+		memcpy(&digest, rec->digest, sizeof(digest));
+		registry_publish(i, img, rec->digest_valid ? &digest : NULL);
+
+		/* Under a shorter -L than before, the chain runs now */
+		if (rec->chain_len <= lazy_max) {
+			memcpy(slot->chain, rec->chain, rec->chain_len);
+			slot->chain_len = rec->chain_len;
+		} else {
+			lazy_run(i, rec->chain, rec->chain_len);
+		}
+
+		/* Written already, unless the chain had to run */
+		slot->snap_version = slot->version;
+		slot->snap_gen = snapshot_gen;
+		slot->snap_bytes = SNAP_RECORD_BYTES(rec->data_len);
+		snapshot_restored++;
+	}
+
+	free(index.recs);
+	return 0;
+}
+
+/* Print the counters of the snapshot */
+void dump_snapshot_stats(void)
+{
+	sync_printf("INFO: snapshot restored=%lu records=%lu bytes=%lu failures=%lu "
+		    "compactions=%lu file=%.1lf MB\n", snapshot_restored,
+		    snapshot.stats.records, snapshot.stats.bytes, snapshot.stats.failures,
+		    snapshot.stats.compactions, (double)snap_size(&snapshot) / (1 << 20));
+}
+
+/* Apply <filter> to <img> split in <bands> row bands. The calling
+ * worker computes the first band and then, rather than idling, works
+ * on any band still queued until all of its own bands are done. */
+struct image * filter_in_bands(struct band_pool * pool, const struct image * img,
+			       enum img_filter filter, size_t bands)
+{
+	struct image * out = createFilterOutput(img, filter);
+	struct band_task * tasks;
+	struct band_group group;
+	size_t i;
+
+	tasks = (struct band_task *)malloc(bands * sizeof(struct band_task));
+	if (!out || !tasks) {
+		ERROR_INFO();
+		perror("Unable to allocate row bands");
+		free(tasks);
+		return out;
+	}
+
+	group.pending = bands;
+	sem_init(&group.done, 0, 0);
+
+	for (i = 0; i < bands; ++i) {
+		tasks[i].src = img;
+		tasks[i].dst = out;
+		tasks[i].filter = filter;
+		tasks[i].y0 = (uint64_t)img->height * i / bands;
+		tasks[i].y1 = (uint64_t)img->height * (i + 1) / bands;
+		tasks[i].group = &group;
+	}
+
+	for (i = 1; i < bands; ++i) {
+		band_pool_push(pool, &tasks[i]);
+	}
+
+	run_band_task(&tasks[0]);
+
+	while (__atomic_load_n(&group.pending, __ATOMIC_ACQUIRE) > 0 &&
+	       sem_trywait(&pool->notify) == 0) {
+		run_band_task(band_pool_pop(pool));
+	}
+
+	sem_wait(&group.done);
+	sem_destroy(&group.done);
+	free(tasks);
+
+	return out;
+}
+
+/* Start <fn> in a new thread running on <stack>, of stack_size
+ * bytes. These are full pthreads rather than bare clone() threads:
+ * the C library (malloc in particular) keeps per-thread state that
+ * threads created with clone() would share with the main thread. */
+int start_thread(pthread_t * thread, char * stack, void * (*fn)(void *), void * arg)
+{
+	pthread_attr_t attr;
+	int retval;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, stack_size);
+	retval = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	if (retval) {
+		errno = retval;
+		return -1;
+	}
+	return 0;
+}
+
+/* Main logic of the helper threads */
+void * helper_main (void * arg) {
+	struct helper_params * params = (struct helper_params *)arg;
+
+	while (!__atomic_load_n(&params->helper_done, __ATOMIC_ACQUIRE)) {
+		sem_wait(&band_pool->notify);
+		if (__atomic_load_n(&params->helper_done, __ATOMIC_ACQUIRE))
+			break;
+		run_band_task(band_pool_pop(band_pool));
+	}
+
+	return NULL;
+}
+
+/* This function will start/stop the helper threads of the band pool,
+ * in the same way as control_workers() */
+int control_helpers(enum worker_command cmd, size_t helper_count)
+{
+	static char ** helper_stacks = NULL;
+	static struct helper_params ** helper_params = NULL;
+	static int * helper_ids = NULL;
+	static pthread_t * helper_threads = NULL;
+
+	if (cmd == WORKERS_START) {
+		size_t i;
+		helper_stacks = (char **)malloc(helper_count * sizeof(char *));
+		helper_params = (struct helper_params **)
+			malloc(helper_count * sizeof(struct helper_params *));
+		helper_ids = (int *)malloc(helper_count * sizeof(int));
+		helper_threads = (pthread_t *)malloc(helper_count * sizeof(pthread_t));
+
+		if (!helper_stacks || !helper_params || !helper_ids || !helper_threads) {
+			ERROR_INFO();
+			perror("Unable to allocate descriptor arrays for helpers.");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			helper_ids[i] = -1;
+
+			helper_stacks[i] = workerpool_stack_alloc(stack_size);
+			helper_params[i] = (struct helper_params *)
+				malloc(sizeof(struct helper_params));
+
+			if (!helper_stacks[i] || !helper_params[i]) {
+				ERROR_INFO();
+				perror("Unable to allocate memory for helper.");
+				return EXIT_FAILURE;
+			}
+
+			helper_params[i]->helper_done = 0;
+			helper_params[i]->helper_id = i;
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			helper_ids[i] = start_thread(&helper_threads[i], helper_stacks[i],
+						     helper_main, helper_params[i]);
+
+			if (helper_ids[i] < 0) {
+				ERROR_INFO();
+				perror("Unable to start helper.");
+				return EXIT_FAILURE;
+			} else {
+				sync_printf("INFO: Helper thread %ld started!\n", i);
+			}
+		}
+	}
+
+	else if (cmd == WORKERS_STOP) {
+		size_t i;
+
+		if (!helper_stacks || !helper_params || !helper_ids) {
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			if (helper_ids[i] >= 0) {
+				__atomic_store_n(&helper_params[i]->helper_done, 1, __ATOMIC_RELEASE);
+			}
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			if (helper_ids[i] < 0) {
+				continue;
+			}
+
+			sem_post(&band_pool->notify);
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			if (helper_ids[i] < 0) {
+				continue;
+			}
+
+			pthread_join(helper_threads[i], NULL);
+			sync_printf("INFO: Helper thread exited.\n");
+		}
+
+		for (i = 0; i < helper_count; ++i) {
+			workerpool_stack_free(helper_stacks[i], stack_size);
+			free(helper_params[i]);
+		}
+
+		free(helper_stacks);
+		helper_stacks = NULL;
+
+		free(helper_params);
+		helper_params = NULL;
+
+		free(helper_ids);
+		helper_ids = NULL;
+
+		free(helper_threads);
+		helper_threads = NULL;
+	}
+
+	else {
+		ERROR_INFO();
+		perror("Invalid thread control command.");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Registered payloads also go in the result cache, as the result of
+ * IMG_REGISTER on their own pixels. If the same pixels have been
+ * registered before, <img> is deleted and the earlier copy is returned
+ * instead, to be shared through its reference count. */
+struct image * dedup_image(struct image * img, const struct md5digest * digest)
+{
+	struct imgcache_key key;
+	struct image * prev;
+
+	imgcache_make_key(&key, digest, img->width, img->height, IMG_REGISTER);
+	prev = imgcache_lookup(result_cache, &key);
+
+	/* MD5 collisions can be crafted: make sure that the pixels are
+	 * really the same before sharing them */
+	if (prev && !compareImages(prev, img)) {
+		deleteImage(img);
+		return prev;
+	}
+
+	releaseImage(prev);
+	imgcache_insert(result_cache, &key, img);
+	return img;
+}
+
+/* Publish the staged image <img_id>, in the layout of the server and
+ * shared with identical pixels registered before, if any */
+void registry_publish_staged(uint64_t img_id)
+{
+	struct registry_entry * slot = registry_slot(img_id, 0);
+	struct image * img = slot->staged;
+	struct md5digest digest = slot->digest;
+	int digest_valid = slot->digest_valid;
+
+	if (image_layout != IMG_LAYOUT_LINEAR && convertImageLayout(img, image_layout)) {
+		ERROR_INFO();
+		perror("Unable to convert the image layout");
+	}
+	if (digest_valid) {
+		img = dedup_image(img, &digest);
+	}
+
+	registry_publish(img_id, img, digest_valid ? &digest : NULL);
+	__atomic_store_n(&slot->staged, NULL, __ATOMIC_RELEASE);
+}
+
+/* Append <item> to the send queue of <conn>, in the encoding of the
+ * connection. Event loop only. */
+void send_queue_append(struct connection * conn, struct send_item * item)
+{
+	if (conn->packed) {
+		response_to_v2(&item->packed, &item->resp);
+		item->wire = &item->packed;
+		item->wire_len = sizeof(struct response_v2);
+	} else {
+		item->wire = &item->resp;
+		item->wire_len = sizeof(struct response);
+	}
+
+	item->next = NULL;
+	if (conn->send_tail) {
+		conn->send_tail->next = item;
+	} else {
+		conn->send_head = item;
+	}
+	conn->send_tail = item;
+}
+
+/* Hand <item> over to the event loop, to be sent to the client of
+ * <conn>. Called by the workers, never blocks. */
+void conn_send(struct connection * conn, struct send_item * item)
+{
+	struct connection * head;
+	struct send_item * prev;
+	uint64_t one = 1;
+
+	/* Neither is <item> touched once pushed: the event loop may take
+	 * and send it right away, if the connection is on the ready list */
+	prev = __atomic_load_n(&conn->completions, __ATOMIC_RELAXED);
+	do {
+		item->next = prev;
+	} while (!__atomic_compare_exchange_n(&conn->completions, &prev, item, 1,
+					      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	/* Once is enough until the event loop takes the responses. The
+	 * connection is not touched after this: once it is on the ready
+	 * list, its responses may be sent and the connection freed. */
+	if (prev) {
+		return;
+	}
+
+	head = __atomic_load_n(&ready_list, __ATOMIC_RELAXED);
+	do {
+		conn->ready_next = head;
+	} while (!__atomic_compare_exchange_n(&ready_list, &head, conn, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (!head && write(ready_fd, &one, sizeof(one)) < 0) {
+		ERROR_INFO();
+		perror("Unable to wake up the event loop");
+	}
+}
+
+
+/* Compress the payload of <item> for a client that asked for it. The
+ * worker does it, rather than the event loop that sends it. If it
+ * cannot, the payload is sent as it is. */
+void reply_pack(struct send_item * item)
+{
+	struct image * img = item->img;
+
+	item->compressed = (uint8_t *)malloc(packImageBound(img->width, img->height));
+	if (!item->compressed || packImage(img, item->compressed, &item->compressed_len) ||
+	    item->compressed_len > UINT32_MAX) {
+		free(item->compressed);
+		item->compressed = NULL;
+		return;
+	}
+
+	__atomic_add_fetch(&wire_stats.payloads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wire_stats.bytes, item->compressed_len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wire_stats.raw_bytes,
+			   (uint64_t)img->width * img->height * sizeof(uint32_t), __ATOMIC_RELAXED);
+}
+
+/* Pin the calling thread to the <index>-th CPU of <worker_cpus>, going
+ * around if there are more workers than CPUs. Under -N, to one of the
+ * CPUs of the node of worker <index> instead, in the same way among the
+ * workers of the node. */
+void pin_to_cpu(size_t index)
+{
+	cpu_set_t cpus = worker_cpus, set;
+	size_t nth = index;
+	int cpu;
+
+	if (numa_aware) {
+		CPU_AND(&cpus, &cpus, &numa_topo.node_cpus[worker_node[index]]);
+		nth = index / numa_topo.nodes;
+	}
+	nth %= CPU_COUNT(&cpus);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &cpus) && nth-- == 0) {
+			break;
+		}
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		ERROR_INFO();
+		perror("WARNING: unable to pin the worker to a CPU");
+	} else {
+		sync_printf("INFO: Worker %ld pinned to CPU %d\n", index, cpu);
+	}
+}
+
+/* Keep worker <index>, the calling thread, to the CPUs of its node */
+void bind_to_node(size_t index)
+{
+	size_t node = worker_node[index];
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &numa_topo.node_cpus[node])) {
+		ERROR_INFO();
+		perror("WARNING: unable to bind the worker to its node");
+	} else {
+		sync_printf("INFO: Worker %ld bound to node %ld\n", index, node);
+	}
+}
+
+/* Move the pixels staged for image <img_id> to <node>, that of the
+ * worker registering it, which the operations on the image go to next.
+ * The event loop that received them may have put them anywhere. */
+void numa_place_staged(uint64_t img_id, size_t node)
+{
+	struct image * img = registry_slot(img_id, 0)->staged;
+	size_t bytes = imageBytes(img);
+
+	if (numatopo_node_of(&numa_topo, img->pixels) == (int)node ||
+	    numatopo_move(&numa_topo, img->pixels, bytes, node)) {
+		return;
+	}
+	__atomic_add_fetch(&node_stats[node].moved, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&node_stats[node].moved_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Answer <req>, just taken from the queue by worker <self>, without
+ * running it if its client cancelled it or its deadline has passed.
+ * Returns 1 if so. */
+int drop_request(struct queue * the_queue, size_t self, struct request_meta * req)
+{
+	int cancelled = __atomic_load_n(&req->reply->cancelled, __ATOMIC_RELAXED);
+	struct timespec now;
+
+	if (!cancelled) {
+		if (!req->deadline_ns) {
+			return 0;
+		}
+		tsc_gettime(&now);
+		if (timespec_to_ns(&now) <= req->deadline_ns) {
+			return 0;
+		}
+	}
+
+	admission_drop(&admission, req->cost_ns, cancelled);
+	skip_request(the_queue, req->request.img_id);
+	trace_reject(self, the_queue, req);
+
+	req->reply->resp.req_id = req->request.req_id;
+	req->reply->resp.img_id = 0;
+	req->reply->resp.ack = cancelled ? RESP_CANCELLED : RESP_EXPIRED;
+	req->reply->img = NULL;
+	req->reply->compressed = NULL;
+	conn_send(req->conn, req->reply);
+	return 1;
+}
+
+/* Main logic of the worker thread */
+void * worker_main (void * arg) {
+    struct timespec now;
+    struct worker_params * params = (struct worker_params *)arg;
+
+    if (pin_workers) {
+        pin_to_cpu(params->worker_id);
+    } else if (numa_aware) {
+        bind_to_node(params->worker_id);
+    }
+    workerpool_register(&worker_pool, params->worker_id);
+
+    /* Print the first alive message. */
+    tsc_gettime(&now);
+    sync_printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
+
+    while (!__atomic_load_n(&params->worker_done, __ATOMIC_ACQUIRE)) {
+        struct request_meta req;
+        struct response resp;
+
+        /* Beyond the active workers, wait for the pool to grow */
+        if (workerpool_park(&worker_pool, params->worker_id) ||
+            get_from_queue(params->the_queue, params->worker_id, &req) ||
+            __atomic_load_n(&params->worker_done, __ATOMIC_ACQUIRE))
+            break;
+
+		/* Only the requests of the clients can be dropped: the
+		 * registrations have been acked already */
+		if (req.reply && drop_request(params->the_queue, params->worker_id, &req)) {
+			continue;
+		}
+
+		if (numa_aware) {
+			__atomic_add_fetch(&node_stats[worker_node[params->worker_id]].ops, 1,
+					   __ATOMIC_RELAXED);
+		}
+
+		/* The request is runnable only once all the earlier
+		 * operations on its image are done, so nobody else can
+		 * publish a new version until complete_request() */
+		uint64_t img_id = req.request.img_id;
+
+		/* A registration that the event loop has already acked:
+		 * the operations on the image wait in its mailbox */
+		admission_start(&admission, req.cost_ns);
+
+		if (req.request.img_op == IMG_REGISTER) {
+			tsc_gettime(&req.start_timestamp);
+			if (numa_aware) {
+				numa_place_staged(img_id, worker_node[params->worker_id]);
+			}
+			registry_publish_staged(img_id);
+			tsc_gettime(&req.completion_timestamp);
+			costmodel_learn(&cost_model, IMG_REGISTER, registry_pixels(img_id),
+					timespec_to_ns(&req.completion_timestamp) -
+					timespec_to_ns(&req.start_timestamp));
+			admission_finish(&admission, req.cost_ns, 0);
+			complete_request(params->the_queue, img_id, params->worker_id);
+			continue;
+		}
+
+		tsc_gettime(&req.start_timestamp);
+
+		/* Under -M, the image may have to be read back first. If
+		 * it cannot be, the request is rejected rather than run on
+		 * pixels that are not there, and the next one goes ahead. */
+		if (registry_touch(img_id)) {
+			admission_finish(&admission, req.cost_ns, 0);
+			complete_request(params->the_queue, img_id, params->worker_id);
+			trace_reject(params->worker_id, params->the_queue, &req);
+
+			req.reply->resp.req_id = req.request.req_id;
+			req.reply->resp.img_id = 0;
+			req.reply->resp.ack = RESP_REJECTED;
+			req.reply->img = NULL;
+			req.reply->compressed = NULL;
+			conn_send(req.conn, req.reply);
+			continue;
+		}
+
+		/* Under -L, an overwriting filter only joins the chain of
+		 * the image, and anything else needs what the chain makes */
+		int deferred = 0, lazy_ran = 0;
+		if (lazy_max) {
+			if (req.request.overwrite) {
+				deferred = lazy_defer(&req.request);
+			}
+			if (!deferred) {
+				lazy_ran = lazy_materialize(img_id);
+			}
+		}
+
+		/* Pin the current version: it stays valid for as long as
+		 * we hold the reference, even once it has been replaced */
+		struct image * src = retainImage(registry_lookup(img_id));
+		struct image * img = src;
+		assert(img != NULL);
+		uint64_t pixels = (uint64_t)img->width * img->height;
+		int retrieve = req.request.img_op == IMG_RETRIEVE ||
+			req.request.img_op == IMG_RETRIEVE_REGION;
+
+		/* A retrieve only reads the pinned version, so the next
+		 * operation on the image can start right away, and so can
+		 * the one after a deferred filter */
+		if (retrieve || deferred) {
+			complete_request(params->the_queue, img_id, params->worker_id);
+		}
+
+		/* The size of the image may have changed since the region
+		 * was asked for: clip it to this version */
+		struct img_region * region = &req.region;
+		if (req.request.img_op == IMG_RETRIEVE_REGION &&
+		    region->x < img->width && region->y < img->height) {
+			if (!region->width || region->width > img->width - region->x) {
+				region->width = img->width - region->x;
+			}
+			if (!region->height || region->height > img->height - region->y) {
+				region->height = img->height - region->y;
+			}
+			pixels = (uint64_t)region->width * region->height;
+		}
+
+		/* The same operation on the same pixels gives the same
+		 * result: look for it in the cache first */
+		struct imgcache_key key;
+		struct image * cached = NULL;
+		/* The key of a cache entry names a single operation, so
+		 * the results of pipelines are not cached */
+		int cacheable = result_cache && !retrieve && !deferred &&
+			req.request.img_op != IMG_PIPELINE;
+		int inplace = 0;
+		if (cacheable) {
+			imgcache_make_key(&key, registry_digest(img_id), img->width,
+					  img->height, req.request.img_op);
+			cached = imgcache_lookup(result_cache, &key);
+		}
+
+		/* Large images are split in row bands shared with the
+		 * helper threads */
+		enum img_filter filter;
+		size_t bands = 1;
+		if (band_pool && opcode_to_filter(req.request.img_op, &filter)) {
+			bands = band_count(band_pool, img);
+		}
+
+		/* Image processing operations */
+		if (deferred) {
+			/* In the chain of the image already */
+		} else if (cached) {
+			img = cached;
+		} else if (bands > 1) {
+			img = filter_in_bands(band_pool, img, filter, bands);
+		} else switch (req.request.img_op) {
+			case IMG_ROT90CLKW:
+				/* No need for a second buffer when the
+				 * result replaces the original image and
+				 * only the registry and we refer to it. */
+				if (req.request.overwrite &&
+				    __atomic_load_n(&img->refs, __ATOMIC_ACQUIRE) == 2) {
+					rotate90ClockwiseInPlace(img);
+					inplace = 1;
+				} else {
+					img = rotate90Clockwise(img, NULL);
+				}
+				break;
+			case IMG_BLUR:
+				img = blurImage(img);
+				break;
+			case IMG_SHARPEN:
+				img = sharpenImage(img);
+				break;
+			case IMG_VERTEDGES:
+				img = detectVerticalEdges(img);
+				break;
+			case IMG_HORIZEDGES:
+				img = detectHorizontalEdges(img);
+				break;
+			case IMG_GAUSSBLUR:
+				img = gaussianBlurImage(img);
+				break;
+			case IMG_EMBOSS:
+				img = embossImage(img);
+				break;
+			case IMG_SOBEL:
+				img = detectEdges(img);
+				break;
+			case IMG_PIPELINE: {
+				/* Checked when the request was queued */
+				enum img_filter filters[IMG_PIPELINE_MAX];
+				size_t stages = pipeline_to_filters(&req.request, filters);
+				img = filterImagePipeline(img, filters, stages);
+				break;
+			}
+			case IMG_RETRIEVE_REGION:
+				/* NULL if the region is out of the image */
+				img = regionImage(img, region->x, region->y, region->width,
+						  region->height, region->scale);
+				break;
+		}
+
+		if (cacheable && !cached) {
+			imgcache_insert(result_cache, &key, img);
+		}
+
+		if (!retrieve && !deferred) {
+			if (req.request.overwrite) {
+				/* Publish the new version and drop the
+				 * reference of the registry on the old one:
+				 * it goes back to the pool once the last
+				 * retrieve still sending it is done. A
+				 * rotation in place already holds the
+				 * reference of the registry. */
+				registry_publish(img_id, img, NULL);
+				if (!inplace) {
+					releaseImage(src);
+				}
+			} else {
+				/* Generate new ID and Increase the count of registered images */
+				img_id = registry_reserve();
+				assert(img_id != REGISTRY_FULL);
+				registry_publish(img_id, img, NULL);
+			}
+
+			complete_request(params->the_queue, req.request.img_id, params->worker_id);
+		}
+
+        tsc_gettime(&req.completion_timestamp);
+
+        /* A cache hit says nothing about the cost of the operation,
+         * a pipeline nothing about the cost of each stage, and the
+         * filters deferred or run with others nothing about theirs */
+        if (!cached && !deferred && !lazy_ran && img &&
+            req.request.img_op != IMG_PIPELINE) {
+            costmodel_learn(&cost_model, req.request.img_op, pixels,
+                            timespec_to_ns(&req.completion_timestamp) -
+                            timespec_to_ns(&req.start_timestamp));
+        }
+
+        admission_finish(&admission, req.cost_ns,
+                         timespec_to_ns(&req.completion_timestamp) -
+                         timespec_to_ns(&req.receipt_timestamp));
+
+        /* Response to the client, sent by the event loop along
+         * with the payload of a retrieve. The image of a region is
+         * only for the response, which takes it over. */
+        resp.req_id = req.request.req_id;
+        resp.ack = img ? RESP_COMPLETED : RESP_REJECTED;
+        resp.img_id = img_id;
+
+        req.reply->resp = resp;
+        if (deferred) {
+            req.reply->img = NULL;
+        } else if (req.request.img_op == IMG_RETRIEVE_REGION) {
+            req.reply->img = img;
+        } else {
+            req.reply->img = retrieve ? retainImage(img) : NULL;
+        }
+        req.reply->compressed = NULL;
+        if (req.reply->img && req.conn->compressed) {
+            reply_pack(req.reply);
+        }
+        conn_send(req.conn, req.reply);
+
+        releaseImage(src);
+
+        trace_request(params->worker_id, params->the_queue, &req, img_id);
+        stats_record(params->worker_id, &req);
+        sample_queue_status(params->the_queue);
+
+        if (cacheable &&
+            __atomic_add_fetch(&cache_ops, 1, __ATOMIC_RELAXED) % CACHE_STATS_PERIOD == 0) {
+            dump_cache_stats(result_cache);
+        }
+	}
+
+    return NULL;
+}
+
+
+/* This function will start/stop all the worker threads wrapping
+ * around the pthread_create()/pthread_join() calls */
+int control_workers(enum worker_command cmd, size_t worker_count,
+		    struct worker_params * common_params)
+{
+	/* Anything we allocate should we kept as static for easy
+	 * deallocation when the STOP command is issued */
+	static char ** worker_stacks = NULL;
+	static struct worker_params ** worker_params = NULL;
+	static int * worker_ids = NULL;
+	static pthread_t * worker_threads = NULL;
+
+	/* Start all the workers */
+	if (cmd == WORKERS_START) {
+		size_t i;
+		/* Allocate all stacks and parameters */
+		worker_stacks = (char **)malloc(worker_count * sizeof(char *));
+		worker_params = (struct worker_params **)
+		malloc(worker_count * sizeof(struct worker_params *));
+		worker_ids = (int *)malloc(worker_count * sizeof(int));
+		worker_threads = (pthread_t *)malloc(worker_count * sizeof(pthread_t));
+
+		if (!worker_stacks || !worker_params || !worker_ids || !worker_threads) {
+			ERROR_INFO();
+			perror("Unable to allocate descriptor arrays for threads.");
+			return EXIT_FAILURE;
+		}
+
+		/* Allocate and initialize as needed */
+		for (i = 0; i < worker_count; ++i) {
+			worker_ids[i] = -1;
+
+			worker_stacks[i] = workerpool_stack_alloc(stack_size);
+			worker_params[i] = (struct worker_params *)
+				malloc(sizeof(struct worker_params));
+
+			if (!worker_stacks[i] || !worker_params[i]) {
+				ERROR_INFO();
+				perror("Unable to allocate memory for thread.");
+				return EXIT_FAILURE;
+			}
+
+			worker_params[i]->the_queue = common_params->the_queue;
+			worker_params[i]->worker_done = 0;
+			worker_params[i]->worker_id = i;
+		}
+
+		/* All the allocations and initialization seem okay,
+		 * let's start the threads */
+		for (i = 0; i < worker_count; ++i) {
+			worker_ids[i] = start_thread(&worker_threads[i], worker_stacks[i],
+						     worker_main, worker_params[i]);
+
+			if (worker_ids[i] < 0) {
+				ERROR_INFO();
+				perror("Unable to start thread.");
+				return EXIT_FAILURE;
+			} else {
+				sync_printf("INFO: Worker thread %ld started!\n", i);
+			}
+		}
+	}
+
+	else if (cmd == WORKERS_STOP) {
+		size_t i;
+
+		/* Command to stop the threads issues without a start
+		 * command? */
+		if (!worker_stacks || !worker_params || !worker_ids) {
+			return EXIT_FAILURE;
+		}
+
+		/* First, assert all the termination flags */
+		for (i = 0; i < worker_count; ++i) {
+			if (worker_ids[i] < 0) {
+				continue;
+			}
+
+			/* Request thread termination */
+			__atomic_store_n(&worker_params[i]->worker_done, 1, __ATOMIC_RELEASE);
+		}
+
+		/* Next, unblock threads and wait for completion */
+		workerpool_close(&worker_pool);
+		for (i = 0; i < worker_count; ++i) {
+			if (worker_ids[i] < 0) {
+				continue;
+			}
+
+			queue_shutdown(worker_params[i]->the_queue);
+			pthread_join(worker_threads[i], NULL);
+			sync_printf("INFO: Worker thread exited.\n");
+		}
+
+		/* Finally, do a round of deallocations */
+		for (i = 0; i < worker_count; ++i) {
+			workerpool_stack_free(worker_stacks[i], stack_size);
+			free(worker_params[i]);
+		}
+
+		free(worker_stacks);
+		worker_stacks = NULL;
+
+		free(worker_params);
+		worker_params = NULL;
+
+		free(worker_ids);
+		worker_ids = NULL;
+
+		free(worker_threads);
+		worker_threads = NULL;
+	}
+
+	else {
+		ERROR_INFO();
+		perror("Invalid thread control command.");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void send_item_free(struct send_item * item)
+{
+	releaseImage(item->img);
+	free(item->compressed);
+	free(item);
+}
+
+/* Add the response <item> of request <req_id> to the requests pending
+ * on <conn>, before the request is queued */
+void conn_pend(struct event_loop * loop, struct connection * conn,
+	       struct send_item * item, uint64_t req_id)
+{
+	if (!conn->pending++) {
+		loop->backlogged++;
+	}
+	item->req_id = req_id;
+	item->cancelled = 0;
+	item->pend_next = NULL;
+	item->pend_prev = conn->pend_tail;
+	if (conn->pend_tail) {
+		conn->pend_tail->pend_next = item;
+	} else {
+		conn->pend_head = item;
+	}
+	conn->pend_tail = item;
+}
+
+/* Take <item> off the requests pending on <conn>, once it is back from
+ * the workers or could not be queued */
+void conn_unpend(struct event_loop * loop, struct connection * conn,
+		 struct send_item * item)
+{
+	if (!--conn->pending) {
+		loop->backlogged--;
+	}
+	if (item->pend_prev) {
+		item->pend_prev->pend_next = item->pend_next;
+	} else {
+		conn->pend_head = item->pend_next;
+	}
+	if (item->pend_next) {
+		item->pend_next->pend_prev = item->pend_prev;
+	} else {
+		conn->pend_tail = item->pend_prev;
+	}
+}
+
+/* Have the workers drop request <req_id> of <conn> if they have not
+ * started it yet. Returns 1 if it is not pending. The search starts
+ * from the oldest request, which is what a client gives up on first. */
+int conn_cancel(struct connection * conn, uint64_t req_id)
+{
+	struct send_item * item;
+
+	for (item = conn->pend_head; item; item = item->pend_next) {
+		if (item->req_id == req_id) {
+			__atomic_store_n(&item->cancelled, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Update the epoll interest of <conn>: new requests for as long as
+ * they are accepted, and room in the socket while a response is
+ * stuck at the head of the send queue. */
+void conn_update_events(struct event_loop * loop, struct connection * conn, int want_out)
+{
+	struct epoll_event ev;
+	uint32_t events = (conn->rx_open ? EPOLLIN : 0) | (want_out ? EPOLLOUT : 0);
+
+	if (conn->dead || LOOP_URING(loop) || events == conn->events) {
+		return;
+	}
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to update the events of a connection");
+	}
+	conn->events = events;
+}
+
+/* Free <conn> at the end of the current round of events once it can
+ * no longer be referred to: no more requests are coming, all the
+ * responses owed have been sent or dropped, and the kernel is done
+ * with its buffers. Once the workers are gone, the requests they did
+ * not get to are not waited for. */
+void conn_maybe_close(struct event_loop * loop, struct connection * conn)
+{
+	/* A response still owed is either queued, or on its way to the
+	 * ready list by a worker */
+	if (conn->closing || conn->ops > 0) {
+		return;
+	}
+	if (!loop->stopping && (conn->rx_open || conn->inflight > 0)) {
+		return;
+	}
+
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		loop->conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+
+	conn->closing = 1;
+	conn->next = loop->closed;
+	loop->closed = conn;
+}
+
+/* Give up on <conn> after a socket error. The requests that are still
+ * queued are dropped, and the responses of those in flight too. */
+void conn_kill(struct event_loop * loop, struct connection * conn)
+{
+	struct send_item * item;
+
+	if (conn->dead) {
+		return;
+	}
+
+	for (item = conn->pend_head; item; item = item->pend_next) {
+		__atomic_store_n(&item->cancelled, 1, __ATOMIC_RELAXED);
+	}
+
+	/* The shutdown also completes the pending io_uring operations */
+	if (!LOOP_URING(loop)) {
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	}
+	shutdown(conn->fd, SHUT_RDWR);
+	conn->dead = 1;
+	conn->rx_open = 0;
+	/* A receive in flight may still write into the payload: it is
+	 * then released with the connection */
+	if (conn->rx_image && !conn->rx_armed) {
+		endImageXfer(&conn->rx_xfer);
+		conn->rx_image = 0;
+	}
+}
+
+/* Release the payloads whose zerocopy transmission is complete. Also
+ * collects the notifications that the kernel reports as POLLERR. */
+void conn_reap_zerocopy(struct connection * conn)
+{
+	if (!conn->zerocopy) {
+		return;
+	}
+
+	for (;;) {
+		struct send_item * item = conn->zc_head;
+		uint32_t seq = item ? item->seq : conn->zc.next_seq;
+
+		if (!zeroCopyDone(conn->fd, &conn->zc, seq) || !item) {
+			break;
+		}
+		conn->zc_head = item->next;
+		if (!conn->zc_head) {
+			conn->zc_tail = NULL;
+		}
+		send_item_free(item);
+	}
+}
+
+/* Whether the payload being sent on <conn> goes out with MSG_ZEROCOPY */
+int conn_tx_zerocopy(const struct connection * conn)
+{
+	return conn->zerocopy && conn->tx_xfer.total >= ZEROCOPY_MIN_BYTES;
+}
+
+/* Gather the rest of the responses queued on <conn> in <iov>, so that
+ * they go out with a single sendmsg(): a run of small responses, up to
+ * and including the first one with an image payload, of which at most
+ * CONN_TX_BURST bytes. A zerocopy payload is left out and <more> is
+ * set, for it to be sent on its own. Returns the number of pieces, or
+ * -1 if a payload could not be staged. */
+int conn_tx_gather(struct connection * conn, struct iovec * iov, int * more)
+{
+	struct send_item * item;
+	size_t offset = conn->tx_bytes;
+	int count = 0;
+
+	*more = 0;
+	for (item = conn->send_head; item && count + 3 <= CONN_TX_IOV; item = item->next) {
+		if (offset < item->wire_len) {
+			iov[count].iov_base = (char *)item->wire + offset;
+			iov[count].iov_len = item->wire_len - offset;
+			count++;
+		}
+		offset = 0;
+
+		if (item->img) {
+			size_t room = CONN_TX_BURST;
+			int pieces, i;
+
+			if (!conn->tx_image && item->compressed) {
+				sendImageBeginPacked(&conn->tx_xfer, item->img, item->compressed,
+						     item->compressed_len);
+				conn->tx_image = 1;
+			} else if (!conn->tx_image) {
+				sendImageBegin(&conn->tx_xfer, item->img);
+				conn->tx_image = 1;
+			}
+			if (conn_tx_zerocopy(conn)) {
+				*more = 1;
+				break;
+			}
+			pieces = sendImageTarget(&conn->tx_xfer, &iov[count]);
+			if (pieces < 0) {
+				return -1;
+			}
+			for (i = 0; i < pieces && room; ++i, ++count) {
+				if (iov[count].iov_len > room) {
+					iov[count].iov_len = room;
+				}
+				room -= iov[count].iov_len;
+			}
+			break;
+		}
+	}
+
+	return count;
+}
+
+/* Done with <item>, the response at the head of the send queue of
+ * <conn>, whether it was sent or dropped */
+void conn_send_done(struct connection * conn, struct send_item * item)
+{
+	conn->send_head = item->next;
+	if (!conn->send_head) {
+		conn->send_tail = NULL;
 	}
 
-    return EXIT_SUCCESS;
+	conn->inflight--;
+	conn->tx_bytes = 0;
+
+	/* The kernel may still read the pixels of a zerocopy
+	 * payload: keep the image until it is done */
+	if (item->img && conn->tx_image) {
+		int zerocopy = !conn->dead && conn_tx_zerocopy(conn);
+
+		item->seq = conn->tx_xfer.seq;
+		endImageXfer(&conn->tx_xfer);
+		conn->tx_image = 0;
+		if (zerocopy) {
+			item->next = NULL;
+			if (conn->zc_tail) {
+				conn->zc_tail->next = item;
+			} else {
+				conn->zc_head = item;
+			}
+			conn->zc_tail = item;
+			return;
+		}
+	}
+	send_item_free(item);
 }
 
+/* Account for <sent> bytes of the pieces gathered by conn_tx_gather(),
+ * releasing the responses that are complete */
+void conn_tx_advance(struct connection * conn, size_t sent)
+{
+	struct send_item * item;
 
-/* This function will start/stop all the worker threads wrapping
- * around the clone()/waitpid() system calls */
-int control_workers(enum worker_command cmd, size_t worker_count,
-		    struct worker_params * common_params)
+	while ((item = conn->send_head)) {
+		if (conn->tx_bytes < item->wire_len) {
+			size_t cur = item->wire_len - conn->tx_bytes;
+
+			cur = sent < cur ? sent : cur;
+			conn->tx_bytes += cur;
+			sent -= cur;
+			if (conn->tx_bytes < item->wire_len) {
+				break;
+			}
+		}
+
+		if (item->img) {
+			if (conn_tx_zerocopy(conn) ||
+			    sendImageAdvance(&conn->tx_xfer, sent) != IMG_XFER_DONE) {
+				break;
+			}
+			sent = 0;
+		}
+		conn_send_done(conn, item);
+	}
+}
+
+#ifdef HAVE_URING
+/* io_uring engine: submit the send of the responses queued on <conn>,
+ * unless one is in flight already */
+void uring_flush(struct event_loop * loop, struct connection * conn)
 {
-	/* Anything we allocate should we kept as static for easy
-	 * deallocation when the STOP command is issued */
-	static char ** worker_stacks = NULL;
-	static struct worker_params ** worker_params = NULL;
-	static int * worker_ids = NULL;
+	while (!conn->tx_armed && conn->send_head) {
+		struct io_uring_sqe * sqe;
+		int count, more;
 
-	/* Start all the workers */
-	if (cmd == WORKERS_START) {
-		size_t i;
-		/* Allocate all stacks and parameters */
-		worker_stacks = (char **)malloc(worker_count * sizeof(char *));
-		worker_params = (struct worker_params **)
-		malloc(worker_count * sizeof(struct worker_params *));
-		worker_ids = (int *)malloc(worker_count * sizeof(int));
+		if (conn->dead) {
+			conn_send_done(conn, conn->send_head);
+			continue;
+		}
 
-		if (!worker_stacks || !worker_params) {
+		count = conn_tx_gather(conn, conn->tx_iov, &more);
+		if (count < 0) {
 			ERROR_INFO();
-			perror("Unable to allocate descriptor arrays for threads.");
-			return EXIT_FAILURE;
+			perror("Unable to stage an image payload");
+			conn_kill(loop, conn);
+			continue;
 		}
 
-		/* Allocate and initialize as needed */
-		for (i = 0; i < worker_count; ++i) {
-			worker_ids[i] = -1;
+		sqe = uring_get_sqe(loop->ring, (uintptr_t)conn | URING_OP_SEND);
+		if (!sqe) {
+			ERROR_INFO();
+			perror("Unable to submit a send");
+			conn_kill(loop, conn);
+			continue;
+		}
+		memset(&conn->tx_msg, 0, sizeof(conn->tx_msg));
+		conn->tx_msg.msg_iov = conn->tx_iov;
+		conn->tx_msg.msg_iovlen = count;
+		uring_prep_sendmsg(sqe, conn->fd, &conn->tx_msg, MSG_NOSIGNAL);
+		conn->tx_armed = 1;
+		conn->ops++;
+	}
 
-			worker_stacks[i] = malloc(STACK_SIZE);
-			worker_params[i] = (struct worker_params *)
-				malloc(sizeof(struct worker_params));
+	conn_maybe_close(loop, conn);
+}
+
+/* io_uring engine: <res> bytes of the responses queued on <conn> went
+ * out, or the send failed */
+void uring_send_done(struct event_loop * loop, struct connection * conn, int res)
+{
+	conn->tx_armed = 0;
+	conn->ops--;
+
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		conn_kill(loop, conn);
+	} else if (res >= 0 && !conn->dead) {
+		conn_tx_advance(conn, res);
+	}
+
+	uring_flush(loop, conn);
+}
+#endif
+
+/* Send the queued responses of <conn> until the socket is full, or
+ * CONN_TX_BURST bytes of them have gone out: the rest waits for the
+ * next round of events, which comes right away as the socket still has
+ * room. Runs of small responses are coalesced in one sendmsg(), along
+ * with the payload that follows them. */
+void conn_flush(struct event_loop * loop, struct connection * conn)
+{
+	enum img_xfer_status status = IMG_XFER_DONE;
+	struct iovec iov[CONN_TX_IOV];
+	size_t budget = CONN_TX_BURST;
+	struct msghdr msg;
+
+#ifdef HAVE_URING
+	if (LOOP_URING(loop)) {
+		uring_flush(loop, conn);
+		return;
+	}
+#endif
+
+	while (conn->send_head) {
+		struct send_item * item = conn->send_head;
+		int count, more;
+		ssize_t sent;
+
+		if (conn->dead) {
+			conn_send_done(conn, item);
+			continue;
+		}
+		if (!budget) {
+			status = IMG_XFER_AGAIN;
+			break;
+		}
+
+		count = conn_tx_gather(conn, iov, &more);
+		if (count < 0) {
+			ERROR_INFO();
+			perror("Unable to stage an image payload");
+			conn_kill(loop, conn);
+			continue;
+		}
+
+		/* Only the zerocopy payload of the head is left */
+		if (!count) {
+			status = sendImageSome(conn->fd, &conn->tx_xfer, &conn->zc);
+			budget = 0;
+			if (status == IMG_XFER_AGAIN) {
+				break;
+			}
+			if (status == IMG_XFER_ERROR) {
+				conn_kill(loop, conn);
+			} else {
+				conn_send_done(conn, item);
+			}
+			continue;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		sent = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			status = IMG_XFER_AGAIN;
+			break;
+		}
+		if (sent < 0) {
+			conn_kill(loop, conn);
+			continue;
+		}
+		budget -= (size_t)sent < budget ? (size_t)sent : budget;
+		conn_tx_advance(conn, sent);
+	}
+
+	if (!conn->dead) {
+		conn_reap_zerocopy(conn);
+	}
+	conn_update_events(loop, conn, status == IMG_XFER_AGAIN);
+	conn_maybe_close(loop, conn);
+}
+
+/* Queue a response of the event loop itself to the client of <conn> */
+void conn_reply(struct event_loop * loop, struct connection * conn,
+		const struct response * resp)
+{
+	struct send_item * item = (struct send_item *)malloc(sizeof(struct send_item));
+
+	if (!item) {
+		ERROR_INFO();
+		perror("Unable to allocate a response");
+		conn_kill(loop, conn);
+		return;
+	}
+
+	item->resp = *resp;
+	item->img = NULL;
+	item->compressed = NULL;
+	conn->inflight++;
+
+	send_queue_append(conn, item);
+	conn_flush(loop, conn);
+}
+
+/* Registered payloads are received by the event loop, a piece at a
+ * time as they arrive. Once one is complete it gets its ID and is
+ * acked right away, before any later request of the same client is
+ * looked at. The layout conversion and the deduplication are left to
+ * a worker: the operations on the image that arrive meanwhile wait in
+ * its mailbox until it has been published. */
+void finish_registration(struct event_loop * loop, struct connection * conn,
+			 struct image * new_img)
+{
+	struct request_meta * req = &conn->rx_req;
+	uint64_t img_id = registry_reserve();
+	struct md5digest digest;
+	struct response resp;
+
+	/* The pixels have been hashed as they arrived, for the
+	 * deduplication and for the first cache lookup on the image */
+	if (result_cache) {
+		digest = md5_final(&conn->rx_md5);
+	}
+
+	resp.req_id = req->request.req_id;
+	resp.img_id = img_id;
+	resp.ack = RESP_COMPLETED;
+
+	if (img_id == REGISTRY_FULL) {
+		ERROR_INFO();
+		fprintf(stderr, "Image registry full.\n");
+		releaseImage(new_img);
+		resp.ack = RESP_REJECTED;
+	} else {
+		struct request_meta job = *req;
+
+		registry_stage(img_id, new_img, result_cache ? &digest : NULL);
+
+		job.request.img_id = img_id;
+		job.conn = NULL;
+		job.reply = NULL;
+		job.cost_ns = estimate_cost(&job, registry_pixels(img_id));
+		if (add_to_queue(job, loop->the_queue)) {
+			/* No room in the queue: nothing can be waiting
+			 * for the image yet, publish it here */
+			registry_publish_staged(img_id);
+		}
+	}
+
+	conn_reply(loop, conn, &resp);
+
+	tsc_gettime(&req->completion_timestamp);
+
+	trace_request(loop->thread_id, loop->the_queue, req, img_id);
+	stats_record(loop->thread_id, req);
+	sample_queue_status(loop->the_queue);
+}
+
+/* Requests that <conn> may have pending: -C, or under FAIR an equal
+ * share of the queue with the other clients that have requests
+ * pending, keeping one share free for a client that has none yet, so
+ * that it does not find the queue full of someone else's requests */
+size_t conn_share(const struct event_loop * loop, const struct connection * conn)
+{
+	size_t others = loop->backlogged - (conn->pending > 0);
+	size_t share;
+
+	if (client_queue || loop->the_queue->policy != QUEUE_FAIR) {
+		return client_queue ? client_queue : loop->the_queue->max_size;
+	}
+	share = loop->the_queue->max_size / (others + 2);
+	return share ? share : 1;
+}
+
+/* Act on the request just received on <conn>: start receiving the
+ * payload of a registration, or hand the operation to the workers. */
+void handle_request(struct event_loop * loop, struct connection * conn)
+{
+	struct request_meta * req = &conn->rx_req;
+	struct response resp;
+	int res = 0;
+
+	histo_record(&thread_stats[loop->thread_id].queue_len,
+		     __atomic_load_n(&loop->the_queue->queued, __ATOMIC_RELAXED));
+
+	/* Answered by the event loop, which knows what is pending */
+	if (req->request.img_op == IMG_CANCEL) {
+		resp.req_id = req->request.req_id;
+		resp.img_id = 0;
+		resp.ack = conn_cancel(conn, req->request.img_id) ? RESP_REJECTED : RESP_COMPLETED;
+		conn_reply(loop, conn, &resp);
+		return;
+	}
+
+	/* The payload of a registration is not known yet: it is always
+	 * taken, and accounted for once received */
+	if (req->request.img_op == IMG_REGISTER) {
+		tsc_gettime(&req->start_timestamp);
+		recvImageBegin(&conn->rx_xfer);
+		md5_init(&conn->rx_md5);
+		conn->rx_image = 1;
+		return;
+	}
+
+	/* Reject malformed pipelines and regions, and unknown images
+	 * right away, not to have a worker fail on them later */
+	if (req->request.img_op == IMG_PIPELINE) {
+		enum img_filter filters[IMG_PIPELINE_MAX];
+		res = !pipeline_to_filters(&req->request, filters);
+	}
+	if (req->request.img_op == IMG_RETRIEVE_REGION) {
+		res = !req->region.scale || req->region.scale > IMG_REGION_SCALE_MAX;
+	}
+	if (!res && !registry_known(req->request.img_id)) {
+		res = 1;
+	}
+
+	/* Nor more of them than the share of the client */
+	if (!res && conn->pending >= conn_share(loop, conn)) {
+		admission_reject_share(&admission);
+		res = 1;
+	}
+
+	/* Unless expected to be too late, for the SLO or the client */
+	if (!res) {
+		req->cost_ns = estimate_cost(req, registry_pixels(req->request.img_id));
+		res = admission_admit(&admission, req->cost_ns, req->deadline_ns ?
+				      req->deadline_ns - timespec_to_ns(&req->receipt_timestamp) : 0);
+	}
+
+	if (!res) {
+		req->conn = conn;
+		req->reply = (struct send_item *)malloc(sizeof(struct send_item));
+		if (req->reply) {
+			conn_pend(loop, conn, req->reply, req->request.req_id);
+		}
+		res = !req->reply || add_to_queue(*req, loop->the_queue);
+		if (res) {
+			if (req->reply) {
+				conn_unpend(loop, conn, req->reply);
+			}
+			free(req->reply);
+			admission_reject_full(&admission);
+		} else {
+			conn->inflight++;
+		}
+	}
+
+	/* The queue is full, the client has its share of it, the request
+	 * is malformed or it would miss the SLO if the return value is 1 */
+	if (res) {
+		resp.req_id = req->request.req_id;
+		resp.img_id = 0;
+		resp.ack = RESP_REJECTED;
+		conn_reply(loop, conn, &resp);
+
+		trace_reject(loop->thread_id, loop->the_queue, req);
+	}
+}
+
+/* Parse the requests in the receive buffer of <conn>, plain or within
+ * frames, along with the start of the payloads that follow them */
+void conn_parse(struct event_loop * loop, struct connection * conn)
+{
+	size_t pos = 0;
+
+	while (conn->rx_open && !conn->dead) {
+		size_t avail = conn->rx_len - pos, len;
+		uint32_t timeout_us;
+
+		if (conn->rx_image) {
+			enum img_xfer_status status;
+			void * buf;
+
+			if (!avail) {
+				break;
+			}
+			len = recvImageTarget(&conn->rx_xfer, &buf);
+			len = len < avail ? len : avail;
+			memcpy(buf, conn->rx_buf + pos, len);
+			pos += len;
+
+			status = recvImageAdvance(&conn->rx_xfer, len,
+						  result_cache ? md5_consume : NULL, &conn->rx_md5);
+			if (status == IMG_XFER_ERROR) {
+				conn_kill(loop, conn);
+			} else if (status == IMG_XFER_DONE) {
+				conn->rx_image = 0;
+				finish_registration(loop, conn, conn->rx_xfer.img);
+			}
+			continue;
+		}
+
+		if (!conn->rx_frame_left) {
+			struct frame_header hdr;
+			int first = !conn->rx_started;
+			int frame, valid, version;
+
+			if (avail < sizeof(hdr)) {
+				break;
+			}
+			memcpy(&hdr, conn->rx_buf + pos, sizeof(hdr));
+			conn->rx_started = 1;
+
+			/* The packed encoding can only be asked for by the
+			 * first frame, and then is all there is */
+			frame = le32toh(hdr.magic) == REQ_FRAME_MAGIC;
+			version = le16toh(hdr.version) & ~REQ_FRAME_FLAGS;
+			if (frame && first) {
+				conn->packed = version == REQ_FRAME_VERSION_PACKED;
+				conn->compressed = !!(le16toh(hdr.version) & REQ_FRAME_COMPRESSED);
+				conn->deadlines = !!(le16toh(hdr.version) & REQ_FRAME_DEADLINE);
+			}
+			valid = conn->packed ? frame && version == REQ_FRAME_VERSION_PACKED
+				: !frame || version == REQ_FRAME_VERSION;
+			if (!valid || (frame && le16toh(hdr.count) > REQ_FRAME_MAX)) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid request frame.\n");
+				conn_kill(loop, conn);
+				break;
+			}
+			if (frame) {
+				conn->rx_frame_left = le16toh(hdr.count);
+				pos += sizeof(hdr);
+				continue;
+			}
+		}
+
+		if (conn->packed) {
+			struct request_v2 v2;
+
+			if (avail < sizeof(v2)) {
+				break;
+			}
+			memcpy(&v2, conn->rx_buf + pos, sizeof(v2));
+			request_from_v2(&conn->rx_req.request, &v2);
+			len = sizeof(v2);
+		} else {
+			if (avail < sizeof(struct request)) {
+				break;
+			}
+			memcpy(&conn->rx_req.request, conn->rx_buf + pos, sizeof(struct request));
+			len = sizeof(struct request);
+		}
+
+		/* So does its deadline, and then the rectangle of a region:
+		 * all are taken at once */
+		timeout_us = 0;
+		if (conn->deadlines) {
+			if (avail < len + sizeof(timeout_us)) {
+				break;
+			}
+			memcpy(&timeout_us, conn->rx_buf + pos + len, sizeof(timeout_us));
+			timeout_us = le32toh(timeout_us);
+			len += sizeof(timeout_us);
+		}
+		if (conn->rx_req.request.img_op == IMG_RETRIEVE_REGION) {
+			struct img_region * region = &conn->rx_req.region;
+
+			if (avail < len + sizeof(*region)) {
+				break;
+			}
+			memcpy(region, conn->rx_buf + pos + len, sizeof(*region));
+			region->x = le32toh(region->x);
+			region->y = le32toh(region->y);
+			region->width = le32toh(region->width);
+			region->height = le32toh(region->height);
+			len += sizeof(*region);
+		}
+		pos += len;
+		if (conn->rx_frame_left) {
+			conn->rx_frame_left--;
+		}
+
+		tsc_gettime(&conn->rx_req.receipt_timestamp);
+		conn->rx_req.deadline_ns = timeout_us ? timespec_to_ns(&conn->rx_req.receipt_timestamp) +
+			(nstime_t)timeout_us * 1000 : 0;
+		handle_request(loop, conn);
+	}
+
+	/* Keep the partial request, if any, at the front */
+	if (conn->dead) {
+		conn->rx_len = 0;
+	} else {
+		memmove(conn->rx_buf, conn->rx_buf + pos, conn->rx_len - pos);
+		conn->rx_len -= pos;
+	}
+}
+
+/* Receive what is available on <conn>: requests, and the payloads of
+ * the registrations. */
+void conn_receive(struct event_loop * loop, struct connection * conn)
+{
+	size_t n;
+
+	for (n = 0; n < CONN_RX_BUDGET && conn->rx_open; ++n) {
+		ssize_t cur;
+
+		if (conn->rx_image) {
+			enum img_xfer_status status =
+				recvImageSome(conn->fd, &conn->rx_xfer,
+					      result_cache ? md5_consume : NULL, &conn->rx_md5);
+			if (status == IMG_XFER_AGAIN) {
+				return;
+			}
+			if (status == IMG_XFER_ERROR) {
+				conn_kill(loop, conn);
+				break;
+			}
+			conn->rx_image = 0;
+			finish_registration(loop, conn, conn->rx_xfer.img);
+			continue;
+		}
+
+		/* As much as there is room for: requests may arrive
+		 * many at a time, or split across segments */
+		cur = recv(conn->fd, conn->rx_buf + conn->rx_len,
+			   CONN_RX_BUF - conn->rx_len, MSG_DONTWAIT);
+		if (cur < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cur < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (cur < 0) {
+			conn_kill(loop, conn);
+			break;
+		}
+		if (cur == 0) {
+			/* The client is done: send the responses still
+			 * owed before closing the connection */
+			conn->rx_open = 0;
+			conn_update_events(loop, conn, conn->send_head != NULL);
+			break;
+		}
+
+		conn->rx_len += cur;
+		conn_parse(loop, conn);
+	}
+
+	conn_maybe_close(loop, conn);
+}
+
+#ifdef HAVE_URING
+/* io_uring engine: submit the receive of more requests, or of the
+ * rest of the payload of a registration straight into the pixels of
+ * the new image */
+void uring_arm_recv(struct event_loop * loop, struct connection * conn)
+{
+	struct io_uring_sqe * sqe;
+	void * buf;
+	size_t len;
+
+	if (!conn->rx_open || conn->dead || conn->rx_armed) {
+		return;
+	}
+
+	if (conn->rx_image) {
+		len = recvImageTarget(&conn->rx_xfer, &buf);
+	} else {
+		buf = conn->rx_buf + conn->rx_len;
+		len = CONN_RX_BUF - conn->rx_len;
+	}
+
+	sqe = uring_get_sqe(loop->ring, (uintptr_t)conn | URING_OP_RECV);
+	if (!sqe) {
+		ERROR_INFO();
+		perror("Unable to submit a receive");
+		conn_kill(loop, conn);
+		return;
+	}
+	uring_prep_recv(sqe, conn->fd, buf, len, 0);
+	conn->rx_armed = 1;
+	conn->ops++;
+}
+
+/* io_uring engine: <res> bytes arrived on <conn>, or the receive
+ * failed */
+void uring_recv_done(struct event_loop * loop, struct connection * conn, int res)
+{
+	conn->rx_armed = 0;
+	conn->ops--;
+
+	if (conn->dead || res == -EAGAIN || res == -EINTR) {
+		/* Nothing new */
+	} else if (res < 0) {
+		conn_kill(loop, conn);
+	} else if (res == 0) {
+		/* The client is done: the responses still owed are sent
+		 * before closing the connection */
+		conn->rx_open = 0;
+	} else if (conn->rx_image) {
+		enum img_xfer_status status =
+			recvImageAdvance(&conn->rx_xfer, res,
+					 result_cache ? md5_consume : NULL, &conn->rx_md5);
+		if (status == IMG_XFER_ERROR) {
+			conn_kill(loop, conn);
+		} else if (status == IMG_XFER_DONE) {
+			conn->rx_image = 0;
+			finish_registration(loop, conn, conn->rx_xfer.img);
+		}
+	} else {
+		conn->rx_len += res;
+		conn_parse(loop, conn);
+	}
+
+	uring_arm_recv(loop, conn);
+	conn_maybe_close(loop, conn);
+}
+#endif
+
+/* Start serving the client connected to <fd> */
+void conn_open(struct event_loop * loop, int fd)
+{
+	struct connection * conn;
+	int optval;
+
+	conn = (struct connection *)calloc(1, sizeof(struct connection));
+	if (!conn) {
+		ERROR_INFO();
+		perror("Unable to allocate a connection");
+		close(fd);
+		return;
+	}
+
+	/* Responses are small and latency-bound: do not let Nagle hold
+	 * them back */
+	optval = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&optval, sizeof(optval));
+
+	/* Raising it above net.core.busy_read takes CAP_NET_ADMIN */
+	if (busy_poll_us &&
+	    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us))) {
+		perror("WARNING: busy polling not allowed");
+		busy_poll_us = 0;
+	}
+
+	if (zerocopy_enabled) {
+		conn->zerocopy = !enableZeroCopy(fd);
+		if (!conn->zerocopy) {
+			perror("WARNING: zerocopy sends not supported");
+			zerocopy_enabled = 0;
+		}
+	}
+
+	conn->fd = fd;
+	conn->rx_open = 1;
+	conn->events = EPOLLIN;
+
+	if (!LOOP_URING(loop)) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			ERROR_INFO();
+			perror("Unable to add a connection to the event loop");
+			free(conn);
+			close(fd);
+			return;
+		}
+	}
+
+	conn->next = loop->conns;
+	if (loop->conns) {
+		loop->conns->prev = conn;
+	}
+	loop->conns = conn;
+
+	sync_printf("INFO: Client connected.\n");
+
+#ifdef HAVE_URING
+	if (LOOP_URING(loop)) {
+		uring_arm_recv(loop, conn);
+	}
+#endif
+}
+
+/* Accept all the pending connections on the listening socket */
+void accept_clients(struct event_loop * loop)
+{
+	for (;;) {
+		int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ERROR_INFO();
+				perror("Unable to accept connections");
+			}
+			return;
+		}
+		conn_open(loop, fd);
+	}
+}
+
+/* Flush the connections that the workers have put on the ready list */
+void flush_ready(struct event_loop * loop)
+{
+	struct connection * conn, * next;
+
+	conn = __atomic_exchange_n(&ready_list, NULL, __ATOMIC_ACQUIRE);
+
+	for (; conn; conn = next) {
+		struct send_item * item, * newest;
 
-			if (!worker_stacks[i] || !worker_params[i]) {
-				ERROR_INFO();
-				perror("Unable to allocate memory for thread.");
-				return EXIT_FAILURE;
-			}
+		/* Read before the responses are taken: from then on, a
+		 * worker may put the connection back on the ready list */
+		next = conn->ready_next;
 
-			worker_params[i]->conn_socket = common_params->conn_socket;
-			worker_params[i]->the_queue = common_params->the_queue;
-			worker_params[i]->worker_done = 0;
-			worker_params[i]->worker_id = i;
+		/* Append all the responses pushed so far, oldest first. The
+		 * release orders the read of ready_next before the worker
+		 * that finds the list empty, and so writes it again. */
+		newest = __atomic_exchange_n(&conn->completions, NULL, __ATOMIC_ACQ_REL);
+		for (item = NULL; newest; ) {
+			struct send_item * older = newest->next;
+
+			newest->next = item;
+			item = newest;
+			newest = older;
+		}
+		for (; item; item = newest) {
+			newest = item->next;
+			conn_unpend(loop, conn, item);
+			send_queue_append(conn, item);
 		}
 
-		/* All the allocations and initialization seem okay,
-		 * let's start the threads */
-		for (i = 0; i < worker_count; ++i) {
-			worker_ids[i] = clone(worker_main, worker_stacks[i] + STACK_SIZE,
-					      CLONE_THREAD | CLONE_VM | CLONE_SIGHAND |
-					      CLONE_FS | CLONE_FILES | CLONE_SYSVSEM,
-					      worker_params[i]);
+		conn_flush(loop, conn);
+	}
+}
 
-			if (worker_ids[i] < 0) {
-				ERROR_INFO();
-				perror("Unable to start thread.");
-				return EXIT_FAILURE;
-			} else {
-				sync_printf("INFO: Worker thread %ld (TID = %d) started!\n",
-				       i, worker_ids[i]);
-			}
-		}
+/* Release <conn>, whose responses have all been sent or dropped */
+void conn_free(struct event_loop * loop, struct connection * conn)
+{
+	struct send_item * item, * next;
+
+	for (item = conn->zc_head; item; item = next) {
+		next = item->next;
+		send_item_free(item);
+	}
+	for (item = conn->send_head; item; item = next) {
+		next = item->next;
+		send_item_free(item);
+	}
+	for (item = conn->completions; item; item = next) {
+		next = item->next;
+		send_item_free(item);
+	}
+	if (conn->tx_image) {
+		endImageXfer(&conn->tx_xfer);
+	}
+	if (conn->rx_image) {
+		endImageXfer(&conn->rx_xfer);
 	}
 
-	else if (cmd == WORKERS_STOP) {
-		size_t i;
+	shutdown(conn->fd, SHUT_RDWR);
+	close(conn->fd);
+	free(conn);
 
-		/* Command to stop the threads issues without a start
-		 * command? */
-		if (!worker_stacks || !worker_params || !worker_ids) {
-			return EXIT_FAILURE;
+	sync_printf("INFO: Client disconnected.\n");
+	dump_admission_stats(loop->the_queue);
+	if (result_cache) {
+		dump_cache_stats(result_cache);
+	}
+	dump_memory_stats();
+}
+
+/* The tags of the events of everything but the connections */
+static int listen_tag, signal_tag, ready_tag;
+
+/* Handle the events of the sockets with epoll until the server gets
+ * SIGINT or SIGTERM */
+void run_epoll(struct event_loop * loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct connection * conn;
+	int done = 0;
+
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = &listen_tag;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &events[0]);
+	events[0].data.ptr = &signal_tag;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->signal_fd, &events[0]);
+	events[0].data.ptr = &ready_tag;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ready_fd, &events[0]);
+
+	while (!done) {
+		int i, count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+
+		if (count < 0 && errno != EINTR) {
+			ERROR_INFO();
+			perror("Unable to wait for events");
+			break;
 		}
 
-		/* First, assert all the termination flags */
-		for (i = 0; i < worker_count; ++i) {
-			if (worker_ids[i] < 0) {
+		for (i = 0; i < count; ++i) {
+			uint32_t ev = events[i].events;
+			void * tag = events[i].data.ptr;
+
+			if (tag == &listen_tag) {
+				accept_clients(loop);
+				continue;
+			}
+			if (tag == &signal_tag) {
+				done = 1;
 				continue;
 			}
+			if (tag == &ready_tag) {
+				uint64_t count;
 
-			/* Request thread termination */
-			worker_params[i]->worker_done = 1;
-		}
+				if (read(ready_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+					ERROR_INFO();
+					perror("Unable to read the ready list notifications");
+				}
+				flush_ready(loop);
+				continue;
+			}
 
-		/* Next, unblock threads and wait for completion */
-		for (i = 0; i < worker_count; ++i) {
-			if (worker_ids[i] < 0) {
+			conn = (struct connection *)tag;
+			if (conn->closing || conn->dead) {
 				continue;
 			}
 
-			sem_post(queue_notify);
-			waitpid(-1, NULL, __WCLONE);
-			sync_printf("INFO: Worker thread exited.\n");
-		}
+			/* POLLERR also reports zerocopy completions */
+			if (ev & EPOLLERR) {
+				int err = 0;
+				socklen_t len = sizeof(err);
 
-		/* Finally, do a round of deallocations */
-		for (i = 0; i < worker_count; ++i) {
-			free(worker_stacks[i]);
-			free(worker_params[i]);
+				conn_reap_zerocopy(conn);
+				getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err) {
+					conn_kill(loop, conn);
+				}
+			}
+			if (ev & EPOLLHUP) {
+				conn_kill(loop, conn);
+			}
+			if ((ev & EPOLLIN) && conn->rx_open) {
+				conn_receive(loop, conn);
+			}
+			if (ev & EPOLLOUT || conn->dead) {
+				conn_flush(loop, conn);
+			}
 		}
 
-		free(worker_stacks);
-		worker_stacks = NULL;
+		/* Nothing refers to these anymore */
+		while (loop->closed) {
+			conn = loop->closed;
+			loop->closed = conn->next;
+			conn_free(loop, conn);
+		}
+	}
+}
 
-		free(worker_params);
-		worker_params = NULL;
+#ifdef HAVE_URING
+/* io_uring engine: submit the next accept on the listening socket */
+void uring_arm_accept(struct event_loop * loop)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(loop->ring, (uintptr_t)&listen_tag);
 
-		free(worker_ids);
-		worker_ids = NULL;
+	if (!sqe) {
+		ERROR_INFO();
+		perror("Unable to submit an accept");
+		return;
 	}
+	uring_prep_accept(sqe, loop->listen_fd, 0);
+}
 
-	else {
+/* io_uring engine: submit a read of <fd>, tagged with <tag> */
+void uring_arm_read(struct event_loop * loop, int * tag, int fd, void * buf, size_t len)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(loop->ring, (uintptr_t)tag);
+
+	if (!sqe) {
 		ERROR_INFO();
-		perror("Invalid thread control command.");
-		return EXIT_FAILURE;
+		perror("Unable to submit a read");
+		return;
 	}
-
-	return EXIT_SUCCESS;
+	uring_prep_read(sqe, fd, buf, len);
 }
 
-/* Main function to handle connection with the client. This function
- * takes in input conn_socket and returns only when the connection
- * with the client is interrupted. */
-void handle_connection(int conn_socket, struct connection_params conn_params)
+/* io_uring engine: submit all the operations queued since the last
+ * call with a single system call, wait for and handle a round of
+ * completions. Returns 1 once the server got SIGINT or SIGTERM, and
+ * -1 on errors. */
+int uring_round(struct event_loop * loop)
 {
-	struct request_meta * req;
-	struct queue * the_queue;
-	size_t in_bytes;
+	struct io_uring_cqe * cqe;
+	struct connection * conn;
+	int done = 0;
 
-	/* The connection with the client is alive here. Let's start
-	 * the worker thread. */
-	struct worker_params common_worker_params;
-	int res;
+	if (uring_submit_and_wait(loop->ring, 1) < 0) {
+		ERROR_INFO();
+		perror("Unable to wait for completions");
+		return -1;
+	}
 
-	/* Now handle queue allocation and initialization */
-	the_queue = (struct queue *)malloc(sizeof(struct queue));
-	queue_init(the_queue, conn_params.queue_size, conn_params.queue_policy);
+	while ((cqe = uring_peek_cqe(loop->ring))) {
+		uint64_t data = cqe->user_data;
+		void * tag = (void *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+		int res = cqe->res;
 
-	common_worker_params.conn_socket = conn_socket;
-	common_worker_params.the_queue = the_queue;
-	res = control_workers(WORKERS_START, conn_params.workers, &common_worker_params);
+		uring_cqe_seen(loop->ring);
 
-	/* Do not continue if there has been a problem while starting
-	 * the workers. */
-	if (res != EXIT_SUCCESS) {
-		free(the_queue);
+		if (tag == &listen_tag) {
+			if (res >= 0 && loop->stopping) {
+				close(res);
+			} else if (res >= 0) {
+				conn_open(loop, res);
+			} else if (res != -EAGAIN && res != -EINTR) {
+				ERROR_INFO();
+				errno = -res;
+				perror("Unable to accept connections");
+			}
+			if (!loop->stopping) {
+				uring_arm_accept(loop);
+			}
+		} else if (tag == &signal_tag) {
+			done = 1;
+		} else if (tag == &ready_tag) {
+			flush_ready(loop);
+			if (!loop->stopping) {
+				uring_arm_read(loop, &ready_tag, ready_fd,
+					       &loop->ready_count, sizeof(loop->ready_count));
+			}
+		} else if ((data & URING_OP_MASK) == URING_OP_RECV) {
+			uring_recv_done(loop, (struct connection *)tag, res);
+		} else {
+			uring_send_done(loop, (struct connection *)tag, res);
+		}
+	}
 
-		/* Stop any worker that was successfully started */
-		control_workers(WORKERS_STOP, conn_params.workers, NULL);
-		return;
+	/* Nothing refers to these anymore, the kernel included */
+	while (loop->closed) {
+		conn = loop->closed;
+		loop->closed = conn->next;
+		conn_free(loop, conn);
 	}
 
-	/* We are ready to proceed with the rest of the request
-	 * handling logic. */
-    req = (struct request_meta *)malloc(sizeof(struct request_meta));
+	return done;
+}
 
-    do {
-        in_bytes = recv(conn_socket, &req->request, sizeof(struct request), 0);
-        clock_gettime(CLOCK_MONOTONIC, &req->receipt_timestamp);
+/* Handle the events of the sockets with io_uring until the server
+ * gets SIGINT or SIGTERM. The descriptors are switched to blocking
+ * mode: io_uring waits for them to be ready by itself, but completes
+ * at once with -EAGAIN on nonblocking ones. */
+void run_uring(struct event_loop * loop)
+{
+	int fds[3] = { loop->listen_fd, loop->signal_fd, ready_fd };
+	size_t i;
 
-		/* Don't just return if in_bytes is 0 or -1. Instead
-		 * skip the response and break out of the loop in an
-		 * orderly fashion so that we can de-allocate the req
-		 * and resp varaibles, and shutdown the socket. */
-		if (in_bytes > 0) {
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) & ~O_NONBLOCK);
+	}
 
-			/* Handle image registration right away! */
-			if(req->request.img_op == IMG_REGISTER) {
-				clock_gettime(CLOCK_MONOTONIC, &req->start_timestamp);
+	uring_arm_accept(loop);
+	uring_arm_read(loop, &signal_tag, loop->signal_fd,
+		       &loop->siginfo, sizeof(loop->siginfo));
+	uring_arm_read(loop, &ready_tag, ready_fd,
+		       &loop->ready_count, sizeof(loop->ready_count));
 
-				register_new_image(conn_socket, &req->request);
+	while (!uring_round(loop)) {
+		continue;
+	}
+}
+#endif
 
-				clock_gettime(CLOCK_MONOTONIC, &req->completion_timestamp);
+/* Serve all the clients that connect to <listen_fd> until the server
+ * gets SIGINT or SIGTERM. The requests and payloads are received a
+ * piece at a time as they arrive, and the responses are sent from
+ * per-connection queues. */
+void serve_clients(int listen_fd, int signal_fd, struct queue * the_queue,
+		   struct connection_params conn_params)
+{
+	struct connection * conn, * next;
+	struct event_loop loop;
+#ifdef HAVE_URING
+	struct uring ring;
+#endif
 
-				sync_printf("T%ld R%ld:%lf,%s,%d,%ld,%ld,%lf,%lf,%lf\n",
-				       conn_params.workers, req->request.req_id,
-				       TSPEC_TO_DOUBLE(req->request.req_timestamp),
-				       OPCODE_TO_STRING(req->request.img_op),
-				       req->request.overwrite, req->request.img_id,
-				       image_counter - 1,
-				       TSPEC_TO_DOUBLE(req->receipt_timestamp),
-				       TSPEC_TO_DOUBLE(req->start_timestamp),
-				       TSPEC_TO_DOUBLE(req->completion_timestamp));
+	memset(&loop, 0, sizeof(loop));
+	loop.listen_fd = listen_fd;
+	loop.signal_fd = signal_fd;
+	loop.epoll_fd = -1;
+	loop.the_queue = the_queue;
+	loop.thread_id = conn_params.max_workers;
 
-				dump_queue_status(the_queue);
-				continue;
+#ifdef HAVE_URING
+	if (uring_enabled) {
+		if (uring_init(&ring, URING_ENTRIES) < 0) {
+			perror("WARNING: io_uring not available, using epoll");
+		} else {
+			loop.ring = &ring;
+			if (zerocopy_enabled) {
+				printf("INFO: zerocopy sends are not used with io_uring\n");
+				zerocopy_enabled = 0;
 			}
+		}
+	}
+#else
+	if (uring_enabled) {
+		printf("WARNING: built without io_uring, using epoll\n");
+	}
+#endif
+
+	if (!LOOP_URING(&loop)) {
+		loop.epoll_fd = epoll_create1(0);
+		if (loop.epoll_fd < 0) {
+			ERROR_INFO();
+			perror("Unable to create the event loop");
+			return;
+		}
+	}
+
+	printf("INFO: Waiting for incoming connections...\n");
 
-			res = add_to_queue(*req, the_queue);
+#ifdef HAVE_URING
+	if (LOOP_URING(&loop)) {
+		run_uring(&loop);
+	} else
+#endif
+	{
+		run_epoll(&loop);
+	}
 
-			/* The queue is full if the return value is 1 */
-			if (res) {
-				struct response resp;
-				/* Now provide a response! */
-				resp.req_id = req->request.req_id;
-				resp.ack = RESP_REJECTED;
-				sem_wait(&conn_socket_mutex);
-				send(conn_socket, &resp, sizeof(struct response), 0);
-				sem_post(&conn_socket_mutex);
+	printf("INFO: Shutting down.\n");
 
-				sync_printf("X%ld:%lf,%lf,%lf\n", req->request.req_id,
-				       TSPEC_TO_DOUBLE(req->request.req_timestamp),
-				       TSPEC_TO_DOUBLE(req->request.req_length),
-				       TSPEC_TO_DOUBLE(req->receipt_timestamp)
-					);
+	/* Stop the workers before the connections their requests refer
+	 * to go away */
+	control_workers(WORKERS_STOP, conn_params.max_workers, NULL);
+	if (band_pool) {
+		control_helpers(WORKERS_STOP, conn_params.helpers);
+	}
 
-			}
+	/* The responses still on their way are dropped */
+	ready_list = NULL;
+
+	loop.stopping = 1;
+	for (conn = loop.conns; conn; conn = next) {
+		next = conn->next;
+		conn_kill(&loop, conn);
+		conn_maybe_close(&loop, conn);
+	}
+
+#ifdef HAVE_URING
+	/* Wait for the kernel to be done with the buffers of the
+	 * connections before they are freed */
+	if (LOOP_URING(&loop)) {
+		while (loop.conns && uring_round(&loop) >= 0) {
+			continue;
 		}
-	} while (in_bytes > 0);
-    free(req);
-	free(the_queue->requests);
-	free(the_queue);
-    shutdown(conn_socket, SHUT_RDWR);
-    close(conn_socket);
-    sync_printf("INFO: Client disconnected.\n");
+	}
+#endif
+
+	while (loop.closed) {
+		conn = loop.closed;
+		loop.closed = conn->next;
+		conn_free(&loop, conn);
+	}
+	while (loop.conns) {
+		conn = loop.conns;
+		loop.conns = conn->next;
+		conn_free(&loop, conn);
+	}
+
+#ifdef HAVE_URING
+	if (LOOP_URING(&loop)) {
+		uring_destroy(&ring);
+	}
+#endif
+	if (loop.epoll_fd >= 0) {
+		close(loop.epoll_fd);
+	}
 }
 
 
@@ -597,37 +4666,178 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
  * server. The server must accept in input a command line parameter
  * with the <port number> to bind the server to. */
 int main (int argc, char ** argv) {
-    int sockfd, retval, accepted, optval, opt;
+    int sockfd, retval, optval, opt, signal_fd, p;
     in_port_t socket_port;
-    struct sockaddr_in addr, client;
+    struct sockaddr_in addr;
     struct in_addr any_address;
-    socklen_t client_len;
+    struct worker_params common_worker_params;
+    struct queue * the_queue;
+    sigset_t sigs;
+    cpu_set_t cpus;
     struct connection_params conn_params;
+    const char * trace_path = NULL;
+    const char * spill_path = NULL;
+    const char * snapshot_path = NULL;
+    pthread_t spill_thread;
+    FILE * trace_file = stdout;
     conn_params.queue_size = 0;
     conn_params.queue_policy = QUEUE_FIFO;
     conn_params.workers = 1;
+    conn_params.max_workers = 0;
+    conn_params.helpers = 0;
+    conn_params.band_pixels = DEFAULT_BAND_PIXELS;
+    conn_params.cache_mb = DEFAULT_CACHE_MB;
+    conn_params.slo_ns = 0;
 
     /* Parse all the command line arguments */
-    while((opt = getopt(argc, argv, "q:w:p:")) != -1) {
+    while((opt = getopt(argc, argv, "q:C:w:W:f:t:K:NB:Y:p:j:b:zc:l:uS:AT:Q:P:L:M:F:ZR:I:")) != -1) {
         switch (opt) {
         case 'q':
             conn_params.queue_size = strtol(optarg, NULL, 10);
             printf("INFO: setting queue size = %ld\n", conn_params.queue_size);
             break;
+        case 'C':
+            client_queue = strtol(optarg, NULL, 10);
+            printf("INFO: setting client queue = %ld\n", client_queue);
+            break;
         case 'w':
             conn_params.workers = strtol(optarg, NULL, 10);
             printf("INFO: setting worker count = %ld\n", conn_params.workers);
             break;
+        case 'W':
+            conn_params.max_workers = strtol(optarg, NULL, 10);
+            printf("INFO: setting max worker count = %ld\n", conn_params.max_workers);
+            break;
+        case 'f':
+            fast_workers = strtol(optarg, NULL, 10);
+            printf("INFO: setting fast lane workers = %ld\n", fast_workers);
+            break;
+        case 't':
+            cheap_ns = (nstime_t)strtoul(optarg, NULL, 10) * 1000;
+            printf("INFO: fast lane for requests under %lu us\n", cheap_ns / 1000);
+            break;
+        case 'K':
+            stack_size = strtol(optarg, NULL, 10) * 1024;
+            if (stack_size < (size_t)PTHREAD_STACK_MIN) {
+                stack_size = PTHREAD_STACK_MIN;
+            }
+            stack_size = (stack_size + sysconf(_SC_PAGESIZE) - 1) &
+                ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+            printf("INFO: setting thread stack = %ld KB\n", stack_size / 1024);
+            break;
         case 'p':
-            if (!strcmp(optarg, "FIFO")) {
-                conn_params.queue_policy = QUEUE_FIFO;
-            } else {
+            for (p = 0; p < QUEUE_POLICIES; ++p) {
+                if (!strcmp(optarg, policies[p].name)) {
+                    conn_params.queue_policy = p;
+                    break;
+                }
+            }
+            if (p == QUEUE_POLICIES) {
                 ERROR_INFO();
                 fprintf(stderr, "Invalid queue policy.\n" USAGE_STRING, argv[0]);
                 return EXIT_FAILURE;
             }
             printf("INFO: setting queue policy = %s\n", optarg);
             break;
+        case 'j':
+            conn_params.helpers = strtol(optarg, NULL, 10);
+            printf("INFO: setting helper count = %ld\n", conn_params.helpers);
+            break;
+        case 'b':
+            conn_params.band_pixels = strtol(optarg, NULL, 10);
+            printf("INFO: setting band size = %ld pixels\n", conn_params.band_pixels);
+            break;
+        case 'z':
+            zerocopy_enabled = 1;
+            printf("INFO: enabling zerocopy image sends\n");
+            break;
+        case 'c':
+            conn_params.cache_mb = strtol(optarg, NULL, 10);
+            printf("INFO: setting result cache size = %ld MB\n", conn_params.cache_mb);
+            break;
+        case 'u':
+            uring_enabled = 1;
+            printf("INFO: using io_uring for the sockets\n");
+            break;
+        case 'T':
+            trace_path = optarg;
+            printf("INFO: writing the binary trace to %s\n", trace_path);
+            break;
+        case 'Q':
+            dump_period = strtol(optarg, NULL, 10);
+            if (!dump_period) {
+                dump_period = 1;
+            }
+            printf("INFO: printing the queue every %ld requests\n", dump_period);
+            break;
+        case 'P':
+            stats_period_ms = strtol(optarg, NULL, 10);
+            printf("INFO: printing the statistics every %ld ms\n", stats_period_ms);
+            break;
+        case 'L':
+            lazy_max = strtol(optarg, NULL, 10);
+            if (lazy_max > IMG_PIPELINE_MAX) {
+                lazy_max = IMG_PIPELINE_MAX;
+            }
+            printf("INFO: deferring up to %ld filters per image\n", lazy_max);
+            break;
+        case 'M':
+            memory_budget = (size_t)strtol(optarg, NULL, 10) << 20;
+            printf("INFO: setting memory budget = %ld MB\n", memory_budget >> 20);
+            break;
+        case 'F':
+            spill_path = optarg;
+            printf("INFO: spilling images to %s\n", spill_path);
+            break;
+        case 'Z':
+            compress_cold = 1;
+            printf("INFO: compressing the cold images\n");
+            break;
+        case 'R':
+            snapshot_path = optarg;
+            printf("INFO: keeping a snapshot of the images in %s\n", snapshot_path);
+            break;
+        case 'I':
+            snapshot_period_ms = strtol(optarg, NULL, 10);
+            if (!snapshot_period_ms) {
+                snapshot_period_ms = 1;
+            }
+            printf("INFO: taking a snapshot every %ld ms\n", snapshot_period_ms);
+            break;
+        case 'N':
+            numa_aware = 1;
+            printf("INFO: placing the workers and images on the NUMA nodes\n");
+            break;
+        case 'B':
+            spin_ns = (nstime_t)strtoul(optarg, NULL, 10) * 1000;
+            printf("INFO: idle workers spin for %lu us\n", spin_ns / 1000);
+            break;
+        case 'Y':
+            busy_poll_us = strtol(optarg, NULL, 10);
+            printf("INFO: busy polling the client sockets for %d us\n", busy_poll_us);
+            break;
+        case 'A':
+            pin_workers = 1;
+            printf("INFO: pinning the workers to CPUs\n");
+            break;
+        case 'S':
+            conn_params.slo_ns = strtod(optarg, NULL) * 1e6;
+            printf("INFO: setting SLO = %lf ms\n", conn_params.slo_ns / 1e6);
+            break;
+        case 'l':
+            if (!strcmp(optarg, "linear")) {
+                image_layout = IMG_LAYOUT_LINEAR;
+            } else if (!strcmp(optarg, "tiled")) {
+                image_layout = IMG_LAYOUT_TILED;
+            } else if (!strcmp(optarg, "planar")) {
+                image_layout = IMG_LAYOUT_PLANAR;
+            } else {
+                ERROR_INFO();
+                fprintf(stderr, "Invalid image layout.\n" USAGE_STRING, argv[0]);
+                return EXIT_FAILURE;
+            }
+            printf("INFO: using the %s image layout\n", optarg);
+            break;
         default: /* '?' */
             fprintf(stderr, USAGE_STRING, argv[0]);
         }
@@ -639,6 +4849,55 @@ int main (int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 
+    /* Without -W, the pool keeps its size */
+    if (conn_params.max_workers < conn_params.workers) {
+        conn_params.max_workers = conn_params.workers;
+    }
+
+    /* The other policies already let the cheap requests go first, and
+     * the pool never parks the fast lane but keeps a worker for the
+     * rest */
+    if (fast_workers && policies[conn_params.queue_policy].key) {
+        printf("INFO: the fast lane is only used under FIFO\n");
+        fast_workers = 0;
+    }
+    if (fast_workers >= conn_params.workers) {
+        ERROR_INFO();
+        fprintf(stderr, "The fast lane needs fewer workers than -w.\n" USAGE_STRING, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The workers take the nodes in turn, so that those of the pool
+     * that are active first are spread over all of them */
+    if (numa_aware) {
+        static int cpu_kernel_node[CPU_SETSIZE];
+        int kernel_nodes = 1;
+        size_t i;
+
+        worker_node = (size_t *)malloc(conn_params.max_workers * sizeof(size_t));
+        if (!worker_node || numatopo_discover(&numa_topo)) {
+            ERROR_INFO();
+            perror("Unable to find the NUMA nodes");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < conn_params.max_workers; ++i) {
+            worker_node[i] = i % numa_topo.nodes;
+        }
+        for (i = 0; i < numa_topo.nodes; ++i) {
+            printf("INFO: NUMA node %ld (%d for the kernel) with %d CPUs\n", i,
+                   numa_topo.kernel_node[i], CPU_COUNT(&numa_topo.node_cpus[i]));
+        }
+        for (i = 0; i < CPU_SETSIZE; ++i) {
+            int node = numa_topo.cpu_node[i];
+
+            cpu_kernel_node[i] = node < 0 ? -1 : numa_topo.kernel_node[node];
+            if (cpu_kernel_node[i] >= kernel_nodes) {
+                kernel_nodes = cpu_kernel_node[i] + 1;
+            }
+        }
+        setPoolNodes(cpu_kernel_node, CPU_SETSIZE, kernel_nodes);
+    }
+
     if (optind < argc) {
         socket_port = strtol(argv[optind], NULL, 10);
         printf("INFO: setting server port as: %d\n", socket_port);
@@ -648,8 +4907,17 @@ int main (int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 
-    /* Socket creation and binding */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    /* Timestamps come off the TSC from now on, if it can be trusted */
+    if (tsc_init()) {
+        printf("INFO: no invariant TSC, timestamps use clock_gettime()\n");
+    } else {
+        printf("INFO: timestamps use the TSC at %.3lf MHz\n", tsc_hz() / 1e6);
+    }
+    PRINT_BUILD_INFO();
+
+    /* Socket creation and binding. The event loop accepts all the
+     * pending connections at once, until it would block. */
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         ERROR_INFO();
         perror("Unable to create socket");
@@ -678,15 +4946,6 @@ int main (int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 
-    printf("INFO: Waiting for incoming connection...\n");
-    client_len = sizeof(struct sockaddr_in);
-    accepted = accept(sockfd, (struct sockaddr *)&client, &client_len);
-    if (accepted == -1) {
-        ERROR_INFO();
-        perror("Unable to accept connections");
-        return EXIT_FAILURE;
-    }
-
     /* Initialize semaphores */
     printf_mutex = (sem_t *)malloc(sizeof(sem_t));
     retval = sem_init(printf_mutex, 0, 1);
@@ -696,48 +4955,246 @@ int main (int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 
-    queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-    queue_notify = (sem_t *)malloc(sizeof(sem_t));
-    retval = sem_init(queue_mutex, 0, 1);
-    if (retval < 0) {
+    operation_mutex = malloc(sizeof(sem_t));
+    if (sem_init(operation_mutex, 0, 1) != 0) {
+        perror("Unable to initialize mutex for operation on image");
+        return EXIT_FAILURE;
+    }
+    if (conn_params.cache_mb) {
+        result_cache = (struct imgcache *)malloc(sizeof(struct imgcache));
+        if (!result_cache ||
+            imgcache_init(result_cache, conn_params.cache_mb * 1024 * 1024)) {
+            perror("WARNING: unable to allocate the result cache");
+            free(result_cache);
+            result_cache = NULL;
+        }
+    }
+
+    /* SIGINT and SIGTERM stop the event loop: block them before
+     * starting any thread, so that they are only ever delivered
+     * through signal_fd */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    /* A client that goes away must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd < 0 || ready_fd < 0) {
         ERROR_INFO();
-        perror("Unable to initialize queue mutex");
+        perror("Unable to create the event loop descriptors");
         return EXIT_FAILURE;
     }
-    retval = sem_init(queue_notify, 0, 0);
-    if (retval < 0) {
+
+    if (pin_workers && sched_getaffinity(0, sizeof(worker_cpus), &worker_cpus)) {
+        ERROR_INFO();
+        perror("WARNING: unable to get the CPUs to pin the workers to");
+        pin_workers = 0;
+    }
+
+    /* Now handle queue allocation and initialization. Every worker
+     * that may be active has its ring, and only the first ones of the
+     * pool are active. */
+    costmodel_init(&cost_model, cost_priors, sizeof(cost_priors) / sizeof(cost_priors[0]));
+    admission_init(&admission, conn_params.slo_ns, conn_params.workers);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) ||
+        workerpool_init(&worker_pool, conn_params.workers, conn_params.max_workers,
+                        CPU_COUNT(&cpus))) {
         ERROR_INFO();
-        perror("Unable to initialize queue notify");
+        perror("Unable to set up the worker pool");
         return EXIT_FAILURE;
     }
-	retval = sem_init(&conn_socket_mutex, 0, 1);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize connection socket mutex");
-		return EXIT_FAILURE;
-	}
-    operation_mutex = malloc(sizeof(sem_t));
-    if (sem_init(operation_mutex, 0, 1) != 0) {
-        perror("Unable to initialize mutex for operation on image");
+    the_queue = (struct queue *)aligned_alloc(RINGQ_CACHELINE, sizeof(struct queue));
+    if (!the_queue ||
+        queue_init(the_queue, conn_params.queue_size, conn_params.queue_policy,
+                   conn_params.max_workers)) {
+        ERROR_INFO();
+        perror("Unable to allocate the request queue");
         return EXIT_FAILURE;
     }
-    sem_init(&arr_mutex, 0, 1);
-    img_semaphores = NULL; 
-    /* Handle connection */
-    handle_connection(accepted, conn_params);
 
-	if (wait_op) {
-        for (size_t i = 0; i < image_counter; i++) {
-			if (wait_op[i].request_ids) {
-            	free(wait_op[i].request_ids);
-			}
+    /* The trace ring of the event loop comes after those of the workers */
+    if (trace_path) {
+        trace_file = fopen(trace_path, "wb");
+    }
+    if (!trace_file ||
+        trace_init(&tracer, conn_params.max_workers + 1, TRACE_RING_RECORDS, trace_file,
+                   trace_path != NULL, __opcode_strings,
+                   sizeof(__opcode_strings) / sizeof(__opcode_strings[0])) ||
+        trace_start(&tracer)) {
+        ERROR_INFO();
+        perror("Unable to set up the request trace");
+        return EXIT_FAILURE;
+    }
+
+    thread_stats_count = conn_params.max_workers + 1;
+    thread_stats = (struct thread_stats *)calloc(thread_stats_count,
+                                                 sizeof(struct thread_stats));
+    sem_init(&stats_stop, 0, 0);
+    if (!thread_stats ||
+        (stats_period_ms &&
+         pthread_create(&stats_thread, NULL, stats_main, the_queue))) {
+        ERROR_INFO();
+        perror("Unable to set up the statistics");
+        return EXIT_FAILURE;
+    }
+
+    /* The images of the snapshot are back before anything can look for
+     * them, and the snapshots go on from there */
+    sem_init(&spill_wake, 0, 0);
+    sem_init(&snapshot_stop, 0, 0);
+    if (snapshot_path) {
+        if (snap_open(&snapshot, snapshot_path) || snapshot_restore()) {
+            ERROR_INFO();
+            perror("Unable to read the snapshot");
+            return EXIT_FAILURE;
+        }
+        printf("INFO: restored %lu images from the snapshot\n", snapshot_restored);
+        snapshot_enabled = 1;
+    }
+
+    /* The spiller only ever runs operations on idle images, so it can
+     * start before the workers, and so can the snapshots */
+    if (memory_budget &&
+        (spill_init(&spill_store, spill_path) ||
+         pthread_create(&spill_thread, NULL, spill_main, the_queue))) {
+        ERROR_INFO();
+        perror("Unable to set up the spill store");
+        return EXIT_FAILURE;
+    }
+    if (snapshot_enabled &&
+        pthread_create(&snapshot_thread, NULL, snapshot_main, the_queue)) {
+        ERROR_INFO();
+        perror("Unable to start the snapshots");
+        return EXIT_FAILURE;
+    }
+
+    /* Start the helper threads first, so that the band pool is
+     * ready by the time the first request is processed. */
+    if (conn_params.helpers > 0) {
+        band_pool = (struct band_pool *)malloc(sizeof(struct band_pool));
+        retval = band_pool_init(band_pool, conn_params.helpers, conn_params.max_workers,
+                                conn_params.band_pixels);
+        if (retval == EXIT_SUCCESS) {
+            retval = control_helpers(WORKERS_START, conn_params.helpers);
+        }
+        if (retval != EXIT_SUCCESS) {
+            control_helpers(WORKERS_STOP, conn_params.helpers);
+            return EXIT_FAILURE;
         }
-        free(wait_op);
     }
 
-	free(queue_mutex);
-    free(queue_notify);
+    /* The workers are shared by all the clients */
+    common_worker_params.the_queue = the_queue;
+    retval = control_workers(WORKERS_START, conn_params.max_workers, &common_worker_params);
+    if (retval != EXIT_SUCCESS) {
+        /* Stop any worker that was successfully started */
+        control_workers(WORKERS_STOP, conn_params.max_workers, NULL);
+        return EXIT_FAILURE;
+    }
+
+    /* The active workers follow the load, under -W */
+    sem_init(&pool_stop, 0, 0);
+    if (conn_params.max_workers > conn_params.workers &&
+        pthread_create(&pool_thread, NULL, pool_main, the_queue)) {
+        ERROR_INFO();
+        perror("Unable to start the sizing of the worker pool");
+        return EXIT_FAILURE;
+    }
+
+    /* Handle the connections, until told to stop */
+    serve_clients(sockfd, signal_fd, the_queue, conn_params);
+
+    if (conn_params.max_workers > conn_params.workers) {
+        sem_post(&pool_stop);
+        pthread_join(pool_thread, NULL);
+        dump_pool_stats();
+    }
+    sem_destroy(&pool_stop);
+
+    /* The workers are gone: nothing can be spilled or faulted anymore,
+     * and the last snapshot has all the images as they are left */
+    if (memory_budget) {
+        __atomic_store_n(&spill_stop, 1, __ATOMIC_RELEASE);
+        sem_post(&spill_wake);
+        pthread_join(spill_thread, NULL);
+        dump_memory_stats();
+    }
+    if (snapshot_enabled) {
+        sem_post(&snapshot_stop);
+        pthread_join(snapshot_thread, NULL);
+        dump_snapshot_stats();
+    }
+    sem_destroy(&spill_wake);
+    sem_destroy(&snapshot_stop);
+
+    /* Nobody records anything anymore */
+    if (stats_period_ms) {
+        sem_post(&stats_stop);
+        pthread_join(stats_thread, NULL);
+    }
+    dump_latency_stats(the_queue);
+    free(thread_stats);
+    sem_destroy(&stats_stop);
+
+    trace_stop(&tracer);
+    trace_destroy(&tracer);
+    if (trace_path) {
+        fclose(trace_file);
+    }
+
+    if (!policies[conn_params.queue_policy].key) {
+        sync_printf("INFO: work steals=%lu wakeups=%lu spin_pops=%lu\n",
+                    __atomic_load_n(&the_queue->work.steals, __ATOMIC_RELAXED),
+                    __atomic_load_n(&the_queue->work.wakeups, __ATOMIC_RELAXED),
+                    __atomic_load_n(&the_queue->work.spin_pops, __ATOMIC_RELAXED));
+    } else if (spin_ns) {
+        sync_printf("INFO: spin_pops=%lu\n",
+                    __atomic_load_n(&the_queue->spin_pops, __ATOMIC_RELAXED));
+    }
+    sync_printf("INFO: operations on the worker that ran the previous one "
+                "on the image=%lu of %lu\n", the_queue->affine_runs, the_queue->runs);
+    if (fast_workers) {
+        sync_printf("INFO: operations on the fast lane=%lu of %lu\n",
+                    the_queue->fast_runs, the_queue->runs);
+    }
+    if (lazy_max) {
+        sync_printf("INFO: lazy deferred=%lu collapsed=%lu materialized=%lu\n",
+                    lazy_stats.deferred, lazy_stats.collapsed, lazy_stats.materialized);
+    }
+    if (wire_stats.payloads) {
+        sync_printf("INFO: compressed payloads=%lu bytes=%lu of %lu (%.1lf%%)\n",
+                    wire_stats.payloads, wire_stats.bytes, wire_stats.raw_bytes,
+                    100.0 * wire_stats.bytes / wire_stats.raw_bytes);
+    }
+
+    queue_destroy(the_queue);
+    free(the_queue);
+    workerpool_destroy(&worker_pool);
+    free(worker_node);
+
+	for (size_t i = 0; i < mailbox_count; i++) {
+		free(mailboxes[i].reqs);
+	}
+	free(mailboxes);
+	if (result_cache) {
+		imgcache_destroy(result_cache);
+		free(result_cache);
+	}
+	registry_destroy();
+	if (memory_budget) {
+		spill_destroy(&spill_store);
+	}
+	if (snapshot_enabled) {
+		snap_close(&snapshot);
+	}
+
     free(printf_mutex);
 	free(operation_mutex);
+    close(ready_fd);
+    close(signal_fd);
     close(sockfd);
 }
\ No newline at end of file
@@ -0,0 +1,257 @@
+/*******************************************************************************
+* Snapshot File of the Image Registry (implementation)
+*
+* Description:
+*     A file of records of images that the server can start again from,
+*     see snapshot.h.
+*
+* Notes:
+*     The file starts with SNAP_ALIGN bytes of header, with its magic
+*     and version, and the records follow one after the other, each at
+*     a multiple of SNAP_ALIGN. The gap between the pixels of a record
+*     and the next one is never written, and reads back as zeros.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+#define SNAP_MAGIC "IMGSNAP"
+#define SNAP_VERSION 1
+#define SNAP_RECORD_MAGIC "SREC"
+
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size; /* sizeof(struct snap_record) when written */
+};
+
+/* FNV-1a of the fields of <rec> before its checksum */
+static uint32_t snap_check(const struct snap_record * rec)
+{
+	const uint8_t * p = (const uint8_t *)rec;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < offsetof(struct snap_record, check); ++i) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Whether <rec>, at <offset> of a file of <size> bytes, is whole */
+static int snap_valid(const struct snap_record * rec, uint64_t offset, uint64_t size)
+{
+	return !memcmp(rec->magic, SNAP_RECORD_MAGIC, sizeof(rec->magic)) &&
+		rec->check == snap_check(rec) && rec->encoding <= SNAP_PACKED &&
+		rec->chain_len <= SNAP_CHAIN_MAX &&
+		rec->data_len <= size - offset - SNAP_ALIGN;
+}
+
+static int snap_pwrite(int fd, const void * data, size_t len, uint64_t offset)
+{
+	const char * buf = (const char *)data;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t cur = pwrite(fd, buf + done, len - done, offset + done);
+
+		if (cur < 0 && errno == EINTR)
+			continue;
+		if (cur <= 0)
+			return 1;
+		done += cur;
+	}
+	return 0;
+}
+
+static int snap_write_header(int fd)
+{
+	struct snap_header header;
+	char page[SNAP_ALIGN];
+
+	memset(page, 0, sizeof(page));
+	memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+	header.version = SNAP_VERSION;
+	header.record_size = sizeof(struct snap_record);
+	memcpy(page, &header, sizeof(header));
+	return snap_pwrite(fd, page, sizeof(page), 0);
+}
+
+int snap_open(struct snap_file * snap, const char * path)
+{
+	struct snap_header header;
+	struct snap_record rec;
+	struct stat st;
+	uint64_t offset;
+
+	memset(snap, 0, sizeof(struct snap_file));
+	snap->new_fd = -1;
+	snap->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (snap->fd < 0)
+		return 1;
+	snap->path = strdup(path);
+	if (!snap->path || fstat(snap->fd, &st))
+		goto fail;
+
+	if (!st.st_size) {
+		if (snap_write_header(snap->fd))
+			goto fail;
+		snap->end = SNAP_ALIGN;
+		return 0;
+	}
+
+	if (pread(snap->fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) ||
+	    header.version != SNAP_VERSION ||
+	    header.record_size != sizeof(struct snap_record)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	/* Up to the first record that did not make it */
+	for (offset = SNAP_ALIGN; offset + SNAP_ALIGN <= (uint64_t)st.st_size;
+	     offset += SNAP_RECORD_BYTES(rec.data_len)) {
+		if (pread(snap->fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+		    !snap_valid(&rec, offset, st.st_size))
+			break;
+	}
+	if (offset < (uint64_t)st.st_size && ftruncate(snap->fd, offset))
+		goto fail;
+	snap->end = offset;
+	return 0;
+
+fail:
+	close(snap->fd);
+	free(snap->path);
+	return 1;
+}
+
+long snap_replay(struct snap_file * snap, snap_record_fn fn, void * arg)
+{
+	uint64_t offset;
+	long count = 0;
+
+	if (snap->end == SNAP_ALIGN)
+		return 0;
+
+	snap->map = (char *)mmap(NULL, snap->end, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				 snap->fd, 0);
+	if (snap->map == MAP_FAILED) {
+		snap->map = NULL;
+		return -1;
+	}
+	snap->map_len = snap->end;
+
+	/* All of them were checked by snap_open() */
+	for (offset = SNAP_ALIGN; offset < snap->end; ++count) {
+		struct snap_record * rec = (struct snap_record *)(snap->map + offset);
+
+		fn(arg, rec, snap->map + offset + SNAP_ALIGN);
+		offset += SNAP_RECORD_BYTES(rec->data_len);
+	}
+	return count;
+}
+
+uint64_t snap_append(struct snap_file * snap, struct snap_record * rec, const void * data)
+{
+	int fd = snap->new_fd >= 0 ? snap->new_fd : snap->fd;
+	uint64_t * end = snap->new_fd >= 0 ? &snap->new_end : &snap->end;
+	uint64_t len = SNAP_RECORD_BYTES(rec->data_len);
+
+	memcpy(rec->magic, SNAP_RECORD_MAGIC, sizeof(rec->magic));
+	rec->check = snap_check(rec);
+
+	/* The metadata goes last: until then, the record does not exist */
+	if (snap_pwrite(fd, data, rec->data_len, *end + SNAP_ALIGN) ||
+	    snap_pwrite(fd, rec, sizeof(struct snap_record), *end)) {
+		snap->stats.failures++;
+		return 0;
+	}
+
+	*end += len;
+	snap->stats.records++;
+	snap->stats.bytes += len;
+	return len;
+}
+
+int snap_sync(struct snap_file * snap)
+{
+	return fdatasync(snap->new_fd >= 0 ? snap->new_fd : snap->fd) != 0;
+}
+
+/* Name of the file that a compaction writes to */
+static char * snap_new_path(const struct snap_file * snap)
+{
+	size_t len = strlen(snap->path) + sizeof(".new");
+	char * path = (char *)malloc(len);
+
+	if (path)
+		snprintf(path, len, "%s.new", snap->path);
+	return path;
+}
+
+int snap_begin_compact(struct snap_file * snap)
+{
+	char * path = snap_new_path(snap);
+
+	if (!path)
+		return 1;
+	snap->new_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (snap->new_fd >= 0 && snap_write_header(snap->new_fd)) {
+		close(snap->new_fd);
+		unlink(path);
+		snap->new_fd = -1;
+	}
+	free(path);
+	snap->new_end = SNAP_ALIGN;
+	return snap->new_fd < 0;
+}
+
+int snap_end_compact(struct snap_file * snap, int commit)
+{
+	char * path = snap_new_path(snap);
+	int err = !path;
+
+	if (commit && !err) {
+		err = fdatasync(snap->new_fd) || rename(path, snap->path);
+	}
+	if (commit && !err) {
+		/* A mapping of the old file keeps it alive */
+		close(snap->fd);
+		snap->fd = snap->new_fd;
+		snap->end = snap->new_end;
+		snap->stats.compactions++;
+	} else {
+		close(snap->new_fd);
+		if (path)
+			unlink(path);
+	}
+	free(path);
+	snap->new_fd = -1;
+	return err;
+}
+
+uint64_t snap_size(const struct snap_file * snap)
+{
+	return snap->new_fd >= 0 ? snap->new_end : snap->end;
+}
+
+void snap_close(struct snap_file * snap)
+{
+	if (snap->new_fd >= 0)
+		snap_end_compact(snap, 0);
+	if (snap->map)
+		munmap(snap->map, snap->map_len);
+	close(snap->fd);
+	free(snap->path);
+}
@@ -0,0 +1,125 @@
+/*******************************************************************************
+* Snapshot File of the Image Registry (header)
+*
+* Description:
+*     A file where the server keeps a copy of its images, so that it can
+*     start again with them. Every image is appended as a record, its
+*     metadata followed by its pixels, whenever it has changed since it
+*     was last written. On startup, the file is mapped in memory and the
+*     latest record of each image is handed back, pixels included, so
+*     that the images can be used straight from the mapping.
+*
+* Notes:
+*     The file only ever grows while it is in use: a record is never
+*     overwritten, so the images over a mapping of the file stay valid
+*     however many records are appended after them. Once the records
+*     that are out of date take too much of it, the current ones are
+*     written to a new file, <path>.new, which then replaces the old one
+*     with a rename(): a mapping of the old file still holds on to it.
+*
+*     The pixels of a record are written before its metadata, which
+*     carries a checksum: a record cut short by a crash is found out,
+*     and the file is truncated back to the record before it. The
+*     pixels themselves are not checked, since that would touch all of
+*     them on startup. None of the functions are thread-safe.
+*
+*******************************************************************************/
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Alignment of the records, and so of the pixels after their metadata */
+#define SNAP_ALIGN 64
+
+/* Deferred filters that a record can carry at most */
+#define SNAP_CHAIN_MAX 6
+
+/* How the pixels of a record are stored */
+enum snap_encoding {
+	SNAP_RAW = 0, /* The pixel buffer, in the layout of the record */
+	SNAP_PACKED   /* The output of packImage() */
+};
+
+/* Metadata of one image, followed by <data_len> bytes of pixels. At
+ * most SNAP_ALIGN bytes, so that the pixels stay aligned. */
+struct snap_record {
+	char magic[4];
+	uint32_t encoding;  /* One of enum snap_encoding */
+	uint64_t img_id;
+	uint64_t data_len;
+	uint32_t width;
+	uint32_t height;
+	uint32_t layout;    /* One of enum img_layout */
+	uint8_t digest[16]; /* MD5 of the pixels in x-y order, if known */
+	uint8_t digest_valid;
+	uint8_t chain_len;
+	uint8_t chain[SNAP_CHAIN_MAX]; /* Filters deferred on the image */
+	uint32_t check;     /* Of all the fields above */
+};
+
+/* Bytes that a record with <data_len> bytes of pixels takes in the file */
+#define SNAP_RECORD_BYTES(data_len)					\
+	(SNAP_ALIGN + (((uint64_t)(data_len) + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1)))
+
+struct snap_stats {
+	uint64_t records;   /* Records written */
+	uint64_t bytes;     /* Of the records written */
+	uint64_t failures;  /* Records that could not be written */
+	uint64_t compactions;
+};
+
+struct snap_file {
+	int fd;
+	char * path;
+	uint64_t end;       /* Of the last record */
+	int new_fd;         /* Of <path>.new while compacting, -1 otherwise */
+	uint64_t new_end;
+	char * map;         /* See snap_replay() */
+	size_t map_len;
+	struct snap_stats stats;
+};
+
+/* Called by snap_replay() for every record, oldest first, with its
+ * pixels in the mapping of the file */
+typedef void (*snap_record_fn)(void * arg, const struct snap_record * rec, void * data);
+
+/* Open the snapshot file at <path>, creating it if it does not exist,
+ * and find the end of its last whole record, from which it is then
+ * appended to. Returns 0 on success and 1 on error, with errno set,
+ * also if the file is not a snapshot. */
+int snap_open(struct snap_file * snap, const char * path);
+
+/* Map the records of <snap> in memory, privately and writable, and
+ * call <fn> on each of them. The mapping is kept until snap_close().
+ * Returns the number of records, or -1 if the file cannot be mapped. */
+long snap_replay(struct snap_file * snap, snap_record_fn fn, void * arg);
+
+/* Append a record with <rec> and its <rec->data_len> bytes at <data>,
+ * to the new file while compacting. Returns the bytes that the record
+ * takes in the file, or 0 on error. */
+uint64_t snap_append(struct snap_file * snap, struct snap_record * rec, const void * data);
+
+/* Write the records appended so far through to the disk. Returns 0 on
+ * success and 1 on error. */
+int snap_sync(struct snap_file * snap);
+
+/* Start writing the records to <path>.new instead, until
+ * snap_end_compact(). Returns 0 on success and 1 on error. */
+int snap_begin_compact(struct snap_file * snap);
+
+/* Make the new file the snapshot file if <commit>, or drop it. Returns
+ * 0 on success and 1 on error, in which case the old file is kept. */
+int snap_end_compact(struct snap_file * snap, int commit);
+
+/* Bytes of the file that records are written to */
+uint64_t snap_size(const struct snap_file * snap);
+
+/* Close the file of <snap> and unmap it, which must only be done once
+ * nothing refers to the pixels of its mapping anymore */
+void snap_close(struct snap_file * snap);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -0,0 +1,205 @@
+/*******************************************************************************
+* Spill Store for Cold Images (implementation)
+*
+* Description:
+*     A backing file for the pixel buffers of images that are taken out
+*     of memory, see spill.h.
+*
+* Notes:
+*     Extents are whole pages. The free ones are kept in an array sorted
+*     by offset, merged with their neighbours as they are released, and
+*     handed out first fit: the file only grows when none is large
+*     enough. A released extent is punched out of the file, which drops
+*     its pages from the page cache and its blocks from the disk.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+
+#define SPILL_PAGE 4096
+
+int spill_init(struct spill_store * store, const char * path)
+{
+	memset(store, 0, sizeof(struct spill_store));
+
+	if (path) {
+		store->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	} else {
+		const char * dir = getenv("TMPDIR");
+		char tmpl[4096];
+
+		snprintf(tmpl, sizeof(tmpl), "%s/imgspill.XXXXXX", dir ? dir : "/tmp");
+		store->fd = mkstemp(tmpl);
+		if (store->fd >= 0)
+			unlink(tmpl);
+	}
+	if (store->fd < 0)
+		return 1;
+
+	store->map = (const char *)mmap(NULL, SPILL_MAP_MAX, PROT_READ, MAP_SHARED,
+					store->fd, 0);
+	if (store->map == MAP_FAILED) {
+		close(store->fd);
+		return 1;
+	}
+
+	pthread_mutex_init(&store->lock, NULL);
+	return 0;
+}
+
+void spill_destroy(struct spill_store * store)
+{
+	munmap((void *)store->map, SPILL_MAP_MAX);
+	close(store->fd);
+	free(store->free);
+	pthread_mutex_destroy(&store->lock);
+}
+
+/* Take <len> bytes, a multiple of SPILL_PAGE, from the first free
+ * extent that has them, or else from the end of the file. Returns 1 if
+ * the file cannot grow. Called with the lock held. */
+static int spill_alloc(struct spill_store * store, uint64_t len, uint64_t * offset)
+{
+	size_t i;
+
+	for (i = 0; i < store->free_count; ++i) {
+		struct spill_extent * e = &store->free[i];
+
+		if (e->len < len)
+			continue;
+		*offset = e->offset;
+		e->offset += len;
+		e->len -= len;
+		if (!e->len) {
+			memmove(e, e + 1, (store->free_count - i - 1) * sizeof(*e));
+			store->free_count--;
+		}
+		return 0;
+	}
+
+	if (store->stats.file_size + len > SPILL_MAP_MAX ||
+	    ftruncate(store->fd, store->stats.file_size + len))
+		return 1;
+	*offset = store->stats.file_size;
+	store->stats.file_size += len;
+	return 0;
+}
+
+/* Add <ext> to the free extents, merged with the ones it touches.
+ * Called with the lock held. */
+static void spill_free(struct spill_store * store, const struct spill_extent * ext)
+{
+	struct spill_extent * e;
+	size_t i;
+
+	for (i = 0; i < store->free_count && store->free[i].offset < ext->offset; ++i)
+		;
+
+	/* Right after the previous one */
+	if (i > 0 && store->free[i - 1].offset + store->free[i - 1].len == ext->offset) {
+		e = &store->free[i - 1];
+		e->len += ext->len;
+		if (i < store->free_count && e->offset + e->len == store->free[i].offset) {
+			e->len += store->free[i].len;
+			memmove(&store->free[i], &store->free[i + 1],
+				(store->free_count - i - 1) * sizeof(*e));
+			store->free_count--;
+		}
+		return;
+	}
+
+	/* Right before the next one */
+	if (i < store->free_count && ext->offset + ext->len == store->free[i].offset) {
+		store->free[i].offset = ext->offset;
+		store->free[i].len += ext->len;
+		return;
+	}
+
+	if (store->free_count == store->free_capacity) {
+		size_t capacity = store->free_capacity ? 2 * store->free_capacity : 64;
+		e = (struct spill_extent *)realloc(store->free, capacity * sizeof(*e));
+		/* Out of memory: the extent is lost until the next run */
+		if (!e)
+			return;
+		store->free = e;
+		store->free_capacity = capacity;
+	}
+	memmove(&store->free[i + 1], &store->free[i], (store->free_count - i) * sizeof(*e));
+	store->free[i] = *ext;
+	store->free_count++;
+}
+
+int spill_write(struct spill_store * store, const void * data, size_t len,
+		struct spill_extent * ext)
+{
+	const char * buf = (const char *)data;
+	size_t done = 0;
+	int err;
+
+	ext->len = (len + SPILL_PAGE - 1) & ~(uint64_t)(SPILL_PAGE - 1);
+
+	pthread_mutex_lock(&store->lock);
+	err = spill_alloc(store, ext->len, &ext->offset);
+	if (err)
+		store->stats.failures++;
+	pthread_mutex_unlock(&store->lock);
+	if (err)
+		return 1;
+
+	/* The extent is ours: no need for the lock while writing it */
+	while (done < len) {
+		ssize_t cur = pwrite(store->fd, buf + done, len - done, ext->offset + done);
+
+		if (cur < 0 && errno == EINTR)
+			continue;
+		if (cur <= 0) {
+			pthread_mutex_lock(&store->lock);
+			spill_free(store, ext);
+			store->stats.failures++;
+			pthread_mutex_unlock(&store->lock);
+			return 1;
+		}
+		done += cur;
+	}
+
+	pthread_mutex_lock(&store->lock);
+	store->stats.spills++;
+	store->stats.bytes += ext->len;
+	pthread_mutex_unlock(&store->lock);
+	return 0;
+}
+
+const void * spill_map(struct spill_store * store, const struct spill_extent * ext)
+{
+	return store->map + ext->offset;
+}
+
+void spill_release(struct spill_store * store, const struct spill_extent * ext,
+		   int faulted)
+{
+	fallocate(store->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  ext->offset, ext->len);
+
+	pthread_mutex_lock(&store->lock);
+	spill_free(store, ext);
+	store->stats.bytes -= ext->len;
+	if (faulted)
+		store->stats.faults++;
+	pthread_mutex_unlock(&store->lock);
+}
+
+void spill_get_stats(struct spill_store * store, struct spill_stats * stats)
+{
+	pthread_mutex_lock(&store->lock);
+	*stats = store->stats;
+	pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+* Spill Store for Cold Images (header)
+*
+* Description:
+*     A backing file for the pixel buffers of images that are taken out
+*     of memory. A buffer is written to a free extent of the file, and
+*     read back through a mapping of the whole file when needed again,
+*     after which its extent can be reused.
+*
+* Notes:
+*     The file is unlinked as soon as it is created unless a path is
+*     given, and never needs to outlive the process: nothing is synced
+*     to disk, the kernel writes the pages back at its own pace and
+*     reclaims them from the page cache like any other clean page. The
+*     mapping reserves SPILL_MAP_MAX bytes of address space up front
+*     and the file grows into it, so that a pointer returned by
+*     spill_map() stays valid while the file grows. All the functions
+*     are thread-safe.
+*
+*******************************************************************************/
+#ifndef __SPILL_H__
+#define __SPILL_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Largest size of the backing file */
+#define SPILL_MAP_MAX (1ULL << 36)
+
+/* Bytes of the file where one buffer is kept */
+struct spill_extent {
+	uint64_t offset;
+	uint64_t len;
+};
+
+struct spill_stats {
+	uint64_t spills;    /* Buffers written */
+	uint64_t faults;    /* Buffers read back */
+	uint64_t failures;  /* Buffers that could not be written */
+	uint64_t bytes;     /* Bytes of the buffers in the file now */
+	uint64_t file_size; /* Bytes of the file, free extents included */
+};
+
+struct spill_store {
+	pthread_mutex_t lock;
+	int fd;
+	const char * map;
+	struct spill_extent * free; /* Free extents, by increasing offset */
+	size_t free_count;
+	size_t free_capacity;
+	struct spill_stats stats;
+};
+
+/* Create the backing file of <store> at <path>, or as an unlinked
+ * temporary file in $TMPDIR (or /tmp) if NULL. Returns 0 on success
+ * and 1 on error, with errno set. */
+int spill_init(struct spill_store * store, const char * path);
+
+/* Close and unmap the backing file of <store> */
+void spill_destroy(struct spill_store * store);
+
+/* Write the <len> bytes at <data> to a free extent of <store>, which
+ * is returned in <ext>. Returns 0 on success and 1 on error, e.g. once
+ * the file would grow beyond SPILL_MAP_MAX. */
+int spill_write(struct spill_store * store, const void * data, size_t len,
+		struct spill_extent * ext);
+
+/* The bytes of <ext>, valid until spill_release() */
+const void * spill_map(struct spill_store * store, const struct spill_extent * ext);
+
+/* Give <ext> back to the free extents of <store>. <faulted> tells
+ * whether its bytes were read back, for the counters. */
+void spill_release(struct spill_store * store, const struct spill_extent * ext,
+		   int faulted);
+
+/* Copy the current counters of <store> into <stats> */
+void spill_get_stats(struct spill_store * store, struct spill_stats * stats);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
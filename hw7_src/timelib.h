@@ -18,6 +18,15 @@
 *     using this library. Modifications or improvements are welcome. Please
 *     refer to the accompanying documentation for detailed usage instructions.
 *
+*     The TSC clock reads time off the time stamp counter with RDTSC, with
+*     no system call, once tsc_init() has measured its frequency. It only
+*     does so if the CPU reports an invariant (constant and nonstop) TSC,
+*     which ticks at the same rate on all the cores whatever their power
+*     state: otherwise, or before tsc_init(), it falls back on
+*     clock_gettime(). Its readings are on the same time base as
+*     CLOCK_MONOTONIC, and can be compared with those of other processes,
+*     within the precision of the calibration (a few parts per million).
+*
 *******************************************************************************/
 #ifndef __TIMELIB_H__
 #define __TIMELIB_H__
@@ -33,6 +42,52 @@
 /* How many nanoseconds in a second */
 #define NANO_IN_SEC (1000*1000*1000)
 
+/* A point in time or a duration as a plain count of nanoseconds, which
+ * lasts for 584 years of CLOCK_MONOTONIC. Adding, subtracting and
+ * comparing two of them takes a single integer operation. */
+typedef uint64_t nstime_t;
+
+static inline nstime_t timespec_to_ns(const struct timespec * ts)
+{
+	return (nstime_t)ts->tv_sec * NANO_IN_SEC + ts->tv_nsec;
+}
+
+static inline struct timespec ns_to_timespec(nstime_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NANO_IN_SEC;
+	ts.tv_nsec = ns % NANO_IN_SEC;
+	return ts;
+}
+
+/* 1 if a is later than b, -1 if earlier, 0 if they are the same,
+ * without a branch */
+static inline int ns_cmp(nstime_t a, nstime_t b)
+{
+	return (a > b) - (a < b);
+}
+
+/* Seconds in <ns>, for printing: the whole seconds and the fraction
+ * are converted apart, so that no nanosecond is lost to the rounding
+ * of a large value */
+static inline double ns_to_double(nstime_t ns)
+{
+	return (double)(ns / NANO_IN_SEC) + (double)(ns % NANO_IN_SEC) / NANO_IN_SEC;
+}
+
+/* Nanoseconds in <seconds>, to the nearest, 0 if negative */
+static inline nstime_t double_to_ns(double seconds)
+{
+	nstime_t sec;
+
+	if (!(seconds > 0))
+		return 0;
+
+	sec = (nstime_t)seconds;
+	return sec * NANO_IN_SEC + (nstime_t)((seconds - (double)sec) * NANO_IN_SEC + 0.5);
+}
+
 /* Macro wrapper for RDTSC instruction */
 #define get_clocks(clocks)						\
 	do {								\
@@ -45,6 +100,26 @@
 			((uint64_t)__clocks_lo);			\
 	} while (0)
 
+/* Measure the frequency of the TSC against CLOCK_MONOTONIC by sleeping
+ * for a short while, as in HW1. Must be called before any other thread
+ * reads the TSC clock. Returns 0 if the TSC clock is in use, and 1 if
+ * the CPU has no invariant TSC and clock_gettime() is used instead. */
+int tsc_init(void);
+
+/* Time of the TSC clock, in nanoseconds of CLOCK_MONOTONIC */
+nstime_t tsc_now_ns(void);
+
+/* Same as tsc_now_ns(), as a timespec, in place of clock_gettime() on
+ * CLOCK_MONOTONIC */
+void tsc_gettime(struct timespec * ts);
+
+/* Nominal frequency of the TSC in Hz, 0 if not in use */
+uint64_t tsc_hz(void);
+
+/* Busywait for <ns> nanoseconds on the TSC clock. Return the number of
+ * clock cycles elapsed. */
+uint64_t busywait_ns(nstime_t ns);
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec);
@@ -57,7 +132,7 @@ uint64_t get_elapsed_busywait(long sec, long nsec);
  * parameter */
 uint64_t busywait_timespec(struct timespec delay);
 
-/* Add two timespec structures together */
+/* Add two timespec structures together, into the first one */
 void timespec_add (struct timespec *, struct timespec *);
 
 /* Compare two timespec structures with one another */
@@ -0,0 +1,336 @@
+/*******************************************************************************
+* Request Trace Buffers (implementation)
+*
+* Description:
+*     Per-thread SPSC rings of trace records and their flusher, see
+*     trace.h.
+*
+* Notes:
+*     The positions of a ring only ever grow: the producer owns <tail>
+*     and the flusher <head>, and the ring holds the records between the
+*     two. The producer publishes a record by storing <tail> with release
+*     semantics after copying it, and the flusher hands the slots back by
+*     storing <head> the same way once it is done with them.
+*
+*     In binary mode, the flusher scatters the fields of the records into
+*     the columns of a block in memory, and writes the block out once it
+*     is full, or when the trace is stopped.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* Pause of the flusher when it finds all the rings empty */
+#define TRACE_FLUSH_NS 2000000
+
+/* The columns of a binary trace, one per field of the records */
+struct trace_column {
+	const char * name;
+	size_t width;
+	size_t field;
+};
+
+#define TRACE_COLUMN(f)						\
+	{ #f, sizeof(((struct trace_record *)0)->f), offsetof(struct trace_record, f) }
+
+static const struct trace_column trace_columns[] = {
+	TRACE_COLUMN(req_id),
+	TRACE_COLUMN(img_id),
+	TRACE_COLUMN(out_img_id),
+	TRACE_COLUMN(sent_ns),
+	TRACE_COLUMN(length_ns),
+	TRACE_COLUMN(receipt_ns),
+	TRACE_COLUMN(start_ns),
+	TRACE_COLUMN(completion_ns),
+	TRACE_COLUMN(thread),
+	TRACE_COLUMN(queue_len),
+	TRACE_COLUMN(kind),
+	TRACE_COLUMN(opcode),
+	TRACE_COLUMN(overwrite),
+};
+
+#define TRACE_COLUMNS (sizeof(trace_columns) / sizeof(trace_columns[0]))
+
+/* The row count of a block takes 8 bytes, to keep the columns aligned */
+#define TRACE_BLOCK_HEADER 8
+
+static size_t trace_column_offset(size_t column)
+{
+	size_t i, offset = TRACE_BLOCK_HEADER;
+
+	for (i = 0; i < column; ++i)
+		offset += trace_columns[i].width * TRACE_BLOCK_ROWS;
+	return offset;
+}
+
+static size_t trace_block_size(void)
+{
+	return trace_column_offset(TRACE_COLUMNS);
+}
+
+static void trace_fill_header(struct trace_file_header * hdr,
+			      struct trace_column_desc * cols)
+{
+	size_t i;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+	hdr->block_rows = TRACE_BLOCK_ROWS;
+	hdr->column_count = TRACE_COLUMNS;
+	hdr->block_size = trace_block_size();
+
+	memset(cols, 0, TRACE_COLUMNS * sizeof(*cols));
+	for (i = 0; i < TRACE_COLUMNS; ++i) {
+		strncpy(cols[i].name, trace_columns[i].name, sizeof(cols[i].name) - 1);
+		cols[i].width = trace_columns[i].width;
+		cols[i].offset = trace_column_offset(i);
+	}
+}
+
+int trace_init(struct trace * t, size_t producers, size_t capacity, FILE * out,
+	       int binary, const char * const * opcodes, size_t opcode_count)
+{
+	size_t i;
+
+	memset(t, 0, sizeof(struct trace));
+	t->count = producers;
+	t->capacity = capacity ? capacity : 1;
+	t->out = out;
+	t->binary = binary;
+	t->opcodes = opcodes;
+	t->opcode_count = opcode_count;
+
+	if (posix_memalign((void **)&t->rings, TRACE_CACHELINE,
+			   producers * sizeof(struct trace_ring))) {
+		t->rings = NULL;
+		return 1;
+	}
+	memset(t->rings, 0, producers * sizeof(struct trace_ring));
+
+	for (i = 0; i < producers; ++i) {
+		t->rings[i].records = (struct trace_record *)
+			malloc(t->capacity * sizeof(struct trace_record));
+		if (!t->rings[i].records) {
+			trace_destroy(t);
+			return 1;
+		}
+	}
+
+	if (binary) {
+		struct trace_file_header hdr;
+		struct trace_column_desc cols[TRACE_COLUMNS];
+
+		trace_fill_header(&hdr, cols);
+		t->block = (char *)calloc(1, hdr.block_size);
+		if (!t->block ||
+		    fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+		    fwrite(cols, sizeof(cols), 1, out) != 1) {
+			trace_destroy(t);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void trace_destroy(struct trace * t)
+{
+	size_t i;
+
+	for (i = 0; t->rings && i < t->count; ++i)
+		free(t->rings[i].records);
+	free(t->rings);
+	free(t->block);
+	t->rings = NULL;
+	t->block = NULL;
+}
+
+void trace_add(struct trace * t, size_t producer, const struct trace_record * rec)
+{
+	struct trace_ring * ring = &t->rings[producer];
+	size_t tail = ring->tail;
+
+	/* Wait for the flusher rather than lose the record */
+	while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= t->capacity)
+		sched_yield();
+
+	ring->records[tail % t->capacity] = *rec;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static double ns_to_double(uint64_t ns)
+{
+	/* Same rounding as TSPEC_TO_DOUBLE() on the original timespec */
+	return (double)(ns / 1000000000ULL) + (double)(ns % 1000000000ULL) / 1000000000ULL;
+}
+
+void trace_print(FILE * out, const struct trace_record * rec,
+		 const char * const * opcodes, size_t opcode_count)
+{
+	if (rec->kind == TRACE_REJECT) {
+		fprintf(out, "X%lu:%lf,%lf,%lf\n", rec->req_id,
+			ns_to_double(rec->sent_ns), ns_to_double(rec->length_ns),
+			ns_to_double(rec->receipt_ns));
+		return;
+	}
+
+	fprintf(out, "T%u R%lu:%lf,%s,%d,%lu,%lu,%lf,%lf,%lf\n",
+		rec->thread, rec->req_id, ns_to_double(rec->sent_ns),
+		rec->opcode < opcode_count ? opcodes[rec->opcode] : "IMG_UNKNOWN",
+		rec->overwrite, rec->img_id, rec->out_img_id,
+		ns_to_double(rec->receipt_ns), ns_to_double(rec->start_ns),
+		ns_to_double(rec->completion_ns));
+}
+
+/* Write out the block being filled, if it holds any row */
+static void trace_write_block(struct trace * t)
+{
+	size_t size = trace_block_size();
+
+	if (!t->block_rows)
+		return;
+
+	*(uint32_t *)t->block = t->block_rows;
+	fwrite(t->block, size, 1, t->out);
+
+	/* The last block is padded with zeros */
+	memset(t->block, 0, size);
+	t->block_rows = 0;
+}
+
+static void trace_append_row(struct trace * t, const struct trace_record * rec)
+{
+	size_t i, offset = TRACE_BLOCK_HEADER;
+
+	for (i = 0; i < TRACE_COLUMNS; ++i) {
+		const struct trace_column * col = &trace_columns[i];
+
+		memcpy(t->block + offset + t->block_rows * col->width,
+		       (const char *)rec + col->field, col->width);
+		offset += col->width * TRACE_BLOCK_ROWS;
+	}
+
+	if (++t->block_rows == TRACE_BLOCK_ROWS)
+		trace_write_block(t);
+}
+
+/* Write out everything in the rings. Returns the number of records. */
+static size_t trace_drain(struct trace * t)
+{
+	size_t i, total = 0;
+
+	/* Other threads may print on the same stream: no line of theirs
+	 * must end up in the middle of a record */
+	flockfile(t->out);
+
+	for (i = 0; i < t->count; ++i) {
+		struct trace_ring * ring = &t->rings[i];
+		size_t head = ring->head;
+		size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head, ++total) {
+			const struct trace_record * rec = &ring->records[head % t->capacity];
+
+			if (t->binary)
+				trace_append_row(t, rec);
+			else
+				trace_print(t->out, rec, t->opcodes, t->opcode_count);
+		}
+
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+
+	funlockfile(t->out);
+
+	return total;
+}
+
+static void * trace_flusher_main(void * arg)
+{
+	struct trace * t = (struct trace *)arg;
+	struct timespec pause = { 0, TRACE_FLUSH_NS };
+
+	for (;;) {
+		int stopping = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+
+		/* One last pass after the stop, for the latest records */
+		if (!trace_drain(t)) {
+			if (stopping)
+				break;
+			nanosleep(&pause, NULL);
+		}
+	}
+
+	if (t->binary)
+		trace_write_block(t);
+	fflush(t->out);
+	return NULL;
+}
+
+int trace_start(struct trace * t)
+{
+	return pthread_create(&t->flusher, NULL, trace_flusher_main, t) != 0;
+}
+
+void trace_stop(struct trace * t)
+{
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->flusher, NULL);
+}
+
+int trace_reader_open(struct trace_reader * r, FILE * in)
+{
+	struct trace_file_header hdr, expected;
+	struct trace_column_desc cols[TRACE_COLUMNS], expected_cols[TRACE_COLUMNS];
+
+	memset(r, 0, sizeof(struct trace_reader));
+	trace_fill_header(&expected, expected_cols);
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(&hdr, &expected, sizeof(hdr)) ||
+	    fread(cols, sizeof(cols), 1, in) != 1 ||
+	    memcmp(cols, expected_cols, sizeof(cols)))
+		return 1;
+
+	r->in = in;
+	r->block_size = hdr.block_size;
+	r->block = (char *)malloc(r->block_size);
+	return r->block == NULL;
+}
+
+size_t trace_reader_next(struct trace_reader * r, struct trace_record * out)
+{
+	size_t i, row, rows, offset = TRACE_BLOCK_HEADER;
+
+	if (fread(r->block, r->block_size, 1, r->in) != 1)
+		return 0;
+
+	rows = *(uint32_t *)r->block;
+	if (rows > TRACE_BLOCK_ROWS)
+		return 0;
+
+	memset(out, 0, rows * sizeof(struct trace_record));
+	for (i = 0; i < TRACE_COLUMNS; ++i) {
+		const struct trace_column * col = &trace_columns[i];
+
+		for (row = 0; row < rows; ++row) {
+			memcpy((char *)&out[row] + col->field,
+			       r->block + offset + row * col->width, col->width);
+		}
+		offset += col->width * TRACE_BLOCK_ROWS;
+	}
+
+	return rows;
+}
+
+void trace_reader_close(struct trace_reader * r)
+{
+	free(r->block);
+	r->block = NULL;
+}
@@ -0,0 +1,157 @@
+/*******************************************************************************
+* Request Trace Buffers (header)
+*
+* Description:
+*     Per-thread lock-free buffers for the trace of the requests that the
+*     server completes or rejects. Every thread that produces records owns
+*     a single-producer/single-consumer ring, so recording one costs a
+*     copy and a release store, with no lock and no formatting. A
+*     background flusher thread drains all the rings, and either prints
+*     the records in the text format of the server or writes them to a
+*     binary columnar trace, to be decoded offline with tracedec or
+*     mapped into memory by the analysis scripts (see trace_load.py).
+*
+* Notes:
+*     A producer that finds its ring full yields until the flusher makes
+*     room, so no record is ever dropped. Records of different rings come
+*     out grouped by ring within a round of the flusher, not in global
+*     time order: sort on the timestamps if that matters.
+*
+*     A binary trace starts with a header that names the columns, their
+*     width in bytes and their offset within a block, as in struct
+*     trace_file_header and struct trace_column_desc. Then come blocks of
+*     TRACE_BLOCK_ROWS rows, all of the same size: a block starts with its
+*     number of rows, which is less than TRACE_BLOCK_ROWS only in the last
+*     block, followed by each column in turn. The values are in the byte
+*     order of the server, and every column starts 8-byte aligned within
+*     the file, so that it can be used in place once mapped.
+*
+*******************************************************************************/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define TRACE_CACHELINE 64
+
+/* Identifies a binary trace, and the version of its layout */
+#define TRACE_MAGIC "IMGTRC02"
+
+/* Rows in each block of a binary trace, a multiple of 8 */
+#define TRACE_BLOCK_ROWS 4096
+
+enum trace_kind {
+	TRACE_DONE = 0,   /* Printed as T<thread> R<req_id>:... */
+	TRACE_REJECT = 1, /* Printed as X<req_id>:... */
+};
+
+struct trace_record {
+	uint64_t req_id;
+	uint64_t img_id;        /* As in the request */
+	uint64_t out_img_id;    /* Image the operation produced */
+	uint64_t sent_ns;       /* Timestamp of the request, from the client */
+	uint64_t length_ns;     /* Length of the request, from the client */
+	uint64_t receipt_ns;
+	uint64_t start_ns;
+	uint64_t completion_ns;
+	uint32_t thread;        /* Worker ID, or that of the event loop */
+	uint32_t queue_len;     /* Requests queued at completion or rejection */
+	uint8_t kind;
+	uint8_t opcode;
+	uint8_t overwrite;
+	uint8_t reserved;
+};
+
+struct trace_ring {
+	/* Written by the producer only */
+	size_t tail __attribute__((aligned(TRACE_CACHELINE)));
+
+	/* Written by the flusher only */
+	size_t head __attribute__((aligned(TRACE_CACHELINE)));
+
+	struct trace_record * records __attribute__((aligned(TRACE_CACHELINE)));
+};
+
+struct trace {
+	struct trace_ring * rings;
+	size_t count;
+	size_t capacity;
+
+	FILE * out;
+	int binary;
+	const char * const * opcodes; /* Names of the opcodes, for the text */
+	size_t opcode_count;
+
+	pthread_t flusher;
+	int stop;
+
+	/* Block of the binary trace being filled by the flusher */
+	char * block;
+	size_t block_rows;
+};
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t block_rows;
+	uint32_t column_count;
+	uint64_t block_size;   /* In bytes, including the row count */
+	/* Followed by <column_count> struct trace_column_desc */
+};
+
+struct trace_column_desc {
+	char name[24];
+	uint32_t width;        /* Of a value, in bytes */
+	uint32_t offset;       /* Of the column from the start of a block */
+};
+
+/* Reader of binary traces, for the analysis tools */
+struct trace_reader {
+	FILE * in;
+	char * block;
+	size_t block_size;
+};
+
+/* Initialize <t> with <producers> rings of <capacity> records, to be
+ * flushed to <out> either in binary or as text, with the opcodes named
+ * after the <opcode_count> strings of <opcodes>. Returns 0 on success
+ * and 1 on failure. */
+int trace_init(struct trace * t, size_t producers, size_t capacity, FILE * out,
+	       int binary, const char * const * opcodes, size_t opcode_count);
+
+/* Start the flusher thread of <t>. Returns 0 on success and 1 on
+ * failure. */
+int trace_start(struct trace * t);
+
+/* Add a copy of <rec> to the ring of <producer>, which only one thread
+ * may use at a time */
+void trace_add(struct trace * t, size_t producer, const struct trace_record * rec);
+
+/* Flush all the records added so far and stop the flusher thread */
+void trace_stop(struct trace * t);
+
+/* Release the memory of <t>. The flusher must be stopped. */
+void trace_destroy(struct trace * t);
+
+/* Print <rec> into <out> in the text format of the server */
+void trace_print(FILE * out, const struct trace_record * rec,
+		 const char * const * opcodes, size_t opcode_count);
+
+/* Read the header of the binary trace <in> into <r>. Returns 0 on
+ * success and 1 if <in> is not a trace with the columns of this
+ * version of the server. */
+int trace_reader_open(struct trace_reader * r, FILE * in);
+
+/* Read the next block of <r> into <out>, which must have room for
+ * TRACE_BLOCK_ROWS records. Returns the number of records read, 0 at
+ * the end of the trace. */
+size_t trace_reader_next(struct trace_reader * r, struct trace_record * out);
+
+/* Release the memory of <r>. The trace itself is not closed. */
+void trace_reader_close(struct trace_reader * r);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -0,0 +1,60 @@
+# Loader of the binary traces that the server writes with -T.
+#
+# The trace is mapped into memory, not parsed: every column comes back
+# as a numpy array, gathered from its slices in the blocks of the trace
+# (or a view of the mapping if there is a single block). Traces of
+# millions of requests load in about the time it takes to page them in.
+#
+# Usage (e.g. in a notebook):
+#
+#     from trace_load import load_trace
+#     t = load_trace('trace.bin')
+#     done = t['kind'] == 0
+#     wait = (t['start_ns'] - t['receipt_ns'])[done] / 1e9
+#     blur = done & (t['opcode'] == OPCODES.index('IMG_BLUR'))
+#
+# The layout is described in trace.h.
+
+import struct
+import numpy as np
+
+MAGIC = b'IMGTRC02'
+HEADER = struct.Struct('=8sIIQ')
+COLUMN = struct.Struct('=24sII')
+BLOCK_HEADER = 8
+
+# Same order as __opcode_strings in common.h
+OPCODES = ['IMG_UNUSED', 'IMG_REGISTER', 'IMG_ROT90CLKW', 'IMG_BLUR',
+           'IMG_SHARPEN', 'IMG_VERTEDGES', 'IMG_HORIZEDGES', 'IMG_RETRIEVE',
+           'IMG_GAUSSBLUR', 'IMG_EMBOSS', 'IMG_SOBEL', 'IMG_PIPELINE',
+           'IMG_RETRIEVE_REGION']
+
+_UNSIGNED = {1: np.uint8, 2: np.uint16, 4: np.uint32, 8: np.uint64}
+
+
+def load_trace(path):
+    """Return a dict of numpy arrays, one per column of the trace"""
+    with open(path, 'rb') as f:
+        magic, block_rows, column_count, block_size = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError('%s: not a trace of this server' % path)
+        columns = []
+        for _ in range(column_count):
+            name, width, offset = COLUMN.unpack(f.read(COLUMN.size))
+            columns.append((name.rstrip(b'\0').decode(), width, offset))
+
+    start = HEADER.size + column_count * COLUMN.size
+    raw = np.memmap(path, dtype=np.uint8, mode='r', offset=start)
+    blocks = raw[:len(raw) // block_size * block_size].reshape(-1, block_size)
+    if not len(blocks):
+        return {name: np.empty(0, _UNSIGNED[width]) for name, width, _ in columns}
+
+    # Only the last block may be partly filled
+    last_rows = int(blocks[-1, :4].view(np.uint32)[0])
+    rows = (len(blocks) - 1) * block_rows + last_rows
+
+    trace = {}
+    for name, width, offset in columns:
+        col = blocks[:, offset:offset + width * block_rows]
+        trace[name] = col.reshape(-1).view(_UNSIGNED[width])[:rows]
+    return trace
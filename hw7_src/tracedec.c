@@ -0,0 +1,71 @@
+/*******************************************************************************
+* Binary Trace Decoder
+*
+* Description:
+*     Prints a binary trace written by the server with -T in the same
+*     text format that the server prints by default, so that the usual
+*     scripts can be run on it.
+*
+* Usage:
+*     <build directory>/tracedec <trace file>
+*
+*     e.g. ./build/tracedec trace.bin | grep IMG_BLUR > blur_ops.csv
+*
+* Notes:
+*     The queue dumps are not part of the trace, but the length of the
+*     queue at the time of each record is: see trace_load.py to get at
+*     it, and at the other columns, without going through the text.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define USAGE_STRING				\
+	"Usage: %s <trace file>\n"
+
+int main (int argc, char ** argv)
+{
+	struct trace_reader reader;
+	struct trace_record * recs;
+	size_t i, rows;
+	FILE * in;
+
+	if (argc != 2) {
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		ERROR_INFO();
+		perror("Unable to open the trace");
+		return EXIT_FAILURE;
+	}
+
+	recs = (struct trace_record *)malloc(TRACE_BLOCK_ROWS * sizeof(struct trace_record));
+	if (!recs || trace_reader_open(&reader, in)) {
+		ERROR_INFO();
+		fprintf(stderr, "Not a trace of this server: %s\n", argv[1]);
+		free(recs);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	while ((rows = trace_reader_next(&reader, recs)) > 0) {
+		for (i = 0; i < rows; ++i) {
+			trace_print(stdout, &recs[i], __opcode_strings,
+				    sizeof(__opcode_strings) / sizeof(__opcode_strings[0]));
+		}
+	}
+
+	trace_reader_close(&reader);
+	free(recs);
+	fclose(in);
+	return EXIT_SUCCESS;
+}
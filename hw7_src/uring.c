@@ -0,0 +1,199 @@
+/*******************************************************************************
+* Minimal io_uring Wrapper (implementation)
+*
+* Description:
+*     Setup of the shared rings and batched submission, see uring.h.
+*
+* Notes:
+*     The ring indices shared with the kernel are only ever loaded with
+*     acquire and stored with release semantics: the kernel reads the
+*     entries up to the new <sq_tail> and we read the completions up to
+*     the <cq_tail> that it published.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct uring * ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char * sq;
+	char * cq;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		return -1;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->sq_ring = sq;
+	ring->cq_ring = cq;
+
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		int err = errno;
+		uring_destroy(ring);
+		errno = err;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+void uring_destroy(struct uring * ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+}
+
+int uring_submit_and_wait(struct uring * ring, unsigned wait_nr)
+{
+	while (ring->sq_queued || wait_nr) {
+		int ret = sys_io_uring_enter(ring->fd, ring->sq_queued, wait_nr,
+					     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		ring->sq_queued -= ret;
+
+		/* All submitted: the wait, if any, is over as well */
+		if (!ring->sq_queued) {
+			break;
+		}
+	}
+	return 0;
+}
+
+struct io_uring_sqe * uring_get_sqe(struct uring * ring, uint64_t user_data)
+{
+	unsigned tail = *ring->sq_tail;
+	struct io_uring_sqe * sqe;
+
+	/* Full: hand the batch over to make room */
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		if (uring_submit_and_wait(ring, 0) < 0) {
+			return NULL;
+		}
+		if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = user_data;
+
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_queued++;
+
+	return sqe;
+}
+
+struct io_uring_cqe * uring_peek_cqe(struct uring * ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring * ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_recv(struct io_uring_sqe * sqe, int fd, void * buf, size_t len, int flags)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe * sqe, int fd, const struct msghdr * msg, int flags)
+{
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+}
+
+void uring_prep_read(struct io_uring_sqe * sqe, int fd, void * buf, size_t len)
+{
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1; /* Current position, for non-seekable files */
+}
+
+void uring_prep_accept(struct io_uring_sqe * sqe, int fd, int flags)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = flags;
+}
+
+#endif /* HAVE_URING */
@@ -0,0 +1,91 @@
+/*******************************************************************************
+* Minimal io_uring Wrapper (header)
+*
+* Description:
+*     Just enough of io_uring for the event loop of the server, on top
+*     of the raw system calls: a submission queue that is filled with a
+*     batch of operations and handed to the kernel with a single
+*     io_uring_enter(), and a completion queue that is read straight
+*     from shared memory.
+*
+* Notes:
+*     Built only when <linux/io_uring.h> is available and NO_URING is
+*     not defined, in which case HAVE_URING is defined. A ring is not
+*     thread-safe: it is meant to be used by one thread only.
+*
+*******************************************************************************/
+#ifndef __URING_H__
+#define __URING_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#if !defined(NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+
+	/* Submission queue: the kernel consumes from <sq_head> */
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_queued; /* Filled in but not submitted yet */
+	struct io_uring_sqe * sqes;
+
+	/* Completion queue: the kernel produces at <cq_tail> */
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/* Set up <ring> with room for <entries> operations per batch. Returns
+ * 0 on success and -1 with errno set if io_uring is not available. */
+int uring_init(struct uring * ring, unsigned entries);
+
+/* Tear down <ring>. Operations still in flight are cancelled. */
+void uring_destroy(struct uring * ring);
+
+/* Next free submission entry, cleared, with <user_data> set. When the
+ * queue is full, the batch so far is submitted first. Returns NULL on
+ * submission errors. */
+struct io_uring_sqe * uring_get_sqe(struct uring * ring, uint64_t user_data);
+
+/* Submit the queued entries and wait until at least <wait_nr>
+ * completions are available. Returns 0 on success and -1 with errno
+ * set on error. */
+int uring_submit_and_wait(struct uring * ring, unsigned wait_nr);
+
+/* Oldest completion not consumed yet, or NULL if there is none */
+struct io_uring_cqe * uring_peek_cqe(struct uring * ring);
+
+/* Consume the completion returned by uring_peek_cqe() */
+void uring_cqe_seen(struct uring * ring);
+
+/* Fill in <sqe> for the usual operations */
+void uring_prep_recv(struct io_uring_sqe * sqe, int fd, void * buf, size_t len, int flags);
+void uring_prep_sendmsg(struct io_uring_sqe * sqe, int fd, const struct msghdr * msg, int flags);
+void uring_prep_read(struct io_uring_sqe * sqe, int fd, void * buf, size_t len);
+void uring_prep_accept(struct io_uring_sqe * sqe, int fd, int flags);
+
+#endif /* HAVE_URING */
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
@@ -0,0 +1,225 @@
+/*******************************************************************************
+* Elastic Pool of Workers (implementation)
+*
+* Description:
+*     Parking of the workers beyond the active ones and sizing of the
+*     pool, see workerpool.h.
+*
+* Notes:
+*     Only the thread calling workerpool_adjust() changes <active>, so
+*     it reads it without atomics. Every change, and the close, bumps
+*     <seq> before waking up the parked workers: a worker that checked
+*     <active> and <closed> before the change then finds <seq> different
+*     and does not sleep.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "workerpool.h"
+
+static void futex_wait(uint32_t * addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t * addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Time of <clock> in ns, 0 if it cannot be read (a thread that exited) */
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts)) {
+		return 0;
+	}
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int workerpool_init(struct workerpool * pool, size_t min, size_t max, size_t cpus)
+{
+	pool->seq = 0;
+	pool->closed = 0;
+	pool->min = min ? min : 1;
+	pool->max = max > pool->min ? max : pool->min;
+	pool->active = pool->min;
+	pool->cpus = cpus ? cpus : 1;
+	pool->last_wall_ns = pool->last_worker_ns = pool->last_process_ns = 0;
+	pool->idle_periods = 0;
+	pool->stats.grows = pool->stats.shrinks = 0;
+	pool->stats.peak = pool->active;
+
+	pool->clocks = (clockid_t *)calloc(pool->max, sizeof(clockid_t));
+	pool->registered = (int *)calloc(pool->max, sizeof(int));
+	if (!pool->clocks || !pool->registered) {
+		free(pool->clocks);
+		free(pool->registered);
+		return 1;
+	}
+	return 0;
+}
+
+void workerpool_destroy(struct workerpool * pool)
+{
+	free(pool->clocks);
+	free(pool->registered);
+}
+
+void workerpool_register(struct workerpool * pool, size_t id)
+{
+	if (id < pool->max && !pthread_getcpuclockid(pthread_self(), &pool->clocks[id])) {
+		__atomic_store_n(&pool->registered[id], 1, __ATOMIC_RELEASE);
+	}
+}
+
+int workerpool_park(struct workerpool * pool, size_t id)
+{
+	for (;;) {
+		uint32_t seq = __atomic_load_n(&pool->seq, __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE)) {
+			return 1;
+		}
+		if (id < __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+		futex_wait(&pool->seq, seq);
+	}
+}
+
+size_t workerpool_active(struct workerpool * pool)
+{
+	return __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE);
+}
+
+static void workerpool_wake(struct workerpool * pool)
+{
+	__atomic_add_fetch(&pool->seq, 1, __ATOMIC_RELEASE);
+	futex_wake(&pool->seq, INT_MAX);
+}
+
+void workerpool_close(struct workerpool * pool)
+{
+	__atomic_store_n(&pool->closed, 1, __ATOMIC_RELEASE);
+	workerpool_wake(pool);
+}
+
+size_t workerpool_adjust(struct workerpool * pool, size_t queued)
+{
+	uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+	uint64_t process = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	uint64_t worker = 0, dt, util, busy_cpus;
+	size_t active = pool->active, target = active, idle_cpus, i;
+
+	for (i = 0; i < pool->max; ++i) {
+		if (__atomic_load_n(&pool->registered[i], __ATOMIC_ACQUIRE)) {
+			worker += clock_ns(pool->clocks[i]);
+		}
+	}
+
+	dt = wall - pool->last_wall_ns;
+	if (!pool->last_wall_ns || !dt) {
+		pool->last_wall_ns = wall;
+		pool->last_worker_ns = worker;
+		pool->last_process_ns = process;
+		return active;
+	}
+
+	/* In percent of the active workers, and of a CPU. The clock of a
+	 * worker that is gone no longer adds up. */
+	util = worker > pool->last_worker_ns ?
+		(worker - pool->last_worker_ns) * 100 / (dt * active) : 0;
+	busy_cpus = process > pool->last_process_ns ?
+		(process - pool->last_process_ns) * 100 / dt : 0;
+	idle_cpus = pool->cpus * 100 > busy_cpus ? (pool->cpus * 100 - busy_cpus + 50) / 100 : 0;
+	pool->last_wall_ns = wall;
+	pool->last_worker_ns = worker;
+	pool->last_process_ns = process;
+
+	if (queued > active * WORKERPOOL_GROW_DEPTH && util >= WORKERPOOL_GROW_UTIL &&
+	    idle_cpus && active < pool->max) {
+		size_t want = (queued + WORKERPOOL_GROW_DEPTH - 1) / WORKERPOOL_GROW_DEPTH;
+
+		target = active + idle_cpus;
+		if (target > want) {
+			target = want;
+		}
+		if (target > pool->max) {
+			target = pool->max;
+		}
+		pool->idle_periods = 0;
+	} else if (queued < active && util < WORKERPOOL_SHRINK_UTIL && active > pool->min) {
+		if (++pool->idle_periods >= WORKERPOOL_SHRINK_PERIODS) {
+			target = active - 1;
+			pool->idle_periods = 0;
+		}
+	} else {
+		pool->idle_periods = 0;
+	}
+
+	if (target == active) {
+		return active;
+	}
+	if (target > active) {
+		__atomic_add_fetch(&pool->stats.grows, target - active, __ATOMIC_RELAXED);
+		if (target > pool->stats.peak) {
+			__atomic_store_n(&pool->stats.peak, target, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_add_fetch(&pool->stats.shrinks, active - target, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&pool->active, target, __ATOMIC_RELEASE);
+	workerpool_wake(pool);
+	return target;
+}
+
+void workerpool_get_stats(struct workerpool * pool, struct workerpool_stats * stats)
+{
+	stats->grows = __atomic_load_n(&pool->stats.grows, __ATOMIC_RELAXED);
+	stats->shrinks = __atomic_load_n(&pool->stats.shrinks, __ATOMIC_RELAXED);
+	stats->peak = __atomic_load_n(&pool->stats.peak, __ATOMIC_RELAXED);
+}
+
+/* <size> rounded up to whole pages */
+static size_t stack_bytes(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) & ~(page - 1);
+}
+
+void * workerpool_stack_alloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	char * base;
+
+	base = (char *)mmap(NULL, stack_bytes(size) + page, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	/* The stack grows down, towards the guard */
+	if (mprotect(base, page, PROT_NONE)) {
+		munmap(base, stack_bytes(size) + page);
+		return NULL;
+	}
+	return base + page;
+}
+
+void workerpool_stack_free(void * stack, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (stack) {
+		munmap((char *)stack - page, stack_bytes(size) + page);
+	}
+}
@@ -0,0 +1,115 @@
+/*******************************************************************************
+* Elastic Pool of Workers (header)
+*
+* Description:
+*     Keeps only as many of the worker threads running as the load asks
+*     for, between a minimum and a maximum. All the threads are created
+*     up front, but only the first <active> of them take requests: the
+*     others are parked on a futex until the pool grows again. A control
+*     thread calls workerpool_adjust() periodically with the length of
+*     the queue, and the pool grows when the active workers have more
+*     queued than they keep up with, are busy, and there are idle CPUs
+*     to run more of them on. It shrinks back once the workers have been
+*     mostly idle for a while.
+*
+* Notes:
+*     The utilization of the workers is measured from the CPU clocks of
+*     their threads, and the idle CPUs from that of the process: only
+*     the CPUs and the workers of the server are seen, not the load of
+*     the rest of the machine. The pool grows at once by as many workers
+*     as there are idle CPUs, up to what the queue needs, so that bursts
+*     are served quickly, but only shrinks by one worker at a time after
+*     WORKERPOOL_SHRINK_PERIODS calls, so that it does not oscillate.
+*
+*     A worker that is parked may still be asleep in the queue rather
+*     than on the futex of the pool, and take one more request when it
+*     wakes up: the callers must still be able to run it.
+*
+*******************************************************************************/
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Queued requests per active worker before the pool grows */
+#define WORKERPOOL_GROW_DEPTH 2
+
+/* CPU utilization of the active workers above which the pool grows,
+ * and below which it shrinks, in percent */
+#define WORKERPOOL_GROW_UTIL 75
+#define WORKERPOOL_SHRINK_UTIL 40
+
+/* Consecutive calls to workerpool_adjust() with the workers under
+ * WORKERPOOL_SHRINK_UTIL before one of them is parked */
+#define WORKERPOOL_SHRINK_PERIODS 10
+
+struct workerpool_stats {
+	uint64_t grows;    /* Workers unparked */
+	uint64_t shrinks;  /* Workers parked */
+	size_t peak;       /* Most workers active at once */
+};
+
+struct workerpool {
+	/* Futex of the parked workers, bumped on every change */
+	uint32_t seq __attribute__((aligned(64)));
+	uint32_t active;
+	int closed;
+
+	/* Read-only after workerpool_init() */
+	size_t min __attribute__((aligned(64)));
+	size_t max;
+	size_t cpus;
+	clockid_t * clocks;  /* CPU clocks of the worker threads... */
+	int * registered;    /* ... once they are set */
+
+	/* Only used by the caller of workerpool_adjust() */
+	uint64_t last_wall_ns;
+	uint64_t last_worker_ns;
+	uint64_t last_process_ns;
+	unsigned idle_periods;
+	struct workerpool_stats stats;
+};
+
+/* Initialize <pool> for <max> workers, of which <min> are active at
+ * first and at least, running on <cpus> CPUs. Returns 0 on success and
+ * 1 on allocation failure. */
+int workerpool_init(struct workerpool * pool, size_t min, size_t max, size_t cpus);
+
+/* Release the memory of <pool>. No thread may be using it anymore. */
+void workerpool_destroy(struct workerpool * pool);
+
+/* Called by worker <id> from its own thread when it starts, so that
+ * its CPU time counts in the utilization of the pool */
+void workerpool_register(struct workerpool * pool, size_t id);
+
+/* Wait until worker <id> is active. Returns 0 when it is, and 1 once
+ * the pool has been closed with workerpool_close(). */
+int workerpool_park(struct workerpool * pool, size_t id);
+
+/* Number of workers that are active right now */
+size_t workerpool_active(struct workerpool * pool);
+
+/* Make the parked workers, and any that would park, return 1 from
+ * workerpool_park() */
+void workerpool_close(struct workerpool * pool);
+
+/* Grow or shrink the pool for <queued> requests waiting, based on the
+ * load since the previous call. Must be called periodically, from one
+ * thread. Returns the number of workers active from now on. */
+size_t workerpool_adjust(struct workerpool * pool, size_t queued);
+
+void workerpool_get_stats(struct workerpool * pool, struct workerpool_stats * stats);
+
+/* A stack of <size> bytes, rounded up to whole pages, with a page
+ * below it that faults on access so that an overflow crashes rather
+ * than corrupting the memory under it. Returns NULL on failure. */
+void * workerpool_stack_alloc(size_t size);
+
+/* Release a stack of <size> bytes from workerpool_stack_alloc() */
+void workerpool_stack_free(void * stack, size_t size);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif
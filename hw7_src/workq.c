@@ -0,0 +1,332 @@
+/*******************************************************************************
+* Work-Stealing Request Queues (implementation)
+*
+* Description:
+*     Per-worker lock-free rings with stealing, see workq.h.
+*
+* Notes:
+*     The sleep protocol is the one of ringq_pop(), lifted to the whole
+*     set of rings: a worker announces itself in <sleepers> before it
+*     looks at the rings one last time, and a producer checks
+*     <sleepers> only after its element is published. Either the worker
+*     finds the element, or the producer sees the worker and bumps
+*     <events> before waking it, so the wake-up cannot be missed. With
+*     several nodes, the producer goes through the <sleepers> of all of
+*     them until it finds one, and the last look of a worker takes from
+*     any ring, also of another node: the same argument holds. The
+*     producer passes over the local nodes of workq_set_local() for the
+*     rings of the other nodes, whose workers would not take its element.
+*
+*     A spinning worker counts itself in <spinners> before it looks at
+*     the rings, and a push that takes it out of there after its element
+*     is published skips the wake-up: the spinner either finds the
+*     element while it spins, or goes through the sleep protocol above,
+*     whose last look finds it. A spinner that was counted on and takes
+*     another element instead wakes up a worker for it, like the push
+*     would have.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "workq.h"
+
+static void futex_wait(uint32_t * addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t * addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int workq_init(struct workq * q, size_t count, size_t capacity, size_t elem_size)
+{
+	size_t i;
+
+	memset(q, 0, sizeof(struct workq));
+	q->count = count ? count : 1;
+	q->elem_size = elem_size;
+
+	/* All on node 0 until workq_set_nodes() */
+	q->node_count = 1;
+	q->ring_node = (size_t *)calloc(q->count, sizeof(size_t));
+	if (!q->ring_node)
+		return 1;
+	if (posix_memalign((void **)&q->nodes, RINGQ_CACHELINE, sizeof(struct workq_node))) {
+		free(q->ring_node);
+		return 1;
+	}
+	memset(q->nodes, 0, sizeof(struct workq_node));
+
+	if (posix_memalign((void **)&q->rings, RINGQ_CACHELINE,
+			   q->count * sizeof(struct ringq))) {
+		q->rings = NULL;
+		free(q->ring_node);
+		free(q->nodes);
+		return 1;
+	}
+
+	for (i = 0; i < q->count; ++i) {
+		if (ringq_init(&q->rings[i], capacity, elem_size)) {
+			while (i--)
+				ringq_destroy(&q->rings[i]);
+			free(q->rings);
+			free(q->ring_node);
+			free(q->nodes);
+			q->rings = NULL;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void workq_destroy(struct workq * q)
+{
+	size_t i;
+
+	for (i = 0; q->rings && i < q->count; ++i)
+		ringq_destroy(&q->rings[i]);
+	free(q->rings);
+	free(q->ring_node);
+	free(q->nodes);
+	q->rings = NULL;
+}
+
+int workq_set_nodes(struct workq * q, const size_t * node_of, size_t nodes)
+{
+	struct workq_node * array;
+	size_t i;
+
+	nodes = nodes ? nodes : 1;
+	if (posix_memalign((void **)&array, RINGQ_CACHELINE, nodes * sizeof(struct workq_node)))
+		return 1;
+	memset(array, 0, nodes * sizeof(struct workq_node));
+
+	free(q->nodes);
+	q->nodes = array;
+	q->node_count = nodes;
+	for (i = 0; i < q->count; ++i)
+		q->ring_node[i] = node_of[i] % nodes;
+	return 0;
+}
+
+void workq_set_local(struct workq * q, size_t node)
+{
+	q->nodes[node % q->node_count].local = 1;
+}
+
+void workq_set_spin(struct workq * q, uint64_t spin_ns)
+{
+	q->spin_ns = spin_ns;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Order the publication of an element before the looks at <sleepers>
+ * and <spinners> that follow it. ThreadSanitizer does not model fences:
+ * under it, the looks at <sleepers> are read-modify-writes instead,
+ * which order the same accesses through the modification order of
+ * <sleepers>, against the increment of a worker about to sleep. */
+static void publish_fence(void)
+{
+#ifndef __SANITIZE_THREAD__
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static uint32_t load_sleepers(struct workq_node * n)
+{
+#ifdef __SANITIZE_THREAD__
+	return __atomic_fetch_add(&n->sleepers, 0, __ATOMIC_SEQ_CST);
+#else
+	return __atomic_load_n(&n->sleepers, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Take one of the spinners of <n> out, if there is any. Returns 1 if
+ * so. */
+static int take_spinner(struct workq_node * n)
+{
+	uint32_t spinners = __atomic_load_n(&n->spinners, __ATOMIC_SEQ_CST);
+
+	while (spinners && !__atomic_compare_exchange_n(&n->spinners, &spinners, spinners - 1,
+							 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+	return spinners != 0;
+}
+
+/* Wake up a sleeping worker for an element just published in a ring of
+ * <node>: one of that node if possible. Only pays for the system call
+ * if a worker may be asleep. The caller orders the publication before
+ * the looks at <sleepers> with publish_fence(). */
+static void workq_wake(struct workq * q, size_t node)
+{
+	size_t i;
+
+	for (i = 0; i < q->node_count; ++i) {
+		struct workq_node * n = &q->nodes[(node + i) % q->node_count];
+
+		if (i && n->local)
+			continue;
+		if (load_sleepers(n)) {
+			__atomic_add_fetch(&n->events, 1, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&q->wakeups, 1, __ATOMIC_RELAXED);
+			futex_wake(&n->events, 1);
+			break;
+		}
+	}
+}
+
+int workq_push(struct workq * q, size_t target, const void * elem)
+{
+	size_t node;
+
+	/* The rings are never slept on: workq has its own futexes */
+	target %= q->count;
+	if (ringq_push_nowake(&q->rings[target], elem))
+		return 1;
+
+	/* A spinner of the node of the ring sees it without any help */
+	node = q->ring_node[target];
+	publish_fence();
+	if (q->spin_ns && take_spinner(&q->nodes[node]))
+		return 0;
+
+	workq_wake(q, node);
+	return 0;
+}
+
+/* Own ring first, then the others of the same node, starting from the
+ * next worker so that the thieves do not all descend on the same
+ * victim, and last, unless the node is local, those of the other
+ * nodes that hold <remote_min> requests or more */
+static int workq_try_pop(struct workq * q, size_t self, void * out, size_t remote_min)
+{
+	size_t node = q->ring_node[self], i;
+
+	if (!ringq_try_pop(&q->rings[self], out))
+		return 0;
+
+	for (i = 1; i < q->count; ++i) {
+		size_t victim = (self + i) % q->count;
+
+		if (q->ring_node[victim] == node &&
+		    !ringq_try_pop(&q->rings[victim], out)) {
+			__atomic_add_fetch(&q->steals, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&q->nodes[node].steals, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	for (i = 1; q->node_count > 1 && !q->nodes[node].local && i < q->count; ++i) {
+		size_t victim = (self + i) % q->count;
+
+		if (q->ring_node[victim] != node &&
+		    ringq_length(&q->rings[victim]) >= remote_min &&
+		    !ringq_try_pop(&q->rings[victim], out)) {
+			__atomic_add_fetch(&q->steals, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&q->nodes[node].remote_steals, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Look at the rings for up to the spin time of <q> before sleeping.
+ * Returns 0 if an element was found. */
+static int workq_spin(struct workq * q, size_t self, void * out)
+{
+	struct workq_node * node = &q->nodes[q->ring_node[self]];
+	uint64_t deadline = now_ns() + q->spin_ns;
+	int empty, i;
+
+	__atomic_add_fetch(&node->spinners, 1, __ATOMIC_SEQ_CST);
+	do {
+		for (i = 0; i < WORKQ_SPIN_PAUSES; ++i)
+			workq_cpu_relax();
+		empty = workq_try_pop(q, self, out, WORKQ_REMOTE_MIN);
+	} while (empty && !__atomic_load_n(&q->closed, __ATOMIC_RELAXED) &&
+		 now_ns() < deadline);
+
+	/* A push counted on us, maybe for another element than ours */
+	if (!take_spinner(node) && !empty) {
+		publish_fence();
+		workq_wake(q, q->ring_node[self]);
+	}
+	if (!empty)
+		__atomic_add_fetch(&q->spin_pops, 1, __ATOMIC_RELAXED);
+	return empty;
+}
+
+int workq_pop(struct workq * q, size_t self, void * out)
+{
+	struct workq_node * node;
+
+	self %= q->count;
+	node = &q->nodes[q->ring_node[self]];
+
+	for (;;) {
+		uint32_t events;
+
+		if (!workq_try_pop(q, self, out, WORKQ_REMOTE_MIN))
+			return 0;
+		if (q->spin_ns && !workq_spin(q, self, out))
+			return 0;
+
+		__atomic_add_fetch(&node->sleepers, 1, __ATOMIC_SEQ_CST);
+		events = __atomic_load_n(&node->events, __ATOMIC_SEQ_CST);
+
+		/* Anything at all before sleeping: a push that saw no one
+		 * asleep on its node may have woken us up for it */
+		if (!workq_try_pop(q, self, out, 0)) {
+			__atomic_sub_fetch(&node->sleepers, 1, __ATOMIC_SEQ_CST);
+			return 0;
+		}
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+			__atomic_sub_fetch(&node->sleepers, 1, __ATOMIC_SEQ_CST);
+			return 1;
+		}
+
+		futex_wait(&node->events, events);
+		__atomic_sub_fetch(&node->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void workq_close(struct workq * q)
+{
+	size_t i;
+
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < q->node_count; ++i) {
+		__atomic_add_fetch(&q->nodes[i].events, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&q->nodes[i].events, INT_MAX);
+	}
+}
+
+size_t workq_snapshot(struct workq * q, void * out)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < q->count; ++i)
+		count += ringq_snapshot(&q->rings[i], (char *)out + count * q->elem_size);
+
+	return count;
+}
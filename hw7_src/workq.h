@@ -0,0 +1,147 @@
+/*******************************************************************************
+* Work-Stealing Request Queues (header)
+*
+* Description:
+*     One lock-free ring of runnable requests per worker, instead of a
+*     single ring shared by all of them. Producers push to the ring of a
+*     given worker; each worker serves its own ring first and, once it
+*     runs dry, steals the oldest request of another worker's ring
+*     before going to sleep. A worker thus only contends with the
+*     producers feeding it and with the occasional thief, and the cost
+*     of a pop does not grow with the number of workers.
+*
+* Notes:
+*     The rings are the MPMC rings of ringq.c, so both the owner and the
+*     thieves take requests from the head, in the order they were pushed:
+*     unlike a Chase-Lev deque, a worker never serves its newest request
+*     ahead of its older ones. Sleeping workers wait on a futex shared
+*     by all the rings, so that work pushed to any of them wakes up one
+*     of the idle workers, whoever owns the ring.
+*
+*     The rings may be spread over NUMA nodes with workq_set_nodes():
+*     there is then one futex per node, and a push wakes up an idle
+*     worker of the node of its ring if there is one, and one of another
+*     node only otherwise. A thief tries the rings of its own node
+*     first, and only takes from a ring of another node that holds at
+*     least WORKQ_REMOTE_MIN requests, or before going to sleep: the
+*     requests stay on their node unless it falls behind.
+*
+*     A node may also be made local with workq_set_local(): its workers
+*     then only take from its own rings, and are only woken up for them,
+*     while the workers of the other nodes still steal from its rings as
+*     above. This keeps a group of workers for some of the requests.
+*
+*     With workq_set_spin(), a worker that finds every ring empty keeps
+*     looking for a while before it sleeps, which saves it the wake-up
+*     when the next request comes soon enough. A push to a node with a
+*     spinning worker then makes no system call at all: it takes one
+*     of the spinners, which is bound to look at the rings again.
+*
+*******************************************************************************/
+#ifndef __WORKQ_H__
+#define __WORKQ_H__
+/* DO NOT WRITE ANY CODE ABOVE THIS LINE*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ringq.h"
+
+/* Requests in the ring of a worker of another node before it is
+ * stolen from by a worker that is not about to sleep */
+#define WORKQ_REMOTE_MIN 2
+
+/* Pauses between two looks at the rings of a spinning worker */
+#define WORKQ_SPIN_PAUSES 16
+
+/* Sleep/wake-up state of the workers of one node. <spinners> are the
+ * workers spinning that no push has counted on yet. */
+struct workq_node {
+	uint32_t events __attribute__((aligned(RINGQ_CACHELINE)));
+	uint32_t sleepers;
+	uint32_t spinners;
+	int local; /* See workq_set_local(), read-only after it */
+
+	/* Requests taken by its workers from the ring of another worker
+	 * of the node, and of another node */
+	uint64_t steals;
+	uint64_t remote_steals;
+};
+
+struct workq {
+	int closed __attribute__((aligned(RINGQ_CACHELINE)));
+
+	/* Requests taken from the ring of another worker, and by a worker
+	 * spinning, and pushes that woke up a sleeping worker */
+	uint64_t steals __attribute__((aligned(RINGQ_CACHELINE)));
+	uint64_t spin_pops;
+	uint64_t wakeups;
+
+	/* Read-only after workq_init() and workq_set_nodes() */
+	size_t count __attribute__((aligned(RINGQ_CACHELINE)));
+	size_t elem_size;
+	struct ringq * rings;
+	size_t node_count;
+	size_t * ring_node;        /* Node of each ring */
+	struct workq_node * nodes;
+	uint64_t spin_ns;
+};
+
+/* Hint to the CPU that this is a spin loop, to go easy on the memory
+ * bus and on the other hardware thread of the core */
+static inline void workq_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Initialize <q> with <count> rings of up to <capacity> elements of
+ * <elem_size> bytes each. Returns 0 on success and 1 on allocation
+ * failure. */
+int workq_init(struct workq * q, size_t count, size_t capacity, size_t elem_size);
+
+/* Release the memory of <q>. No thread may be using it anymore. */
+void workq_destroy(struct workq * q);
+
+/* Put the ring of each worker <i> on node <node_of[i]>, of <nodes>
+ * nodes, instead of all on node 0. Must be called before any other
+ * use of <q>. Returns 0 on success and 1 on allocation failure. */
+int workq_set_nodes(struct workq * q, const size_t * node_of, size_t nodes);
+
+/* Have the workers of <node> only take the elements of the rings of
+ * <node>, and be woken up for those only. Must be called after
+ * workq_set_nodes() and before any other use of <q>. */
+void workq_set_local(struct workq * q, size_t node);
+
+/* Have the workers that find every ring empty look again for up to
+ * <spin_ns> before they sleep, 0 not to spin. Must be called before any
+ * other use of <q>. */
+void workq_set_spin(struct workq * q, uint64_t spin_ns);
+
+/* Copy <elem> at the tail of the ring of worker <target>, and wake up
+ * an idle worker if there is one. Returns 0 on success and 1 if the
+ * ring is full. */
+int workq_push(struct workq * q, size_t target, const void * elem);
+
+/* Copy the oldest element of the ring of worker <self> into <out> or,
+ * if that ring is empty, the oldest element of another ring. Sleeps
+ * while all the rings are empty. Returns 1 only once <q> has been
+ * closed with workq_close(). */
+int workq_pop(struct workq * q, size_t self, void * out);
+
+/* Wake up all the sleeping workers and make the ones that find every
+ * ring empty return from workq_pop(). */
+void workq_close(struct workq * q);
+
+/* Best-effort copy of the queued elements into <out>, ring by ring and
+ * oldest first within a ring. <out> must have room for the capacity of
+ * all the rings. Returns the number of elements copied. */
+size_t workq_snapshot(struct workq * q, void * out);
+
+/* DO NOT WRITE ANY CODE BEYOND THIS LINE*/
+#endif